@@ -0,0 +1,265 @@
+/*
+ * Compares the throughput of libbloomd in-process against a
+ * bloomd server over TCP, using the same keys and batch sizes.
+ * The TCP half is skipped if no server is listening.
+ */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "src/bloomd/libbloomd.h"
+
+static int NUM_THREADS = 1;
+static int NUM_KEYS = 1000000;
+static int BATCH = 1;
+static char* HOST = "127.0.0.1";
+static int PORT = 8673;
+static char* CONFIG = NULL;
+
+/**
+ * Commands pipelined on a connection before
+ * the responses are read back
+ */
+#define TCP_WINDOW 1000
+
+typedef struct {
+    int id;
+    pthread_t thread;
+    bloomd_engine *engine;
+    char filter_name[32];
+    uint64_t set_msec;
+    uint64_t check_msec;
+    int failed;
+} bench_info;
+
+uint64_t msec_since(struct timeval *t1) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return ((now.tv_sec - t1->tv_sec) * 1000000ULL + (now.tv_usec - t1->tv_usec)) / 1000;
+}
+
+/**
+ * Generates the keys for a batch starting at i
+ */
+int make_keys(int i, char **keys, char *key_buf) {
+    int num = 0;
+    for (; num < BATCH && i + num < NUM_KEYS; num++) {
+        keys[num] = key_buf + num * 16;
+        sprintf(keys[num], "test%d", i + num);
+    }
+    return num;
+}
+
+void *embed_main(void *in) {
+    bench_info *info = in;
+    char **keys = malloc(BATCH * sizeof(char*));
+    char *key_buf = malloc(BATCH * 16);
+    char *result = malloc(BATCH);
+    struct timeval start;
+    int num;
+
+    if (bloomd_create(info->engine, info->filter_name, 0, 0, 1)) {
+        info->failed = 1;
+        goto LEAVE;
+    }
+
+    gettimeofday(&start, NULL);
+    for (int i=0; i < NUM_KEYS; i += num) {
+        num = make_keys(i, keys, key_buf);
+        bloomd_set(info->engine, info->filter_name, keys, num, result);
+    }
+    info->set_msec = msec_since(&start);
+
+    gettimeofday(&start, NULL);
+    for (int i=0; i < NUM_KEYS; i += num) {
+        num = make_keys(i, keys, key_buf);
+        bloomd_check(info->engine, info->filter_name, keys, num, result);
+    }
+    info->check_msec = msec_since(&start);
+
+    bloomd_drop(info->engine, info->filter_name);
+LEAVE:
+    bloomd_thread_leave(info->engine);
+    free(keys);
+    free(key_buf);
+    free(result);
+    return NULL;
+}
+
+int connect_fd(void) {
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = PF_INET;
+    addr.sin_port = htons(PORT);
+    inet_pton(PF_INET, HOST, &addr.sin_addr);
+
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Reads until the given number of response lines arrive
+ */
+int read_lines(int fd, int lines) {
+    char buf[65536];
+    while (lines > 0) {
+        int n = recv(fd, buf, sizeof(buf), 0);
+        if (n <= 0) return -1;
+        for (int i=0; i < n; i++) {
+            if (buf[i] == '\n') lines--;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Sends a command per batch, a window of commands at a time
+ */
+int tcp_run(int fd, char *cmd, char *filter_name) {
+    char *buf = malloc(TCP_WINDOW * (BATCH * 16 + 64));
+    int len, sent, in_window = 0, res = 0;
+    len = 0;
+    for (int i=0; i < NUM_KEYS && !res; ) {
+        len += sprintf(buf + len, "%s %s", cmd, filter_name);
+        for (int j=0; j < BATCH && i < NUM_KEYS; j++, i++) {
+            len += sprintf(buf + len, " test%d", i);
+        }
+        buf[len++] = '\n';
+
+        if (++in_window == TCP_WINDOW || i >= NUM_KEYS) {
+            sent = send(fd, buf, len, 0);
+            if (sent != len || read_lines(fd, in_window)) res = -1;
+            len = 0;
+            in_window = 0;
+        }
+    }
+    free(buf);
+    return res;
+}
+
+void *tcp_main(void *in) {
+    bench_info *info = in;
+    char cmd[64];
+    struct timeval start;
+
+    int fd = connect_fd();
+    if (fd == -1) {
+        info->failed = 1;
+        return NULL;
+    }
+
+    int len = sprintf(cmd, "create %s in_memory=1\n", info->filter_name);
+    if (send(fd, cmd, len, 0) != len || read_lines(fd, 1)) goto FAILED;
+
+    gettimeofday(&start, NULL);
+    if (tcp_run(fd, (BATCH == 1) ? "s" : "b", info->filter_name)) goto FAILED;
+    info->set_msec = msec_since(&start);
+
+    gettimeofday(&start, NULL);
+    if (tcp_run(fd, (BATCH == 1) ? "c" : "m", info->filter_name)) goto FAILED;
+    info->check_msec = msec_since(&start);
+
+    len = sprintf(cmd, "drop %s\n", info->filter_name);
+    send(fd, cmd, len, 0);
+    read_lines(fd, 1);
+    close(fd);
+    return NULL;
+
+FAILED:
+    info->failed = 1;
+    close(fd);
+    return NULL;
+}
+
+/**
+ * Runs a benchmark on all the threads and prints the rates
+ */
+void run(char *label, void*(*main)(void*), bloomd_engine *engine) {
+    bench_info *infos = calloc(NUM_THREADS, sizeof(bench_info));
+    for (int i=0; i < NUM_THREADS; i++) {
+        infos[i].id = i;
+        infos[i].engine = engine;
+        sprintf(infos[i].filter_name, "bench_embed%d_%d", getpid(), i);
+        pthread_create(&infos[i].thread, NULL, main, infos + i);
+    }
+
+    uint64_t set_msec = 0, check_msec = 0;
+    int failed = 0;
+    for (int i=0; i < NUM_THREADS; i++) {
+        pthread_join(infos[i].thread, NULL);
+        failed |= infos[i].failed;
+        if (infos[i].set_msec > set_msec) set_msec = infos[i].set_msec;
+        if (infos[i].check_msec > check_msec) check_msec = infos[i].check_msec;
+    }
+    free(infos);
+
+    if (failed) {
+        printf("%-12s failed\n", label);
+        return;
+    }
+    double total = (double)NUM_KEYS * NUM_THREADS;
+    printf("%-12s set: %6llu msec %10.0f keys/sec   check: %6llu msec %10.0f keys/sec\n",
+            label,
+            (unsigned long long)set_msec, total / ((set_msec ? set_msec : 1) / 1000.0),
+            (unsigned long long)check_msec, total / ((check_msec ? check_msec : 1) / 1000.0));
+}
+
+void show_usage() {
+    fprintf(stderr, "usage: bench_embed [-f config] [-H host] [-p port] [-t threads] [-n keys] [-b batch]\n\
+\n\
+    -f : bloomd config file used by the in-process engine. Default none\n\
+    -H : Host of the bloomd server. Default 127.0.0.1\n\
+    -p : Port of the bloomd server. Default 8673\n\
+    -t : Number of threads, each uses its own filter. Default 1\n\
+    -n : Number of keys per thread. Default 1000000\n\
+    -b : Keys per command, uses bulk and multi above 1. Default 1\n\
+\n");
+}
+
+int main(int argc, char **argv) {
+    int c;
+    while ((c = getopt(argc, argv, "f:H:p:t:n:b:")) != -1) {
+        switch (c) {
+            case 'f': CONFIG = optarg; break;
+            case 'H': HOST = optarg; break;
+            case 'p': PORT = atoi(optarg); break;
+            case 't': NUM_THREADS = atoi(optarg); break;
+            case 'n': NUM_KEYS = atoi(optarg); break;
+            case 'b': BATCH = atoi(optarg); break;
+            default: show_usage(); return 1;
+        }
+    }
+    if (optind != argc || NUM_THREADS < 1 || NUM_KEYS < 1 || BATCH < 1) {
+        show_usage();
+        return 1;
+    }
+    printf("Threads: %d Keys per thread: %d Batch: %d\n", NUM_THREADS, NUM_KEYS, BATCH);
+
+    bloomd_engine *engine;
+    if (bloomd_open(CONFIG, &engine)) {
+        printf("Failed to open the engine!\n");
+        return 1;
+    }
+    run("in-process", embed_main, engine);
+    bloomd_close(engine);
+
+    int fd = connect_fd();
+    if (fd == -1) {
+        printf("%-12s skipped, no server at %s:%d\n", "tcp", HOST, PORT);
+        return 0;
+    }
+    close(fd);
+    run("tcp", tcp_main, NULL);
+    return 0;
+}
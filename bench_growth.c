@@ -0,0 +1,184 @@
+/*
+ * Compares the fixed and history-aware growth policies of a
+ * scalable bloom filter. A day of keys is added with a daily
+ * cycle in the insert rate, sampling the history each minute
+ * like a flush does. Then the layers, bytes and the bits probed
+ * by checks of present and missing keys are reported for each.
+ */
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "src/libbloom/sbf.h"
+
+static int NUM_KEYS = 2000000;
+static double DAYS = 1;
+static uint64_t CAPACITY = 100000;
+static double PROB = 1e-4;
+static int SCALE = 4;
+static double REDUCTION = 0.9;
+static int CHECKS = 200000;
+
+static const int SAMPLE_SECS = 60;
+static const int DAY_SECS = 86400;
+
+/**
+ * Sizes the new layers from the history the benchmark
+ * keeps, expecting keys for the lifetime of the filter.
+ */
+static uint64_t history_grow(void *in, bloom_sbf *sbf) {
+    return sbf_growth_capacity(sbf, (bloom_sbf_history*)in, DAYS * DAY_SECS);
+}
+
+uint64_t nsec_since(struct timespec *t1) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t1->tv_sec) * 1000000000ULL + (now.tv_nsec - t1->tv_nsec);
+}
+
+/**
+ * Checks the keys prefix0 to prefixN, counting the bits probed.
+ * Each layer is probed until a bit is unset, largest first.
+ * @return The number of keys found
+ */
+int count_probes(bloom_sbf *sbf, char *prefix, int num, uint64_t *probes) {
+    char buf[32];
+    uint64_t hashes[64];
+    int found = 0;
+    uint32_t k_max = 4;
+    for (uint32_t i=0; i < sbf->num_filters; i++) {
+        if (sbf->filters[i]->header->k_num > k_max) k_max = sbf->filters[i]->header->k_num;
+    }
+
+    *probes = 0;
+    for (int n=0; n < num; n++) {
+        snprintf(buf, sizeof(buf), "%s%d", prefix, n);
+        bf_compute_hashes(k_max, buf, hashes);
+        int present = 0;
+        for (uint32_t i=0; i < sbf->num_filters && !present; i++) {
+            bloom_bloomfilter *f = sbf->filters[i];
+            uint64_t m = f->offset;
+            uint64_t offset = 8 * sizeof(bloom_filter_header);
+            present = 1;
+            for (uint32_t j=0; j < f->header->k_num; j++, offset += m) {
+                *probes += 1;
+                if (!bitmap_getbit(f->map, offset + (hashes[j] % m))) {
+                    present = 0;
+                    break;
+                }
+            }
+        }
+        found += present;
+    }
+    return found;
+}
+
+/**
+ * Times checks of the keys prefix0 to prefixN
+ */
+uint64_t time_checks(bloom_sbf *sbf, char *prefix, int num) {
+    char buf[32];
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int n=0; n < num; n++) {
+        snprintf(buf, sizeof(buf), "%s%d", prefix, n);
+        sbf_contains(sbf, buf);
+    }
+    return nsec_since(&start);
+}
+
+void report(char *name, bloom_sbf *sbf) {
+    uint64_t hit_probes, miss_probes;
+    int hits = count_probes(sbf, "key", CHECKS, &hit_probes);
+    int fps = count_probes(sbf, "miss", CHECKS, &miss_probes);
+    uint64_t base = time_checks(sbf, "miss", CHECKS);
+    uint64_t size = sbf_size(sbf), cap = sbf_total_capacity(sbf);
+
+    printf("%s: Layers: %u Capacity: %llu Used: %.1f%% Bytes: %llu (%.2f bits/key)\n",
+            name, sbf->num_filters, (unsigned long long)cap, 100.0 * size / cap,
+            (unsigned long long)sbf_total_byte_size(sbf), 8.0 * sbf_total_byte_size(sbf) / size);
+    printf("    Probes present: %.2f/key (%d found) missing: %.2f/key (%d false positives) Check missing: %.1f ns/key\n",
+            (double)hit_probes / CHECKS, hits, (double)miss_probes / CHECKS, fps, (double)base / CHECKS);
+    for (uint32_t i=0; i < sbf->num_filters; i++) {
+        printf("    Layer %u: Capacity: %llu Size: %llu K: %u\n", sbf->num_filters - i - 1,
+                (unsigned long long)sbf->capacities[i],
+                (unsigned long long)bf_size(sbf->filters[i]), sbf->filters[i]->header->k_num);
+    }
+}
+
+void usage(void) {
+    printf("usage: bench_growth [-n keys a day] [-d days] [-c initial capacity] [-p prob]\n"
+           "                    [-s scale] [-r reduction] [-k checks]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int ch;
+    while ((ch = getopt(argc, argv, "n:d:c:p:s:r:k:")) != -1) {
+        switch (ch) {
+            case 'n':
+                NUM_KEYS = atoi(optarg);
+                break;
+            case 'd':
+                DAYS = atof(optarg);
+                break;
+            case 'c':
+                CAPACITY = strtoull(optarg, NULL, 10);
+                break;
+            case 'p':
+                PROB = atof(optarg);
+                break;
+            case 's':
+                SCALE = atoi(optarg);
+                break;
+            case 'r':
+                REDUCTION = atof(optarg);
+                break;
+            case 'k':
+                CHECKS = atoi(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (NUM_KEYS <= 0 || DAYS <= 0 || !CAPACITY || PROB <= 0 || PROB >= 1 ||
+        SCALE < 2 || REDUCTION <= 0 || REDUCTION >= 1 || CHECKS <= 0) usage();
+
+    bloom_sbf_params params = {CAPACITY, PROB, SCALE, REDUCTION};
+    bloom_sbf fixed, adaptive;
+    bloom_sbf_history history = {0, 0, 0};
+    if (sbf_from_filters(&params, NULL, NULL, 0, NULL, &fixed) ||
+        sbf_from_filters(&params, NULL, &history, 0, NULL, &adaptive)) {
+        printf("Failed to create the filters\n");
+        return 1;
+    }
+    adaptive.grow_callback = history_grow;
+
+    // Each minute gets its share of the day, busiest at noon
+    double horizon = DAYS * DAY_SECS;
+    double per_sample = (double)NUM_KEYS * SAMPLE_SECS / DAY_SECS, due = 0;
+    int added = 0, total = NUM_KEYS * DAYS, num;
+    char buf[32];
+    for (int t=0; added < total; t += SAMPLE_SECS) {
+        due += per_sample * (1 - 0.5 * cos(2 * M_PI * t / DAY_SECS));
+        for (num=0; num < due && added < total; num++, added++) {
+            snprintf(buf, sizeof(buf), "key%d", added);
+            sbf_add(&fixed, buf);
+            sbf_add(&adaptive, buf);
+        }
+        due -= num;
+        sbf_record_history(&history, horizon, num, SAMPLE_SECS);
+    }
+    if (CHECKS > total) CHECKS = total;
+
+    printf("Keys: %d over %.1f days, Initial capacity: %llu Prob: %g Scale: %d Reduction: %g\n",
+            total, DAYS, (unsigned long long)CAPACITY, PROB, SCALE, REDUCTION);
+    report("Fixed", &fixed);
+    report("History", &adaptive);
+    sbf_close(&fixed);
+    sbf_close(&adaptive);
+    return 0;
+}
@@ -0,0 +1,166 @@
+/*
+ * Opens many idle connections to a bloomd server and reports
+ * how much memory the server uses for them. After connecting,
+ * each connection sends one command and reads the response,
+ * then goes idle again. The server RSS is read from /proc, so
+ * the server must run on the same host.
+ */
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static int NUM_CONNS = 100000;
+static char* HOST = "127.0.0.1";
+static int PORT = 8673;
+static int SERVER_PID = 0;
+
+/**
+ * Each local address can only have so many connections
+ * to one port, so on loopback we spread the connections
+ * over many source addresses.
+ */
+#define CONNS_PER_ADDR 20000
+
+/**
+ * Returns the resident memory of the server in KB
+ */
+long server_rss_kb(void) {
+    char path[64], line[256];
+    snprintf(path, sizeof(path), "/proc/%d/status", SERVER_PID);
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+
+    long rss = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "VmRSS: %ld kB", &rss) == 1) break;
+    }
+    fclose(f);
+    return rss;
+}
+
+int connect_fd(int index) {
+    int fd = socket(PF_INET, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    // Spread loopback connections across source addresses
+    if (!strncmp(HOST, "127.", 4)) {
+        struct sockaddr_in local;
+        bzero(&local, sizeof(local));
+        local.sin_family = PF_INET;
+        local.sin_addr.s_addr = htonl(0x7f000002 + index / CONNS_PER_ADDR);
+        if (bind(fd, (struct sockaddr*)&local, sizeof(local))) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = PF_INET;
+    addr.sin_port = htons(PORT);
+    inet_pton(PF_INET, HOST, &addr.sin_addr);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/**
+ * Sends a command and reads the response up to END
+ */
+int list_round_trip(int fd) {
+    static const char cmd[] = "list bench_idle\n";
+    if (write(fd, cmd, sizeof(cmd) - 1) != sizeof(cmd) - 1) return -1;
+
+    char buf[256];
+    int len = 0, n;
+    while (len < (int)sizeof(buf) - 1) {
+        n = read(fd, buf + len, sizeof(buf) - 1 - len);
+        if (n <= 0) return -1;
+        len += n;
+        buf[len] = '\0';
+        if (strstr(buf, "END\n")) return 0;
+    }
+    return -1;
+}
+
+void report(char *stage, long base_rss, int conns) {
+    long rss = server_rss_kb();
+    if (rss < 0) {
+        printf("%s: %d connections\n", stage, conns);
+        return;
+    }
+    printf("%s: %d connections, server RSS %ld KB", stage, conns, rss);
+    if (conns) printf(" (%.0f bytes per connection)", (rss - base_rss) * 1024.0 / conns);
+    printf("\n");
+}
+
+void usage(void) {
+    printf("usage: bench_idle [-n conns] [-h host] [-p port] [-P server pid]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int ch;
+    while ((ch = getopt(argc, argv, "n:h:p:P:")) != -1) {
+        switch (ch) {
+            case 'n':
+                NUM_CONNS = atoi(optarg);
+                break;
+            case 'h':
+                HOST = optarg;
+                break;
+            case 'p':
+                PORT = atoi(optarg);
+                break;
+            case 'P':
+                SERVER_PID = atoi(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (NUM_CONNS <= 0) usage();
+
+    // Make room for all the sockets
+    struct rlimit lim;
+    getrlimit(RLIMIT_NOFILE, &lim);
+    lim.rlim_cur = lim.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &lim);
+
+    int *fds = malloc(NUM_CONNS * sizeof(int));
+    long base_rss = server_rss_kb();
+    report("Start", base_rss, 0);
+
+    int conns;
+    for (conns=0; conns < NUM_CONNS; conns++) {
+        fds[conns] = connect_fd(conns);
+        if (fds[conns] < 0) {
+            perror("Failed to connect");
+            break;
+        }
+    }
+
+    // Give the server time to accept everything
+    sleep(1);
+    report("Connected", base_rss, conns);
+
+    int failed = 0;
+    for (int i=0; i < conns; i++) {
+        if (list_round_trip(fds[i])) failed++;
+    }
+    if (failed) printf("%d commands failed\n", failed);
+    report("After one command each", base_rss, conns);
+
+    for (int i=0; i < conns; i++) close(fds[i]);
+    free(fds);
+    return 0;
+}
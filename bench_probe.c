@@ -0,0 +1,121 @@
+/*
+ * Measures the cost of probing a bloom filter, apart from
+ * hashing. The keys are hashed up front, then added, checked
+ * while present, and checked while missing.
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "src/libbloom/bloom.h"
+
+static int NUM_KEYS = 1000000;
+static uint64_t CAPACITY = 0;
+static double PROB = 1e-4;
+static int ROUNDS = 5;
+
+uint64_t nsec_since(struct timespec *t1) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t1->tv_sec) * 1000000000ULL + (now.tv_nsec - t1->tv_nsec);
+}
+
+/**
+ * Hashes the keys prefix0 to prefixN
+ */
+uint64_t *make_hashes(char *prefix, uint32_t k_num) {
+    char buf[32];
+    uint64_t *hashes = malloc((uint64_t)NUM_KEYS * k_num * sizeof(uint64_t));
+    for (int i=0; i < NUM_KEYS; i++) {
+        snprintf(buf, sizeof(buf), "%s%d", prefix, i);
+        bf_compute_hashes(k_num, buf, hashes + (uint64_t)i * k_num);
+    }
+    return hashes;
+}
+
+void usage(void) {
+    printf("usage: bench_probe [-n keys] [-c capacity] [-p prob] [-r rounds]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int ch;
+    while ((ch = getopt(argc, argv, "n:c:p:r:")) != -1) {
+        switch (ch) {
+            case 'n':
+                NUM_KEYS = atoi(optarg);
+                break;
+            case 'c':
+                CAPACITY = strtoull(optarg, NULL, 10);
+                break;
+            case 'p':
+                PROB = atof(optarg);
+                break;
+            case 'r':
+                ROUNDS = atoi(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (NUM_KEYS <= 0 || ROUNDS <= 0 || PROB <= 0 || PROB >= 1) usage();
+    if (!CAPACITY) CAPACITY = NUM_KEYS;
+
+    bloom_filter_params params = {0, 0, CAPACITY, PROB};
+    if (bf_params_for_capacity(&params)) {
+        printf("Bad filter parameters\n");
+        return 1;
+    }
+    uint32_t k_num = (params.k_num < 4) ? 4 : params.k_num;
+    uint64_t *present = make_hashes("test", k_num);
+    uint64_t *missing = make_hashes("miss", k_num);
+    printf("Keys: %d Capacity: %llu Bytes: %llu K: %u\n", NUM_KEYS,
+            (unsigned long long)CAPACITY, (unsigned long long)params.bytes, params.k_num);
+
+    // Take the best of each round, with a new filter for each
+    uint64_t best_add = 0, best_hit = 0, best_miss = 0, nsec;
+    int hits = 0, fps = 0;
+    struct timespec start;
+    for (int r=0; r < ROUNDS; r++) {
+        bloom_bitmap map;
+        bloom_bloomfilter filter;
+        if (bitmap_from_file(-1, params.bytes, ANONYMOUS, &map) ||
+            bf_from_bitmap(&map, params.k_num, 1, &filter)) {
+            printf("Failed to create the filter\n");
+            return 1;
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i=0; i < NUM_KEYS; i++) {
+            bf_add_hashes(&filter, present + (uint64_t)i * k_num);
+        }
+        nsec = nsec_since(&start);
+        if (!r || nsec < best_add) best_add = nsec;
+
+        hits = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i=0; i < NUM_KEYS; i++) {
+            hits += bf_contains_hashes(&filter, present + (uint64_t)i * k_num);
+        }
+        nsec = nsec_since(&start);
+        if (!r || nsec < best_hit) best_hit = nsec;
+
+        fps = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i=0; i < NUM_KEYS; i++) {
+            fps += bf_contains_hashes(&filter, missing + (uint64_t)i * k_num);
+        }
+        nsec = nsec_since(&start);
+        if (!r || nsec < best_miss) best_miss = nsec;
+        bf_close(&filter);
+    }
+
+    printf("Add: %.1f ns/key\n", (double)best_add / NUM_KEYS);
+    printf("Check present: %.1f ns/key (%d found)\n", (double)best_hit / NUM_KEYS, hits);
+    printf("Check missing: %.1f ns/key (%d false positives)\n", (double)best_miss / NUM_KEYS, fps);
+    free(present);
+    free(missing);
+    return 0;
+}
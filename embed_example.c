@@ -0,0 +1,46 @@
+/*
+ * Minimal example of embedding bloomd in a batch job.
+ * Build with the libbloomd target, and link against
+ * libbloomd, libbloom, libinih and the hash libraries.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include "src/bloomd/libbloomd.h"
+
+int main(int argc, char **argv) {
+    // Use the same INI file as the server, or the defaults
+    bloomd_engine *engine;
+    if (bloomd_open((argc > 1) ? argv[1] : NULL, &engine)) {
+        printf("Failed to open the engine!\n");
+        return 1;
+    }
+
+    // Create the filter if it is missing
+    int res = bloomd_create(engine, "example", 100000, 0.0001, -1);
+    if (res && res != -1) {
+        printf("Failed to create filter! Res: %d\n", res);
+        bloomd_close(engine);
+        return 1;
+    }
+
+    // Add and check a few keys
+    char *keys[] = {"zipper", "cartographer", "lamplight"};
+    char result[3];
+    bloomd_set(engine, "example", keys, 2, result);
+    bloomd_check(engine, "example", keys, 3, result);
+    for (int i=0; i < 3; i++) {
+        printf("%s: %s\n", keys[i], result[i] ? "Yes" : "No");
+    }
+
+    bloomd_filter_info info;
+    if (!bloomd_info(engine, "example", &info)) {
+        printf("Size: %llu Capacity: %llu Bytes: %llu\n",
+                (unsigned long long)info.size,
+                (unsigned long long)info.capacity,
+                (unsigned long long)info.bytes);
+    }
+
+    // Flushes the filter to disk
+    bloomd_close(engine);
+    return 0;
+}
@@ -18,6 +18,18 @@ except ImportError:
 
 def pytest_funcarg__servers(request):
     "Returns a new APIHandler with a filter manager"
+    return start_server(request)
+
+
+def pytest_funcarg__watermark_servers(request):
+    "Returns connections to a server that pauses clients with 1MB of unsent output"
+    return start_server(request, """output_high_watermark = 1048576
+output_low_watermark = 262144
+""")
+
+
+def start_server(request, extra_conf=""):
+    "Starts bloomd with any extra configuration, and returns two connections"
     # Create tmpdir and delete after
     tmpdir = tempfile.mkdtemp()
     port = random.randint(2000, 60000)
@@ -28,7 +40,7 @@ def pytest_funcarg__servers(request):
 data_dir = %(dir)s
 port = %(port)d
 """ % {"dir": tmpdir, "port": port}
-    open(config_path, "w").write(conf)
+    open(config_path, "w").write(conf + extra_conf)
 
     # Start the process
     proc = subprocess.Popen("./bloomd -f %s" % config_path, shell=True)
@@ -451,6 +463,137 @@ class TestInteg(object):
         assert "test:create:filter:with:long:prefix:2" in fh.readline()
         assert fh.readline() == "END\n"
 
+    def test_compact(self, servers):
+        "Tests compacting a filter into a read-only filter"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create nolog\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("compact nolog\n")
+        assert fh.readline() == "Filter has no key log\n"
+
+        server.sendall("create sealme key_log=1\n")
+        assert fh.readline() == "Done\n"
+        for x in xrange(1000):
+            server.sendall("set sealme test%d\n" % x)
+            assert fh.readline() == "Yes\n"
+        server.sendall("compact sealme\n")
+        assert fh.readline() == "Done\n"
+
+        for x in xrange(1000):
+            server.sendall("check sealme test%d\n" % x)
+            assert fh.readline() == "Yes\n"
+        server.sendall("set sealme new\n")
+        assert fh.readline() == "Filter is read-only\n"
+        server.sendall("compact sealme\n")
+        assert fh.readline() == "Filter is read-only\n"
+
+    def test_stable(self, servers):
+        "Tests a stable filter keeps a fixed size"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("create stable capacity=20000 stable=1\n")
+        assert fh.readline() == "Done\n"
+        storage = None
+        for x in xrange(10):
+            keys = " ".join("test%d" % (x * 10000 + y) for y in xrange(10000))
+            server.sendall("bulk stable %s\n" % keys)
+            fh.readline()
+
+            server.sendall("info stable\n")
+            info = {}
+            line = fh.readline()
+            while line != "END\n":
+                if line != "START\n":
+                    k, v = line.strip().split(" ")
+                    info[k] = v
+                line = fh.readline()
+            assert info["stable"] == "1"
+            assert storage is None or info["storage"] == storage
+            storage = info["storage"]
+
+        server.sendall("check stable test99999\n")
+        assert fh.readline() == "Yes\n"
+        server.sendall("check stable test0\n")
+        assert fh.readline() == "No\n"
+
+    def test_shrink(self, servers):
+        "Tests shrinking an oversized filter"
+        server, _ = servers
+        fh = server.makefile()
+        server.sendall("shrink noexist\n")
+        assert fh.readline() == "Filter does not exist\n"
+        server.sendall("create shrinkme capacity=1000000\n")
+        assert fh.readline() == "Done\n"
+        for x in xrange(1000):
+            server.sendall("set shrinkme test%d\n" % x)
+            assert fh.readline() == "Yes\n"
+        server.sendall("shrink shrinkme 2\n")
+        assert fh.readline() == "Client Error: Bad arguments\n"
+        server.sendall("shrink shrinkme\n")
+        assert fh.readline() == "Done\n"
+        server.sendall("shrink shrinkme\n")
+        assert fh.readline() == "Filter cannot shrink further\n"
+
+        for x in xrange(1000):
+            server.sendall("check shrinkme test%d\n" % x)
+            assert fh.readline() == "Yes\n"
+        server.sendall("set shrinkme new\n")
+        assert fh.readline() == "Yes\n"
+
+    def test_output_backlog(self, watermark_servers):
+        "Tests a client that does not read is paused, then resumed"
+        server, other = watermark_servers
+        fh = server.makefile()
+        server.sendall("create backlog\n")
+        assert fh.readline() == "Done\n"
+
+        # Send far more info commands than fit in the socket
+        # buffers and the high watermark, without reading
+        num = 60000
+        sender = threading.Thread(target=server.sendall,
+                                  args=("info backlog\n" * num,))
+        sender.start()
+
+        def stats():
+            ofh = other.makefile()
+            other.sendall("stats\n")
+            assert ofh.readline() == "START\n"
+            info = {}
+            line = ofh.readline()
+            while line != "END\n":
+                k, v = line.strip().split(" ")
+                info[k] = int(v)
+                line = ofh.readline()
+            return info
+
+        # The stats report the paused client
+        for x in xrange(50):
+            info = stats()
+            if info["connections_paused"]:
+                break
+            time.sleep(0.1)
+        assert info["connections_paused"] == 1
+        assert info["connection_pauses"] >= 1
+        assert info["output_high_watermark"] == 1048576
+        assert info["output_low_watermark"] == 262144
+
+        # Reading the output resumes the client, and
+        # every command is answered
+        ends = 0
+        while ends < num:
+            line = fh.readline()
+            assert line
+            if line == "END\n":
+                ends += 1
+        sender.join()
+        server.sendall("check backlog foo\n")
+        assert fh.readline() == "No\n"
+
+        info = stats()
+        assert info["connections_paused"] == 0
+        assert info["connection_pauses"] >= 1
+
 if __name__ == "__main__":
     sys.exit(pytest.main(args="-k TestInteg."))
 
@@ -0,0 +1,257 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+#include <unistd.h>
+#include "src/bloomd/capture.h"
+
+static int NUM_CONNS = 1;
+static char* HOST = "127.0.0.1";
+static int PORT = 8673;
+static double SPEED = 1.0;  // 0 replays as fast as possible
+
+/**
+ * A connection replays every record from the
+ * captured clients that hash onto it, in order.
+ */
+typedef struct {
+    int conn_fd;
+    pthread_t thread;
+
+    capture_record **records;
+    uint64_t num_records;
+    uint64_t max_records;
+
+    uint64_t *latencies;    // Microseconds per command
+    uint64_t errors;
+
+    char read_buf[65536];
+    int read_start;
+    int read_end;
+} conn_info;
+
+static struct timeval START;
+
+int connect_fd(conn_info *info) {
+    struct sockaddr_in addr;
+    bzero(&addr, sizeof(addr));
+    addr.sin_family = PF_INET;
+    addr.sin_port = htons(PORT);
+    inet_pton(PF_INET, HOST, &addr.sin_addr);
+
+    info->conn_fd = socket(PF_INET, SOCK_STREAM, 0);
+    return connect(info->conn_fd, (struct sockaddr*)&addr, sizeof(addr));
+}
+
+uint64_t usec_since(struct timeval *t1) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - t1->tv_sec) * 1000000ULL + (now.tv_usec - t1->tv_usec);
+}
+
+/**
+ * Reads a single response line into line, without the newline.
+ * Returns the length, or -1 on error.
+ */
+int read_line(conn_info *info, char **line) {
+    while (1) {
+        char *start = info->read_buf + info->read_start;
+        char *nl = memchr(start, '\n', info->read_end - info->read_start);
+        if (nl) {
+            *nl = '\0';
+            *line = start;
+            info->read_start = nl - info->read_buf + 1;
+            return nl - start;
+        }
+
+        // Compact and read more
+        memmove(info->read_buf, start, info->read_end - info->read_start);
+        info->read_end -= info->read_start;
+        info->read_start = 0;
+        if (info->read_end == sizeof(info->read_buf)) return -1;
+        int n = recv(info->conn_fd, info->read_buf + info->read_end,
+                sizeof(info->read_buf) - info->read_end, 0);
+        if (n <= 0) return -1;
+        info->read_end += n;
+    }
+}
+
+/**
+ * Reads a full response. List and info responses
+ * span multiple lines between START and END.
+ */
+int read_response(conn_info *info) {
+    char *line;
+    if (read_line(info, &line) < 0) return -1;
+    if (!strncmp(line, "Client Error", 12) || !strncmp(line, "Internal Error", 14))
+        info->errors++;
+    if (strcmp(line, "START")) return 0;
+    while (1) {
+        if (read_line(info, &line) < 0) return -1;
+        if (!strcmp(line, "END")) return 0;
+    }
+}
+
+void *thread_main(void *in) {
+    conn_info *info = in;
+    char cmd_buf[1024];
+    char *cmd;
+    struct timeval sent;
+    for (uint64_t i=0; i < info->num_records; i++) {
+        capture_record *rec = info->records[i];
+
+        // Wait until the command was originally sent
+        if (SPEED > 0) {
+            uint64_t target = rec->offset / SPEED;
+            uint64_t now = usec_since(&START);
+            if (now < target) usleep(target - now);
+        }
+
+        // Append a newline to the command
+        cmd = (rec->len + 1 <= sizeof(cmd_buf)) ? cmd_buf : malloc(rec->len + 1);
+        memcpy(cmd, (char*)(rec + 1), rec->len);
+        cmd[rec->len] = '\n';
+
+        gettimeofday(&sent, NULL);
+        int res = send(info->conn_fd, cmd, rec->len + 1, 0);
+        if (cmd != cmd_buf) free(cmd);
+        if (res == -1 || read_response(info)) {
+            printf("Connection failed after %llu commands!\n", (unsigned long long)i);
+            info->num_records = i;
+            break;
+        }
+        info->latencies[i] = usec_since(&sent);
+    }
+    return NULL;
+}
+
+int cmp_u64(const void *a, const void *b) {
+    uint64_t x = *(uint64_t*)a, y = *(uint64_t*)b;
+    return (x > y) - (x < y);
+}
+
+void show_usage() {
+    fprintf(stderr, "usage: replay [-H host] [-p port] [-c conns] [-s speed] capture_file\n\
+\n\
+    -H : Host to replay against. Default 127.0.0.1\n\
+    -p : Port to replay against. Default 8673\n\
+    -c : Number of connections to replay over. Default 1\n\
+    -s : Timing multiplier, 2 replays at twice the original rate.\n\
+         Use 0 to replay as fast as possible. Default 1\n\
+\n");
+}
+
+int main(int argc, char **argv) {
+    int c;
+    while ((c = getopt(argc, argv, "H:p:c:s:")) != -1) {
+        switch (c) {
+            case 'H': HOST = optarg; break;
+            case 'p': PORT = atoi(optarg); break;
+            case 'c': NUM_CONNS = atoi(optarg); break;
+            case 's': SPEED = atof(optarg); break;
+            default: show_usage(); return 1;
+        }
+    }
+    if (optind != argc - 1 || NUM_CONNS < 1 || SPEED < 0) {
+        show_usage();
+        return 1;
+    }
+
+    // Read in the capture
+    int fd = open(argv[optind], O_RDONLY);
+    struct stat st;
+    if (fd == -1 || fstat(fd, &st)) {
+        printf("Failed to open capture file!\n");
+        return 1;
+    }
+    char *data = malloc(st.st_size);
+    uint64_t total = 0;
+    while (total < (uint64_t)st.st_size) {
+        int n = read(fd, data + total, st.st_size - total);
+        if (n <= 0) break;
+        total += n;
+    }
+    close(fd);
+
+    capture_header *header = (capture_header*)data;
+    if (total < sizeof(capture_header) || memcmp(header->magic, CAPTURE_MAGIC, 8) ||
+            header->version != CAPTURE_VERSION) {
+        printf("Not a bloomd capture file!\n");
+        return 1;
+    }
+    printf("Capture sampled %0.2f%% of commands.\n", header->sample_ppm / 10000.0);
+
+    // Split the records by client onto the connections
+    conn_info *conns = calloc(NUM_CONNS, sizeof(conn_info));
+    uint64_t offset = sizeof(capture_header);
+    uint64_t num_records = 0;
+    uint64_t duration = 0;
+    while (offset + sizeof(capture_record) <= total) {
+        capture_record *rec = (capture_record*)(data + offset);
+        if (offset + sizeof(capture_record) + rec->len > total) break;
+        offset += sizeof(capture_record) + rec->len;
+
+        conn_info *info = conns + (rec->conn_id * 2654435761U) % NUM_CONNS;
+        if (info->num_records == info->max_records) {
+            info->max_records = (info->max_records) ? info->max_records * 2 : 1024;
+            info->records = realloc(info->records, info->max_records * sizeof(capture_record*));
+        }
+        info->records[info->num_records++] = rec;
+        num_records++;
+        duration = rec->offset;
+    }
+    printf("Replaying %llu commands over %d connections. Captured over %llu msec.\n",
+            (unsigned long long)num_records, NUM_CONNS, (unsigned long long)duration / 1000);
+
+    // Connect everything before starting the clock
+    for (int i=0; i < NUM_CONNS; i++) {
+        if (connect_fd(conns + i)) {
+            printf("Failed to connect!\n");
+            return 1;
+        }
+        conns[i].latencies = calloc(conns[i].num_records + 1, sizeof(uint64_t));
+    }
+
+    gettimeofday(&START, NULL);
+    for (int i=0; i < NUM_CONNS; i++) {
+        pthread_create(&conns[i].thread, NULL, thread_main, conns + i);
+    }
+    for (int i=0; i < NUM_CONNS; i++) {
+        pthread_join(conns[i].thread, NULL);
+    }
+    uint64_t elapsed = usec_since(&START);
+
+    // Merge the latencies
+    uint64_t done = 0, errors = 0;
+    uint64_t *latencies = malloc((num_records + 1) * sizeof(uint64_t));
+    for (int i=0; i < NUM_CONNS; i++) {
+        memcpy(latencies + done, conns[i].latencies, conns[i].num_records * sizeof(uint64_t));
+        done += conns[i].num_records;
+        errors += conns[i].errors;
+    }
+    if (!done) {
+        printf("No commands replayed!\n");
+        return 1;
+    }
+    qsort(latencies, done, sizeof(uint64_t), cmp_u64);
+
+    printf("Replayed: %llu commands in %llu msec. Errors: %llu\n",
+            (unsigned long long)done, (unsigned long long)elapsed / 1000,
+            (unsigned long long)errors);
+    printf("Throughput: %0.0f commands/sec\n", done / (elapsed / 1e6));
+    printf("Latency usec: p50 %llu, p90 %llu, p99 %llu, p999 %llu, max %llu\n",
+            (unsigned long long)latencies[done * 50 / 100],
+            (unsigned long long)latencies[done * 90 / 100],
+            (unsigned long long)latencies[done * 99 / 100],
+            (unsigned long long)latencies[done * 999 / 1000],
+            (unsigned long long)latencies[done - 1]);
+    return 0;
+}
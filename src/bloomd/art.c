@@ -1,7 +1,9 @@
 #include <stdlib.h>
+#include <stddef.h>
 #include <string.h>
 #include <strings.h>
 #include <stdio.h>
+#include <sys/mman.h>
 #include <emmintrin.h>
 #include <assert.h>
 #include "art.h"
@@ -13,53 +15,201 @@
 #define SET_LEAF(x) ((void*)((uintptr_t)x | 1))
 #define LEAF_RAW(x) ((void*)((uintptr_t)x & ~1))
 
+/**
+ * Slab chunks start with room for this many objects,
+ * and double in size up to ART_MAX_CHUNK bytes. Chunks
+ * of that size are aligned to it, and backed by huge
+ * pages where possible, so lookups in large trees miss
+ * the TLB less.
+ */
+#define ART_MIN_CHUNK_OBJS 8
+#define ART_MAX_CHUNK (2 * 1024 * 1024)
+
+/**
+ * Rounds a size up to whole cache lines
+ */
+#define CACHE_LINES(x) (((x) + ART_CACHE_LINE - 1) & ~(ART_CACHE_LINE - 1))
+
+/**
+ * The sizes of each node type, indexed by type
+ */
+static const size_t NODE_SIZES[] = {
+    0,
+    sizeof(art_node4),
+    sizeof(art_node16),
+    sizeof(art_node48),
+    sizeof(art_node256)
+};
+
+static void slab_init(art_slab *s, uint32_t size) {
+    memset(s, 0, sizeof(art_slab));
+    s->size = size;
+    s->chunk_bytes = ART_CACHE_LINE + ART_MIN_CHUNK_OBJS * size;
+}
+
+/**
+ * Allocates a chunk for a slab. Chunks of the largest size
+ * are mapped on their own, aligned to their size, so they
+ * can be backed by huge pages.
+ * @return The chunk, or NULL if out of memory.
+ */
+static void* alloc_chunk(size_t bytes) {
+    void *chunk;
+    if (bytes < ART_MAX_CHUNK) {
+        return posix_memalign(&chunk, ART_CACHE_LINE, bytes) ? NULL : chunk;
+    }
+
+    // Map twice the size, and trim to an aligned chunk
+    char *map = mmap(NULL, 2 * bytes, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+    if (map == MAP_FAILED) return NULL;
+    char *aligned = (char*)(((uintptr_t)map + bytes - 1) & ~(uintptr_t)(bytes - 1));
+    if (aligned > map) munmap(map, aligned - map);
+    munmap(aligned + bytes, map + bytes - aligned);
+#ifdef MADV_HUGEPAGE
+    madvise(aligned, bytes, MADV_HUGEPAGE);
+#endif
+    return aligned;
+}
+
+/**
+ * Takes an object from the slab. A new chunk is
+ * allocated once the free list and the last chunk
+ * are empty. The first cache line of a chunk links
+ * it to the others and holds its size, so the
+ * objects stay aligned.
+ * @return The object, or NULL if out of memory.
+ */
+static void* slab_alloc(art_slab *s) {
+    void *obj = s->free_list;
+    if (obj) {
+        s->free_list = *(void**)obj;
+        return obj;
+    }
+
+    if (s->next == s->end) {
+        size_t bytes = s->chunk_bytes;
+        void **chunk = alloc_chunk(bytes);
+        if (!chunk) return NULL;
+        chunk[0] = s->chunks;
+        chunk[1] = (void*)bytes;
+        s->chunks = chunk;
+        s->next = (char*)chunk + ART_CACHE_LINE;
+        s->end = s->next + (bytes - ART_CACHE_LINE) / s->size * s->size;
+        s->bytes += bytes;
+        s->chunk_bytes = (bytes * 2 < ART_MAX_CHUNK) ? bytes * 2 : ART_MAX_CHUNK;
+    }
+
+    obj = s->next;
+    s->next += s->size;
+    return obj;
+}
+
+static void slab_free(art_slab *s, void *obj) {
+    *(void**)obj = s->free_list;
+    s->free_list = obj;
+}
+
+// Frees all the chunks of a slab
+static void slab_destroy(art_slab *s) {
+    void **chunk = s->chunks, **next;
+    while (chunk) {
+        next = chunk[0];
+        if ((size_t)chunk[1] < ART_MAX_CHUNK) {
+            free(chunk);
+        } else {
+            munmap(chunk, (size_t)chunk[1]);
+        }
+        chunk = next;
+    }
+    slab_init(s, s->size);
+}
+
 /**
  * Allocates a node of the given type,
  * initializes to zero and sets the type.
  */
-static art_node* alloc_node(uint8_t type) {
-    art_node* n;
-    switch (type) {
-        case NODE4:
-            n = calloc(1, sizeof(art_node4));
-            break;
-        case NODE16:
-            n = calloc(1, sizeof(art_node16));
-            break;
-        case NODE48:
-            n = calloc(1, sizeof(art_node48));
-            break;
-        case NODE256:
-            n = calloc(1, sizeof(art_node256));
-            break;
-        default:
-            abort();
-    }
+static art_node* alloc_node(art_tree *t, uint8_t type) {
+    if (type < NODE4 || type > NODE256) abort();
+    art_node *n = slab_alloc(&t->slabs[type - 1]);
+    if (!n) return NULL;
+    memset(n, 0, NODE_SIZES[type]);
     n->type = type;
     return n;
 }
 
+// Returns a node to the slab of its type
+static void free_node(art_tree *t, void *n) {
+    slab_free(&t->slabs[((art_node*)n)->type - 1], n);
+}
+
+/**
+ * Returns the slab of leaves with a key of
+ * the given length, or NULL if it is too large.
+ */
+static art_slab* leaf_slab(art_leaves *a, uint32_t key_len) {
+    size_t idx = (offsetof(art_leaf, key) + key_len - 1) / ART_LEAF_STEP;
+    return (idx < ART_LEAF_SLABS) ? &a->slabs[idx] : NULL;
+}
+
+/**
+ * Drops a reference to a leaf, and frees
+ * it once no tree refers to it.
+ */
+static void release_leaf(art_tree *t, art_leaf *l) {
+    if (__sync_sub_and_fetch(&l->ref_count, 1)) return;
+    art_leaves *a = t->leaves;
+    pthread_mutex_lock(&a->lock);
+    art_slab *s = leaf_slab(a, l->key_len);
+    if (s) {
+        slab_free(s, l);
+    } else {
+        a->large_leaves--;
+        a->large_bytes -= offsetof(art_leaf, key) + l->key_len;
+        free(l);
+    }
+    pthread_mutex_unlock(&a->lock);
+}
+
+// Sets up the empty node slabs of a tree
+static void init_node_slabs(art_tree *t) {
+    t->root = NULL;
+    t->size = 0;
+    for (int type=NODE4; type <= NODE256; type++) {
+        slab_init(&t->slabs[type - 1], CACHE_LINES(NODE_SIZES[type]));
+    }
+}
+
 /**
  * Initializes an ART tree
  * @return 0 on success.
  */
 int init_art_tree(art_tree *t) {
-    t->root = NULL;
-    t->size = 0;
+    init_node_slabs(t);
+    art_leaves *a = t->leaves = calloc(1, sizeof(art_leaves));
+    if (!a) return -1;
+    pthread_mutex_init(&a->lock, NULL);
+    a->trees = 1;
+    for (int i=0; i < ART_LEAF_SLABS; i++) {
+        slab_init(&a->slabs[i], (i + 1) * ART_LEAF_STEP);
+    }
     return 0;
 }
 
-// Recursively destroys the tree
-static void destroy_node(art_node *n) {
+/**
+ * Recursively drops the leaves of a tree. If the tree is
+ * the last to use its leaves, only the leaves that are not
+ * in a slab are freed, as the slabs are freed after.
+ */
+static void destroy_node(art_tree *t, art_node *n, int last) {
     // Break if null
     if (!n) return;
 
     // Special case leafs
     if (IS_LEAF(n)) {
-        // Only release the leaf if the ref count hits zero
         art_leaf *l = LEAF_RAW(n);
-        int ref = __sync_sub_and_fetch(&l->ref_count, 1);
-        if (!ref)
+        if (!last)
+            release_leaf(t, l);
+        else if (!leaf_slab(t->leaves, l->key_len))
             free(l);
         return;
     }
@@ -76,21 +226,22 @@ static void destroy_node(art_node *n) {
         case NODE4:
             p.p1 = (art_node4*)n;
             for (i=0;i<n->num_children;i++) {
-                destroy_node(p.p1->children[i]);
+                destroy_node(t, p.p1->children[i], last);
             }
             break;
 
         case NODE16:
             p.p2 = (art_node16*)n;
             for (i=0;i<n->num_children;i++) {
-                destroy_node(p.p2->children[i]);
+                destroy_node(t, p.p2->children[i], last);
             }
             break;
 
         case NODE48:
+            // Deletes leave holes in the children
             p.p3 = (art_node48*)n;
-            for (i=0;i<n->num_children;i++) {
-                destroy_node(p.p3->children[i]);
+            for (i=0;i<48;i++) {
+                destroy_node(t, p.p3->children[i], last);
             }
             break;
 
@@ -98,27 +249,79 @@ static void destroy_node(art_node *n) {
             p.p4 = (art_node256*)n;
             for (i=0;i<256;i++) {
                 if (p.p4->children[i])
-                    destroy_node(p.p4->children[i]);
+                    destroy_node(t, p.p4->children[i], last);
             }
             break;
 
         default:
             abort();
     }
-
-    // Free ourself on the way up
-    free(n);
 }
 
 /**
- * Destroys an ART tree
+ * Destroys an ART tree. The nodes are freed with their
+ * slabs. A tree that shares its leaves drops each of them,
+ * while the last tree frees the leaf slabs, so it only
+ * walks the tree if there are large leaves.
  * @return 0 on success.
  */
 int destroy_art_tree(art_tree *t) {
-    destroy_node(t->root);
+    art_leaves *a = t->leaves;
+    pthread_mutex_lock(&a->lock);
+    int shared = a->trees > 1;
+    pthread_mutex_unlock(&a->lock);
+    if (shared) destroy_node(t, t->root, 0);
+
+    // Another tree may have been destroyed meanwhile
+    pthread_mutex_lock(&a->lock);
+    int last = --a->trees == 0;
+    pthread_mutex_unlock(&a->lock);
+    if (last) {
+        if (!shared && a->large_leaves) destroy_node(t, t->root, 1);
+        for (int i=0; i < ART_LEAF_SLABS; i++) {
+            slab_destroy(&a->slabs[i]);
+        }
+        pthread_mutex_destroy(&a->lock);
+        free(a);
+    }
+
+    for (int i=0; i < NODE256; i++) {
+        slab_destroy(&t->slabs[i]);
+    }
+    t->root = NULL;
+    t->size = 0;
+    t->leaves = NULL;
     return 0;
 }
 
+/**
+ * Returns the bytes of memory held by the ART tree,
+ * including the unused parts of its slabs and the
+ * leaves it shares with its copies.
+ */
+uint64_t art_memory(art_tree *t) {
+    art_leaves *a = t->leaves;
+    pthread_mutex_lock(&a->lock);
+    uint64_t bytes = a->large_bytes;
+    for (int i=0; i < ART_LEAF_SLABS; i++) {
+        bytes += a->slabs[i].bytes;
+    }
+    pthread_mutex_unlock(&a->lock);
+    return bytes + art_node_memory(t);
+}
+
+/**
+ * Returns the bytes of memory held by the nodes of
+ * the ART tree, which are not shared with copies.
+ */
+uint64_t art_node_memory(art_tree *t) {
+    uint64_t bytes = 0;
+    for (int i=0; i < NODE256; i++) {
+        bytes += t->slabs[i].bytes;
+    }
+    return bytes;
+}
+
 /**
  * Returns the size of the ART tree.
  */
@@ -320,11 +523,22 @@ art_leaf* art_maximum(art_tree *t) {
     return maximum((art_node*)t->root);
 }
 
-static art_leaf* make_leaf(unsigned char *key, int key_len, void *value) {
-    art_leaf *l = malloc(sizeof(art_leaf)+key_len);
-    l->ref_count = 1;
+static art_leaf* make_leaf(art_tree *t, unsigned char *key, int key_len, void *value) {
+    art_leaf *l;
+    art_leaves *a = t->leaves;
+    pthread_mutex_lock(&a->lock);
+    art_slab *s = leaf_slab(a, key_len);
+    if (s) {
+        l = slab_alloc(s);
+    } else if ((l = malloc(offsetof(art_leaf, key) + key_len))) {
+        a->large_leaves++;
+        a->large_bytes += offsetof(art_leaf, key) + key_len;
+    }
+    pthread_mutex_unlock(&a->lock);
+    if (!l) return NULL;
     l->value = value;
     l->key_len = key_len;
+    l->ref_count = 1;
     memcpy(l->key, key, key_len);
     return l;
 }
@@ -345,13 +559,14 @@ static void copy_header(art_node *dest, art_node *src) {
     memcpy(dest->partial, src->partial, min(MAX_PREFIX_LEN, src->partial_len));
 }
 
-static void add_child256(art_node256 *n, art_node **ref, unsigned char c, void *child) {
+static void add_child256(art_tree *t, art_node256 *n, art_node **ref, unsigned char c, void *child) {
+    (void)t;
     (void)ref;
     n->n.num_children++;
     n->children[c] = child;
 }
 
-static void add_child48(art_node48 *n, art_node **ref, unsigned char c, void *child) {
+static void add_child48(art_tree *t, art_node48 *n, art_node **ref, unsigned char c, void *child) {
     if (n->n.num_children < 48) {
         int pos = 0;
         while (n->children[pos]) pos++;
@@ -359,7 +574,7 @@ static void add_child48(art_node48 *n, art_node **ref, unsigned char c, void *ch
         n->keys[c] = pos + 1;
         n->n.num_children++;
     } else {
-        art_node256 *new = (art_node256*)alloc_node(NODE256);
+        art_node256 *new = (art_node256*)alloc_node(t, NODE256);
         for (int i=0;i<256;i++) {
             if (n->keys[i]) {
                 new->children[i] = n->children[n->keys[i] - 1];
@@ -367,12 +582,12 @@ static void add_child48(art_node48 *n, art_node **ref, unsigned char c, void *ch
         }
         copy_header((art_node*)new, (art_node*)n);
         *ref = (art_node*)new;
-        free(n);
-        add_child256(new, ref, c, child);
+        free_node(t, n);
+        add_child256(t, new, ref, c, child);
     }
 }
 
-static void add_child16(art_node16 *n, art_node **ref, unsigned char c, void *child) {
+static void add_child16(art_tree *t, art_node16 *n, art_node **ref, unsigned char c, void *child) {
     if (n->n.num_children < 16) {
         __m128i cmp;
 
@@ -400,7 +615,7 @@ static void add_child16(art_node16 *n, art_node **ref, unsigned char c, void *ch
         n->n.num_children++;
 
     } else {
-        art_node48 *new = (art_node48*)alloc_node(NODE48);
+        art_node48 *new = (art_node48*)alloc_node(t, NODE48);
 
         // Copy the child pointers and populate the key map
         memcpy(new->children, n->children,
@@ -410,12 +625,12 @@ static void add_child16(art_node16 *n, art_node **ref, unsigned char c, void *ch
         }
         copy_header((art_node*)new, (art_node*)n);
         *ref = (art_node*)new;
-        free(n);
-        add_child48(new, ref, c, child);
+        free_node(t, n);
+        add_child48(t, new, ref, c, child);
     }
 }
 
-static void add_child4(art_node4 *n, art_node **ref, unsigned char c, void *child) {
+static void add_child4(art_tree *t, art_node4 *n, art_node **ref, unsigned char c, void *child) {
     if (n->n.num_children < 4) {
         int idx;
         for (idx=0; idx < n->n.num_children; idx++) {
@@ -433,7 +648,7 @@ static void add_child4(art_node4 *n, art_node **ref, unsigned char c, void *chil
         n->n.num_children++;
 
     } else {
-        art_node16 *new = (art_node16*)alloc_node(NODE16);
+        art_node16 *new = (art_node16*)alloc_node(t, NODE16);
 
         // Copy the child pointers and the key map
         memcpy(new->children, n->children,
@@ -442,21 +657,21 @@ static void add_child4(art_node4 *n, art_node **ref, unsigned char c, void *chil
                 sizeof(unsigned char)*n->n.num_children);
         copy_header((art_node*)new, (art_node*)n);
         *ref = (art_node*)new;
-        free(n);
-        add_child16(new, ref, c, child);
+        free_node(t, n);
+        add_child16(t, new, ref, c, child);
     }
 }
 
-static void add_child(art_node *n, art_node **ref, unsigned char c, void *child) {
+static void add_child(art_tree *t, art_node *n, art_node **ref, unsigned char c, void *child) {
     switch (n->type) {
         case NODE4:
-            return add_child4((art_node4*)n, ref, c, child);
+            return add_child4(t, (art_node4*)n, ref, c, child);
         case NODE16:
-            return add_child16((art_node16*)n, ref, c, child);
+            return add_child16(t, (art_node16*)n, ref, c, child);
         case NODE48:
-            return add_child48((art_node48*)n, ref, c, child);
+            return add_child48(t, (art_node48*)n, ref, c, child);
         case NODE256:
-            return add_child256((art_node256*)n, ref, c, child);
+            return add_child256(t, (art_node256*)n, ref, c, child);
         default:
             abort();
     }
@@ -486,10 +701,10 @@ static int prefix_mismatch(art_node *n, unsigned char *key, int key_len, int dep
     return idx;
 }
 
-static void* recursive_insert(art_node *n, art_node **ref, unsigned char *key, int key_len, void *value, int depth, int *old) {
+static void* recursive_insert(art_tree *t, art_node *n, art_node **ref, unsigned char *key, int key_len, void *value, int depth, int *old) {
     // If we are at a NULL node, inject a leaf
     if (!n) {
-        *ref = (art_node*)SET_LEAF(make_leaf(key, key_len, value));
+        *ref = (art_node*)SET_LEAF(make_leaf(t, key, key_len, value));
         return NULL;
     }
 
@@ -506,10 +721,10 @@ static void* recursive_insert(art_node *n, art_node **ref, unsigned char *key, i
         }
 
         // New value, we must split the leaf into a node4
-        art_node4 *new = (art_node4*)alloc_node(NODE4);
+        art_node4 *new = (art_node4*)alloc_node(t, NODE4);
 
         // Create a new leaf
-        art_leaf *l2 = make_leaf(key, key_len, value);
+        art_leaf *l2 = make_leaf(t, key, key_len, value);
 
         // Determine longest prefix
         int longest_prefix = longest_common_prefix(l, l2, depth);
@@ -517,8 +732,8 @@ static void* recursive_insert(art_node *n, art_node **ref, unsigned char *key, i
         memcpy(new->n.partial, key+depth, min(MAX_PREFIX_LEN, longest_prefix));
         // Add the leafs to the new node4
         *ref = (art_node*)new;
-        add_child4(new, ref, l->key[depth+longest_prefix], SET_LEAF(l));
-        add_child4(new, ref, l2->key[depth+longest_prefix], SET_LEAF(l2));
+        add_child4(t, new, ref, l->key[depth+longest_prefix], SET_LEAF(l));
+        add_child4(t, new, ref, l2->key[depth+longest_prefix], SET_LEAF(l2));
         return NULL;
     }
 
@@ -532,28 +747,28 @@ static void* recursive_insert(art_node *n, art_node **ref, unsigned char *key, i
         }
 
         // Create a new node
-        art_node4 *new = (art_node4*)alloc_node(NODE4);
+        art_node4 *new = (art_node4*)alloc_node(t, NODE4);
         *ref = (art_node*)new;
         new->n.partial_len = prefix_diff;
         memcpy(new->n.partial, n->partial, min(MAX_PREFIX_LEN, prefix_diff));
 
         // Adjust the prefix of the old node
         if (n->partial_len <= MAX_PREFIX_LEN) {
-            add_child4(new, ref, n->partial[prefix_diff], n);
+            add_child4(t, new, ref, n->partial[prefix_diff], n);
             n->partial_len -= (prefix_diff+1);
             memmove(n->partial, n->partial+prefix_diff+1,
                     min(MAX_PREFIX_LEN, n->partial_len));
         } else {
             n->partial_len -= (prefix_diff+1);
             art_leaf *l = minimum(n);
-            add_child4(new, ref, l->key[depth+prefix_diff], n);
+            add_child4(t, new, ref, l->key[depth+prefix_diff], n);
             memcpy(n->partial, l->key+depth+prefix_diff+1,
                     min(MAX_PREFIX_LEN, n->partial_len));
         }
 
         // Insert the new leaf
-        art_leaf *l = make_leaf(key, key_len, value);
-        add_child4(new, ref, key[depth+prefix_diff], SET_LEAF(l));
+        art_leaf *l = make_leaf(t, key, key_len, value);
+        add_child4(t, new, ref, key[depth+prefix_diff], SET_LEAF(l));
         return NULL;
     }
 
@@ -562,12 +777,12 @@ RECURSE_SEARCH:;
     // Find a child to recurse to
     art_node **child = find_child(n, key[depth]);
     if (child) {
-        return recursive_insert(*child, child, key, key_len, value, depth+1, old);
+        return recursive_insert(t, *child, child, key, key_len, value, depth+1, old);
     }
 
     // No child, node goes within us
-    art_leaf *l = make_leaf(key, key_len, value);
-    add_child(n, ref, key[depth], SET_LEAF(l));
+    art_leaf *l = make_leaf(t, key, key_len, value);
+    add_child(t, n, ref, key[depth], SET_LEAF(l));
     return NULL;
 }
 
@@ -582,19 +797,19 @@ RECURSE_SEARCH:;
  */
 void* art_insert(art_tree *t, unsigned char *key, int key_len, void *value) {
     int old_val = 0;
-    void *old = recursive_insert(t->root, &t->root, key, key_len, value, 0, &old_val);
+    void *old = recursive_insert(t, t->root, &t->root, key, key_len, value, 0, &old_val);
     if (!old_val) t->size++;
     return old;
 }
 
-static void remove_child256(art_node256 *n, art_node **ref, unsigned char c) {
+static void remove_child256(art_tree *t, art_node256 *n, art_node **ref, unsigned char c) {
     n->children[c] = NULL;
     n->n.num_children--;
 
     // Resize to a node48 on underflow, not immediately to prevent
     // trashing if we sit on the 48/49 boundary
     if (n->n.num_children == 37) {
-        art_node48 *new = (art_node48*)alloc_node(NODE48);
+        art_node48 *new = (art_node48*)alloc_node(t, NODE48);
         *ref = (art_node*)new;
         copy_header((art_node*)new, (art_node*)n);
 
@@ -606,18 +821,18 @@ static void remove_child256(art_node256 *n, art_node **ref, unsigned char c) {
                 pos++;
             }
         }
-        free(n);
+        free_node(t, n);
     }
 }
 
-static void remove_child48(art_node48 *n, art_node **ref, unsigned char c) {
+static void remove_child48(art_tree *t, art_node48 *n, art_node **ref, unsigned char c) {
     int pos = n->keys[c];
     n->keys[c] = 0;
     n->children[pos-1] = NULL;
     n->n.num_children--;
 
     if (n->n.num_children == 12) {
-        art_node16 *new = (art_node16*)alloc_node(NODE16);
+        art_node16 *new = (art_node16*)alloc_node(t, NODE16);
         *ref = (art_node*)new;
         copy_header((art_node*)new, (art_node*)n);
 
@@ -630,27 +845,27 @@ static void remove_child48(art_node48 *n, art_node **ref, unsigned char c) {
                 child++;
             }
         }
-        free(n);
+        free_node(t, n);
     }
 }
 
-static void remove_child16(art_node16 *n, art_node **ref, art_node **l) {
+static void remove_child16(art_tree *t, art_node16 *n, art_node **ref, art_node **l) {
     int pos = l - n->children;
     memmove(n->keys+pos, n->keys+pos+1, n->n.num_children - 1 - pos);
     memmove(n->children+pos, n->children+pos+1, (n->n.num_children - 1 - pos)*sizeof(void*));
     n->n.num_children--;
 
     if (n->n.num_children == 3) {
-        art_node4 *new = (art_node4*)alloc_node(NODE4);
+        art_node4 *new = (art_node4*)alloc_node(t, NODE4);
         *ref = (art_node*)new;
         copy_header((art_node*)new, (art_node*)n);
         memcpy(new->keys, n->keys, 4);
         memcpy(new->children, n->children, 4*sizeof(void*));
-        free(n);
+        free_node(t, n);
     }
 }
 
-static void remove_child4(art_node4 *n, art_node **ref, art_node **l) {
+static void remove_child4(art_tree *t, art_node4 *n, art_node **ref, art_node **l) {
     int pos = l - n->children;
     memmove(n->keys+pos, n->keys+pos+1, n->n.num_children - 1 - pos);
     memmove(n->children+pos, n->children+pos+1, (n->n.num_children - 1 - pos)*sizeof(void*));
@@ -677,26 +892,26 @@ static void remove_child4(art_node4 *n, art_node **ref, art_node **l) {
             child->partial_len += n->n.partial_len + 1;
         }
         *ref = child;
-        free(n);
+        free_node(t, n);
     }
 }
 
-static void remove_child(art_node *n, art_node **ref, unsigned char c, art_node **l) {
+static void remove_child(art_tree *t, art_node *n, art_node **ref, unsigned char c, art_node **l) {
     switch (n->type) {
         case NODE4:
-            return remove_child4((art_node4*)n, ref, l);
+            return remove_child4(t, (art_node4*)n, ref, l);
         case NODE16:
-            return remove_child16((art_node16*)n, ref, l);
+            return remove_child16(t, (art_node16*)n, ref, l);
         case NODE48:
-            return remove_child48((art_node48*)n, ref, c);
+            return remove_child48(t, (art_node48*)n, ref, c);
         case NODE256:
-            return remove_child256((art_node256*)n, ref, c);
+            return remove_child256(t, (art_node256*)n, ref, c);
         default:
             abort();
     }
 }
 
-static art_leaf* recursive_delete(art_node *n, art_node **ref, unsigned char *key, int key_len, int depth) {
+static art_leaf* recursive_delete(art_tree *t, art_node *n, art_node **ref, unsigned char *key, int key_len, int depth) {
     // Search terminated
     if (!n) return NULL;
 
@@ -727,14 +942,14 @@ static art_leaf* recursive_delete(art_node *n, art_node **ref, unsigned char *ke
     if (IS_LEAF(*child)) {
         art_leaf *l = LEAF_RAW(*child);
         if (!leaf_matches(l, key, key_len, depth)) {
-            remove_child(n, ref, key[depth], child);
+            remove_child(t, n, ref, key[depth], child);
             return l;
         }
         return NULL;
 
     // Recurse
     } else {
-        return recursive_delete(*child, child, key, key_len, depth+1);
+        return recursive_delete(t, *child, child, key, key_len, depth+1);
     }
 }
 
@@ -747,15 +962,11 @@ static art_leaf* recursive_delete(art_node *n, art_node **ref, unsigned char *ke
  * the value pointer is returned.
  */
 void* art_delete(art_tree *t, unsigned char *key, int key_len) {
-    art_leaf *l = recursive_delete(t->root, &t->root, key, key_len, 0);
+    art_leaf *l = recursive_delete(t, t->root, &t->root, key, key_len, 0);
     if (l) {
         t->size--;
         void *old = l->value;
-
-        // Only release the leaf if the ref count hits zero
-        int ref = __sync_sub_and_fetch(&l->ref_count, 1);
-        if (!ref)
-            free(l);
+        release_leaf(t, l);
 
         return old;
     }
@@ -898,14 +1109,105 @@ int art_iter_prefix(art_tree *t, unsigned char *key, int key_len, art_callback c
     return 0;
 }
 
-// Recursively copies a tree
-static art_node* recursive_copy(art_node *n) {
+/**
+ * Compares the key of a leaf with a key
+ * @return Negative, zero or positive like memcmp.
+ */
+static int leaf_compare(art_leaf *l, unsigned char *key, int key_len) {
+    int c = memcmp(l->key, key, min(l->key_len, key_len));
+    if (c) return c;
+    return (int)l->key_len - key_len;
+}
+
+/**
+ * Returns the next child of a node in key order,
+ * starting from a position that is advanced past it.
+ * @return The child, or NULL when there are no more.
+ */
+static art_node* next_child(art_node *n, int *pos) {
+    art_node *child;
+    int idx;
+    switch (n->type) {
+        case NODE4:
+            if (*pos >= n->num_children) return NULL;
+            return ((art_node4*)n)->children[(*pos)++];
+        case NODE16:
+            if (*pos >= n->num_children) return NULL;
+            return ((art_node16*)n)->children[(*pos)++];
+        case NODE48:
+            while (*pos < 256) {
+                idx = ((art_node48*)n)->keys[(*pos)++];
+                if (idx) return ((art_node48*)n)->children[idx-1];
+            }
+            return NULL;
+        case NODE256:
+            while (*pos < 256) {
+                child = ((art_node256*)n)->children[(*pos)++];
+                if (child) return child;
+            }
+            return NULL;
+        default:
+            abort();
+    }
+}
+
+static int recursive_iter_after(art_node *n, unsigned char *key, int key_len, art_callback cb, void *data) {
+    // Handle base cases
+    if (!n) return 0;
+    if (IS_LEAF(n)) {
+        art_leaf *l = LEAF_RAW(n);
+        if (leaf_compare(l, key, key_len) <= 0) return 0;
+        return cb(data, (const unsigned char*)l->key, l->key_len, l->value);
+    }
+
+    // Skip the children that are entirely before the key
+    int pos = 0, res;
+    art_node *child;
+    while ((child = next_child(n, &pos))) {
+        if (leaf_compare(maximum(child), key, key_len) > 0) break;
+    }
+    if (!child) return 0;
+
+    // Only this child can hold keys on both sides
+    if (leaf_compare(minimum(child), key, key_len) > 0)
+        res = recursive_iter(child, cb, data);
+    else
+        res = recursive_iter_after(child, key, key_len, cb, data);
+    if (res) return res;
+
+    // Every later child is after the key
+    while ((child = next_child(n, &pos))) {
+        res = recursive_iter(child, cb, data);
+        if (res) return res;
+    }
+    return 0;
+}
+
+/**
+ * Iterates through the entries pairs in the map that
+ * come after a given key, in key order. The key itself
+ * does not need to be in the map. This lets a caller
+ * resume an iteration from the last key it saw.
+ * The call back gets a key, value for each and returns an integer stop value.
+ * If the callback returns non-zero, then the iteration stops.
+ * @arg t The tree to iterate over
+ * @arg key The key to start after
+ * @arg key_len The length of the key
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int art_iter_after(art_tree *t, unsigned char *key, int key_len, art_callback cb, void *data) {
+    return recursive_iter_after(t->root, key, key_len, cb, data);
+}
+
+// Recursively copies the nodes of a tree into another, depth first
+static art_node* recursive_copy(art_tree *t, art_node *n) {
     // Handle the NULL nodes
     if (!n) return NULL;
 
-    // Handle leaves
+    // Re-use leaves, incrementing the ref count
     if (IS_LEAF(n)) {
-        // Re-use leaf, increment ref-count
         art_leaf *l = LEAF_RAW(n);
         __sync_fetch_and_add(&l->ref_count, 1);
         return n;
@@ -919,37 +1221,38 @@ static art_node* recursive_copy(art_node *n) {
     } p;
     switch (n->type) {
         case NODE4:
-            p.p1 = (art_node4*)alloc_node(NODE4);
+            p.p1 = (art_node4*)alloc_node(t, NODE4);
             copy_header((art_node*)p.p1, n);
             memcpy(p.p1->keys, ((art_node4*)n)->keys, 4);
             for (int i=0; i < n->num_children; i++) {
-                p.p1->children[i] = recursive_copy(((art_node4*)n)->children[i]);
+                p.p1->children[i] = recursive_copy(t, ((art_node4*)n)->children[i]);
             }
             return (art_node*)p.p1;
 
         case NODE16:
-            p.p2 = (art_node16*)alloc_node(NODE16);
+            p.p2 = (art_node16*)alloc_node(t, NODE16);
             copy_header((art_node*)p.p2, n);
-            memcpy(p.p1->keys, ((art_node16*)n)->keys, 16);
+            memcpy(p.p2->keys, ((art_node16*)n)->keys, 16);
             for (int i=0; i < n->num_children; i++) {
-                p.p2->children[i] = recursive_copy(((art_node16*)n)->children[i]);
+                p.p2->children[i] = recursive_copy(t, ((art_node16*)n)->children[i]);
             }
             return (art_node*)p.p2;
 
         case NODE48:
-            p.p3 = (art_node48*)alloc_node(NODE48);
+            // Deletes leave holes in the children
+            p.p3 = (art_node48*)alloc_node(t, NODE48);
             copy_header((art_node*)p.p3, n);
             memcpy(p.p3->keys, ((art_node48*)n)->keys, 256);
-            for (int i=0; i < n->num_children; i++) {
-                p.p3->children[i] = recursive_copy(((art_node48*)n)->children[i]);
+            for (int i=0; i < 48; i++) {
+                p.p3->children[i] = recursive_copy(t, ((art_node48*)n)->children[i]);
             }
             return (art_node*)p.p3;
 
         case NODE256:
-            p.p4 = (art_node256*)alloc_node(NODE256);
+            p.p4 = (art_node256*)alloc_node(t, NODE256);
             copy_header((art_node*)p.p4, n);
             for (int i=0; i < 256; i++) {
-                p.p4->children[i] = recursive_copy(((art_node256*)n)->children[i]);
+                p.p4->children[i] = recursive_copy(t, ((art_node256*)n)->children[i]);
             }
             return (art_node*)p.p4;
 
@@ -959,19 +1262,22 @@ static art_node* recursive_copy(art_node *n) {
 }
 
 /**
- * Creates a copy of an ART tree. The two trees will
- * share the internal leaves, but will NOT share internal nodes.
- * This allows leaves to be added and deleted from each tree
- * individually. It is important that concurrent updates to
- * a given key has no well defined behavior since the leaves are
- * shared.
+ * Creates a copy of an ART tree. The copy has its own nodes,
+ * allocated depth first so that the nodes of a path are close
+ * together. The leaves and values are shared, so a value that
+ * is replaced in one tree is replaced in both. Each tree may
+ * be updated by a different thread.
  * @arg dst The destination tree. Not initialized yet.
  * @arg src The source tree, must be initialized.
  * @return 0 on success.
  */
 int art_copy(art_tree *dst, art_tree *src) {
+    init_node_slabs(dst);
+    dst->leaves = src->leaves;
+    pthread_mutex_lock(&dst->leaves->lock);
+    dst->leaves->trees++;
+    pthread_mutex_unlock(&dst->leaves->lock);
     dst->size = src->size;
-    dst->root = recursive_copy(src->root);
+    dst->root = recursive_copy(dst, src->root);
     return 0;
 }
-
@@ -1,4 +1,5 @@
 #include <stdint.h>
+#include <pthread.h>
 #ifndef ART_H
 #define ART_H
 
@@ -61,20 +62,60 @@ typedef struct {
 /**
  * Represents a leaf. These are
  * of arbitrary size, as they include the key.
+ * A leaf is shared by a tree and its copies.
  */
 typedef struct {
-    uint16_t ref_count;
     void *value;
     uint32_t key_len;
+    uint32_t ref_count;
     unsigned char key[];
 } art_leaf;
 
+/**
+ * Nodes are allocated from a slab per node type,
+ * rounded up to whole cache lines. Leaves come from
+ * slabs of sizes in steps of ART_LEAF_STEP bytes, and
+ * larger leaves are allocated on their own.
+ */
+#define ART_CACHE_LINE 64
+#define ART_LEAF_STEP 16
+#define ART_LEAF_SLABS 16
+
+/**
+ * Hands out objects of one size from chunks that
+ * grow as the slab is used. Freed objects are kept
+ * on a list, linked through their first word.
+ */
+typedef struct {
+    uint32_t size;          // Bytes of each object
+    uint32_t chunk_bytes;   // Bytes of the next chunk
+    void *free_list;        // Freed objects
+    char *next;             // Next unused object of the last chunk
+    char *end;              // End of the last chunk
+    void *chunks;           // Chunks, linked through their first word
+    uint64_t bytes;         // Bytes of all the chunks
+} art_slab;
+
+/**
+ * The leaves of a tree and its copies. The arena
+ * is freed along with the last of those trees.
+ */
+typedef struct {
+    pthread_mutex_t lock;           // Guards the rest
+    uint32_t trees;                 // Trees using the leaves
+    uint64_t large_leaves;          // Leaves too large for the slabs
+    uint64_t large_bytes;           // Bytes of those leaves
+    art_slab slabs[ART_LEAF_SLABS]; // Leaf slabs by size
+} art_leaves;
+
 /**
  * Main struct, points to root.
  */
 typedef struct {
     art_node *root;
     uint64_t size;
+    art_leaves *leaves;             // Shared with copies of the tree
+    art_slab slabs[NODE256];        // Node slabs by type
 } art_tree;
 
 /**
@@ -96,6 +137,19 @@ inline uint64_t art_size(art_tree *t) {
     return t->size;
 }
 
+/**
+ * Returns the bytes of memory held by the ART tree,
+ * including the unused parts of its slabs and the
+ * leaves it shares with its copies.
+ */
+uint64_t art_memory(art_tree *t);
+
+/**
+ * Returns the bytes of memory held by the nodes of
+ * the ART tree, which are not shared with copies.
+ */
+uint64_t art_node_memory(art_tree *t);
+
 /**
  * Inserts a new value into the ART tree
  * @arg t The tree
@@ -166,12 +220,27 @@ int art_iter(art_tree *t, art_callback cb, void *data);
 int art_iter_prefix(art_tree *t, unsigned char *prefix, int prefix_len, art_callback cb, void *data);
 
 /**
- * Creates a copy of an ART tree. The two trees will
- * share the internal leaves, but will NOT share internal nodes.
- * This allows leaves to be added and deleted from each tree
- * individually. It is important that concurrent updates to
- * a given key has no well defined behavior since the leaves are
- * shared.
+ * Iterates through the entries pairs in the map that
+ * come after a given key, in key order. The key itself
+ * does not need to be in the map. This lets a caller
+ * resume an iteration from the last key it saw.
+ * The call back gets a key, value for each and returns an integer stop value.
+ * If the callback returns non-zero, then the iteration stops.
+ * @arg t The tree to iterate over
+ * @arg key The key to start after
+ * @arg key_len The length of the key
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int art_iter_after(art_tree *t, unsigned char *key, int key_len, art_callback cb, void *data);
+
+/**
+ * Creates a copy of an ART tree. The copy has its own nodes,
+ * allocated depth first so that the nodes of a path are close
+ * together. The leaves and values are shared, so a value that
+ * is replaced in one tree is replaced in both. Each tree may
+ * be updated by a different thread.
  * @arg dst The destination tree. Not initialized yet.
  * @arg src The source tree, must be initialized.
  * @return 0 on success.
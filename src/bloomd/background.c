@@ -1,6 +1,9 @@
 #include <unistd.h>
 #include <stdlib.h>
+#include <sys/time.h>
 #include "background.h"
+#include "ratelimit.h"
+#include "logger.h"
 
 
 /**
@@ -23,14 +26,45 @@
 */
 #define PERIODIC_CHECKPOINT 16
 
+/*
+ * How many pages the scrubber checks at a time. Each
+ * chunk is paced against the scrub rate.
+ */
+#define SCRUB_CHUNK_PAGES 256
+
 static void* flush_thread_main(void *in);
 static void* unmap_thread_main(void *in);
+static void* snapshot_thread_main(void *in);
+static void* scrub_thread_main(void *in);
+static void* rewrite_thread_main(void *in);
+static void run_rewrite(bloom_filtmgr *mgr, owned_cmd *cmd);
 typedef struct {
     bloom_config *config;
     bloom_filtmgr *mgr;
     int *should_run;
 } background_thread_args;
 
+/**
+ * A command queued for the rewrite thread
+ */
+typedef struct rewrite_job {
+    owned_cmd *cmd;
+    void (*done)(owned_cmd *cmd);
+    struct rewrite_job *next;
+} rewrite_job;
+
+/**
+ * The queue of the rewrite thread. Commands are
+ * only queued while the thread is running.
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;    // Signaled when commands are queued
+    rewrite_job *head;
+    rewrite_job *tail;
+    int running;
+} REWRITES = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0};
+
 /**
  * Helper macro to pack and unpack the arguments
  * to the thread, and free the memory.
@@ -96,6 +130,108 @@ int start_cold_unmap_thread(bloom_config *config, bloom_filtmgr *mgr, int *shoul
     return 1;
 }
 
+/**
+ * Starts a snapshot thread which on every snapshot
+ * interval, writes the in-memory filters to disk.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_snapshot_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t) {
+    // Return if we are not scheduled
+    if(config->snapshot_interval <= 0) {
+        return 0;
+    }
+
+    // Start thread
+    background_thread_args *args;
+    PACK_ARGS();
+    pthread_create(t, NULL, snapshot_thread_main, args);
+    return 1;
+}
+
+
+/**
+ * Starts a scrub thread which on every scrub interval
+ * checks the data files of the cold filters against their
+ * checksums. Reads are paced to the configured scrub rate.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_scrub_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t) {
+    // Return if we are not scheduled
+    if(config->scrub_interval <= 0) {
+        return 0;
+    }
+
+    // Start thread
+    background_thread_args *args;
+    PACK_ARGS();
+    pthread_create(t, NULL, scrub_thread_main, args);
+    return 1;
+}
+
+
+/**
+ * Starts a rewrite thread which shrinks or compacts the filters
+ * queued with queue_rewrite, one at a time, so that the workers
+ * are not held up while the layers are folded or the fuse
+ * filters are built. Commands still
+ * queued when it exits fail with an internal error.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_rewrite_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t) {
+    REWRITES.running = 1;
+
+    // Start thread
+    background_thread_args *args;
+    PACK_ARGS();
+    pthread_create(t, NULL, rewrite_thread_main, args);
+    return 1;
+}
+
+/**
+ * Queues a shrink or compaction for the rewrite thread. The result is
+ * stored in the res field of the command, and it is passed
+ * to the done callback on the rewrite thread.
+ * @note Thread safe.
+ * @arg cmd The command to run
+ * @arg done Invoked with the command once it is finished
+ * @return 0 on success, -1 if the rewrite thread is not running.
+ */
+int queue_rewrite(owned_cmd *cmd, void (*done)(owned_cmd *cmd)) {
+    rewrite_job *job = malloc(sizeof(rewrite_job));
+    if (!job) return -1;
+    job->cmd = cmd;
+    job->done = done;
+    job->next = NULL;
+
+    pthread_mutex_lock(&REWRITES.lock);
+    if (!REWRITES.running) {
+        pthread_mutex_unlock(&REWRITES.lock);
+        free(job);
+        return -1;
+    }
+    if (REWRITES.tail) REWRITES.tail->next = job;
+    else REWRITES.head = job;
+    REWRITES.tail = job;
+    pthread_cond_signal(&REWRITES.cond);
+    pthread_mutex_unlock(&REWRITES.lock);
+    return 0;
+}
+
 
 static void* flush_thread_main(void *in) {
     bloom_config *config;
@@ -106,18 +242,18 @@ static void* flush_thread_main(void *in) {
     // Perform the initial checkpoint with the manager
     filtmgr_client_checkpoint(mgr);
 
-    syslog(LOG_INFO, "Flush thread started. Interval: %d seconds.", config->flush_interval);
+    bloom_log(LOG_INFO, "Flush thread started. Interval: %d seconds.", config->flush_interval);
     unsigned int ticks = 0;
     while (*should_run) {
         usleep(PERIODIC_TIME_USEC);
         filtmgr_client_checkpoint(mgr);
         if ((++ticks % SEC_TO_TICKS(config->flush_interval)) == 0 && *should_run) {
             // List all the filters
-            syslog(LOG_INFO, "Scheduled flush started.");
+            bloom_log(LOG_INFO, "Scheduled flush started.");
             bloom_filter_list_head *head;
             int res = filtmgr_list_filters(mgr, NULL, &head);
             if (res != 0) {
-                syslog(LOG_WARNING, "Failed to list filters for flushing!");
+                bloom_log(LOG_WARNING, "Failed to list filters for flushing!");
                 continue;
             }
 
@@ -147,14 +283,14 @@ static void* unmap_thread_main(void *in) {
     // Perform the initial checkpoint with the manager
     filtmgr_client_checkpoint(mgr);
 
-    syslog(LOG_INFO, "Cold unmap thread started. Interval: %d seconds.", config->cold_interval);
+    bloom_log(LOG_INFO, "Cold unmap thread started. Interval: %d seconds.", config->cold_interval);
     unsigned int ticks = 0;
     while (*should_run) {
         usleep(PERIODIC_TIME_USEC);
         filtmgr_client_checkpoint(mgr);
         if ((++ticks % SEC_TO_TICKS(config->cold_interval)) == 0 && *should_run) {
             // List the cold filters
-            syslog(LOG_INFO, "Cold unmap started.");
+            bloom_log(LOG_INFO, "Cold unmap started.");
             bloom_filter_list_head *head;
             int res = filtmgr_list_cold_filters(mgr, &head);
             if (res != 0) {
@@ -162,11 +298,11 @@ static void* unmap_thread_main(void *in) {
             }
 
             // Close the filters, save memory
-            syslog(LOG_INFO, "Cold filter count: %d", head->size);
+            bloom_log(LOG_INFO, "Cold filter count: %d", head->size);
             bloom_filter_list *node = head->head;
             unsigned int cmds = 0;
             while (node) {
-                syslog(LOG_INFO, "Unmapping filter '%s' for being cold.", node->filter_name);
+                bloom_log(LOG_INFO, "Unmapping filter '%s' for being cold.", node->filter_name);
                 filtmgr_unmap_filter(mgr, node->filter_name);
                 if (!(++cmds % PERIODIC_CHECKPOINT)) filtmgr_client_checkpoint(mgr);
                 node = node->next;
@@ -179,4 +315,175 @@ static void* unmap_thread_main(void *in) {
     return NULL;
 }
 
+static void* snapshot_thread_main(void *in) {
+    bloom_config *config;
+    bloom_filtmgr *mgr;
+    int *should_run;
+    UNPACK_ARGS();
+
+    // Perform the initial checkpoint with the manager
+    filtmgr_client_checkpoint(mgr);
+
+    bloom_log(LOG_INFO, "Snapshot thread started. Interval: %d seconds.", config->snapshot_interval);
+    unsigned int ticks = 0;
+    while (*should_run) {
+        usleep(PERIODIC_TIME_USEC);
+        filtmgr_client_checkpoint(mgr);
+        if ((++ticks % SEC_TO_TICKS(config->snapshot_interval)) == 0 && *should_run) {
+            // List all the filters
+            bloom_log(LOG_INFO, "Scheduled snapshot started.");
+            bloom_filter_list_head *head;
+            int res = filtmgr_list_filters(mgr, NULL, &head);
+            if (res != 0) {
+                bloom_log(LOG_WARNING, "Failed to list filters for snapshots!");
+                continue;
+            }
+
+            // Snapshot all, ignore errors since
+            // filters might get deleted in the process
+            bloom_filter_list *node = head->head;
+            unsigned int cmds = 0;
+            while (node) {
+                filtmgr_snapshot_filter(mgr, node->filter_name);
+                if (!(++cmds % PERIODIC_CHECKPOINT)) filtmgr_client_checkpoint(mgr);
+                node = node->next;
+            }
+
+            // Cleanup
+            filtmgr_cleanup_list(head);
+        }
+    }
+    return NULL;
+}
+
+
+static void* scrub_thread_main(void *in) {
+    bloom_config *config;
+    bloom_filtmgr *mgr;
+    int *should_run;
+    UNPACK_ARGS();
+
+    // Perform the initial checkpoint with the manager
+    filtmgr_client_checkpoint(mgr);
+
+    bloom_log(LOG_INFO, "Scrub thread started. Interval: %d seconds.", config->scrub_interval);
+    bloom_bucket bucket;
+    bucket_init(&bucket, config->scrub_rate);
+    unsigned int ticks = 0;
+    while (*should_run) {
+        usleep(PERIODIC_TIME_USEC);
+        filtmgr_client_checkpoint(mgr);
+        if ((++ticks % SEC_TO_TICKS(config->scrub_interval)) == 0 && *should_run) {
+            // List all the filters, only the cold ones are checked
+            bloom_log(LOG_INFO, "Scheduled scrub started.");
+            bloom_filter_list_head *head;
+            int res = filtmgr_list_filters(mgr, NULL, &head);
+            if (res != 0) {
+                bloom_log(LOG_WARNING, "Failed to list filters for scrubbing!");
+                continue;
+            }
+
+            // Check each filter a chunk at a time, waiting out
+            // the scrub rate between chunks. Ignore errors since
+            // filters might get deleted in the process
+            bloom_filter_list *node = head->head;
+            uint64_t total = 0;
+            while (node && *should_run) {
+                uint64_t page = 0;
+                int64_t pages;
+                while (*should_run &&
+                        (pages = filtmgr_scrub_filter(mgr, node->filter_name, &page, SCRUB_CHUNK_PAGES)) > 0) {
+                    filtmgr_client_checkpoint(mgr);
+                    total += pages;
+                    double wait = bucket_take(&bucket, pages * 4096, bucket_clock());
+                    while (wait > 0 && *should_run) {
+                        usleep((wait * 1e6 < PERIODIC_TIME_USEC) ? wait * 1e6 : PERIODIC_TIME_USEC);
+                        wait -= PERIODIC_TIME_USEC / 1e6;
+                    }
+                }
+                filtmgr_client_checkpoint(mgr);
+                node = node->next;
+            }
+            bloom_log(LOG_INFO, "Scheduled scrub done. Checked %llu pages.", (unsigned long long)total);
+
+            // Cleanup
+            filtmgr_cleanup_list(head);
+        }
+    }
+    return NULL;
+}
+
 
+static void* rewrite_thread_main(void *in) {
+    bloom_config *config;
+    bloom_filtmgr *mgr;
+    int *should_run;
+    UNPACK_ARGS();
+    (void)config;
+
+    // Perform the initial checkpoint with the manager
+    filtmgr_client_checkpoint(mgr);
+
+    bloom_log(LOG_INFO, "Rewrite thread started.");
+    rewrite_job *job;
+    struct timeval now;
+    struct timespec wake;
+    while (*should_run) {
+        // Wait for a command, waking up each tick to checkpoint
+        pthread_mutex_lock(&REWRITES.lock);
+        if (!REWRITES.head) {
+            gettimeofday(&now, NULL);
+            uint64_t usec = now.tv_usec + PERIODIC_TIME_USEC;
+            wake.tv_sec = now.tv_sec + usec / 1000000;
+            wake.tv_nsec = (usec % 1000000) * 1000;
+            pthread_cond_timedwait(&REWRITES.cond, &REWRITES.lock, &wake);
+        }
+        job = REWRITES.head;
+        if (job) {
+            REWRITES.head = job->next;
+            if (!REWRITES.head) REWRITES.tail = NULL;
+        }
+        pthread_mutex_unlock(&REWRITES.lock);
+
+        filtmgr_client_checkpoint(mgr);
+        if (!job) continue;
+        run_rewrite(mgr, job->cmd);
+        job->done(job->cmd);
+        free(job);
+    }
+
+    // Fail the commands that were not started
+    pthread_mutex_lock(&REWRITES.lock);
+    REWRITES.running = 0;
+    job = REWRITES.head;
+    REWRITES.head = REWRITES.tail = NULL;
+    pthread_mutex_unlock(&REWRITES.lock);
+    while (job) {
+        rewrite_job *next = job->next;
+        job->cmd->res = -2;
+        job->done(job->cmd);
+        free(job);
+        job = next;
+    }
+    return NULL;
+}
+
+/**
+ * Runs a queued command, storing the result of the
+ * filter manager call on it.
+ */
+static void run_rewrite(bloom_filtmgr *mgr, owned_cmd *cmd) {
+    switch (cmd->rewrite) {
+        case REWRITE_SHRINK:
+            bloom_log(LOG_INFO, "Shrinking filter '%s'.", cmd->filter_name);
+            cmd->res = filtmgr_shrink_filter(mgr, cmd->filter_name, cmd->prob);
+            break;
+        case REWRITE_COMPACT:
+            bloom_log(LOG_INFO, "Compacting filter '%s'.", cmd->filter_name);
+            cmd->res = filtmgr_compact_filter(mgr, cmd->filter_name);
+            break;
+        default:
+            cmd->res = -2;
+            break;
+    }
+}
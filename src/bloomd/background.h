@@ -3,6 +3,7 @@
 #include <pthread.h>
 #include "config.h"
 #include "filter_manager.h"
+#include "owner.h"
 
 /**
  * Starts a flushing thread which on every
@@ -28,4 +29,55 @@ int start_flush_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run
  */
 int start_cold_unmap_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *);
 
+/**
+ * Starts a snapshot thread which on every snapshot
+ * interval, writes the in-memory filters to disk.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_snapshot_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t);
+
+/**
+ * Starts a scrub thread which on every scrub interval
+ * checks the data files of the cold filters against their
+ * checksums. Reads are paced to the configured scrub rate.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_scrub_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t);
+
+/**
+ * Starts a rewrite thread which shrinks or compacts the filters
+ * queued with queue_rewrite, one at a time, so that the workers
+ * are not held up while the layers are folded or the fuse
+ * filters are built. Commands still
+ * queued when it exits fail with an internal error.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_rewrite_thread(bloom_config *config, bloom_filtmgr *mgr, int *should_run, pthread_t *t);
+
+/**
+ * Queues a shrink or compaction for the rewrite thread. The result is
+ * stored in the res field of the command, and it is passed
+ * to the done callback on the rewrite thread.
+ * @note Thread safe.
+ * @arg cmd The command to run
+ * @arg done Invoked with the command once it is finished
+ * @return 0 on success, -1 if the rewrite thread is not running.
+ */
+int queue_rewrite(owned_cmd *cmd, void (*done)(owned_cmd *cmd));
+
 #endif
@@ -19,13 +19,16 @@
 #include "networking.h"
 #include "filter_manager.h"
 #include "background.h"
+#include "handover.h"
+#include "capture.h"
+#include "logger.h"
 
 // Simple struct that holds args for the workers
 typedef struct {
     bloom_filtmgr *mgr;
     bloom_networking *netconf;
 } worker_args;
-static void worker_main(worker_args *args);
+static void* worker_main(void *in);
 
 /**
  * By default we should run. Our signal
@@ -148,9 +151,26 @@ int main(int argc, char **argv) {
     // Set the syslog mask
     setlogmask(config->syslog_log_level);
 
+    // Move logging off the calling threads. The log thread
+    // outlives the others so it can write their last messages.
+    int log_running = 1, log_on;
+    pthread_t log_thread;
+    log_on = start_log_thread(&log_running, &log_thread);
+
     // Log that we are starting up
     syslog(LOG_INFO, "Starting bloomd.");
 
+    // Take over from a running bloomd if there is one. We wait
+    // for it to close its filters before we load them.
+    bloom_handover *handover = NULL;
+    int listen_fds[HANDOVER_LISTENERS];
+    if (handover_receive(config, &handover)) {
+        syslog(LOG_ERR, "Failed to take over from running bloomd!");
+        return 1;
+    }
+    int handover_from = (handover != NULL);
+    if (handover) handover_wait(handover, listen_fds);
+
     // Initialize the filters
     bloom_filtmgr *mgr;
     int mgr_res = init_filter_manager(config, 1, &mgr);
@@ -159,25 +179,52 @@ int main(int argc, char **argv) {
         return 1;
     }
 
+    // Restore the in-memory filters that were handed over
+    if (handover) {
+        handover_adopt_filters(handover, mgr);
+        handover_done(handover);
+        handover = NULL;
+    }
+
     // Start the background tasks
-    int flush_on, unmap_on;
-    pthread_t flush_thread, unmap_thread;
+    int flush_on, unmap_on, snapshot_on, scrub_on;
+    pthread_t flush_thread, unmap_thread, snapshot_thread, scrub_thread;
     flush_on = start_flush_thread(config, mgr, &SHOULD_RUN, &flush_thread);
     unmap_on = start_cold_unmap_thread(config, mgr, &SHOULD_RUN, &unmap_thread);
+    snapshot_on = start_snapshot_thread(config, mgr, &SHOULD_RUN, &snapshot_thread);
+    scrub_on = start_scrub_thread(config, mgr, &SHOULD_RUN, &scrub_thread);
 
     // Initialize the networking
     bloom_networking *netconf = NULL;
-    int net_res = init_networking(config, mgr, &netconf);
+    int net_res = init_networking(config, mgr, (handover_from) ? listen_fds : NULL, &netconf);
     if (net_res != 0) {
         syslog(LOG_ERR, "Failed to initialize bloomd networking!");
         return 1;
     }
 
+    // Start capturing commands if configured
+    if (init_capture(config)) {
+        syslog(LOG_ERR, "Failed to initialize command capture!");
+        return 1;
+    }
+    int capture_on;
+    pthread_t capture_thread;
+    capture_on = start_capture_thread(config, &SHOULD_RUN, &capture_thread);
+
+    // Run shrinks and compactions off the workers
+    pthread_t rewrite_thread;
+    start_rewrite_thread(config, mgr, &SHOULD_RUN, &rewrite_thread);
+
+    // Allow a future process to take over from us
+    int handover_on;
+    pthread_t handover_thread;
+    handover_on = start_handover_thread(config, mgr, netconf, &SHOULD_RUN, &handover_thread);
+
     // Start the network workers
     worker_args wargs = {mgr, netconf};
     pthread_t *threads = calloc(config->worker_threads, sizeof(pthread_t));
     for (int i=0; i < config->worker_threads; i++) {
-        pthread_create(&threads[i], NULL, (void*(*)(void*))worker_main, &wargs);
+        pthread_create(&threads[i], NULL, worker_main, &wargs);
     }
 
     // Prepare our signal handlers to loop until we are signaled to quit
@@ -189,16 +236,32 @@ int main(int argc, char **argv) {
     // Loop forever
     enter_main_loop(netconf, &SHOULD_RUN, threads);
 
+    // Check if we are being replaced by a new process
+    if (handover_on) pthread_join(handover_thread, (void**)&handover);
+
+    // Answer the rewrites while the workers still run
+    pthread_join(rewrite_thread, NULL);
+
     // Begin the shutdown/cleanup
     shutdown_networking(netconf, threads);
 
     // Shutdown the background tasks
     if (flush_on) pthread_join(flush_thread, NULL);
     if (unmap_on) pthread_join(unmap_thread, NULL);
+    if (snapshot_on) pthread_join(snapshot_thread, NULL);
+    if (scrub_on) pthread_join(scrub_thread, NULL);
+    if (capture_on) pthread_join(capture_thread, NULL);
 
     // Cleanup the filters
     destroy_filter_manager(mgr);
 
+    // Let the new process begin serving
+    handover_done(handover);
+
+    // Write out the remaining log messages
+    log_running = 0;
+    if (log_on) pthread_join(log_thread, NULL);
+
     // Free our memory
     free(threads);
     free(config);
@@ -208,11 +271,14 @@ int main(int argc, char **argv) {
 }
 
 // Main entry point for the worker threads
-static void worker_main(worker_args *args) {
+static void* worker_main(void *in) {
+    worker_args *args = in;
+
     // Perform the initial checkpoint with the manager
     filtmgr_client_checkpoint(args->mgr);
 
     // Enter the networking event loop forever
     start_networking_worker(args->netconf);
+    return NULL;
 }
 
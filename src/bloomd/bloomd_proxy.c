@@ -0,0 +1,205 @@
+/**
+ * This is the main entry point into bloomd-proxy.
+ * It speaks the bloomd protocol to clients, and shards
+ * the filters over the backend bloomd processes set in
+ * the proxy_backends option, using a consistent hash ring
+ * of the filter names. It shares its networking and
+ * configuration with bloomd.
+ */
+#include <ctype.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <signal.h>
+#include "config.h"
+#include "networking.h"
+#include "proxy_handler.h"
+#include "logger.h"
+
+static void* worker_main(void *in);
+
+/**
+ * By default we should run. Our signal
+ * handler updates this variable to allow the
+ * program to gracefully terminate.
+ */
+static int SHOULD_RUN = 1;
+
+/**
+ * Prints our usage to stderr
+ */
+void show_usage() {
+    fprintf(stderr, "usage: bloomd-proxy [-h] [-f filename] [-w num]\n\
+\n\
+    -h : Displays this help info\n\
+    -f : Reads the configuration from this file\n\
+    -w : Sets the number of worker threads\n\
+\n");
+}
+
+/**
+ * Invoked to parse the command line options
+ */
+int parse_cmd_line_args(int argc, char **argv, char **config_file, int *workers) {
+    int enable_help = 0;
+
+    int c;
+    long w;
+    opterr = 0;
+    while ((c = getopt(argc, argv, "hf:w:")) != -1) {
+        switch (c) {
+            case 'h':
+                enable_help = 1;
+                break;
+            case 'f':
+                *config_file = optarg;
+                break;
+            case 'w':
+                w = strtol(optarg, NULL, 10);
+                if (w == 0 && errno == EINVAL) {
+                    fprintf(stderr, "Option -%c requires a number.\n", optopt);
+                    break;
+                }
+                *workers = w;
+                break;
+            case '?':
+                if (optopt == 'f')
+                    fprintf(stderr, "Option -%c requires a filename.\n", optopt);
+                if (optopt == 'w')
+                    fprintf(stderr, "Option -%c requires a positive integer.\n", optopt);
+                else if (isprint(optopt))
+                    fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+                else
+                    fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
+                return 1;
+        }
+    }
+
+    // Check if we need to show usage
+    if (enable_help) {
+        show_usage();
+        return 1;
+    }
+
+    return 0;
+}
+
+
+/**
+ * Initializes the syslog configuration
+ */
+void setup_syslog() {
+    // If we are on a tty, log the errors out
+    int flags = LOG_CONS|LOG_NDELAY|LOG_PID;
+    if (isatty(1)) {
+        flags |= LOG_PERROR;
+    }
+    openlog("bloomd-proxy", flags, LOG_LOCAL0);
+}
+
+
+/**
+ * Our registered signal handler, invoked
+ * when we get signals such as SIGINT, SIGTERM.
+ */
+void signal_handler(int signum) {
+    SHOULD_RUN = 0;  // Stop running now
+    syslog(LOG_WARNING, "Received signal [%s]! Exiting...", strsignal(signum));
+}
+
+
+int main(int argc, char **argv) {
+    // Initialize syslog
+    setup_syslog();
+
+    // Parse the command line
+    char *config_file = NULL;
+    int workers = 0;
+    int parse_res = parse_cmd_line_args(argc, argv, &config_file, &workers);
+    if (parse_res) return 1;
+
+    // Parse the config file
+    bloom_config *config = calloc(1, sizeof(bloom_config));
+    int config_res = config_from_filename(config_file, config);
+    if (config_res != 0) {
+        syslog(LOG_ERR, "Failed to read the configuration file!");
+        return 1;
+    }
+
+    // Set the workers if specified
+    if (workers) config->worker_threads = workers;
+
+    // Validate the config file
+    int validate_res = validate_config(config);
+    if (validate_res != 0) {
+        syslog(LOG_ERR, "Invalid configuration!");
+        return 1;
+    }
+
+    // Set the syslog mask
+    setlogmask(config->syslog_log_level);
+
+    // Move logging off the workers
+    int log_running = 1, log_on;
+    pthread_t log_thread;
+    log_on = start_log_thread(&log_running, &log_thread);
+
+    // Log that we are starting up
+    syslog(LOG_INFO, "Starting bloomd-proxy.");
+
+    // Place the backends on the ring
+    if (init_proxy(config)) {
+        syslog(LOG_ERR, "Failed to initialize the backends!");
+        return 1;
+    }
+
+    // Initialize the networking, there is no filter manager
+    bloom_networking *netconf = NULL;
+    int net_res = init_networking(config, NULL, NULL, &netconf);
+    if (net_res != 0) {
+        syslog(LOG_ERR, "Failed to initialize bloomd-proxy networking!");
+        return 1;
+    }
+
+    // Start the network workers
+    pthread_t *threads = calloc(config->worker_threads, sizeof(pthread_t));
+    for (int i=0; i < config->worker_threads; i++) {
+        pthread_create(&threads[i], NULL, worker_main, netconf);
+    }
+
+    // Prepare our signal handlers to loop until we are signaled to quit
+    signal(SIGPIPE, SIG_IGN);       // Ignore SIG_IGN
+    signal(SIGHUP, SIG_IGN);        // Ignore SIG_IGN
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+
+    // Loop forever
+    enter_main_loop(netconf, &SHOULD_RUN, threads);
+
+    // Begin the shutdown/cleanup
+    shutdown_networking(netconf, threads);
+    destroy_proxy();
+
+    // Write out the remaining log messages
+    log_running = 0;
+    if (log_on) pthread_join(log_thread, NULL);
+
+    // Free our memory
+    free(threads);
+    free(config);
+
+    // Done
+    return 0;
+}
+
+// Main entry point for the worker threads
+static void* worker_main(void *in) {
+    // Enter the networking event loop until we are told to quit
+    start_networking_worker(in);
+    return NULL;
+}
+
@@ -0,0 +1,743 @@
+/**
+ * This is the main entry point into bloomd-tool. It works
+ * on the directories of filters while bloomd is stopped, to
+ * inspect and verify their data files, merge filters, and
+ * rewrite them into folded or sealed filters. Large files
+ * are split up over a pool of threads.
+ */
+#include <ctype.h>
+#include <errno.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "config.h"
+#include "filter.h"
+#include "inspect.h"
+#include "type_compat.h"
+#include "workpool.h"
+
+/**
+ * The names of the files in a filter directory.
+ * These must match the names used by filter.c.
+ */
+static const char* FILTER_PREFIX = "bloomd.";
+static const char* CONFIG_FILENAME = "config.ini";
+static const char* FUSE_FILENAME = "fuse.data";
+static const char* KEY_LOG_FILENAME = "keys.log";
+
+/**
+ * Counts differ from the estimate from the set bits by
+ * less than this fraction in a healthy filter, plus a
+ * small slack for nearly empty layers.
+ */
+static const double COUNT_TOLERANCE = 0.2;
+static const double COUNT_SLACK = 64;
+
+/**
+ * Pages of a data file read at a time when
+ * checking its checksums.
+ */
+static const uint64_t CHECKSUM_CHUNK_PAGES = 4096;
+
+/**
+ * Rewrites a number of filters, one per task on the pool
+ */
+typedef struct {
+    bloom_config *config;   // Defaults for the filters
+    char **dirs;            // Filter directories
+    double prob;            // Probability to shrink to
+    int *results;           // Result of each filter
+    uint64_t *values;       // Bytes or keys after the rewrite
+} rewrite_job;
+
+/**
+ * Prints our usage to stderr
+ */
+void show_usage() {
+    fprintf(stderr, "usage: bloomd-tool [-h] [-f filename] [-t num] command [args]\n\
+\n\
+    -h : Displays this help info\n\
+    -f : Reads the configuration from this file\n\
+    -t : Sets the number of threads, defaults to the number of CPUs\n\
+\n\
+Commands:\n\
+    info dir...        : Shows the layers of each filter directory\n\
+    verify dir...      : Checks the data files of each filter directory\n\
+    merge dest src...  : ORs the filters into the dest filter\n\
+    shrink prob dir... : Folds the layers to a false positive rate\n\
+    seal dir...        : Converts each filter into a sealed fuse filter\n\
+\n\
+The filters must not be in use by a running bloomd.\n\
+\n");
+}
+
+/**
+ * Invoked to parse the command line options
+ */
+int parse_cmd_line_args(int argc, char **argv, char **config_file, int *threads) {
+    int enable_help = 0;
+
+    int c;
+    long t;
+    opterr = 0;
+    while ((c = getopt(argc, argv, "+hf:t:")) != -1) {
+        switch (c) {
+            case 'h':
+                enable_help = 1;
+                break;
+            case 'f':
+                *config_file = optarg;
+                break;
+            case 't':
+                t = strtol(optarg, NULL, 10);
+                if (t <= 0) {
+                    fprintf(stderr, "Option -%c requires a positive integer.\n", c);
+                    return 1;
+                }
+                *threads = t;
+                break;
+            case '?':
+                if (optopt == 'f')
+                    fprintf(stderr, "Option -%c requires a filename.\n", optopt);
+                else if (optopt == 't')
+                    fprintf(stderr, "Option -%c requires a positive integer.\n", optopt);
+                else if (isprint(optopt))
+                    fprintf(stderr, "Unknown option `-%c'.\n", optopt);
+                else
+                    fprintf(stderr, "Unknown option character `\\x%x'.\n", optopt);
+                return 1;
+        }
+    }
+
+    // Check if we need to show usage
+    if (enable_help || optind >= argc) {
+        show_usage();
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Works with scandir to select the data files
+ */
+static int select_data_files(CONST_DIRENT_T *d) {
+    int len = strlen(d->d_name);
+    return len > 5 && strcmp(d->d_name + len - 5, ".mmap") == 0;
+}
+
+/**
+ * Works with scandir to select the snapshot files
+ */
+static int select_snapshot_files(CONST_DIRENT_T *d) {
+    int len = strlen(d->d_name);
+    return len > 14 && strncmp(d->d_name, "snapshot.", 9) == 0 &&
+        strcmp(d->d_name + len - 5, ".snap") == 0;
+}
+
+/**
+ * Works with scandir to select the files left behind
+ * by an interrupted rewrite
+ */
+static int select_tmp_files(CONST_DIRENT_T *d) {
+    int len = strlen(d->d_name);
+    return (len > 4 && strcmp(d->d_name + len - 4, ".tmp") == 0) ||
+        (len > 8 && strcmp(d->d_name + len - 8, ".tmp.crc") == 0);
+}
+
+/**
+ * Reads the config.ini of a filter directory.
+ * @return 0 on success, -1 if the directory is
+ * not a filter, or the config cannot be read.
+ */
+static int read_filter_config(char *dir, bloom_filter_config *fc) {
+    struct stat buf;
+    if (stat(dir, &buf) || !S_ISDIR(buf.st_mode)) {
+        fprintf(stderr, "%s: Not a directory.\n", dir);
+        return -1;
+    }
+
+    memset(fc, 0, sizeof(bloom_filter_config));
+    char *config_path = join_path(dir, (char*)CONFIG_FILENAME);
+    int res = filter_config_from_filename(config_path, fc);
+    free(config_path);
+    if (res) {
+        fprintf(stderr, "%s: Failed to read %s.\n", dir, CONFIG_FILENAME);
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Lists the files holding the layers of a filter, the
+ * oldest and smallest first. That is the fuse filter once
+ * sealed, the snapshots of an in-memory filter, and the
+ * data files otherwise.
+ * @arg dir The filter directory
+ * @arg fc The filter config
+ * @arg paths Output, the full paths. Free with free_paths.
+ * @return The number of layers, or -1 on error.
+ */
+static int list_layers(char *dir, bloom_filter_config *fc, char ***paths) {
+    if (fc->sealed) {
+        *paths = malloc(sizeof(char*));
+        (*paths)[0] = join_path(dir, (char*)FUSE_FILENAME);
+        return 1;
+    }
+
+    struct dirent **namelist = NULL;
+    int num = scandir(dir, &namelist,
+            (fc->in_memory) ? select_snapshot_files : select_data_files, alphasort);
+    if (num < 0) {
+        fprintf(stderr, "%s: Failed to list the layers. %s\n", dir, strerror(errno));
+        return -1;
+    }
+
+    *paths = malloc((num + 1) * sizeof(char*));
+    for (int i=0; i < num; i++) {
+        (*paths)[i] = join_path(dir, namelist[i]->d_name);
+        free(namelist[i]);
+    }
+    free(namelist);
+    return num;
+}
+
+static void free_paths(char **paths, int num) {
+    for (int i=0; i < num; i++) free(paths[i]);
+    free(paths);
+}
+
+static const char* layer_type_name(layer_type type) {
+    switch (type) {
+        case LAYER_BLOOM: return "bloom";
+        case LAYER_FUSE: return "fuse";
+        case LAYER_STABLE: return "stable";
+        default: return "unknown";
+    }
+}
+
+/**
+ * Shows the settings and layers of each filter
+ */
+static int cmd_info(bloom_workpool *pool, char **dirs, int num_dirs) {
+    int failed = 0;
+    for (int d=0; d < num_dirs; d++) {
+        bloom_filter_config fc;
+        char **paths;
+        int num;
+        if (read_filter_config(dirs[d], &fc) || (num = list_layers(dirs[d], &fc, &paths)) < 0) {
+            failed++;
+            continue;
+        }
+
+        printf("%s\n", dirs[d]);
+        printf("  size %llu capacity %llu bytes %llu probability %g in_memory %d key_log %d sealed %d stable %d layers %d\n",
+                (unsigned long long)fc.size, (unsigned long long)fc.capacity,
+                (unsigned long long)fc.bytes, fc.default_probability, fc.in_memory,
+                fc.key_log, fc.sealed, fc.stable, num);
+
+        layer_stats stats;
+        for (int i=0; i < num; i++) {
+            if (inspect_layer(paths[i], pool, &stats)) {
+                printf("  %s unreadable\n", basename(paths[i]));
+                failed++;
+                continue;
+            }
+            printf("  %s type %s bytes %llu k %u count %llu capacity %llu fill %.4f keys %.0f fp %.3g\n",
+                    basename(paths[i]), layer_type_name(stats.type),
+                    (unsigned long long)stats.bytes, stats.k_num,
+                    (unsigned long long)stats.count, (unsigned long long)stats.capacity,
+                    (stats.cells) ? (double)stats.cells_set / stats.cells : 0,
+                    inspect_estimate_keys(&stats), inspect_fp_rate(&stats));
+        }
+        free_paths(paths, num);
+    }
+    return (failed) ? 1 : 0;
+}
+
+/**
+ * Checks a single layer, and prints any problems.
+ * @return The number of problems.
+ */
+static int verify_layer(char *dir, char *path, int res, layer_type expect, layer_stats *stats) {
+    char *name = basename(path);
+    if (res == -1) {
+        printf("%s: %s cannot be read.\n", dir, name);
+        return 1;
+    } else if (res == -2) {
+        printf("%s: %s is truncated.\n", dir, name);
+        return 1;
+    } else if (stats->type != expect) {
+        printf("%s: %s is a %s layer, expected %s.\n", dir, name,
+                layer_type_name(stats->type), layer_type_name(expect));
+        return 1;
+    }
+
+    int problems = 0;
+    if (stats->type == LAYER_FUSE) {
+        if (stats->k_num != 8 && stats->k_num != 16) {
+            printf("%s: %s has %u bit fingerprints.\n", dir, name, stats->k_num);
+            problems++;
+        } else if (stats->bytes < sizeof(bloom_fuse_header) + (uint64_t)stats->cells * (stats->k_num / 8)) {
+            printf("%s: %s is truncated.\n", dir, name);
+            problems++;
+        }
+        return problems;
+    }
+
+    if (stats->k_num == 0 || stats->cells < stats->k_num) {
+        printf("%s: %s has a bad k of %u.\n", dir, name, stats->k_num);
+        return 1;
+    }
+    if (stats->capacity && stats->count > stats->capacity) {
+        printf("%s: %s has %llu keys, over its capacity of %llu.\n", dir, name,
+                (unsigned long long)stats->count, (unsigned long long)stats->capacity);
+        problems++;
+    }
+
+    // Stable filters forget keys, so their count only grows
+    if (stats->type == LAYER_BLOOM) {
+        double keys = inspect_estimate_keys(stats);
+        double slack = stats->count * COUNT_TOLERANCE + COUNT_SLACK;
+        if (keys > stats->count + slack || keys < stats->count - slack) {
+            printf("%s: %s has %llu keys, but its bits hold about %.0f.\n", dir, name,
+                    (unsigned long long)stats->count, keys);
+            problems++;
+        }
+    }
+    return problems;
+}
+
+/**
+ * Checks the pages of a data file against its checksums,
+ * if it has any, and prints any that do not match.
+ * @return The number of problems.
+ */
+static int verify_checksums(char *dir, char *path) {
+    uint64_t page = 0, bad = 0;
+    int64_t res;
+    while ((res = bitmap_verify_file(path, page, CHECKSUM_CHUNK_PAGES, &bad)) > 0) {
+        page += res;
+    }
+    if (res == -1) {
+        printf("%s: %s checksums cannot be read.\n", dir, basename(path));
+        return 1;
+    } else if (bad) {
+        printf("%s: %s has %llu pages that do not match their checksums.\n", dir,
+                basename(path), (unsigned long long)bad);
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Checks the data files of each filter against their headers,
+ * each other and the config.ini, and prints any problems.
+ */
+static int cmd_verify(bloom_workpool *pool, char **dirs, int num_dirs) {
+    int failed = 0;
+    for (int d=0; d < num_dirs; d++) {
+        bloom_filter_config fc;
+        char **paths;
+        int num;
+        if (read_filter_config(dirs[d], &fc) || (num = list_layers(dirs[d], &fc, &paths)) < 0) {
+            failed++;
+            continue;
+        }
+
+        // Check each layer, counting the bits on the pool
+        int problems = 0, unreadable = 0;
+        uint64_t size = 0, bytes = 0;
+        layer_type expect = (fc.sealed) ? LAYER_FUSE : (fc.stable) ? LAYER_STABLE : LAYER_BLOOM;
+        layer_stats stats;
+        for (int i=0; i < num; i++) {
+            int res = inspect_layer(paths[i], pool, &stats);
+            problems += verify_layer(dirs[d], paths[i], res, expect, &stats);
+            if (res) {
+                unreadable = 1;
+                continue;
+            }
+            if (!fc.sealed && !fc.in_memory) problems += verify_checksums(dirs[d], paths[i]);
+            size += stats.count;
+            bytes += stats.bytes;
+        }
+        if (fc.stable && num > 1) {
+            printf("%s: Stable filter has %d layers.\n", dirs[d], num);
+            problems++;
+        }
+
+        // The config is written on each flush. An in-memory
+        // filter may have keys that were never snapshotted.
+        int check_totals = !fc.in_memory && num && !unreadable;
+        if (check_totals && fc.size != size) {
+            printf("%s: %s has %llu keys, the layers hold %llu.\n", dirs[d], CONFIG_FILENAME,
+                    (unsigned long long)fc.size, (unsigned long long)size);
+            problems++;
+        }
+        if (check_totals && fc.bytes != bytes) {
+            printf("%s: %s has %llu bytes, the layers hold %llu.\n", dirs[d], CONFIG_FILENAME,
+                    (unsigned long long)fc.bytes, (unsigned long long)bytes);
+            problems++;
+        }
+
+        // Files left by an interrupted rewrite are ignored by bloomd
+        struct dirent **namelist = NULL;
+        int num_tmp = scandir(dirs[d], &namelist, select_tmp_files, alphasort);
+        for (int i=0; i < num_tmp; i++) {
+            printf("%s: Warning, %s is left from an interrupted rewrite.\n", dirs[d], namelist[i]->d_name);
+            free(namelist[i]);
+        }
+        if (namelist) free(namelist);
+
+        if (problems) {
+            failed++;
+        } else {
+            printf("%s: OK\n", dirs[d]);
+        }
+        free_paths(paths, num);
+    }
+    return (failed) ? 1 : 0;
+}
+
+/**
+ * Reads the layers of a filter that can be merged.
+ * @return The number of layers, or -1 on error.
+ */
+static int merge_layers(char *dir, bloom_filter_config *fc, char ***paths) {
+    if (read_filter_config(dir, fc)) return -1;
+    if (fc->sealed || fc->stable) {
+        fprintf(stderr, "%s: Sealed and stable filters cannot be merged.\n", dir);
+        return -1;
+    }
+    return list_layers(dir, fc, paths);
+}
+
+/**
+ * Appends the key log of a filter to the key log of another.
+ * @return 0 on success, -1 on error.
+ */
+static int append_key_log(char *dest, char *src) {
+    char *src_path = join_path(src, (char*)KEY_LOG_FILENAME);
+    FILE *in = fopen(src_path, "r");
+    free(src_path);
+    if (!in) return (errno == ENOENT) ? 0 : -1;
+
+    char *dest_path = join_path(dest, (char*)KEY_LOG_FILENAME);
+    FILE *out = fopen(dest_path, "a");
+    free(dest_path);
+    if (!out) {
+        fclose(in);
+        return -1;
+    }
+
+    char buf[65536];
+    size_t len;
+    int res = 0;
+    while (!res && (len = fread(buf, 1, sizeof(buf), in)) > 0) {
+        if (fwrite(buf, 1, len, out) != len) res = -1;
+    }
+    if (ferror(in)) res = -1;
+    fclose(in);
+    if (fclose(out)) res = -1;
+    return res;
+}
+
+/**
+ * ORs the layers of each source filter into the layers of the
+ * destination. The filters must have grown the same way, so
+ * that each layer has the same size and hash functions. The
+ * key logs are appended, so the result can still be sealed.
+ */
+static int cmd_merge(bloom_workpool *pool, char *dest, char **srcs, int num_srcs) {
+    bloom_filter_config fc, src_fc;
+    char **paths, **src_paths;
+    int num = merge_layers(dest, &fc, &paths);
+    if (num < 0) return 1;
+
+    // Check every layer before changing any of them
+    layer_stats stats, src_stats;
+    int res = 0;
+    for (int s=0; s < num_srcs && !res; s++) {
+        int src_num = merge_layers(srcs[s], &src_fc, &src_paths);
+        if (src_num < 0) {
+            res = 1;
+            break;
+        }
+        if (src_num != num) {
+            fprintf(stderr, "%s: Has %d layers, %s has %d.\n", srcs[s], src_num, dest, num);
+            res = 1;
+        } else if (fc.key_log && !src_fc.key_log) {
+            fprintf(stderr, "%s: Has no key log for %s.\n", srcs[s], dest);
+            res = 1;
+        }
+        for (int i=0; i < num && !res; i++) {
+            if (inspect_header(paths[i], &stats) ||
+                    inspect_header(src_paths[i], &src_stats) ||
+                    stats.type != LAYER_BLOOM || src_stats.type != LAYER_BLOOM ||
+                    stats.bytes != src_stats.bytes || stats.k_num != src_stats.k_num) {
+                fprintf(stderr, "%s: Layer %s does not match %s.\n", srcs[s],
+                        basename(src_paths[i]), basename(paths[i]));
+                res = 1;
+            }
+        }
+        free_paths(src_paths, src_num);
+    }
+
+    // Merge each layer in turn, splitting it over the pool
+    for (int s=0; s < num_srcs && !res; s++) {
+        merge_layers(srcs[s], &src_fc, &src_paths);
+        for (int i=0; i < num && !res; i++) {
+            if (inspect_merge_layer(paths[i], src_paths[i], pool)) {
+                fprintf(stderr, "%s: Failed to merge %s.\n", dest, basename(paths[i]));
+                res = 1;
+            }
+        }
+        free_paths(src_paths, num);
+
+        // Keep the key log complete, so the filter can be sealed
+        if (!res && fc.key_log && append_key_log(dest, srcs[s])) {
+            fprintf(stderr, "%s: Failed to append the key log of %s.\n", dest, srcs[s]);
+            res = 1;
+        }
+    }
+
+    // Update the config with the merged counts
+    if (!res) {
+        fc.size = 0;
+        for (int i=0; i < num; i++) {
+            if (!inspect_header(paths[i], &stats)) fc.size += stats.count;
+        }
+        char *config_path = join_path(dest, (char*)CONFIG_FILENAME);
+        if (update_filename_from_filter_config(config_path, &fc)) {
+            fprintf(stderr, "%s: Failed to write %s.\n", dest, CONFIG_FILENAME);
+            res = 1;
+        } else {
+            printf("%s: Merged %d filters. Keys: %llu\n", dest, num_srcs,
+                    (unsigned long long)fc.size);
+        }
+        free(config_path);
+    }
+    free_paths(paths, num);
+    return res;
+}
+
+/**
+ * Opens a filter directory as a filter, using the data
+ * directory that holds it.
+ * @return 0 on success, -1 on error.
+ */
+static int open_filter(bloom_config *defaults, char *dir, bloom_config **config, bloom_filter **filter) {
+    bloom_filter_config fc;
+    if (read_filter_config(dir, &fc)) return -1;
+
+    // The filter is named by its directory
+    char *dir_copy = strdup(dir);
+    int len = strlen(dir_copy);
+    while (len > 1 && dir_copy[len - 1] == '/') dir_copy[--len] = '\0';
+    char *base = basename(dir_copy);
+    if (strncmp(base, FILTER_PREFIX, strlen(FILTER_PREFIX)) || !base[strlen(FILTER_PREFIX)]) {
+        fprintf(stderr, "%s: Not a filter directory.\n", dir);
+        free(dir_copy);
+        return -1;
+    }
+    char *name = strdup(base + strlen(FILTER_PREFIX));
+
+    // Each filter gets its own data directory
+    *config = malloc(sizeof(bloom_config));
+    memcpy(*config, defaults, sizeof(bloom_config));
+    (*config)->data_dir = strdup(dirname(dir_copy));
+    free(dir_copy);
+
+    int res = init_bloom_filter(*config, name, 1, filter);
+    free(name);
+    if (res) {
+        fprintf(stderr, "%s: Failed to load the filter.\n", dir);
+        destroy_bloom_filter(*filter);
+        free((*config)->data_dir);
+        free(*config);
+        return -1;
+    }
+    return 0;
+}
+
+static void close_filter(bloom_config *config, bloom_filter *filter) {
+    destroy_bloom_filter(filter);
+    free(config->data_dir);
+    free(config);
+}
+
+/**
+ * Folds the layers of one filter, on the pool
+ */
+static void shrink_task(void *arg, int idx) {
+    rewrite_job *job = arg;
+    bloom_config *config;
+    bloom_filter *filter;
+    if (open_filter(job->config, job->dirs[idx], &config, &filter)) {
+        job->results[idx] = -5;
+        return;
+    }
+
+    // An in-memory filter would lose the folded layers
+    bloom_shrink *shrink;
+    int res = -4;
+    if (!filter->filter_config.in_memory) {
+        res = bloomf_shrink_build(filter, job->prob, &shrink);
+    }
+    if (!res) {
+        res = bloomf_shrink_swap(filter, shrink);
+        bloomf_shrink_free(shrink);
+    }
+    job->results[idx] = res;
+    job->values[idx] = bloomf_byte_size(filter);
+    close_filter(config, filter);
+}
+
+/**
+ * Folds the layers of each filter, so that the false positive
+ * rate stays under prob, as the shrink command does.
+ */
+static int cmd_shrink(bloom_workpool *pool, bloom_config *config, double prob, char **dirs, int num_dirs) {
+    rewrite_job job = {config, dirs, prob, calloc(num_dirs, sizeof(int)),
+                       calloc(num_dirs, sizeof(uint64_t))};
+    workpool_run(pool, num_dirs, shrink_task, &job);
+
+    int failed = 0;
+    for (int d=0; d < num_dirs; d++) {
+        switch (job.results[d]) {
+            case 0:
+                printf("%s: Shrunk to %llu bytes.\n", dirs[d], (unsigned long long)job.values[d]);
+                break;
+            case 1:
+                printf("%s: No layer can be folded.\n", dirs[d]);
+                break;
+            case -2:
+                printf("%s: Sealed and stable filters cannot be shrunk.\n", dirs[d]);
+                failed++;
+                break;
+            case -4:
+                printf("%s: In-memory filters cannot be shrunk offline.\n", dirs[d]);
+                failed++;
+                break;
+            default:
+                printf("%s: Failed to shrink.\n", dirs[d]);
+                failed++;
+        }
+    }
+    free(job.results);
+    free(job.values);
+    return (failed) ? 1 : 0;
+}
+
+/**
+ * Seals one filter, on the pool
+ */
+static void seal_task(void *arg, int idx) {
+    rewrite_job *job = arg;
+    bloom_config *config;
+    bloom_filter *filter;
+    if (open_filter(job->config, job->dirs[idx], &config, &filter)) {
+        job->results[idx] = -5;
+        return;
+    }
+
+    // Same as the compact command, without sets to race with
+    uint64_t log_len = 0;
+    int res = bloomf_key_log_size(filter, &log_len);
+    if (res == -1) res = -4;
+    if (!res) res = bloomf_compact_build(filter, NULL, log_len);
+    if (!res) res = bloomf_compact_seal(filter, log_len);
+    job->results[idx] = res;
+    job->values[idx] = bloomf_size(filter);
+    close_filter(config, filter);
+}
+
+/**
+ * Converts each filter into a sealed fuse filter built
+ * from its key log, as the compact command does.
+ */
+static int cmd_seal(bloom_workpool *pool, bloom_config *config, char **dirs, int num_dirs) {
+    rewrite_job job = {config, dirs, 0, calloc(num_dirs, sizeof(int)),
+                       calloc(num_dirs, sizeof(uint64_t))};
+    workpool_run(pool, num_dirs, seal_task, &job);
+
+    int failed = 0;
+    for (int d=0; d < num_dirs; d++) {
+        switch (job.results[d]) {
+            case 0:
+                printf("%s: Sealed. Keys: %llu\n", dirs[d], (unsigned long long)job.values[d]);
+                break;
+            case -4:
+                printf("%s: Only filters with a key log can be sealed.\n", dirs[d]);
+                failed++;
+                break;
+            case -2:
+                printf("%s: Already sealed.\n", dirs[d]);
+                break;
+            default:
+                printf("%s: Failed to seal.\n", dirs[d]);
+                failed++;
+        }
+    }
+    free(job.results);
+    free(job.values);
+    return (failed) ? 1 : 0;
+}
+
+int main(int argc, char **argv) {
+    // Log errors to the terminal
+    openlog("bloomd-tool", LOG_CONS|LOG_PERROR|LOG_PID, LOG_LOCAL0);
+    setlogmask(LOG_UPTO(LOG_WARNING));
+
+    // Parse the command line
+    char *config_file = NULL;
+    int threads = sysconf(_SC_NPROCESSORS_ONLN);
+    if (parse_cmd_line_args(argc, argv, &config_file, &threads)) return 1;
+    char *cmd = argv[optind];
+    char **args = argv + optind + 1;
+    int num_args = argc - optind - 1;
+
+    // The config sets the defaults of the filters
+    bloom_config *config = calloc(1, sizeof(bloom_config));
+    if (config_from_filename(config_file, config)) {
+        fprintf(stderr, "Failed to read the configuration file!\n");
+        return 1;
+    }
+
+    // The calling thread runs tasks too
+    bloom_workpool *pool = NULL;
+    if (threads > 1 && init_workpool(threads - 1, &pool)) {
+        fprintf(stderr, "Failed to start the threads!\n");
+        return 1;
+    }
+
+    int res = -1;
+    if (strcmp(cmd, "info") == 0 && num_args >= 1) {
+        res = cmd_info(pool, args, num_args);
+    } else if (strcmp(cmd, "verify") == 0 && num_args >= 1) {
+        res = cmd_verify(pool, args, num_args);
+    } else if (strcmp(cmd, "merge") == 0 && num_args >= 2) {
+        res = cmd_merge(pool, args[0], args + 1, num_args - 1);
+    } else if (strcmp(cmd, "shrink") == 0 && num_args >= 2) {
+        double prob = strtod(args[0], NULL);
+        if (prob <= 0 || prob >= 1) {
+            fprintf(stderr, "The probability must be between 0 and 1.\n");
+            res = 1;
+        } else {
+            res = cmd_shrink(pool, config, prob, args + 1, num_args - 1);
+        }
+    } else if (strcmp(cmd, "seal") == 0 && num_args >= 1) {
+        res = cmd_seal(pool, config, args, num_args);
+    }
+
+    if (res == -1) {
+        show_usage();
+        res = 1;
+    }
+    if (pool) destroy_workpool(pool);
+    free(config);
+    return res;
+}
@@ -0,0 +1,225 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <sys/time.h>
+#include <syslog.h>
+#include "capture.h"
+#include "logger.h"
+
+/**
+ * Size of each of the two capture buffers. Commands
+ * are appended to one while the other is written out.
+ */
+#define CAPTURE_BUFFER_SIZE (4*1024*1024)
+
+/**
+ * How long the capture thread sleeps between writes
+ * in microseconds
+ */
+#define CAPTURE_WRITE_USEC 100000
+
+/**
+ * Global capture state. Only the active buffer
+ * is protected by the lock, the spare buffer is
+ * owned by the capture thread.
+ */
+static struct {
+    volatile int enabled;
+    uint32_t sample_threshold;  // Sample if a random value is below this
+    int fd;
+    struct timespec start;
+
+    pthread_mutex_t lock;
+    char *active;
+    uint64_t active_len;
+    char *spare;
+
+    uint64_t captured;
+    uint64_t dropped;
+} CAPTURE;
+
+/**
+ * Seed for the per-thread sampling generator
+ */
+static __thread uint32_t SAMPLE_STATE = 0;
+
+/* Static declarations */
+static void* capture_thread_main(void *in);
+static int write_buffer(int fd, char *buf, uint64_t len);
+static uint32_t sample_random(void);
+
+/**
+ * Initializes command capture. Opens the configured capture
+ * file, and truncates any existing file. No-op if capture
+ * is not configured.
+ * @arg config The configuration
+ * @return 0 on success, negative on error.
+ */
+int init_capture(bloom_config *config) {
+    if (!config->capture_file) return 0;
+
+    int fd = open(config->capture_file, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd == -1) {
+        bloom_log(LOG_ERR, "Failed to open capture file '%s'. %s",
+                config->capture_file, strerror(errno));
+        return -1;
+    }
+
+    // Write out the header
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    capture_header header;
+    memcpy(header.magic, CAPTURE_MAGIC, sizeof(header.magic));
+    header.version = CAPTURE_VERSION;
+    header.sample_ppm = config->capture_sample * 1000000;
+    header.start_time = now.tv_sec * 1000000ULL + now.tv_usec;
+    if (write_buffer(fd, (char*)&header, sizeof(header))) {
+        bloom_log(LOG_ERR, "Failed to write capture file '%s'. %s",
+                config->capture_file, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    // Setup the buffers
+    CAPTURE.fd = fd;
+    CAPTURE.sample_threshold = config->capture_sample * UINT32_MAX;
+    clock_gettime(CLOCK_MONOTONIC, &CAPTURE.start);
+    pthread_mutex_init(&CAPTURE.lock, NULL);
+    CAPTURE.active = malloc(CAPTURE_BUFFER_SIZE);
+    CAPTURE.spare = malloc(CAPTURE_BUFFER_SIZE);
+    CAPTURE.active_len = 0;
+    CAPTURE.enabled = 1;
+
+    bloom_log(LOG_INFO, "Capturing %0.2f%% of commands to '%s'.",
+            config->capture_sample * 100, config->capture_file);
+    return 0;
+}
+
+/**
+ * Records a command received from a client, if it is sampled.
+ * This only copies the command into a buffer, it is written
+ * out by the capture thread. Commands are dropped if the
+ * capture thread falls behind.
+ * @note Thread safe.
+ * @arg conn Opaque handle of the client connection
+ * @arg cmd The command line
+ * @arg len The length of the command line
+ */
+void capture_command(void *conn, char *cmd, int len) {
+    if (!CAPTURE.enabled) return;
+    if (CAPTURE.sample_threshold != UINT32_MAX && sample_random() >= CAPTURE.sample_threshold)
+        return;
+
+    // Build the record
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    capture_record rec;
+    rec.offset = (now.tv_sec - CAPTURE.start.tv_sec) * 1000000ULL +
+                 (now.tv_nsec - CAPTURE.start.tv_nsec) / 1000;
+    rec.conn_id = (uint32_t)((uintptr_t)conn >> 3);
+    rec.len = len;
+
+    // Append to the active buffer, drop if full
+    uint64_t rec_len = sizeof(rec) + len;
+    pthread_mutex_lock(&CAPTURE.lock);
+    if (CAPTURE.enabled && CAPTURE.active_len + rec_len <= CAPTURE_BUFFER_SIZE) {
+        memcpy(CAPTURE.active + CAPTURE.active_len, &rec, sizeof(rec));
+        memcpy(CAPTURE.active + CAPTURE.active_len + sizeof(rec), cmd, len);
+        CAPTURE.active_len += rec_len;
+        CAPTURE.captured++;
+    } else {
+        CAPTURE.dropped++;
+    }
+    pthread_mutex_unlock(&CAPTURE.lock);
+}
+
+/**
+ * Starts the capture thread which writes out captured commands.
+ * Once should_run is cleared, the remaining commands are
+ * written and the capture file is closed.
+ * @arg config The configuration
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_capture_thread(bloom_config *config, int *should_run, pthread_t *t) {
+    // Return if we are not capturing
+    if (!config->capture_file || !CAPTURE.enabled) {
+        return 0;
+    }
+
+    // Start thread
+    pthread_create(t, NULL, capture_thread_main, should_run);
+    return 1;
+}
+
+static void* capture_thread_main(void *in) {
+    int *should_run = in;
+    int running = 1;
+    char *buf;
+    uint64_t len;
+    while (running) {
+        usleep(CAPTURE_WRITE_USEC);
+        running = *should_run;
+
+        // Swap the buffers, stop capturing on the last pass
+        pthread_mutex_lock(&CAPTURE.lock);
+        buf = CAPTURE.active;
+        len = CAPTURE.active_len;
+        CAPTURE.active = CAPTURE.spare;
+        CAPTURE.active_len = 0;
+        CAPTURE.spare = buf;
+        if (!running) CAPTURE.enabled = 0;
+        pthread_mutex_unlock(&CAPTURE.lock);
+
+        // Write out the commands
+        if (len && write_buffer(CAPTURE.fd, buf, len)) {
+            bloom_log(LOG_ERR, "Failed to write capture file, stopping capture. %s", strerror(errno));
+            pthread_mutex_lock(&CAPTURE.lock);
+            CAPTURE.enabled = 0;
+            pthread_mutex_unlock(&CAPTURE.lock);
+            break;
+        }
+    }
+
+    bloom_log(LOG_INFO, "Capture finished. Captured: %llu. Dropped: %llu.",
+            (unsigned long long)CAPTURE.captured, (unsigned long long)CAPTURE.dropped);
+    close(CAPTURE.fd);
+    free(CAPTURE.active);
+    free(CAPTURE.spare);
+    return NULL;
+}
+
+/**
+ * Writes a whole buffer out to a file
+ */
+static int write_buffer(int fd, char *buf, uint64_t len) {
+    uint64_t total = 0;
+    ssize_t n;
+    while (total < len) {
+        n = write(fd, buf + total, len - total);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        total += n;
+    }
+    return 0;
+}
+
+/**
+ * Cheap per-thread xorshift generator used for sampling
+ */
+static uint32_t sample_random(void) {
+    uint32_t x = SAMPLE_STATE;
+    if (!x) x = ((uint32_t)(uintptr_t)&SAMPLE_STATE ^ (uint32_t)time(NULL)) | 1;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    SAMPLE_STATE = x;
+    return x;
+}
@@ -0,0 +1,67 @@
+#ifndef BLOOM_CAPTURE_H
+#define BLOOM_CAPTURE_H
+#include <stdint.h>
+#include <pthread.h>
+#include "config.h"
+
+/**
+ * Magic bytes and version at the start of a capture file
+ */
+#define CAPTURE_MAGIC "BLOOMCAP"
+#define CAPTURE_VERSION 1
+
+/**
+ * A capture file starts with this header,
+ * followed by a sequence of records.
+ */
+typedef struct {
+    char magic[8];          // CAPTURE_MAGIC
+    uint32_t version;       // CAPTURE_VERSION
+    uint32_t sample_ppm;    // Sampled commands per million
+    uint64_t start_time;    // Wall clock start, microseconds since epoch
+} __attribute__ ((packed)) capture_header;
+
+/**
+ * Each captured command is a record header, followed
+ * by the command line without the trailing newline.
+ */
+typedef struct {
+    uint64_t offset;        // Microseconds since the capture started
+    uint32_t conn_id;       // Identifies the client connection
+    uint32_t len;           // Length of the command that follows
+} __attribute__ ((packed)) capture_record;
+
+/**
+ * Initializes command capture. Opens the configured capture
+ * file, and truncates any existing file. No-op if capture
+ * is not configured.
+ * @arg config The configuration
+ * @return 0 on success, negative on error.
+ */
+int init_capture(bloom_config *config);
+
+/**
+ * Records a command received from a client, if it is sampled.
+ * This only copies the command into a buffer, it is written
+ * out by the capture thread. Commands are dropped if the
+ * capture thread falls behind.
+ * @note Thread safe.
+ * @arg conn Opaque handle of the client connection
+ * @arg cmd The command line
+ * @arg len The length of the command line
+ */
+void capture_command(void *conn, char *cmd, int len);
+
+/**
+ * Starts the capture thread which writes out captured commands.
+ * Once should_run is cleared, the remaining commands are
+ * written and the capture file is closed.
+ * @arg config The configuration
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_capture_thread(bloom_config *config, int *should_run, pthread_t *t);
+
+#endif
@@ -30,7 +30,28 @@ static const bloom_config DEFAULT_CONFIG = {
     3600,               // Cold after an hour
     0,                  // Persist to disk by default
     1,                  // Only a single worker thread by default
-    0                   // Do NOT use mmap by default
+    0,                  // Do NOT use mmap by default
+    NULL,               // No handover socket by default
+    0,                  // Do not snapshot in-memory filters
+    0,                  // One shutdown worker per CPU
+    NULL,               // No command capture by default
+    1.0,                // Capture all commands if enabled
+    0,                  // Any worker can use any filter
+    0,                  // Do not log keys
+    0,                  // Use scalable filters
+    0,                  // Apply each set on its own
+    0,                  // No pool for large commands
+    0,                  // Ignore NUMA placement
+    8388608,            // Stop reading a client with 8MB of unsent output
+    1048576,            // Resume reading it below 1MB
+    NULL,               // Not a proxy by default
+    0,                  // No limit on the keys of a filter
+    0,                  // No limit on the bytes of a filter
+    0,                  // No limit on the keys of a client
+    0,                  // No limit on the bytes of a client
+    86400,              // Scrub the cold filters daily
+    8388608,            // Read at most 8MB a second when scrubbing
+    0                   // Grow filters by scale_size
 };
 
 /**
@@ -120,16 +141,52 @@ static int config_callback(void* user, const char* section, const char* name, co
          return value_to_int(value, &config->use_mmap);
     } else if (NAME_MATCH("workers")) {
          return value_to_int(value, &config->worker_threads);
+    } else if (NAME_MATCH("snapshot_interval")) {
+         return value_to_int(value, &config->snapshot_interval);
+    } else if (NAME_MATCH("shutdown_workers")) {
+         return value_to_int(value, &config->shutdown_workers);
+    } else if (NAME_MATCH("shared_nothing")) {
+         return value_to_int(value, &config->shared_nothing);
+    } else if (NAME_MATCH("key_log")) {
+         return value_to_int(value, &config->key_log);
+    } else if (NAME_MATCH("stable")) {
+         return value_to_int(value, &config->stable);
+    } else if (NAME_MATCH("group_commit")) {
+         return value_to_int(value, &config->group_commit);
+    } else if (NAME_MATCH("parallel_threads")) {
+         return value_to_int(value, &config->parallel_threads);
+    } else if (NAME_MATCH("numa_aware")) {
+         return value_to_int(value, &config->numa_aware);
+    } else if (NAME_MATCH("rate_ops")) {
+         return value_to_int64(value, &config->rate_ops);
+    } else if (NAME_MATCH("rate_bytes")) {
+         return value_to_int64(value, &config->rate_bytes);
+    } else if (NAME_MATCH("conn_rate_ops")) {
+         return value_to_int64(value, &config->conn_rate_ops);
+    } else if (NAME_MATCH("conn_rate_bytes")) {
+         return value_to_int64(value, &config->conn_rate_bytes);
+    } else if (NAME_MATCH("scrub_interval")) {
+         return value_to_int(value, &config->scrub_interval);
+    } else if (NAME_MATCH("scrub_rate")) {
+         return value_to_int64(value, &config->scrub_rate);
+    } else if (NAME_MATCH("growth_horizon")) {
+         return value_to_int(value, &config->growth_horizon);
 
     // Handle the int64 cases
     } else if (NAME_MATCH("initial_capacity")) {
          return value_to_int64(value, &config->initial_capacity);
+    } else if (NAME_MATCH("output_high_watermark")) {
+         return value_to_int64(value, &config->output_high_watermark);
+    } else if (NAME_MATCH("output_low_watermark")) {
+         return value_to_int64(value, &config->output_low_watermark);
 
     // Handle the double cases
     } else if (NAME_MATCH("default_probability")) {
          return value_to_double(value, &config->default_probability);
     } else if (NAME_MATCH("probability_reduction")) {
          return value_to_double(value, &config->probability_reduction);
+    } else if (NAME_MATCH("capture_sample")) {
+         return value_to_double(value, &config->capture_sample);
 
     // Copy the string values
     } else if (NAME_MATCH("data_dir")) {
@@ -138,6 +195,12 @@ static int config_callback(void* user, const char* section, const char* name, co
         config->log_level = strdup(value);
     } else if (NAME_MATCH("bind_address")) {
         config->bind_address = strdup(value);
+    } else if (NAME_MATCH("handover_socket")) {
+        config->handover_socket = strdup(value);
+    } else if (NAME_MATCH("capture_file")) {
+        config->capture_file = strdup(value);
+    } else if (NAME_MATCH("proxy_backends")) {
+        config->proxy_backends = strdup(value);
 
     // Unknown parameter?
     } else {
@@ -375,6 +438,169 @@ int sane_worker_threads(int threads) {
     return 0;
 }
 
+int sane_handover_socket(char *path) {
+    // Handover is optional
+    if (!path) return 0;
+
+    // Must fit in a sockaddr_un
+    if (strlen(path) == 0 || strlen(path) >= 104) {
+        syslog(LOG_ERR,
+               "Handover socket path must be between 1 and 103 characters!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_snapshot_interval(int intv) {
+    if (intv < 0) {
+        syslog(LOG_ERR, "Snapshot interval cannot be negative!");
+        return 1;
+    } else if (intv > 0 && intv < 10) {
+        syslog(LOG_WARNING,
+               "Snapshot interval is very short. Snapshots copy entire filters.");
+    }
+    return 0;
+}
+
+int sane_shutdown_workers(int workers) {
+    if (workers < 0) {
+        syslog(LOG_ERR, "Cannot have a negative number of shutdown workers!");
+        return 1;
+    } else if (workers > 64) {
+        syslog(LOG_WARNING, "More than 64 shutdown workers is unlikely to help.");
+    }
+    return 0;
+}
+
+int sane_capture_sample(double sample) {
+    if (sample <= 0 || sample > 1) {
+        syslog(LOG_ERR, "Capture sample must be greater than 0 and at most 1!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_shared_nothing(int shared_nothing) {
+    if (shared_nothing != 0 && shared_nothing != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for shared_nothing. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_key_log(int key_log) {
+    if (key_log != 0 && key_log != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for key_log. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_stable(int stable) {
+    if (stable != 0 && stable != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for stable. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_group_commit(int group_commit) {
+    if (group_commit != 0 && group_commit != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for group_commit. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_parallel_threads(int threads) {
+    if (threads < 0) {
+        syslog(LOG_ERR, "Cannot have a negative number of parallel threads!");
+        return 1;
+    } else if (threads > 64) {
+        syslog(LOG_WARNING, "More than 64 parallel threads is unlikely to help.");
+    }
+    return 0;
+}
+
+int sane_numa_aware(int numa_aware) {
+    if (numa_aware != 0 && numa_aware != 1) {
+        syslog(LOG_ERR,
+               "Illegal value for numa_aware. Must be 0 or 1.");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_output_watermarks(uint64_t high, uint64_t low) {
+    if (high && low >= high) {
+        syslog(LOG_ERR,
+               "The output_low_watermark must be below the output_high_watermark.");
+        return 1;
+    } else if (high && high < 65536) {
+        syslog(LOG_WARNING, "An output_high_watermark below 64KB will pause clients often.");
+    }
+    return 0;
+}
+
+int sane_proxy_backends(char *backends) {
+    if (!backends) return 0;
+
+    // Each backend must be a host:port
+    char *copy = strdup(backends);
+    char *save = NULL, *host, *port;
+    int count = 0, res = 0;
+    for (host = strtok_r(copy, ", ", &save); host; host = strtok_r(NULL, ", ", &save)) {
+        port = strrchr(host, ':');
+        int port_num = (port) ? atoi(port + 1) : 0;
+        if (!port || port == host || port_num <= 0 || port_num > 65535) {
+            syslog(LOG_ERR, "Illegal proxy backend %s. Must be host:port.", host);
+            res = 1;
+        }
+        count++;
+    }
+    free(copy);
+
+    if (!count) {
+        syslog(LOG_ERR, "The proxy_backends must list at least one backend.");
+        res = 1;
+    }
+    return res;
+}
+
+int sane_rate_limits(int64_t ops, int64_t bytes) {
+    if (ops < 0 || bytes < 0) {
+        syslog(LOG_ERR, "Rate limits cannot be negative!");
+        return 1;
+    }
+    return 0;
+}
+
+int sane_scrub(int intv, int64_t rate) {
+    if (intv < 0) {
+        syslog(LOG_ERR, "Scrub interval cannot be negative!");
+        return 1;
+    } else if (rate < 0) {
+        syslog(LOG_ERR, "Scrub rate cannot be negative!");
+        return 1;
+    } else if (intv == 0) {
+        syslog(LOG_WARNING, "Scrubbing is disabled! Cold filters are only checked when loaded.");
+    } else if (rate == 0) {
+        syslog(LOG_WARNING, "Scrub rate is unlimited! Scrubs may compete with flushes for the disk.");
+    }
+    return 0;
+}
+
+int sane_growth_horizon(int horizon) {
+    if (horizon < 0) {
+        syslog(LOG_ERR, "Growth horizon cannot be negative!");
+        return 1;
+    }
+    return 0;
+}
 
 /**
  * Validates the configuration
@@ -395,6 +621,22 @@ int validate_config(bloom_config *config) {
     res |= sane_in_memory(config->in_memory);
     res |= sane_use_mmap(config->use_mmap);
     res |= sane_worker_threads(config->worker_threads);
+    res |= sane_handover_socket(config->handover_socket);
+    res |= sane_snapshot_interval(config->snapshot_interval);
+    res |= sane_shutdown_workers(config->shutdown_workers);
+    res |= sane_capture_sample(config->capture_sample);
+    res |= sane_shared_nothing(config->shared_nothing);
+    res |= sane_key_log(config->key_log);
+    res |= sane_stable(config->stable);
+    res |= sane_group_commit(config->group_commit);
+    res |= sane_parallel_threads(config->parallel_threads);
+    res |= sane_numa_aware(config->numa_aware);
+    res |= sane_output_watermarks(config->output_high_watermark, config->output_low_watermark);
+    res |= sane_proxy_backends(config->proxy_backends);
+    res |= sane_rate_limits(config->rate_ops, config->rate_bytes);
+    res |= sane_rate_limits(config->conn_rate_ops, config->conn_rate_bytes);
+    res |= sane_scrub(config->scrub_interval, config->scrub_rate);
+    res |= sane_growth_horizon(config->growth_horizon);
 
     return res;
 }
@@ -424,6 +666,14 @@ static int filter_config_callback(void* user, const char* section, const char* n
         return value_to_int(value, &config->scale_size);
     } else if (NAME_MATCH("in_memory")) {
          return value_to_int(value, &config->in_memory);
+    } else if (NAME_MATCH("key_log")) {
+         return value_to_int(value, &config->key_log);
+    } else if (NAME_MATCH("sealed")) {
+         return value_to_int(value, &config->sealed);
+    } else if (NAME_MATCH("stable")) {
+         return value_to_int(value, &config->stable);
+    } else if (NAME_MATCH("growth_horizon")) {
+         return value_to_int(value, &config->growth_horizon);
 
     // Handle the int64 cases
     } else if (NAME_MATCH("initial_capacity")) {
@@ -434,12 +684,24 @@ static int filter_config_callback(void* user, const char* section, const char* n
          return value_to_int64(value, &config->capacity);
     } else if (NAME_MATCH("bytes")) {
          return value_to_int64(value, &config->bytes);
+    } else if (NAME_MATCH("rate_ops")) {
+         return value_to_int64(value, &config->rate_ops);
+    } else if (NAME_MATCH("rate_bytes")) {
+         return value_to_int64(value, &config->rate_bytes);
+    } else if (NAME_MATCH("growth_time")) {
+         return value_to_int64(value, &config->growth_time);
 
     // Handle the double cases
     } else if (NAME_MATCH("default_probability")) {
          return value_to_double(value, &config->default_probability);
     } else if (NAME_MATCH("probability_reduction")) {
          return value_to_double(value, &config->probability_reduction);
+    } else if (NAME_MATCH("growth_keys")) {
+         return value_to_double(value, &config->growth_keys);
+    } else if (NAME_MATCH("growth_secs")) {
+         return value_to_double(value, &config->growth_secs);
+    } else if (NAME_MATCH("growth_age")) {
+         return value_to_double(value, &config->growth_age);
 
     // Unknown parameter?
     } else {
@@ -493,14 +755,34 @@ probability_reduction = %f\n\
 in_memory = %d\n\
 size = %llu\n\
 capacity = %llu\n\
-bytes = %llu\n", (unsigned long long)config->initial_capacity,
+bytes = %llu\n\
+key_log = %d\n\
+sealed = %d\n\
+stable = %d\n\
+rate_ops = %llu\n\
+rate_bytes = %llu\n\
+growth_horizon = %d\n\
+growth_keys = %f\n\
+growth_secs = %f\n\
+growth_age = %f\n\
+growth_time = %llu\n", (unsigned long long)config->initial_capacity,
                  config->default_probability,
                  config->scale_size,
                  config->probability_reduction,
                  config->in_memory,
                  (unsigned long long)config->size,
                  (unsigned long long)config->capacity,
-                 (unsigned long long)config->bytes
+                 (unsigned long long)config->bytes,
+                 config->key_log,
+                 config->sealed,
+                 config->stable,
+                 (unsigned long long)config->rate_ops,
+                 (unsigned long long)config->rate_bytes,
+                 config->growth_horizon,
+                 config->growth_keys,
+                 config->growth_secs,
+                 config->growth_age,
+                 (unsigned long long)config->growth_time
     );
 
     // Close
@@ -22,6 +22,27 @@ typedef struct {
     int in_memory;
     int worker_threads;
     int use_mmap;
+    char *handover_socket;
+    int snapshot_interval;
+    int shutdown_workers;
+    char *capture_file;
+    double capture_sample;
+    int shared_nothing;
+    int key_log;
+    int stable;
+    int group_commit;
+    int parallel_threads;
+    int numa_aware;
+    uint64_t output_high_watermark;
+    uint64_t output_low_watermark;
+    char *proxy_backends;
+    uint64_t rate_ops;
+    uint64_t rate_bytes;
+    uint64_t conn_rate_ops;
+    uint64_t conn_rate_bytes;
+    int scrub_interval;
+    uint64_t scrub_rate;
+    int growth_horizon;
 } bloom_config;
 
 /**
@@ -37,6 +58,16 @@ typedef struct {
     uint64_t size;          // Total size
     uint64_t capacity;      // Total capacity
     uint64_t bytes;         // Total byte size
+    int key_log;            // Are set keys logged
+    int sealed;             // Compacted into a read-only fuse filter
+    int stable;             // Stable filter that forgets old keys
+    uint64_t rate_ops;      // Most keys checked or set each second, 0 for no limit
+    uint64_t rate_bytes;    // Most bytes of keys each second, 0 for no limit
+    int growth_horizon;     // Seconds to size new layers for, 0 to scale by scale_size
+    double growth_keys;     // Keys added, decayed by age
+    double growth_secs;     // Seconds observed, decayed by age
+    double growth_age;      // Seconds observed in total
+    uint64_t growth_time;   // Unix time the history was last updated
 } bloom_filter_config;
 
 
@@ -87,6 +118,21 @@ int sane_cold_interval(int intv);
 int sane_in_memory(int in_mem);
 int sane_use_mmap(int use_mmap);
 int sane_worker_threads(int threads);
+int sane_handover_socket(char *path);
+int sane_snapshot_interval(int intv);
+int sane_shutdown_workers(int workers);
+int sane_capture_sample(double sample);
+int sane_shared_nothing(int shared_nothing);
+int sane_key_log(int key_log);
+int sane_stable(int stable);
+int sane_group_commit(int group_commit);
+int sane_parallel_threads(int threads);
+int sane_numa_aware(int numa_aware);
+int sane_output_watermarks(uint64_t high, uint64_t low);
+int sane_proxy_backends(char *backends);
+int sane_rate_limits(int64_t ops, int64_t bytes);
+int sane_scrub(int intv, int64_t rate);
+int sane_growth_horizon(int horizon);
 
 /**
  * Joins two strings as part of a path,
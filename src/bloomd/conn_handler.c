@@ -4,8 +4,17 @@
 #include <regex.h>
 #include <assert.h>
 #include "conn_handler.h"
+#include "background.h"
+#include "capture.h"
+#include "numa.h"
+#include "ratelimit.h"
+#include "logger.h"
 #include "handler_constants.c"
 
+/* Static regexes */
+static regex_t VALID_FILTER_NAMES_RE;
+static const char *VALID_FILTER_NAMES_PATTERN = "^[^ \t\n\r]{1,200}$";
+
 /**
  * Defines the number of keys we set/check in a single
  * iteration for our multi commands. We do not do all the
@@ -15,6 +24,71 @@
  */
 #define MULTI_OP_SIZE 32
 
+/**
+ * Defines the most keys that are set under one lock when
+ * grouping the sets of many clients into the same filter.
+ */
+#define GROUP_COMMIT_SIZE 512
+
+/**
+ * Defines how many keys a multi command must have to be
+ * done in batches of this size instead. Large batches are
+ * hashed first and their probes sorted by location, so
+ * each page of a large filter is touched once per batch.
+ */
+#define LARGE_OP_SIZE 4096
+
+/**
+ * Defines how many keys a check must have before it is
+ * split across the work pool, and how many keys each task
+ * of the split checks. Smaller commands are not worth
+ * handing off to other threads.
+ */
+#define PARALLEL_MIN_KEYS 8192
+#define PARALLEL_TASK_KEYS LARGE_OP_SIZE
+
+/**
+ * Used to split a check across the work pool.
+ * Each task records its result and how many keys
+ * it checked before any error.
+ */
+typedef struct {
+    bloom_filtmgr *mgr;
+    owned_cmd *cmd;
+    int *res;
+    int *num_done;
+} parallel_check;
+
+/**
+ * Defines the size of the chunks the list command writes
+ * its lines in, so a list of many filters is streamed
+ * out without holding every line in memory at once.
+ */
+#define LIST_CHUNK_SIZE 16384
+
+/**
+ * Buffers the lines of a list command. Once a
+ * chunk is full, it is sent and the buffer reused.
+ */
+typedef struct {
+    bloom_conn_info *conn;
+    char *buf;
+    int len;
+    int limit;      // Most filters to list, 0 for all
+    int listed;     // Filters listed so far
+} list_output;
+
+/**
+ * An entry of a batch command. The entries are grouped
+ * by filter, and index keeps their place in the response.
+ */
+typedef struct {
+    char *filter_name;
+    char *key;
+    int is_set;
+    int index;
+} batch_entry;
+
 /**
  * Invoked in any context with a bloom_conn_handler
  * to send out an INTERNAL_ERROR message to the client.
@@ -31,14 +105,32 @@ static void handle_drop_cmd(bloom_conn_handler *handle, char *args, int args_len
 static void handle_close_cmd(bloom_conn_handler *handle, char *args, int args_len);
 static void handle_clear_cmd(bloom_conn_handler *handle, char *args, int args_len);
 static void handle_list_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static int list_filter_cb(void *data, char *filter_name, bloom_filter *filter);
+static void flush_list_output(list_output *out);
 static void handle_info_cmd(bloom_conn_handler *handle, char *args, int args_len);
 static void handle_flush_cmd(bloom_conn_handler *handle, char *args, int args_len);
-
+static void handle_compact_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void send_compact_response(bloom_conn_handler *handle, int res);
+static void handle_shrink_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void send_shrink_response(bloom_conn_handler *handle, int res);
+static void handle_stats_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void handle_batch_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static int parse_batch_entries(char *args, int args_len, batch_entry **entries);
+static int compare_batch_entries(const void *a, const void *b);
+static void send_batch_response(bloom_conn_handler *handle, int *results, int num_entries);
+static void handle_limit_cmd(bloom_conn_handler *handle, char *args, int args_len);
+static void throttle_cmd(bloom_conn_handler *handle, char *filter_name, uint64_t ops, uint64_t bytes);
+static int count_keys(char *keys, int keys_len);
+
+static int forward_or_defer(bloom_conn_handler *handle, char *filter_name, char *keys, int keys_len, int split,
+        int(*filtmgr_func)(bloom_filtmgr *, char*, char **, int, char*));
+static void execute_owned_cmd(bloom_conn_handler *handle, owned_cmd *cmd);
+static void execute_parallel_check(bloom_conn_handler *handle, owned_cmd *cmd);
+static void parallel_check_task(void *arg, int task);
+static int has_many_keys(char *keys, int keys_len, int min_keys);
+static int can_group_cmd(owned_cmd *cmd);
+static int compare_owned_cmds(const void *a, const void *b);
 static int handle_multi_response(bloom_conn_handler *handle, int cmd_res, int num_keys, char *res_buf, int end_of_input);
-static inline void handle_client_resp(bloom_conn_info *conn, char* resp_mesg, int resp_len);
-static void handle_client_err(bloom_conn_info *conn, char* err_msg, int msg_len);
-static conn_cmd_type determine_client_command(char *cmd_buf, int buf_len, char **arg_buf, int *arg_len);
-static int buffer_after_terminator(char *buf, int buf_len, char terminator, char **after_term, int *after_len);
 
 /**
  * Invoked to initialize the conn handler layer.
@@ -68,6 +160,9 @@ int handle_client_connect(bloom_conn_handler *handle) {
         status = extract_to_terminator(handle->conn, '\n', &buf, &buf_len, &should_free);
         if (status == -1) break; // Return if no command is available
 
+        // Record the command if we are capturing traffic
+        capture_command(handle->conn, buf, buf_len - 1);
+
         // Determine the command type
         conn_cmd_type type = determine_client_command(buf, buf_len, &arg_buf, &arg_buf_len);
 
@@ -106,6 +201,21 @@ int handle_client_connect(bloom_conn_handler *handle) {
             case FLUSH:
                 handle_flush_cmd(handle, arg_buf, arg_buf_len);
                 break;
+            case COMPACT:
+                handle_compact_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case SHRINK:
+                handle_shrink_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case STATS:
+                handle_stats_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case BATCH:
+                handle_batch_cmd(handle, arg_buf, arg_buf_len);
+                break;
+            case LIMIT:
+                handle_limit_cmd(handle, arg_buf, arg_buf_len);
+                break;
             default:
                 handle_client_err(handle->conn, (char*)&CMD_NOT_SUP, CMD_NOT_SUP_LEN);
                 break;
@@ -113,6 +223,9 @@ int handle_client_connect(bloom_conn_handler *handle) {
 
         // Make sure to free the command buffer if we need to
         if (should_free) free(buf);
+
+        // Stop if we are waiting on another worker
+        if (client_suspended(handle->conn)) break;
     }
 
     return 0;
@@ -147,6 +260,12 @@ static void handle_filt_key_cmd(bloom_conn_handler *handle, char *args, int args
     int err = buffer_after_terminator(args, args_len, ' ', &key, &key_len);
     if (err || key_len <= 1) CHECK_ARG_ERR();
 
+    // Defer the next commands if over the rate limits
+    throttle_cmd(handle, args, 1, key_len - 1);
+
+    // Send to the owning worker, or group with other sets
+    if (forward_or_defer(handle, args, key, key_len - 1, 0, filtmgr_func)) return;
+
     // Setup the buffers
     char *key_buf[] = {key};
     char result_buf[1];
@@ -189,6 +308,23 @@ static void handle_filt_multi_key_cmd(bloom_conn_handler *handle, char *args, in
     int err = buffer_after_terminator(args, args_len, ' ', &key, &key_len);
     if (err || key_len <= 1) CHECK_ARG_ERR();
 
+    // Defer the next commands if over the rate limits
+    throttle_cmd(handle, args, count_keys(key, key_len - 1), key_len - 1);
+
+    // Send to the owning worker, or group with other sets
+    if (forward_or_defer(handle, args, key, key_len - 1, 1, filtmgr_func)) return;
+
+    // Do large commands in large batches, and split very
+    // large checks across the work pool
+    if (has_many_keys(key, key_len, LARGE_OP_SIZE)) {
+        owned_cmd *cmd = owned_cmd_new(args, key, key_len - 1, 1);
+        cmd->is_set = (filtmgr_func == filtmgr_set_keys);
+        execute_owned_cmd(handle, cmd);
+        finish_owned_cmd(handle, cmd);
+        owned_cmd_free(cmd);
+        return;
+    }
+
     // Parse any options
     char *curr_key = key;
     int index = 0;
@@ -232,6 +368,379 @@ static void handle_set_multi_cmd(bloom_conn_handler *handle, char *args, int arg
 }
 
 
+/**
+ * Internal command used to check and set keys over many
+ * filters at once. The entries are grouped by filter, and
+ * each run of checks or sets to a filter is done under one
+ * lock, in the order they were sent. Each entry has its own
+ * result, so a missing filter does not fail the others. The
+ * batch is done by this worker, even if it does not own the
+ * filters.
+ */
+static void handle_batch_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    int *results;
+    uint64_t bytes;
+    double now = bucket_clock(), wait;
+    int num_entries = execute_batch_cmd(handle, args, args_len, now, &results, &bytes, &wait);
+    if (num_entries <= 0) {
+        handle_client_err(handle->conn, (char*)&BATCH_ARGS_NEEDED, BATCH_ARGS_NEEDED_LEN);
+        return;
+    }
+
+    send_batch_response(handle, results, num_entries);
+    throttle_client(handle->conn, num_entries, bytes, now, wait);
+    free(results);
+}
+
+/**
+ * Executes the checks and sets of a batch command, which may
+ * span many filters. The keys of each filter are done in runs
+ * of up to LARGE_OP_SIZE, in the order they were sent.
+ * Does not use the connection object of the handle.
+ * @arg handle The connection related information
+ * @arg args The arguments of the command, split in place
+ * @arg args_len The length of the arguments
+ * @arg now The current time from bucket_clock
+ * @arg results Output, the result of each entry in the order
+ * sent: 1 or 0, or negative if its filter failed. Must be freed.
+ * @arg bytes Output, the bytes of all the keys
+ * @arg wait Output, the longest wait of the filter limits
+ * @return The number of entries, or -1 if they are malformed.
+ */
+int execute_batch_cmd(bloom_conn_handler *handle, char *args, int args_len, double now,
+        int **results, uint64_t *bytes, double *wait) {
+    batch_entry *entries;
+    int num_entries = parse_batch_entries(args, args_len, &entries);
+    if (num_entries <= 0) return -1;
+
+    // Entries for the same filter are adjacent, in the order sent
+    qsort(entries, num_entries, sizeof(batch_entry), compare_batch_entries);
+
+    char **keys = malloc(LARGE_OP_SIZE * sizeof(char*));
+    char *result = malloc(LARGE_OP_SIZE);
+    int *entry_res = malloc(num_entries * sizeof(int));
+    int start, end, res;
+    uint64_t run_bytes, total_bytes = 0;
+    double run_wait, max_wait = 0;
+    for (start=0; start < num_entries; start = end) {
+        // Gather the run of checks or sets to the filter
+        batch_entry *first = entries + start;
+        run_bytes = 0;
+        for (end=start; end < num_entries && end - start < LARGE_OP_SIZE; end++) {
+            if (entries[end].is_set != first->is_set) break;
+            if (strcmp(entries[end].filter_name, first->filter_name)) break;
+            keys[end - start] = entries[end].key;
+            run_bytes += strlen(entries[end].key);
+        }
+
+        // Each filter takes the keys of its runs from its limits
+        filtmgr_charge(handle->mgr, first->filter_name, end - start, run_bytes, now, &run_wait);
+        if (run_wait > max_wait) max_wait = run_wait;
+        total_bytes += run_bytes;
+
+        if (first->is_set)
+            res = filtmgr_set_keys(handle->mgr, first->filter_name, keys, end - start, result);
+        else
+            res = filtmgr_check_keys(handle->mgr, first->filter_name, keys, end - start, result);
+
+        // Place the results back in the order sent
+        for (int i=start; i < end; i++) {
+            entry_res[entries[i].index] = (res) ? res : result[i - start];
+        }
+    }
+
+    free(keys);
+    free(result);
+    free(entries);
+    *results = entry_res;
+    *bytes = total_bytes;
+    *wait = max_wait;
+    return num_entries;
+}
+
+/**
+ * Splits the arguments of a batch command into entries
+ * of a filter name, an op of c, check, s or set, and a key.
+ * @arg args The arguments
+ * @arg args_len The length of the arguments
+ * @arg entries Output, the entries to free
+ * @return The number of entries, or -1 if they are malformed.
+ */
+static int parse_batch_entries(char *args, int args_len, batch_entry **entries) {
+    if (!args) return -1;
+
+    // Every entry has 3 words
+    int num_words = 1;
+    for (int i=0; i < args_len; i++) {
+        if (args[i] == ' ') num_words++;
+    }
+    if (num_words % 3) return -1;
+
+    int num_entries = num_words / 3;
+    batch_entry *e = *entries = malloc(num_entries * sizeof(batch_entry));
+    char *cursor = args, *op;
+    for (int i=0; i < num_entries; i++, e++) {
+        e->filter_name = strsep(&cursor, " ");
+        op = strsep(&cursor, " ");
+        e->key = strsep(&cursor, " ");
+        e->index = i;
+        if (!strcmp(op, "c") || !strcmp(op, "check")) {
+            e->is_set = 0;
+        } else if (!strcmp(op, "s") || !strcmp(op, "set")) {
+            e->is_set = 1;
+        } else {
+            break;
+        }
+        if (!*e->filter_name || !*e->key) break;
+    }
+
+    if (e != *entries + num_entries) {
+        free(*entries);
+        return -1;
+    }
+    return num_entries;
+}
+
+/**
+ * Orders batch entries by filter name, and then
+ * by their place in the command.
+ */
+static int compare_batch_entries(const void *a, const void *b) {
+    const batch_entry *ea = a, *eb = b;
+    int res = strcmp(ea->filter_name, eb->filter_name);
+    if (res) return res;
+    return ea->index - eb->index;
+}
+
+/**
+ * Sends the results of a batch command on one line,
+ * separated by spaces. Each is Yes or No, or else
+ * Missing, ReadOnly or Error if the entry failed.
+ */
+static void send_batch_response(bloom_conn_handler *handle, int *results, int num_entries) {
+    char *out = malloc(num_entries * (READ_ONLY_RESP_LEN + 1));
+    int len = 0;
+    const char *word;
+    int word_len;
+    for (int i=0; i < num_entries; i++) {
+        switch (results[i]) {
+            case 0:
+                word = NO_RESP;
+                word_len = NO_RESP_LEN - 1;
+                break;
+            case 1:
+                word = YES_RESP;
+                word_len = YES_RESP_LEN - 1;
+                break;
+            case -1:
+                word = MISSING_RESP;
+                word_len = MISSING_RESP_LEN;
+                break;
+            case -3:
+                word = READ_ONLY_RESP;
+                word_len = READ_ONLY_RESP_LEN;
+                break;
+            default:
+                word = ERROR_RESP;
+                word_len = ERROR_RESP_LEN;
+                break;
+        }
+        memcpy(out + len, word, word_len);
+        len += word_len;
+        out[len++] = (i + 1 < num_entries) ? ' ' : '\n';
+    }
+    handle_client_resp(handle->conn, out, len);
+    free(out);
+}
+
+
+/**
+ * In shared nothing mode, forwards a check or set to the
+ * worker that owns the filter, unless that is this worker.
+ * When NUMA aware, it is forwarded if the owner is on another
+ * node, so it runs on the node holding the filter. With group
+ * commit, a set is instead deferred until the end of the event
+ * loop pass, to be applied with the other sets to the same filter.
+ * @return 1 if the command was forwarded or deferred.
+ */
+static int forward_or_defer(bloom_conn_handler *handle, char *filter_name, char *keys, int keys_len, int split,
+        int(*filtmgr_func)(bloom_filtmgr *, char*, char **, int, char*)) {
+    int is_set = (filtmgr_func == filtmgr_set_keys);
+    int worker = client_worker(handle->conn), owner = worker;
+    if (handle->config->worker_threads > 1 &&
+            (handle->config->shared_nothing || handle->config->numa_aware)) {
+        owner = filter_owner(filter_name, handle->config->worker_threads);
+        if (!handle->config->shared_nothing && numa_worker_node(owner) == numa_worker_node(worker))
+            owner = worker;
+    }
+    int forward = (owner != worker);
+    if (!forward && !(is_set && handle->config->group_commit)) return 0;
+
+    owned_cmd *cmd = owned_cmd_new(filter_name, keys, keys_len, split);
+    cmd->is_set = is_set;
+    if (forward)
+        forward_owned_cmd(handle->conn, owner, cmd);
+    else
+        defer_owned_cmd(handle->conn, cmd);
+    return 1;
+}
+
+/**
+ * Invoked by the networking layer to execute commands that
+ * were forwarded by other workers or deferred by its own
+ * clients. Sets to the same filter are grouped, and each group
+ * is applied under a single lock. Each command is marked done.
+ * Does not provide a connection object as part of the handle.
+ * @arg handle The connection related information
+ * @arg cmds The commands to execute, linked by next
+ */
+void execute_owned_cmds(bloom_conn_handler *handle, owned_cmd *cmds) {
+    // Each client has at most one command waiting, so they can
+    // be executed in any order. Sort so that the sets to each
+    // filter are adjacent.
+    int num_cmds = 0;
+    for (owned_cmd *cmd = cmds; cmd; cmd = cmd->next) num_cmds++;
+    owned_cmd **sorted = malloc(num_cmds * sizeof(owned_cmd*));
+    num_cmds = 0;
+    for (owned_cmd *cmd = cmds; cmd; cmd = cmd->next) sorted[num_cmds++] = cmd;
+    qsort(sorted, num_cmds, sizeof(owned_cmd*), compare_owned_cmds);
+
+    char *keys[GROUP_COMMIT_SIZE];
+    char result[GROUP_COMMIT_SIZE];
+    owned_cmd *cmd;
+    int start, end, num_keys, res;
+    for (start=0; start < num_cmds; start = end) {
+        // Checks and large sets are executed on their own
+        cmd = sorted[start];
+        if (!can_group_cmd(cmd)) {
+            execute_owned_cmd(handle, cmd);
+            cmd->done = 1;
+            end = start + 1;
+            continue;
+        }
+
+        // Gather the keys of the following sets to the same filter
+        num_keys = 0;
+        for (end=start; end < num_cmds; end++) {
+            if (!can_group_cmd(sorted[end])) break;
+            if (strcmp(sorted[end]->filter_name, cmd->filter_name)) break;
+            if (num_keys + sorted[end]->num_keys > GROUP_COMMIT_SIZE) break;
+            memcpy(keys + num_keys, sorted[end]->keys, sorted[end]->num_keys * sizeof(char*));
+            num_keys += sorted[end]->num_keys;
+        }
+        res = filtmgr_set_keys(handle->mgr, cmd->filter_name, keys, num_keys, result);
+
+        // Hand back the results of each command
+        num_keys = 0;
+        for (int i=start; i < end; i++) {
+            cmd = sorted[i];
+            cmd->res = res;
+            if (!res) {
+                memcpy(cmd->result, result + num_keys, cmd->num_keys);
+                cmd->num_done = cmd->num_keys;
+            }
+            num_keys += cmd->num_keys;
+            cmd->done = 1;
+        }
+    }
+    free(sorted);
+}
+
+/**
+ * Executes a single owned command, in the same batches as
+ * the multi commands, or large batches for large commands.
+ * Very large checks are split across the work pool.
+ */
+static void execute_owned_cmd(bloom_conn_handler *handle, owned_cmd *cmd) {
+    if (handle->pool && !cmd->is_set && cmd->num_keys >= PARALLEL_MIN_KEYS) {
+        execute_parallel_check(handle, cmd);
+        return;
+    }
+
+    int(*filtmgr_func)(bloom_filtmgr *, char*, char **, int, char*) =
+        (cmd->is_set) ? filtmgr_set_keys : filtmgr_check_keys;
+
+    // Stop at the first error
+    int num, batch = (cmd->num_keys >= LARGE_OP_SIZE) ? LARGE_OP_SIZE : MULTI_OP_SIZE;
+    for (int i=0; i < cmd->num_keys; i += num) {
+        num = cmd->num_keys - i;
+        if (num > batch) num = batch;
+        cmd->res = filtmgr_func(handle->mgr, cmd->filter_name, cmd->keys + i, num, cmd->result + i);
+        if (cmd->res) break;
+        cmd->num_done += num;
+    }
+}
+
+/**
+ * Checks the keys of a command in parallel on the work pool.
+ * The pool threads do not checkpoint with the filter manager,
+ * but the filters they use cannot be vacuumed while we wait.
+ */
+static void execute_parallel_check(bloom_conn_handler *handle, owned_cmd *cmd) {
+    int num_tasks = (cmd->num_keys + PARALLEL_TASK_KEYS - 1) / PARALLEL_TASK_KEYS;
+    parallel_check check = {handle->mgr, cmd, NULL, NULL};
+    check.res = calloc(num_tasks, sizeof(int));
+    check.num_done = calloc(num_tasks, sizeof(int));
+    workpool_run(handle->pool, num_tasks, parallel_check_task, &check);
+
+    // Keys are done up to the first error
+    for (int i=0; i < num_tasks; i++) {
+        cmd->num_done += check.num_done[i];
+        if (check.res[i]) {
+            cmd->res = check.res[i];
+            break;
+        }
+    }
+    free(check.res);
+    free(check.num_done);
+}
+
+/**
+ * Checks the keys of one task of a parallel check,
+ * as a single large batch.
+ */
+static void parallel_check_task(void *arg, int task) {
+    parallel_check *check = arg;
+    owned_cmd *cmd = check->cmd;
+    int start = task * PARALLEL_TASK_KEYS;
+    int num = cmd->num_keys - start;
+    if (num > PARALLEL_TASK_KEYS) num = PARALLEL_TASK_KEYS;
+
+    int res = filtmgr_check_keys(check->mgr, cmd->filter_name, cmd->keys + start, num, cmd->result + start);
+    if (res)
+        check->res[task] = res;
+    else
+        check->num_done[task] = num;
+}
+
+/**
+ * Invoked by the networking layer on the worker serving a
+ * client, to respond once the owner, or the rewrite thread,
+ * has executed a command.
+ * @arg handle The connection related information
+ * @arg cmd The executed command
+ */
+void finish_owned_cmd(bloom_conn_handler *handle, owned_cmd *cmd) {
+    if (cmd->rewrite == REWRITE_SHRINK) {
+        send_shrink_response(handle, cmd->res);
+        return;
+    } else if (cmd->rewrite == REWRITE_COMPACT) {
+        send_compact_response(handle, cmd->res);
+        return;
+    }
+
+    // Respond in batches, as if executed locally
+    int num, res;
+    for (int i=0; i < cmd->num_keys; i += num) {
+        num = cmd->num_keys - i;
+        if (num > MULTI_OP_SIZE) num = MULTI_OP_SIZE;
+        res = (i < cmd->num_done) ? 0 : cmd->res;
+        if (handle_multi_response(handle, res, num, cmd->result + i, i + num == cmd->num_keys))
+            break;
+    }
+}
+
+
 /**
  * Internal command used to handle filter creation.
  */
@@ -273,6 +782,10 @@ static void handle_create_cmd(bloom_conn_handler *handle, char *args, int args_l
             match |= sscanf(param, "capacity=%llu", (unsigned long long*)&config->initial_capacity);
             match |= sscanf(param, "prob=%lf", &config->default_probability);
             match |= sscanf(param, "in_memory=%d", &config->in_memory);
+            match |= sscanf(param, "key_log=%d", &config->key_log);
+            match |= sscanf(param, "stable=%d", &config->stable);
+            match |= sscanf(param, "rate_ops=%llu", (unsigned long long*)&config->rate_ops);
+            match |= sscanf(param, "rate_bytes=%llu", (unsigned long long*)&config->rate_bytes);
 
             // Check if there was no match
             if (!match) {
@@ -290,6 +803,9 @@ static void handle_create_cmd(bloom_conn_handler *handle, char *args, int args_l
         invalid_config |= sane_initial_capacity(config->initial_capacity);
         invalid_config |= sane_default_probability(config->default_probability);
         invalid_config |= sane_in_memory(config->in_memory);
+        invalid_config |= sane_key_log(config->key_log);
+        invalid_config |= sane_stable(config->stable);
+        invalid_config |= sane_rate_limits(config->rate_ops, config->rate_bytes);
 
         // Barf if the configs are bad
         if (invalid_config) {
@@ -378,66 +894,74 @@ static void handle_clear_cmd(bloom_conn_handler *handle, char *args, int args_le
     handle_filt_cmd(handle, args, args_len, filtmgr_clear_filter);
 }
 
+// Writes out the lines of a list that have been buffered
+static void flush_list_output(list_output *out) {
+    if (!out->len) return;
+    char *buffers[] = {out->buf};
+    int sizes[] = {out->len};
+    send_client_response(out->conn, (char**)&buffers, (int*)&sizes, 1);
+    out->len = 0;
+}
+
 // Callback invoked by list command to create an output
 // line for each filter. We hold a filter handle which we
 // can use to get some info about it
-static void list_filter_cb(void *data, char *filter_name, bloom_filter *filter) {
-    char **out = data;
-    int res;
-    res = asprintf(out, "%s %f %llu %llu %llu\n",
-            filter_name,
-            filter->filter_config.default_probability,
-            (unsigned long long)bloomf_byte_size(filter),
-            (unsigned long long)bloomf_capacity(filter),
-            (unsigned long long)bloomf_size(filter));
-    assert(res != -1);
-}
-
-static void handle_list_cmd(bloom_conn_handler *handle, char *args, int args_len) {
-    (void)args_len;
-
-    // List all the filters
-    bloom_filter_list_head *head;
-    int res = filtmgr_list_filters(handle->mgr, args, &head);
-    if (res != 0) {
-        INTERNAL_ERROR();
-        return;
+static int list_filter_cb(void *data, char *filter_name, bloom_filter *filter) {
+    list_output *out = data;
+    int len;
+    for (int retry=0; retry < 2; retry++) {
+        len = snprintf(out->buf + out->len, LIST_CHUNK_SIZE - out->len, "%s %f %llu %llu %llu\n",
+                filter_name,
+                filter->filter_config.default_probability,
+                (unsigned long long)bloomf_byte_size(filter),
+                (unsigned long long)bloomf_capacity(filter),
+                (unsigned long long)bloomf_size(filter));
+        if (out->len + len < LIST_CHUNK_SIZE) break;
+
+        // Send what we have and try again in the empty chunk
+        flush_list_output(out);
     }
+    assert(len < LIST_CHUNK_SIZE);
+    out->len += len;
 
-    // Allocate buffers for the responses
-    int num_out = (head->size+2);
-    char** output_bufs = malloc(num_out * sizeof(char*));
-    int* output_bufs_len = malloc(num_out * sizeof(int));
-
-    // Setup the START/END lines
-    output_bufs[0] = (char*)&START_RESP;
-    output_bufs_len[0] = START_RESP_LEN;
-    output_bufs[head->size+1] = (char*)&END_RESP;
-    output_bufs_len[head->size+1] = END_RESP_LEN;
+    // Stop once we have a full page
+    return (++out->listed == out->limit);
+}
 
-    // Generate the responses
-    char *resp;
-    bloom_filter_list *node = head->head;
-    for (int i=0; i < head->size; i++) {
-        res = filtmgr_filter_cb(handle->mgr, node->filter_name, list_filter_cb, &resp);
-        if (res == 0) {
-            output_bufs[i+1] = resp;
-            output_bufs_len[i+1] = strlen(resp);
-        } else { // Skip this output
-            output_bufs[i+1] = NULL;
-            output_bufs_len[i+1] = 0;
+static void handle_list_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    // Split the prefix from the paging params
+    char *prefix = NULL, *after = NULL;
+    int limit = 0;
+    char *param = args;
+    while (param) {
+        buffer_after_terminator(args, args_len, ' ', &args, &args_len);
+        if (!strncmp(param, "limit=", 6)) {
+            if (sscanf(param, "limit=%d", &limit) != 1 || limit <= 0) {
+                handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+                return;
+            }
+        } else if (!strncmp(param, "after=", 6)) {
+            after = param + 6;
+        } else if (!prefix) {
+            prefix = param;
+        } else {
+            handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+            return;
         }
-        node = node->next;
+        param = args;
     }
 
-    // Write the response
-    send_client_response(handle->conn, output_bufs, output_bufs_len, num_out);
-
-    // Cleanup
-    for (int i=1; i <= head->size; i++) if(output_bufs[i]) free(output_bufs[i]);
-    free(output_bufs);
-    free(output_bufs_len);
-    filtmgr_cleanup_list(head);
+    // Stream the lines out a chunk at a time
+    char buf[LIST_CHUNK_SIZE];
+    list_output out = {handle->conn, buf, 0, limit, 0};
+    memcpy(buf, START_RESP, START_RESP_LEN);
+    out.len = START_RESP_LEN;
+    filtmgr_iter_filters(handle->mgr, prefix, after, list_filter_cb, &out);
+
+    if (out.len + END_RESP_LEN > LIST_CHUNK_SIZE) flush_list_output(&out);
+    memcpy(buf + out.len, END_RESP, END_RESP_LEN);
+    out.len += END_RESP_LEN;
+    flush_list_output(&out);
 }
 
 
@@ -464,22 +988,36 @@ static void info_filter_cb(void *data, char *filter_name, bloom_filter *filter)
 checks %llu\n\
 check_hits %llu\n\
 check_misses %llu\n\
+checksum_errors %llu\n\
 in_memory %d\n\
+numa_node %d\n\
 page_ins %llu\n\
 page_outs %llu\n\
 probability %f\n\
+rate_bytes %llu\n\
+rate_ops %llu\n\
+sealed %d\n\
 sets %llu\n\
 set_hits %llu\n\
 set_misses %llu\n\
 size %llu\n\
-storage %llu\n",
+stable %d\n\
+storage %llu\n\
+throttles %llu\n\
+throttle_msec %llu\n",
     (unsigned long long)capacity, (unsigned long long)checks,
     (unsigned long long)counters->check_hits, (unsigned long long)counters->check_misses,
-    ((bloomf_is_proxied(filter)) ? 0 : 1),
+    (unsigned long long)counters->checksum_errors,
+    ((bloomf_is_proxied(filter)) ? 0 : 1), filter->numa_node,
     (unsigned long long)counters->page_ins, (unsigned long long)counters->page_outs,
     filter->filter_config.default_probability,
+    (unsigned long long)filter->filter_config.rate_bytes,
+    (unsigned long long)filter->filter_config.rate_ops,
+    filter->filter_config.sealed,
     (unsigned long long)sets, (unsigned long long)counters->set_hits,
-    (unsigned long long)counters->set_misses, (unsigned long long)size, (unsigned long long)storage);
+    (unsigned long long)counters->set_misses, (unsigned long long)size,
+    filter->filter_config.stable, (unsigned long long)storage,
+    (unsigned long long)counters->throttles, (unsigned long long)counters->throttle_msec);
     assert(res != -1);
 }
 
@@ -528,6 +1066,54 @@ static void handle_info_cmd(bloom_conn_handler *handle, char *args, int args_len
 }
 
 
+static void handle_stats_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    (void)args_len;
+    if (args) {
+        handle_client_err(handle->conn, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+        return;
+    }
+
+    // Get the counters
+    bloom_conn_stats conns;
+    bloom_log_stats logs;
+    client_stats(&conns);
+    log_stats(&logs);
+
+    // Generate a formatted string output
+    char *output[] = {(char*)&START_RESP, NULL, (char*)&END_RESP};
+    int lens[] = {START_RESP_LEN, 0, END_RESP_LEN};
+    int res = asprintf(&output[1], "connections %llu\n\
+connections_paused %llu\n\
+connection_pauses %llu\n\
+connections_throttled %llu\n\
+connection_throttles %llu\n\
+output_high_watermark %llu\n\
+output_low_watermark %llu\n\
+log_written %llu\n\
+log_dropped %llu\n\
+log_suppressed %llu\n",
+    (unsigned long long)conns.connections,
+    (unsigned long long)conns.paused,
+    (unsigned long long)conns.pauses,
+    (unsigned long long)conns.throttled,
+    (unsigned long long)conns.throttles,
+    (unsigned long long)handle->config->output_high_watermark,
+    (unsigned long long)handle->config->output_low_watermark,
+    (unsigned long long)logs.written,
+    (unsigned long long)logs.dropped,
+    (unsigned long long)logs.suppressed);
+    if (res == -1) {
+        INTERNAL_ERROR();
+        return;
+    }
+    lens[1] = res;
+
+    // Write out the bufs
+    send_client_response(handle->conn, (char**)&output, (int*)&lens, 3);
+    free(output[1]);
+}
+
+
 static void handle_flush_cmd(bloom_conn_handler *handle, char *args, int args_len) {
     // If we have a specfic filter, use filt_cmd
     if (args) {
@@ -559,6 +1145,188 @@ static void handle_flush_cmd(bloom_conn_handler *handle, char *args, int args_le
 }
 
 
+static void handle_compact_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&FILT_NEEDED, FILT_NEEDED_LEN);
+        return;
+    }
+
+    // Scan past the filter name
+    char *key;
+    int key_len;
+    int after = buffer_after_terminator(args, args_len, ' ', &key, &key_len);
+    if (after == 0) {
+        handle_client_err(handle->conn, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+        return;
+    }
+
+    // Build and seal the fuse filter on the rewrite thread,
+    // and answer once it is sealed. The worker is not held up.
+    owned_cmd *cmd = owned_cmd_new(args, "", 0, 0);
+    cmd->rewrite = REWRITE_COMPACT;
+    detach_owned_cmd(handle->conn, cmd);
+    if (queue_rewrite(cmd, return_owned_cmd)) {
+        cmd->res = -2;
+        return_owned_cmd(cmd);
+    }
+}
+
+/**
+ * Answers a compaction once the rewrite thread has run it
+ */
+static void send_compact_response(bloom_conn_handler *handle, int res) {
+    switch (res) {
+        case 0:
+            handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+            break;
+        case -1:
+            handle_client_resp(handle->conn, (char*)FILT_NOT_EXIST, FILT_NOT_EXIST_LEN);
+            break;
+        case -3:
+            handle_client_resp(handle->conn, (char*)FILT_READ_ONLY, FILT_READ_ONLY_LEN);
+            break;
+        case -4:
+            handle_client_resp(handle->conn, (char*)FILT_NO_KEY_LOG, FILT_NO_KEY_LOG_LEN);
+            break;
+        case -5:
+            handle_client_resp(handle->conn, (char*)FILT_CHANGED, FILT_CHANGED_LEN);
+            break;
+        case -6:
+            handle_client_resp(handle->conn, (char*)COMPACT_IN_PROGRESS, COMPACT_IN_PROGRESS_LEN);
+            break;
+        default:
+            INTERNAL_ERROR();
+            break;
+    }
+}
+
+static void handle_shrink_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&FILT_NEEDED, FILT_NEEDED_LEN);
+        return;
+    }
+
+    // Check for a probability after the filter name
+    char *prob_arg;
+    int prob_len;
+    double prob = 0;
+    int after = buffer_after_terminator(args, args_len, ' ', &prob_arg, &prob_len);
+    if (after == 0) {
+        char *end;
+        prob = strtod(prob_arg, &end);
+        if (end == prob_arg || *end != '\0' || sane_default_probability(prob)) {
+            handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+            return;
+        }
+    }
+
+    // Fold the layers on the rewrite thread, and answer once
+    // they are swapped in. The client waits, but not the worker.
+    owned_cmd *cmd = owned_cmd_new(args, "", 0, 0);
+    cmd->rewrite = REWRITE_SHRINK;
+    cmd->prob = prob;
+    detach_owned_cmd(handle->conn, cmd);
+    if (queue_rewrite(cmd, return_owned_cmd)) {
+        cmd->res = -2;
+        return_owned_cmd(cmd);
+    }
+}
+
+/**
+ * Answers a shrink once the rewrite thread has run it
+ */
+static void send_shrink_response(bloom_conn_handler *handle, int res) {
+    switch (res) {
+        case 0:
+            handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+            break;
+        case 1:
+            handle_client_resp(handle->conn, (char*)FILT_NOT_SHRUNK, FILT_NOT_SHRUNK_LEN);
+            break;
+        case -1:
+            handle_client_resp(handle->conn, (char*)FILT_NOT_EXIST, FILT_NOT_EXIST_LEN);
+            break;
+        case -3:
+            handle_client_resp(handle->conn, (char*)FILT_READ_ONLY, FILT_READ_ONLY_LEN);
+            break;
+        case -5:
+            handle_client_resp(handle->conn, (char*)FILT_GREW, FILT_GREW_LEN);
+            break;
+        case -6:
+            handle_client_resp(handle->conn, (char*)REWRITE_IN_PROGRESS, REWRITE_IN_PROGRESS_LEN);
+            break;
+        default:
+            INTERNAL_ERROR();
+            break;
+    }
+}
+
+
+static void handle_limit_cmd(bloom_conn_handler *handle, char *args, int args_len) {
+    // If we have no args, complain.
+    if (!args) {
+        handle_client_err(handle->conn, (char*)&FILT_NEEDED, FILT_NEEDED_LEN);
+        return;
+    }
+
+    // The limits follow the filter name, and are left as
+    // they are unless given
+    char *options;
+    int options_len;
+    if (buffer_after_terminator(args, args_len, ' ', &options, &options_len)) {
+        handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+        return;
+    }
+
+    long long ops = -1, bytes = -1;
+    char *param = options;
+    while (param) {
+        buffer_after_terminator(options, options_len, ' ', &options, &options_len);
+        int match = 0;
+        match |= sscanf(param, "rate_ops=%lld", &ops);
+        match |= sscanf(param, "rate_bytes=%lld", &bytes);
+        if (!match || ops < -1 || bytes < -1) {
+            handle_client_err(handle->conn, (char*)&BAD_ARGS, BAD_ARGS_LEN);
+            return;
+        }
+        param = options;
+    }
+
+    int res = filtmgr_limit_filter(handle->mgr, args, ops, bytes);
+    switch (res) {
+        case 0:
+            handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+            break;
+        case -1:
+            handle_client_resp(handle->conn, (char*)FILT_NOT_EXIST, FILT_NOT_EXIST_LEN);
+            break;
+        default:
+            INTERNAL_ERROR();
+            break;
+    }
+}
+
+
+/**
+ * Takes a command on a filter from the rate limits of the
+ * filter and of the client. The command itself is done, but
+ * a client over either limit has its next commands deferred
+ * until it is back within them.
+ * @arg handle The conn handle
+ * @arg filter_name The name of the filter
+ * @arg ops The number of keys checked or set
+ * @arg bytes The bytes of the keys
+ */
+static void throttle_cmd(bloom_conn_handler *handle, char *filter_name, uint64_t ops, uint64_t bytes) {
+    double now = bucket_clock();
+    double wait;
+    filtmgr_charge(handle->mgr, filter_name, ops, bytes, now, &wait);
+    throttle_client(handle->conn, ops, bytes, now, wait);
+}
+
+
 /**
  * Helper to handle sending the response to the multi commands,
  * either multi or bulk.
@@ -579,6 +1347,9 @@ static int handle_multi_response(bloom_conn_handler *handle, int cmd_res, int nu
             case -1:
                 handle_client_resp(handle->conn, (char*)FILT_NOT_EXIST, FILT_NOT_EXIST_LEN);
                 break;
+            case -3:
+                handle_client_resp(handle->conn, (char*)FILT_READ_ONLY, FILT_READ_ONLY_LEN);
+                break;
             default:
                 INTERNAL_ERROR();
                 break;
@@ -616,105 +1387,44 @@ static int handle_multi_response(bloom_conn_handler *handle, int cmd_res, int nu
 
 
 /**
- * Sends a client response message back. Simple convenience wrapper
- * around handle_client_resp.
+ * Checks if an owned command can be grouped with others.
+ * Only sets small enough for a single multi batch are.
  */
-static inline void handle_client_resp(bloom_conn_info *conn, char* resp_mesg, int resp_len) {
-    char *buffers[] = {resp_mesg};
-    int sizes[] = {resp_len};
-    send_client_response(conn, (char**)&buffers, (int*)&sizes, 1);
+static int can_group_cmd(owned_cmd *cmd) {
+    return cmd->is_set && cmd->num_keys <= MULTI_OP_SIZE;
 }
 
-
 /**
- * Sends a client error message back. Optimizes to use multiple
- * output buffers so we can collapse this into a single write without
- * needing to move our buffers around.
+ * Orders owned commands by filter name, placing the
+ * commands that can be grouped first.
  */
-static void handle_client_err(bloom_conn_info *conn, char* err_msg, int msg_len) {
-    char *buffers[] = {(char*)&CLIENT_ERR, err_msg, (char*)&NEW_LINE};
-    int sizes[] = {CLIENT_ERR_LEN, msg_len, NEW_LINE_LEN};
-    send_client_response(conn, (char**)&buffers, (int*)&sizes, 3);
+static int compare_owned_cmds(const void *a, const void *b) {
+    owned_cmd *cmd_a = *(owned_cmd**)a;
+    owned_cmd *cmd_b = *(owned_cmd**)b;
+    int res = strcmp(cmd_a->filter_name, cmd_b->filter_name);
+    if (res) return res;
+    return can_group_cmd(cmd_b) - can_group_cmd(cmd_a);
 }
 
-
 /**
- * Determines the client command.
- * @arg cmd_buf A command buffer
- * @arg buf_len The length of the buffer
- * @arg arg_buf Output. Sets the start address of the command arguments.
- * @arg arg_len Output. Sets the length of arg_buf.
- * @return The conn_cmd_type enum value.
- * UNKNOWN if it doesn't match anything supported, or a proper command.
+ * Counts the keys in a list of keys separated by spaces.
  */
-static conn_cmd_type determine_client_command(char *cmd_buf, int buf_len, char **arg_buf, int *arg_len) {
-    // Check if we are ending with \r, and remove it.
-    if (cmd_buf[buf_len-2] == '\r') {
-        cmd_buf[buf_len-2] = '\0';
-        buf_len -= 1;
+static int count_keys(char *keys, int keys_len) {
+    int num_keys = 1;
+    for (int i=0; i < keys_len; i++) {
+        if (keys[i] == ' ') num_keys++;
     }
-
-    // Scan for a space. This will setup the arg_buf and arg_len
-    // if we do find the terminator. It will also insert a null terminator
-    // at the space, so we can compare the cmd_buf to the commands.
-    buffer_after_terminator(cmd_buf, buf_len, ' ', arg_buf, arg_len);
-
-    // Search for the command
-    conn_cmd_type type = UNKNOWN;
-    #define CMD_MATCH(name) (strcmp(name, cmd_buf) == 0)
-    if (CMD_MATCH("c") || CMD_MATCH("check")) {
-        type = CHECK;
-    } else if (CMD_MATCH("m") || CMD_MATCH("multi")) {
-        type = CHECK_MULTI;
-    } else if (CMD_MATCH("s") || CMD_MATCH("set")) {
-        type = SET;
-    } else if (CMD_MATCH("b") || CMD_MATCH("bulk")) {
-        type = SET_MULTI;
-    } else if (CMD_MATCH("list")) {
-        type = LIST;
-    } else if (CMD_MATCH("info")) {
-        type = INFO;
-    } else if (CMD_MATCH("create")) {
-        type = CREATE;
-    } else if (CMD_MATCH("drop")) {
-        type = DROP;
-    } else if (CMD_MATCH("close")) {
-        type = CLOSE;
-    } else if (CMD_MATCH("clear")) {
-        type = CLEAR;
-    } else if (CMD_MATCH("flush")) {
-        type = FLUSH;
-    }
-
-    return type;
+    return num_keys;
 }
 
-
 /**
- * Scans the input buffer of a given length up to a terminator.
- * Then sets the start of the buffer after the terminator including
- * the length of the after buffer.
- * @arg buf The input buffer
- * @arg buf_len The length of the input buffer
- * @arg terminator The terminator to scan to. Replaced with the null terminator.
- * @arg after_term Output. Set to the byte after the terminator.
- * @arg after_len Output. Set to the length of the output buffer.
- * @return 0 if terminator found. -1 otherwise.
+ * Checks if a list of keys separated by spaces
+ * has at least min_keys keys.
  */
-static int buffer_after_terminator(char *buf, int buf_len, char terminator, char **after_term, int *after_len) {
-    // Scan for a space
-    char *term_addr = memchr(buf, terminator, buf_len);
-    if (!term_addr) {
-        *after_term = NULL;
-        return -1;
+static int has_many_keys(char *keys, int keys_len, int min_keys) {
+    int num_keys = 1;
+    for (int i=0; i < keys_len && num_keys < min_keys; i++) {
+        if (keys[i] == ' ') num_keys++;
     }
-
-    // Convert the space to a null-seperator
-    *term_addr = '\0';
-
-    // Provide the arg buffer, and arg_len
-    *after_term = term_addr+1;
-    *after_len = buf_len - (term_addr - buf + 1);
-    return 0;
+    return num_keys >= min_keys;
 }
-
@@ -3,6 +3,7 @@
 #include "config.h"
 #include "networking.h"
 #include "filter_manager.h"
+#include "workpool.h"
 
 /**
  * This structure is used to communicate
@@ -13,6 +14,7 @@ typedef struct {
     bloom_config *config;     // Global bloom configuration
     bloom_filtmgr *mgr;       // Filter manager
     bloom_conn_info *conn;    // Opaque handle into the networking stack
+    bloom_workpool *pool;     // Pool for large commands, NULL if disabled
 } bloom_conn_handler;
 
 /**
@@ -39,4 +41,42 @@ int handle_client_connect(bloom_conn_handler *handle);
  */
 void periodic_update(bloom_conn_handler *handle);
 
+/**
+ * Invoked by the networking layer to execute commands that
+ * were forwarded by other workers or deferred by its own
+ * clients. Sets to the same filter are grouped, and each group
+ * is applied under a single lock. Each command is marked done.
+ * Does not provide a connection object as part of the handle.
+ * @arg handle The connection related information
+ * @arg cmds The commands to execute, linked by next
+ */
+void execute_owned_cmds(bloom_conn_handler *handle, owned_cmd *cmds);
+
+/**
+ * Executes the checks and sets of a batch command, which may
+ * span many filters. The keys of each filter are done in runs
+ * of up to LARGE_OP_SIZE, in the order they were sent.
+ * Does not use the connection object of the handle.
+ * @arg handle The connection related information
+ * @arg args The arguments of the command, split in place
+ * @arg args_len The length of the arguments
+ * @arg now The current time from bucket_clock
+ * @arg results Output, the result of each entry in the order
+ * sent: 1 or 0, or negative if its filter failed. Must be freed.
+ * @arg bytes Output, the bytes of all the keys
+ * @arg wait Output, the longest wait of the filter limits
+ * @return The number of entries, or -1 if they are malformed.
+ */
+int execute_batch_cmd(bloom_conn_handler *handle, char *args, int args_len, double now,
+        int **results, uint64_t *bytes, double *wait);
+
+/**
+ * Invoked by the networking layer on the worker serving a
+ * client, to respond once the owner, or the rewrite thread,
+ * has executed a command.
+ * @arg handle The connection related information
+ * @arg cmd The executed command
+ */
+void finish_owned_cmd(bloom_conn_handler *handle, owned_cmd *cmd);
+
 #endif
@@ -1,14 +1,24 @@
+#include <math.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <dirent.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <signal.h>
 #include <pthread.h>
 #include <sys/time.h>
+#include <time.h>
 #include <assert.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <linux/magic.h>
+#endif
 #include "filter.h"
+#include "numa.h"
+#include "logger.h"
 #include "type_compat.h"
 
 /*
@@ -21,21 +31,61 @@ static const char* FILTER_FOLDER_NAME = "bloomd.%s";
  */
 static const char* DATA_FILE_NAME = "data.%03d.mmap";
 
+/**
+ * Format for the snapshot file names of in-memory filters,
+ * and the temporary files they are written to first.
+ */
+static const char* SNAPSHOT_FILE_NAME = "snapshot.%03d.snap";
+static const char* SNAPSHOT_TMP_NAME = "snapshot.%03d.tmp";
+
+/**
+ * Format for the temporary files that folded layers
+ * are written to by a shrink.
+ */
+static const char* SHRINK_TMP_NAME = "shrink.%03d.tmp";
+
 /*
  * Generates the config file name
  */
 static const char* CONFIG_FILENAME = "config.ini";
 
+/**
+ * Names of the key log, and of the fuse filter of a
+ * sealed filter and the temporary file it is built in.
+ */
+static const char* KEY_LOG_FILENAME = "keys.log";
+static const char* FUSE_FILENAME = "fuse.data";
+static const char* FUSE_TMP_FILENAME = "fuse.tmp";
+
 /*
  * Static delarations
  */
 static int thread_safe_fault(bloom_filter *f);
+static int log_key(bloom_filter *f, char *key);
 static int discover_existing_filters(bloom_filter *f);
+static int load_snapshot(bloom_filter *f);
+static int load_fuse(bloom_filter *f);
+static int load_stable(bloom_filter *f);
+static uint64_t get_size(char* filename);
+static int read_key_hashes(FILE *keys, uint64_t len, uint64_t **hashes, uint64_t *count);
+static void delete_files(bloom_filter *f, int (*select)(CONST_DIRENT_T *));
+static char* snapshot_path(bloom_filter *f, const char *format, int idx);
+static int write_snapshot_layer(char *path, unsigned char *buf, uint64_t len);
 static int create_sbf(bloom_filter *f, int num, bloom_bloomfilter **filters);
 static int bloomf_sbf_callback(void* in, uint64_t bytes, bloom_bitmap *out);
+static uint64_t bloomf_grow_callback(void* in, bloom_sbf *sbf);
+static void record_growth(bloom_filter *f, uint64_t size, bloom_sbf_history *history, int update);
+static int memfd_bitmap(bloom_filter *f, uint64_t bytes, bloom_bitmap *out);
+static int is_memory_file(int fd);
+static int new_bitmap(bloom_filter *filt, uint64_t bytes, bloom_bitmap *out);
+static void place_bitmap(bloom_filter *f, bloom_bitmap *map);
 static int timediff_msec(struct timeval *t1, struct timeval *t2);
+static double layer_probability(bloom_filter *f, double prob, int num, int idx);
 
 static int filter_out_special(CONST_DIRENT_T *d);
+static int filter_data_files(CONST_DIRENT_T *d);
+static int filter_checksum_files(CONST_DIRENT_T *d);
+static int filter_snapshot_files(CONST_DIRENT_T *d);
 
 /**
  * Initializes a bloom filter wrapper.
@@ -61,6 +111,11 @@ int init_bloom_filter(bloom_config *config, char *filter_name, int discover, blo
     f->filter_config.scale_size = config->scale_size;
     f->filter_config.probability_reduction = config->probability_reduction;
     f->filter_config.in_memory = config->in_memory;
+    f->filter_config.key_log = config->key_log;
+    f->filter_config.stable = config->stable;
+    f->filter_config.rate_ops = config->rate_ops;
+    f->filter_config.rate_bytes = config->rate_bytes;
+    f->filter_config.growth_horizon = config->growth_horizon;
 
     // Get the folder name
     char *folder_name = NULL;
@@ -79,7 +134,7 @@ int init_bloom_filter(bloom_config *config, char *filter_name, int discover, blo
     // Try to create the folder path
     res = mkdir(f->full_path, 0755);
     if (res && errno != EEXIST) {
-        syslog(LOG_ERR, "Failed to create filter directory '%s'. Err: %d [%d]", f->full_path, res, errno);
+        bloom_log(LOG_ERR, "Failed to create filter directory '%s'. Err: %d [%d]", f->full_path, res, errno);
         return res;
     }
 
@@ -88,16 +143,33 @@ int init_bloom_filter(bloom_config *config, char *filter_name, int discover, blo
     res = filter_config_from_filename(config_name, &f->filter_config);
     free(config_name);
     if (res && res != -ENOENT) {
-        syslog(LOG_ERR, "Failed to read filter '%s' configuration. Err: %d [%d]", f->filter_name, res, errno);
+        bloom_log(LOG_ERR, "Failed to read filter '%s' configuration. Err: %d [%d]", f->filter_name, res, errno);
         return res;
     }
 
+    // Place the bitmaps on the node of the owning worker. Pages
+    // mapped shared from a data file live in the page cache, which
+    // mbind does not move, so those filters are not placed.
+    f->numa_node = -1;
+    if (config->numa_aware && (f->filter_config.in_memory || !config->use_mmap)) {
+        f->numa_node = numa_filter_node(f->filter_name, config->worker_threads);
+    }
+
+    // Limit the rates the filter was created with
+    bucket_init(&f->ops_bucket, f->filter_config.rate_ops);
+    bucket_init(&f->bytes_bucket, f->filter_config.rate_bytes);
+
+    // Continue the insert history from the last flush. The
+    // time it was unloaded counts, since no keys were added.
+    f->growth_size = f->filter_config.size;
+    if (!f->filter_config.growth_time) f->filter_config.growth_time = time(NULL);
+
     // Discover the existing filters if we need to
     res = 0;
     if (discover) {
         res = thread_safe_fault(f);
         if (res) {
-            syslog(LOG_ERR, "Failed to fault in the filter '%s'. Err: %d", f->filter_name, res);
+            bloom_log(LOG_ERR, "Failed to fault in the filter '%s'. Err: %d", f->filter_name, res);
         }
     }
 
@@ -143,7 +215,119 @@ filter_counters* bloomf_counters(bloom_filter *filter) {
  * @return 0 if in-memory, 1 if proxied.
  */
 int bloomf_is_proxied(bloom_filter *filter) {
-    return !(filter->sbf);
+    return !(filter->sbf || filter->fuse || filter->stable);
+}
+
+/**
+ * Takes the keys and bytes of a command from the rate
+ * limits of the filter. Commands are not refused, but
+ * the client should wait before sending more.
+ * @notes Thread safe.
+ * @arg filter The filter
+ * @arg ops The number of keys checked or set
+ * @arg bytes The bytes of the keys
+ * @arg now The current time from bucket_clock
+ * @return The seconds the client should wait,
+ * 0 if the filter is within its limits.
+ */
+double bloomf_charge(bloom_filter *filter, uint64_t ops, uint64_t bytes, double now) {
+    double wait = bucket_take(&filter->ops_bucket, ops, now);
+    double bytes_wait = bucket_take(&filter->bytes_bucket, bytes, now);
+    if (bytes_wait > wait) wait = bytes_wait;
+    if (wait > 0) {
+        LOCK_BLOOM_SPIN(&filter->counter_lock);
+        filter->counters.throttles += 1;
+        filter->counters.throttle_msec += wait * 1000;
+        UNLOCK_BLOOM_SPIN(&filter->counter_lock);
+    }
+    return wait;
+}
+
+/**
+ * Changes the rate limits of the filter, and
+ * persists them with the filter configuration.
+ * @arg filter The filter
+ * @arg ops The most keys each second, 0 for no limit
+ * @arg bytes The most bytes each second, 0 for no limit
+ * @return 0 on success.
+ */
+int bloomf_set_limits(bloom_filter *filter, uint64_t ops, uint64_t bytes) {
+    filter->filter_config.rate_ops = ops;
+    filter->filter_config.rate_bytes = bytes;
+    bucket_set_rate(&filter->ops_bucket, ops);
+    bucket_set_rate(&filter->bytes_bucket, bytes);
+
+    char *config_name = join_path(filter->full_path, (char*)CONFIG_FILENAME);
+    int res = update_filename_from_filter_config(config_name, &filter->filter_config);
+    free(config_name);
+    if (res) {
+        bloom_log(LOG_ERR, "Failed to write filter '%s' configuration. Err: %d.",
+                filter->filter_name, res);
+    }
+    return res;
+}
+
+/**
+ * Checks part of the data files of a filter against their
+ * checksums. Only proxied filters are checked, since a loaded
+ * filter was checked when it was faulted in. Corrupt pages
+ * are logged and counted in the checksum_errors counter.
+ * @notes Thread safe.
+ * @arg filter The filter
+ * @arg page The page to start at, counting over all the data
+ * files in order. Advanced past the pages checked.
+ * @arg max_pages The most pages to check
+ * @return The number of pages checked, 0 once there are no
+ * more, or if the filter is loaded.
+ */
+uint64_t bloomf_scrub(bloom_filter *filter, uint64_t *page, uint64_t max_pages) {
+    // Only the PERSISTENT data files have checksums
+    if (filter->filter_config.in_memory || filter->filter_config.sealed ||
+            filter->config->use_mmap) return 0;
+
+    // Hold the lock so the filter is not faulted in and
+    // flushed while we read the files
+    pthread_mutex_lock(&filter->sbf_lock);
+    uint64_t checked = 0;
+    struct dirent **namelist = NULL;
+    int num = 0;
+    if (bloomf_is_proxied(filter)) {
+        num = scandir(filter->full_path, &namelist, filter_data_files, alphasort);
+    }
+
+    // Find the file holding the page. Files without
+    // usable checksums are skipped.
+    uint64_t first = 0, pages, bad = 0;
+    for (int i=0; i < num && !checked; i++) {
+        char *path = join_path(filter->full_path, namelist[i]->d_name);
+        pages = (get_size(path) + 4095) / 4096;
+        if (*page < first + pages) {
+            int64_t res = bitmap_verify_file(path, *page - first, max_pages, &bad);
+            if (res > 0) {
+                checked = res;
+                *page += res;
+            } else {
+                *page = first + pages;
+            }
+            if (bad) {
+                bloom_log(LOG_ERR, "Scrub found %llu pages of %s that do not match their checksums.",
+                        (unsigned long long)bad, path);
+            }
+        }
+        first += pages;
+        free(path);
+    }
+    pthread_mutex_unlock(&filter->sbf_lock);
+
+    for (int i=0; i < num; i++) free(namelist[i]);
+    if (namelist) free(namelist);
+
+    if (bad) {
+        LOCK_BLOOM_SPIN(&filter->counter_lock);
+        filter->counters.checksum_errors += bad;
+        UNLOCK_BLOOM_SPIN(&filter->counter_lock);
+    }
+    return checked;
 }
 
 /**
@@ -154,14 +338,20 @@ int bloomf_is_proxied(bloom_filter *filter) {
  */
 int bloomf_flush(bloom_filter *filter) {
     // Only do things if we are non-proxied
-    if (filter->sbf) {
+    if (filter->sbf || filter->stable) {
         // Time how long this takes
         struct timeval start, end;
         gettimeofday(&start, NULL);
 
-        // If our size has not changed, there is no need to flush
+        // If our size has not changed, there is no need to flush.
+        // Adds decay a stable filter without changing the size.
         uint64_t new_size = bloomf_size(filter);
-        if (new_size == filter->filter_config.size && filter->filter_config.bytes != 0) {
+        if (filter->sbf && filter->filter_config.growth_horizon > 0) {
+            record_growth(filter, new_size, NULL, 1);
+        }
+        int changed = new_size != filter->filter_config.size;
+        if (filter->stable && bloomf_dirty_bytes(filter)) changed = 1;
+        if (!changed && filter->filter_config.bytes != 0) {
             return 0;
         }
 
@@ -175,19 +365,23 @@ int bloomf_flush(bloom_filter *filter) {
         int res = update_filename_from_filter_config(config_name, &filter->filter_config);
         free(config_name);
         if (res) {
-            syslog(LOG_ERR, "Failed to write filter '%s' configuration. Err: %d.",
+            bloom_log(LOG_ERR, "Failed to write filter '%s' configuration. Err: %d.",
                     filter->filter_name, res);
         }
 
         // Flush the filter
         res = 0;
-        if (!filter->filter_config.in_memory) {
+        if (filter->filter_config.in_memory) {
+            res = 0;
+        } else if (filter->stable) {
+            res = stable_flush((bloom_stable*)filter->stable);
+        } else {
             res = sbf_flush((bloom_sbf*)filter->sbf);
         }
 
         // Compute the elapsed time
         gettimeofday(&end, NULL);
-        syslog(LOG_INFO, "Flushed filter '%s'. Total time: %d msec.",
+        bloom_log(LOG_INFO, "Flushed filter '%s'. Total time: %d msec.",
                 filter->filter_name, timediff_msec(&start, &end));
         return res;
     }
@@ -203,6 +397,9 @@ int bloomf_close(bloom_filter *filter) {
     // Acquire lock
     pthread_mutex_lock(&filter->sbf_lock);
 
+    // The logged keys go to disk before their bits
+    bloomf_flush_key_log(filter);
+
     // Only act if we are non-proxied
     if (filter->sbf) {
         bloomf_flush(filter);
@@ -215,6 +412,34 @@ int bloomf_close(bloom_filter *filter) {
 
         filter->counters.page_outs += 1;
     }
+    if (filter->stable) {
+        bloomf_flush(filter);
+
+        bloom_stable *stable = (bloom_stable*)filter->stable;
+        filter->stable = NULL;
+
+        bloom_bitmap *map = stable->map;
+        stable_close(stable);
+        free(map);
+        free(stable);
+
+        filter->counters.page_outs += 1;
+    }
+    if (filter->fuse) {
+        bloom_fuse *fuse = (bloom_fuse*)filter->fuse;
+        filter->fuse = NULL;
+
+        bloom_bitmap *map = fuse->map;
+        fuse_close(fuse);
+        free(map);
+        free(fuse);
+
+        filter->counters.page_outs += 1;
+    }
+    if (filter->key_log) {
+        fclose(filter->key_log);
+        filter->key_log = NULL;
+    }
 
     // Release lock
     pthread_mutex_unlock(&filter->sbf_lock);
@@ -237,14 +462,14 @@ int bloomf_delete(bloom_filter *filter) {
 
     // Filter only data dirs, in sorted order
     num = scandir(filter->full_path, &namelist, filter_out_special, NULL);
-    syslog(LOG_INFO, "Deleting %d files for filter %s.", num, filter->filter_name);
+    bloom_log(LOG_INFO, "Deleting %d files for filter %s.", num, filter->filter_name);
 
     // Free the memory associated with scandir
     for (int i=0; i < num; i++) {
         char *file_path = join_path(filter->full_path, namelist[i]->d_name);
-        syslog(LOG_INFO, "Deleting: %s.", file_path);
+        bloom_log(LOG_INFO, "Deleting: %s.", file_path);
         if (unlink(file_path)) {
-            syslog(LOG_ERR, "Failed to delete: %s. %s", file_path, strerror(errno));
+            bloom_log(LOG_ERR, "Failed to delete: %s. %s", file_path, strerror(errno));
         }
         free(file_path);
     }
@@ -258,7 +483,7 @@ int bloomf_delete(bloom_filter *filter) {
 
     // Delete the directory
     if (rmdir(filter->full_path)) {
-        syslog(LOG_ERR, "Failed to delete: %s. %s", filter->full_path, strerror(errno));
+        bloom_log(LOG_ERR, "Failed to delete: %s. %s", filter->full_path, strerror(errno));
     }
 
     return 0;
@@ -272,12 +497,18 @@ int bloomf_delete(bloom_filter *filter) {
  * @return 0 if not contained, 1 if contained.
  */
 int bloomf_contains(bloom_filter *filter, char *key) {
-    if (!filter->sbf) {
+    if (bloomf_is_proxied(filter)) {
         if (thread_safe_fault(filter) != 0) return -1;
     }
 
-    // Check the SBF
-    int res = sbf_contains((bloom_sbf*)filter->sbf, key);
+    // Check the SBF, or the fuse filter once sealed
+    int res;
+    if (filter->fuse)
+        res = fuse_contains((bloom_fuse*)filter->fuse, key);
+    else if (filter->stable)
+        res = stable_contains((bloom_stable*)filter->stable, key);
+    else
+        res = sbf_contains((bloom_sbf*)filter->sbf, key);
 
     // Safely update the counters
     LOCK_BLOOM_SPIN(&filter->counter_lock);
@@ -290,6 +521,46 @@ int bloomf_contains(bloom_filter *filter, char *key) {
     return res;
 }
 
+/**
+ * Checks if the filter contains many keys. Large batches
+ * have their probes sorted by location, and the counters
+ * are updated once.
+ * @note Thread safe, as long as bloomf_add is not invoked.
+ * @arg filter The filter to check
+ * @arg keys The keys to check
+ * @arg num_keys The number of keys
+ * @arg result Set to 1 for each key contained, 0 if not
+ * @return 0 on success, -1 on error.
+ */
+int bloomf_contains_keys(bloom_filter *filter, char **keys, int num_keys, char *result) {
+    if (bloomf_is_proxied(filter)) {
+        if (thread_safe_fault(filter) != 0) return -1;
+    }
+
+    // Only the SBF checks in batches
+    int res = 0;
+    if (filter->fuse) {
+        for (int i=0; i < num_keys; i++)
+            result[i] = fuse_contains((bloom_fuse*)filter->fuse, keys[i]);
+    } else if (filter->stable) {
+        for (int i=0; i < num_keys; i++)
+            result[i] = stable_contains((bloom_stable*)filter->stable, keys[i]);
+    } else
+        res = sbf_contains_keys((bloom_sbf*)filter->sbf, keys, num_keys, result);
+    if (res < 0) return -1;
+
+    // Safely update the counters
+    uint64_t hits = 0;
+    for (int i=0; i < num_keys; i++) {
+        hits += result[i];
+    }
+    LOCK_BLOOM_SPIN(&filter->counter_lock);
+    filter->counters.check_hits += hits;
+    filter->counters.check_misses += num_keys - hits;
+    UNLOCK_BLOOM_SPIN(&filter->counter_lock);
+    return 0;
+}
+
 /**
  * Adds a key to the given filter
  * @arg filter The filter to add to
@@ -297,12 +568,21 @@ int bloomf_contains(bloom_filter *filter, char *key) {
  * @return 0 if not added, 1 if added.
  */
 int bloomf_add(bloom_filter *filter, char *key) {
-    if (!filter->sbf) {
+    if (filter->filter_config.sealed) return -2;
+    if (bloomf_is_proxied(filter)) {
         if (thread_safe_fault(filter) != 0) return -1;
     }
 
+    // Log the key, even if it may already be present, since
+    // it could be a false positive.
+    if (log_key(filter, key)) return -1;
+
     // Add the SBF
-    int res = sbf_add((bloom_sbf*)filter->sbf, key);
+    int res;
+    if (filter->stable)
+        res = stable_add((bloom_stable*)filter->stable, key);
+    else
+        res = sbf_add((bloom_sbf*)filter->sbf, key);
 
     // Safely update the counters
     LOCK_BLOOM_SPIN(&filter->counter_lock);
@@ -315,6 +595,580 @@ int bloomf_add(bloom_filter *filter, char *key) {
     return res;
 }
 
+/**
+ * Adds many keys to the given filter. This hashes all the
+ * keys before adding any, and updates the counters once.
+ * @arg filter The filter to add to
+ * @arg keys The keys to add
+ * @arg num_keys The number of keys
+ * @arg result Set to 1 for each key added, 0 if not added
+ * @return 0 on success, -1 on error, -2 if the filter is sealed.
+ * On error, the results are set for the keys before the failure.
+ */
+int bloomf_add_keys(bloom_filter *filter, char **keys, int num_keys, char *result) {
+    if (filter->filter_config.sealed) return -2;
+    if (bloomf_is_proxied(filter)) {
+        if (thread_safe_fault(filter) != 0) return -1;
+    }
+    for (int i=0; i < num_keys; i++) {
+        if (log_key(filter, keys[i])) return -1;
+    }
+
+    // Stable filters decay on every add, so go one at a time
+    int res = 0;
+    if (filter->stable) {
+        for (int i=0; i < num_keys && res >= 0; i++) {
+            res = stable_add((bloom_stable*)filter->stable, keys[i]);
+            result[i] = res;
+        }
+        if (res > 0) res = 0;
+    } else
+        res = sbf_add_keys((bloom_sbf*)filter->sbf, keys, num_keys, result);
+
+    // Safely update the counters
+    uint64_t added = 0;
+    for (int i=0; i < num_keys && res == 0; i++) {
+        added += result[i];
+    }
+    if (res == 0) {
+        LOCK_BLOOM_SPIN(&filter->counter_lock);
+        filter->counters.set_hits += added;
+        filter->counters.set_misses += num_keys - added;
+        UNLOCK_BLOOM_SPIN(&filter->counter_lock);
+    }
+    return (res < 0) ? -1 : 0;
+}
+
+/**
+ * Writes out any buffered keys to the key log, and syncs
+ * it to disk. This is done before the bitmaps are flushed,
+ * so that no bit on disk is missing its key in the log.
+ * @note The caller must prevent concurrent bloomf_add
+ * and bloomf_close calls.
+ * @arg filter The filter
+ * @return 0 on success.
+ */
+int bloomf_flush_key_log(bloom_filter *filter) {
+    if (!filter->key_log) return 0;
+    if (fflush(filter->key_log) || fsync(fileno(filter->key_log))) {
+        bloom_log(LOG_ERR, "Failed to sync key log for filter '%s'. %s",
+                filter->filter_name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Gets the length of the key log, which marks the keys
+ * that a compaction will include.
+ * @arg filter The filter
+ * @arg len Output, the length in bytes
+ * @return 0 on success, -1 if the filter has no key log
+ * or it could not be synced, -2 if the filter is sealed.
+ */
+int bloomf_key_log_size(bloom_filter *filter, uint64_t *len) {
+    if (filter->filter_config.sealed) return -2;
+    if (!filter->filter_config.key_log || filter->filter_config.stable) return -1;
+
+    // Only whole keys are on disk after a flush, and the
+    // length can only be trusted for sealing once synced
+    if (bloomf_flush_key_log(filter)) return -1;
+    char *log_path = join_path(filter->full_path, (char*)KEY_LOG_FILENAME);
+    *len = get_size(log_path);
+    free(log_path);
+    return 0;
+}
+
+/**
+ * Builds a fuse filter from a list of newline separated keys,
+ * and writes it to a temporary file in the filter directory.
+ * This can be slow, and does not access the filter data, so it
+ * may run concurrently with checks and sets.
+ * @arg filter The filter
+ * @arg keys The keys to read, or NULL to read the key log
+ * @arg len The number of bytes of keys to read, or 0 to read
+ * until the end of the keys
+ * @return 0 on success.
+ */
+int bloomf_compact_build(bloom_filter *filter, FILE *keys, uint64_t len) {
+    // Time how long this takes
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    // Read the key log if no keys are given. It
+    // does not exist until the first key is set.
+    FILE *log = NULL;
+    if (!keys) {
+        char *log_path = join_path(filter->full_path, (char*)KEY_LOG_FILENAME);
+        log = fopen(log_path, "r");
+        if (!log && errno != ENOENT) {
+            bloom_log(LOG_ERR, "Failed to open key log: %s. %s", log_path, strerror(errno));
+            free(log_path);
+            return -1;
+        }
+        free(log_path);
+        keys = log;
+    }
+
+    // Hash all the keys, a key may be set many times
+    uint64_t *hashes = NULL;
+    uint64_t count = 0;
+    int res = 0;
+    if (keys) res = read_key_hashes(keys, len, &hashes, &count);
+    if (log) fclose(log);
+    if (res) {
+        bloom_log(LOG_ERR, "Failed to read keys for filter '%s'.", filter->filter_name);
+        free(hashes);
+        return -1;
+    }
+    count = fuse_unique_hashes(hashes, count);
+
+    // Build in memory, then write it out
+    int bits = fuse_bits_for_prob(filter->filter_config.default_probability);
+    bloom_bitmap map;
+    res = bitmap_from_file(-1, fuse_bytes_for_count(count, bits), ANONYMOUS, &map);
+    if (res) {
+        bloom_log(LOG_ERR, "Failed to allocate fuse filter for filter '%s'. Keys: %llu",
+                filter->filter_name, (unsigned long long)count);
+        free(hashes);
+        return -1;
+    }
+    place_bitmap(filter, &map);
+
+    bloom_fuse fuse;
+    res = fuse_build(&map, hashes, count, bits, &fuse);
+    free(hashes);
+    if (!res) {
+        char *tmp_path = join_path(filter->full_path, (char*)FUSE_TMP_FILENAME);
+        res = write_snapshot_layer(tmp_path, map.mmap, map.size);
+        if (res) {
+            bloom_log(LOG_ERR, "Failed to write fuse filter: %s. %s", tmp_path, strerror(errno));
+        }
+        free(tmp_path);
+    }
+    bitmap_close(&map);
+
+    // Compute the elapsed time
+    gettimeofday(&end, NULL);
+    bloom_log(LOG_INFO, "Built fuse filter for '%s'. Keys: %llu. Total time: %d msec.",
+            filter->filter_name, (unsigned long long)count, timediff_msec(&start, &end));
+    return (res) ? -1 : 0;
+}
+
+/**
+ * Replaces the filter data with the fuse filter written by
+ * bloomf_compact_build. The filter is read-only from then on.
+ * @note The caller must prevent concurrent use of the filter.
+ * @arg filter The filter
+ * @arg log_len The length of the key log when the keys were
+ * read, from bloomf_key_log_size. Ignored without a key log.
+ * @return 0 on success, -2 if the filter is sealed,
+ * -3 if keys were logged since log_len, -1 on error.
+ */
+int bloomf_compact_seal(bloom_filter *filter, uint64_t log_len) {
+    int res;
+    if (filter->filter_config.sealed) return -2;
+    if (filter->filter_config.key_log) {
+        uint64_t len;
+        res = bloomf_key_log_size(filter, &len);
+        if (res) return res;
+        if (len != log_len) return -3;
+    }
+
+    // Move the fuse filter into place. It is ignored
+    // until the config marks the filter as sealed.
+    char *tmp_path = join_path(filter->full_path, (char*)FUSE_TMP_FILENAME);
+    char *fuse_path = join_path(filter->full_path, (char*)FUSE_FILENAME);
+    res = rename(tmp_path, fuse_path);
+    if (res) {
+        bloom_log(LOG_ERR, "Failed to rename fuse filter: %s. %s", fuse_path, strerror(errno));
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    if (res) {
+        free(fuse_path);
+        return -1;
+    }
+
+    // Acquire lock
+    pthread_mutex_lock(&filter->sbf_lock);
+
+    // Load the fuse filter before dropping the SBF,
+    // since an in-memory SBF cannot be recovered
+    res = load_fuse(filter);
+    if (res) {
+        unlink(fuse_path);
+        pthread_mutex_unlock(&filter->sbf_lock);
+        free(fuse_path);
+        return -1;
+    }
+    free(fuse_path);
+
+    bloom_sbf *sbf = (bloom_sbf*)filter->sbf;
+    filter->sbf = NULL;
+    if (sbf) {
+        sbf_close(sbf);
+        free(sbf);
+    }
+
+    // Persist that we are sealed, the fuse filter is always on disk
+    bloom_fuse *fuse = (bloom_fuse*)filter->fuse;
+    filter->filter_config.sealed = 1;
+    filter->filter_config.in_memory = 0;
+    filter->filter_config.size = fuse_size(fuse);
+    filter->filter_config.capacity = fuse_size(fuse);
+    filter->filter_config.bytes = fuse->map->size;
+
+    char *config_name = join_path(filter->full_path, (char*)CONFIG_FILENAME);
+    res = update_filename_from_filter_config(config_name, &filter->filter_config);
+    free(config_name);
+    if (res) {
+        bloom_log(LOG_ERR, "Failed to write filter '%s' configuration. Err: %d.",
+                filter->filter_name, res);
+    } else {
+        // Remove the bloom filters that were replaced
+        delete_files(filter, filter_data_files);
+        delete_files(filter, filter_checksum_files);
+        delete_files(filter, filter_snapshot_files);
+    }
+
+    // Release lock
+    pthread_mutex_unlock(&filter->sbf_lock);
+    bloom_log(LOG_INFO, "Sealed filter '%s'. Keys: %llu.", filter->filter_name,
+            (unsigned long long)filter->filter_config.size);
+    return 0;
+}
+
+/**
+ * Folds the layers of the filter into smaller layers, so that
+ * the false positive rate stays under a new probability. The
+ * folded layers are written to temporary files in the filter
+ * directory, unless the filter is in-memory.
+ * @note The caller must prevent concurrent bloomf_add calls.
+ * @arg filter The filter to shrink
+ * @arg prob The false positive probability to shrink to
+ * @arg shrink Output, set to the folded layers
+ * @return 0 on success, 1 if no layer can be folded,
+ * -2 if the filter is sealed or stable, -1 on error.
+ */
+int bloomf_shrink_build(bloom_filter *filter, double prob, bloom_shrink **shrink) {
+    *shrink = NULL;
+    if (filter->filter_config.sealed || filter->filter_config.stable) return -2;
+    if (bloomf_is_proxied(filter)) {
+        if (thread_safe_fault(filter) != 0) return -1;
+    }
+
+    // Time how long this takes
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    // Find how far each layer can be folded. The layers share
+    // the probability like they do when the SBF grows them.
+    bloom_sbf *sbf = (bloom_sbf*)filter->sbf;
+    bloom_shrink *s = calloc(1, sizeof(bloom_shrink));
+    s->num_layers = sbf->num_filters;
+    s->probability = prob;
+    s->size = sbf_size(sbf);
+    s->factors = calloc(s->num_layers, sizeof(uint64_t));
+    s->layers = calloc(s->num_layers, sizeof(bloom_bloomfilter*));
+    s->paths = calloc(s->num_layers, sizeof(char*));
+
+    int folded = 0;
+    for (int i=0; i < s->num_layers; i++) {
+        double layer_prob = layer_probability(filter, prob, s->num_layers, i);
+        s->factors[i] = bf_fold_factor(sbf->filters[i], layer_prob);
+        if (s->factors[i] > 1) folded++;
+    }
+    if (!folded) {
+        bloomf_shrink_free(s);
+        return 1;
+    }
+
+    // Fold each layer into a new bitmap
+    int res = 0;
+    bitmap_mode mode = (filter->config->use_mmap) ? SHARED : PERSISTENT;
+    for (int i=0; i < s->num_layers && !res; i++) {
+        if (s->factors[i] == 1) continue;
+        bloom_bloomfilter *layer = sbf->filters[i];
+        uint64_t bytes = bf_fold_bytes(layer, s->factors[i]);
+
+        bloom_bitmap *map = malloc(sizeof(bloom_bitmap));
+        if (filter->filter_config.in_memory) {
+            res = bloomf_sbf_callback(filter, bytes, map);
+        } else {
+            s->paths[i] = snapshot_path(filter, SHRINK_TMP_NAME, s->num_layers - i - 1);
+            unlink(s->paths[i]);
+            res = bitmap_from_filename(s->paths[i], bytes, 1, mode, map);
+            if (!res) place_bitmap(filter, map);
+        }
+        if (res) {
+            bloom_log(LOG_ERR, "Failed to allocate folded layer for filter '%s'. Err: %d",
+                    filter->filter_name, res);
+            free(map);
+            break;
+        }
+
+        bloom_bloomfilter *out = calloc(1, sizeof(bloom_bloomfilter));
+        res = bf_from_bitmap(map, layer->header->k_num, 1, out);
+        if (res) {
+            bitmap_close(map);
+            free(map);
+            free(out);
+        } else {
+            s->layers[i] = out;
+            res = bf_fold(layer, s->factors[i], out);
+        }
+        if (res) {
+            bloom_log(LOG_ERR, "Failed to fold layer %d of filter '%s'. Err: %d",
+                    i, filter->filter_name, res);
+            break;
+        }
+        double layer_prob = layer_probability(filter, prob, s->num_layers, i);
+        out->header->capacity = bf_capacity_for_prob(out, layer_prob);
+    }
+    if (res) {
+        bloomf_shrink_free(s);
+        return -1;
+    }
+
+    gettimeofday(&end, NULL);
+    bloom_log(LOG_INFO, "Folded %d layers of filter '%s'. Total time: %d msec.",
+            folded, filter->filter_name, timediff_msec(&start, &end));
+    *shrink = s;
+    return 0;
+}
+
+/**
+ * Swaps the folded layers in place of the layers of the
+ * filter. Keys added since the build are folded in first.
+ * @note The caller must prevent concurrent use of the filter.
+ * @arg filter The filter
+ * @arg shrink The folded layers from bloomf_shrink_build
+ * @return 0 on success, -3 if a layer was added since
+ * the build, -1 on error.
+ */
+int bloomf_shrink_swap(bloom_filter *filter, bloom_shrink *shrink) {
+    // Acquire lock
+    pthread_mutex_lock(&filter->sbf_lock);
+    bloom_sbf *sbf = (bloom_sbf*)filter->sbf;
+    int res = 0;
+    if (!sbf || sbf->num_filters != (uint32_t)shrink->num_layers) {
+        res = -3;
+        goto LEAVE;
+    }
+
+    // Fold in any keys added since the build
+    if (sbf_size(sbf) != shrink->size) {
+        for (int i=0; i < shrink->num_layers && !res; i++) {
+            if (shrink->layers[i])
+                res = bf_fold(sbf->filters[i], shrink->factors[i], shrink->layers[i]);
+        }
+        if (res) goto LEAVE;
+    }
+
+    // Swap each layer. A layer is only replaced once its file is
+    // in place, so a failure leaves a mix of whole layers.
+    char *data_path;
+    for (int i=0; i < shrink->num_layers; i++) {
+        bloom_bloomfilter *layer = shrink->layers[i];
+        if (!layer) continue;
+        bf_flush(layer);
+
+        if (shrink->paths[i]) {
+            data_path = snapshot_path(filter, DATA_FILE_NAME, shrink->num_layers - i - 1);
+            if (bitmap_rename_file(shrink->paths[i], data_path)) {
+                bloom_log(LOG_ERR, "Failed to rename folded layer: %s. %s", data_path, strerror(errno));
+                free(data_path);
+                res = -1;
+                continue;
+            }
+            free(data_path);
+            free(shrink->paths[i]);
+            shrink->paths[i] = NULL;
+        }
+
+        sbf_replace_filter(sbf, i, layer);
+        shrink->layers[i] = NULL;
+    }
+
+    // Persist the new probability and size
+    sbf->params.fp_probability = shrink->probability;
+    filter->filter_config.default_probability = shrink->probability;
+    filter->filter_config.size = bloomf_size(filter);
+    filter->filter_config.capacity = bloomf_capacity(filter);
+    filter->filter_config.bytes = bloomf_byte_size(filter);
+    if (filter->filter_config.in_memory)
+        filter->snapshot_size = 0;
+    else
+        sbf_flush(sbf);
+
+    char *config_name = join_path(filter->full_path, (char*)CONFIG_FILENAME);
+    int config_res = update_filename_from_filter_config(config_name, &filter->filter_config);
+    free(config_name);
+    if (config_res) {
+        bloom_log(LOG_ERR, "Failed to write filter '%s' configuration. Err: %d.",
+                filter->filter_name, config_res);
+    }
+    bloom_log(LOG_INFO, "Shrunk filter '%s'. Bytes: %llu.", filter->filter_name,
+            (unsigned long long)filter->filter_config.bytes);
+
+LEAVE:
+    // Release lock
+    pthread_mutex_unlock(&filter->sbf_lock);
+    return res;
+}
+
+/**
+ * Frees the folded layers, and removes any
+ * that were not swapped in.
+ * @arg shrink The folded layers
+ */
+void bloomf_shrink_free(bloom_shrink *shrink) {
+    for (int i=0; i < shrink->num_layers; i++) {
+        if (shrink->layers[i]) {
+            bloom_bitmap *map = shrink->layers[i]->map;
+            bf_close(shrink->layers[i]);
+            free(shrink->layers[i]);
+            free(map);
+        }
+        if (shrink->paths[i]) {
+            unlink(shrink->paths[i]);
+            bitmap_drop_checksums(shrink->paths[i]);
+            free(shrink->paths[i]);
+        }
+    }
+    free(shrink->factors);
+    free(shrink->layers);
+    free(shrink->paths);
+    free(shrink);
+}
+
+/**
+ * Copies the layers of an in-memory filter so that they can
+ * be written out as a snapshot without blocking writers.
+ * @note The caller must prevent concurrent bloomf_add calls.
+ * @arg filter The filter to copy
+ * @arg snap Output, set to the new copy
+ * @return 0 on success, 1 if nothing changed since the last
+ * snapshot, negative on error.
+ */
+int bloomf_snapshot_copy(bloom_filter *filter, bloom_snapshot **snap) {
+    *snap = NULL;
+    bloom_sbf *sbf = (bloom_sbf*)filter->sbf;
+    if (!filter->filter_config.in_memory || !sbf) return 1;
+
+    // The size only changes when new bits are set, so
+    // an unchanged size means the layers are unchanged
+    uint64_t size = sbf_size(sbf);
+    if (size == filter->snapshot_size) return 1;
+
+    bloom_snapshot *s = calloc(1, sizeof(bloom_snapshot));
+    s->num_layers = sbf->num_filters;
+    s->size = size;
+    s->bytes = calloc(s->num_layers, sizeof(uint64_t));
+    s->layers = calloc(s->num_layers, sizeof(unsigned char*));
+    for (int i=0; i < s->num_layers; i++) {
+        bloom_bitmap *map = sbf->filters[i]->map;
+        s->bytes[i] = map->size;
+        s->layers[i] = malloc(map->size);
+        if (!s->layers[i]) {
+            bloom_log(LOG_ERR, "Failed to allocate snapshot of filter '%s'. Size: %llu",
+                    filter->filter_name, (unsigned long long)map->size);
+            bloomf_snapshot_free(s);
+            return -1;
+        }
+        memcpy(s->layers[i], map->mmap, map->size);
+    }
+
+    *snap = s;
+    return 0;
+}
+
+/**
+ * Writes a copy of the layers out to the filter directory.
+ * The previous snapshot is replaced only once all the layers
+ * are safely on disk.
+ * @arg filter The filter that was copied
+ * @arg snap The copy to write out
+ * @return 0 on success.
+ */
+int bloomf_snapshot_write(bloom_filter *filter, bloom_snapshot *snap) {
+    // Time how long this takes
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    // Write each layer to a temporary file. Files are
+    // numbered from the smallest layer, like the data files.
+    int res = 0;
+    char *path;
+    for (int i=0; i < snap->num_layers && !res; i++) {
+        path = snapshot_path(filter, SNAPSHOT_TMP_NAME, snap->num_layers - i - 1);
+        res = write_snapshot_layer(path, snap->layers[i], snap->bytes[i]);
+        if (res) {
+            bloom_log(LOG_ERR, "Failed to write snapshot: %s. %s", path, strerror(errno));
+        }
+        free(path);
+    }
+
+    // Move the layers into place. Bits are only ever set, so
+    // if we are interrupted, the mix of old and new layers still
+    // holds every key in the old snapshot.
+    char *snap_path;
+    for (int i=0; i < snap->num_layers; i++) {
+        path = snapshot_path(filter, SNAPSHOT_TMP_NAME, i);
+        if (res) {
+            unlink(path);
+        } else {
+            snap_path = snapshot_path(filter, SNAPSHOT_FILE_NAME, i);
+            res = rename(path, snap_path);
+            if (res) {
+                bloom_log(LOG_ERR, "Failed to rename snapshot: %s. %s", snap_path, strerror(errno));
+            }
+            free(snap_path);
+        }
+        free(path);
+    }
+    if (res) return -1;
+    filter->snapshot_size = snap->size;
+
+    // Compute the elapsed time
+    gettimeofday(&end, NULL);
+    bloom_log(LOG_INFO, "Snapshot filter '%s'. Total time: %d msec.",
+            filter->filter_name, timediff_msec(&start, &end));
+    return 0;
+}
+
+/**
+ * Frees a copy made with bloomf_snapshot_copy.
+ * @arg snap The copy to free
+ */
+void bloomf_snapshot_free(bloom_snapshot *snap) {
+    for (int i=0; i < snap->num_layers; i++) {
+        if (snap->layers[i]) free(snap->layers[i]);
+    }
+    free(snap->layers);
+    free(snap->bytes);
+    free(snap);
+}
+
+/**
+ * Snapshots an in-memory filter if it has changed
+ * since the last snapshot. Used when closing.
+ * @arg filter The filter
+ * @return 0 on success.
+ */
+int bloomf_snapshot(bloom_filter *filter) {
+    if (filter->config->snapshot_interval <= 0) return 0;
+
+    bloom_snapshot *snap;
+    int res = bloomf_snapshot_copy(filter, &snap);
+    if (res) return (res == 1) ? 0 : res;
+
+    res = bloomf_snapshot_write(filter, snap);
+    bloomf_snapshot_free(snap);
+    return res;
+}
+
 /**
  * Gets the size of the filter in keys
  * @note Thread safe.
@@ -322,7 +1176,11 @@ int bloomf_add(bloom_filter *filter, char *key) {
  * @return The total size of the filter
  */
 uint64_t bloomf_size(bloom_filter *filter) {
-    if (filter->sbf) {
+    if (filter->fuse) {
+        return fuse_size((bloom_fuse*)filter->fuse);
+    } else if (filter->stable) {
+        return stable_size((bloom_stable*)filter->stable);
+    } else if (filter->sbf) {
         return sbf_size((bloom_sbf*)filter->sbf);
     } else {
         return filter->filter_config.size;
@@ -336,7 +1194,11 @@ uint64_t bloomf_size(bloom_filter *filter) {
  * @return The total capacity of the filter
  */
 uint64_t bloomf_capacity(bloom_filter *filter) {
-    if (filter->sbf) {
+    if (filter->fuse) {
+        return fuse_size((bloom_fuse*)filter->fuse);
+    } else if (filter->stable) {
+        return stable_capacity((bloom_stable*)filter->stable);
+    } else if (filter->sbf) {
         return sbf_total_capacity((bloom_sbf*)filter->sbf);
     } else {
         return filter->filter_config.capacity;
@@ -350,13 +1212,133 @@ uint64_t bloomf_capacity(bloom_filter *filter) {
  * @return The total byte size of the filter
  */
 uint64_t bloomf_byte_size(bloom_filter *filter) {
-    if (filter->sbf) {
+    if (filter->fuse) {
+        return filter->fuse->map->size;
+    } else if (filter->stable) {
+        return filter->stable->map->size;
+    } else if (filter->sbf) {
         return sbf_total_byte_size((bloom_sbf*)filter->sbf);
     } else {
         return filter->filter_config.bytes;
     }
 }
 
+/**
+ * Estimates how many bytes closing the filter will
+ * write to disk. Used to schedule the largest flushes first.
+ * @note Thread safe, but may be inconsistent.
+ * @arg filter The filter
+ * @return The number of dirty bytes
+ */
+uint64_t bloomf_dirty_bytes(bloom_filter *filter) {
+    // Stable filters are not snapshotted
+    bloom_stable *stable = (bloom_stable*)filter->stable;
+    if (stable) {
+        if (filter->filter_config.in_memory) return 0;
+        return bitmap_dirty_bytes(stable->map);
+    }
+
+    bloom_sbf *sbf = (bloom_sbf*)filter->sbf;
+    if (!sbf) return 0;
+
+    // In-memory filters are only written by a snapshot
+    if (filter->filter_config.in_memory) {
+        if (filter->config->snapshot_interval <= 0) return 0;
+        if (sbf_size(sbf) == filter->snapshot_size) return 0;
+        return sbf_total_byte_size(sbf);
+    }
+    return sbf_dirty_bytes(sbf);
+}
+
+/**
+ * Adopts a set of shared memory layers that were handed
+ * over by a previous bloomd process. Only valid for in-memory
+ * filters which have not yet been faulted in.
+ * @arg filter The filter
+ * @arg num The number of layers, ordered from largest to smallest
+ * @arg fds The file descriptors of the layers. Not closed.
+ * @arg sizes The byte size of each layer
+ * @return 0 on success.
+ */
+int bloomf_adopt_layers(bloom_filter *filter, int num, int *fds, uint64_t *sizes) {
+    if (!filter->filter_config.in_memory || filter->filter_config.stable) return -1;
+
+    // Acquire lock
+    pthread_mutex_lock(&filter->sbf_lock);
+    if (filter->sbf) {
+        pthread_mutex_unlock(&filter->sbf_lock);
+        return -1;
+    }
+
+    // Map in each of the layers
+    bloom_bitmap **maps = calloc(num, sizeof(bloom_bitmap*));
+    bloom_bloomfilter **filters = calloc(num, sizeof(bloom_bloomfilter*));
+    int res = 0;
+    int loaded = 0;
+    for (; loaded < num; loaded++) {
+        maps[loaded] = malloc(sizeof(bloom_bitmap));
+        res = bitmap_from_file(fds[loaded], sizes[loaded], SHARED, maps[loaded]);
+        if (res) {
+            free(maps[loaded]);
+            break;
+        }
+        place_bitmap(filter, maps[loaded]);
+
+        filters[loaded] = malloc(sizeof(bloom_bloomfilter));
+        res = bf_from_bitmap(maps[loaded], 1, 0, filters[loaded]);
+        if (res) {
+            free(filters[loaded]);
+            bitmap_close(maps[loaded]);
+            free(maps[loaded]);
+            break;
+        }
+    }
+
+    // Create the SBF from the layers
+    if (!res) res = create_sbf(filter, num, filters);
+    if (res) {
+        bloom_log(LOG_ERR, "Failed to adopt handed over layers for filter '%s'. Err: %d",
+                filter->filter_name, res);
+        for (int i=0; i < loaded; i++) {
+            bf_close(filters[i]);
+            bitmap_close(maps[i]);
+            free(filters[i]);
+            free(maps[i]);
+        }
+    }
+
+    // Release lock
+    pthread_mutex_unlock(&filter->sbf_lock);
+    free(maps);
+    free(filters);
+    return res;
+}
+
+/**
+ * Appends a key to the key log, opening it if needed. Stable
+ * filters forget keys, so they are never compacted and need no log.
+ * @return 0 on success, -1 on error.
+ */
+static int log_key(bloom_filter *f, char *key) {
+    if (!f->filter_config.key_log || f->filter_config.stable) return 0;
+    if (!f->key_log) {
+        char *log_path = join_path(f->full_path, (char*)KEY_LOG_FILENAME);
+        f->key_log = fopen(log_path, "a");
+        free(log_path);
+        if (!f->key_log) {
+            bloom_log(LOG_ERR, "Failed to open key log for filter '%s'. %s",
+                    f->filter_name, strerror(errno));
+            return -1;
+        }
+    }
+    if (fputs(key, f->key_log) < 0 || fputc('\n', f->key_log) < 0) {
+        bloom_log(LOG_ERR, "Failed to log key for filter '%s'. %s",
+                f->filter_name, strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
 /**
  * Provides a thread safe faulting of filters.
  * The main use case of this is to allow
@@ -367,8 +1349,14 @@ static int thread_safe_fault(bloom_filter *f) {
     pthread_mutex_lock(&f->sbf_lock);
 
     int res = 0;
-    if (!f->sbf) {
-        if (f->filter_config.in_memory) {
+    if (f->filter_config.sealed) {
+        if (!f->fuse) res = load_fuse(f);
+    } else if (f->filter_config.stable) {
+        if (!f->stable) res = load_stable(f);
+    } else if (!f->sbf) {
+        if (f->filter_config.in_memory && f->config->snapshot_interval > 0) {
+            res = load_snapshot(f);
+        } else if (f->filter_config.in_memory) {
             res = create_sbf(f, 0, NULL);
         } else {
             res = discover_existing_filters(f);
@@ -426,6 +1414,29 @@ static int filter_data_files(CONST_DIRENT_T *d) {
     return 0;
 }
 
+/**
+ * Works with scandir to filter out non-checksum files.
+ */
+static int filter_checksum_files(CONST_DIRENT_T *d) {
+    char *name = (char*)d->d_name;
+    int name_len = strlen(name);
+    return name_len > 9 && strcmp(name+(name_len-9), ".mmap.crc") == 0;
+}
+
+/**
+ * Works with scandir to filter out non-snapshot files.
+ */
+static int filter_snapshot_files(CONST_DIRENT_T *d) {
+    // Get the file name
+    char *name = (char*)d->d_name;
+    int name_len = strlen(name);
+
+    // Compare the prefix and ending
+    if (name_len < 14) return 0;
+    return (strncmp(name, "snapshot.", 9) == 0 &&
+            strcmp(name+(name_len-5), ".snap") == 0);
+}
+
 /**
  * This beast mode method scans the data directory
  * belonging to this filter for any existing filters,
@@ -440,11 +1451,11 @@ static int discover_existing_filters(bloom_filter *f) {
     // Filter only data dirs, in sorted order
     num = scandir(f->full_path, &namelist, filter_data_files, alphasort);
     if (num == -1) {
-        syslog(LOG_ERR, "Failed to scan files for filter '%s'. %s",
+        bloom_log(LOG_ERR, "Failed to scan files for filter '%s'. %s",
                 f->filter_name, strerror(errno));
         return -1;
     }
-    syslog(LOG_INFO, "Found %d files for filter %s.", num, f->filter_name);
+    bloom_log(LOG_INFO, "Found %d files for filter %s.", num, f->filter_name);
 
     // Speical case when there are no filters
     if (num == 0) {
@@ -464,13 +1475,13 @@ static int discover_existing_filters(bloom_filter *f) {
     for (int i=0; i < num && !err; i++) {
         // Get the full path to the bitmap
         char *bitmap_path = join_path(f->full_path, namelist[i]->d_name);
-        syslog(LOG_INFO, "Discovered bloom filter: %s.", bitmap_path);
+        bloom_log(LOG_INFO, "Discovered bloom filter: %s.", bitmap_path);
 
         // Get the size
         size = get_size(bitmap_path);
         if (size == 0) {
             err = 1;
-            syslog(LOG_ERR, "Failed to get the filesize for: %s. %s", bitmap_path, strerror(errno));
+            bloom_log(LOG_ERR, "Failed to get the filesize for: %s. %s", bitmap_path, strerror(errno));
             free(bitmap_path);
             break;
         }
@@ -480,18 +1491,19 @@ static int discover_existing_filters(bloom_filter *f) {
         res = bitmap_from_filename(bitmap_path, size, 0, mode, bitmap);
         if (res != 0) {
             err = 1;
-            syslog(LOG_ERR, "Failed to load bitmap for: %s. %s", bitmap_path, strerror(errno));
+            bloom_log(LOG_ERR, "Failed to load bitmap for: %s. %s", bitmap_path, strerror(errno));
             free(bitmap);
             free(bitmap_path);
             break;
         }
+        place_bitmap(f, bitmap);
 
         // Create the bloom filter
         bloom_bloomfilter *filter = filters[num - i - 1] = malloc(sizeof(bloom_bloomfilter));
         res = bf_from_bitmap(bitmap, 1, 0, filter);
         if (res != 0) {
             err = 1;
-            syslog(LOG_ERR, "Failed to load bloom filter for: %s. [%d]", bitmap_path, res);
+            bloom_log(LOG_ERR, "Failed to load bloom filter for: %s. [%d]", bitmap_path, res);
             free(filter);
             bitmap_close(bitmap);
             free(bitmap);
@@ -515,7 +1527,7 @@ static int discover_existing_filters(bloom_filter *f) {
 
     // Cleanup on err
     if (res != 0) {
-        syslog(LOG_ERR, "Failed to make scalable bloom filter for: %s.", f->filter_name);
+        bloom_log(LOG_ERR, "Failed to make scalable bloom filter for: %s.", f->filter_name);
 
         // For fucks sake. We need to clean up so much shit now.
         for (int i=0; i < num; i++) {
@@ -535,6 +1547,279 @@ static int discover_existing_filters(bloom_filter *f) {
     return (err) ? -1 : 0;
 }
 
+/**
+ * Restores an in-memory filter from the last snapshot,
+ * or creates an empty filter if there is none.
+ * @return 0 on success. -1 on error.
+ */
+static int load_snapshot(bloom_filter *f) {
+    struct dirent **namelist;
+    int num = scandir(f->full_path, &namelist, filter_snapshot_files, alphasort);
+    if (num == -1) {
+        bloom_log(LOG_ERR, "Failed to scan snapshots for filter '%s'. %s",
+                f->filter_name, strerror(errno));
+        return -1;
+    }
+    if (num == 0) {
+        free(namelist);
+        return create_sbf(f, 0, NULL);
+    }
+    bloom_log(LOG_INFO, "Found %d snapshot files for filter %s.", num, f->filter_name);
+
+    // Allocate space for all the filter
+    bloom_bitmap **maps = calloc(num, sizeof(bloom_bitmap*));
+    bloom_bloomfilter **filters = calloc(num, sizeof(bloom_bloomfilter*));
+
+    // Read each layer into a fresh in-memory bitmap
+    int res = 0;
+    int loaded = 0;
+    for (; loaded < num; loaded++) {
+        int idx = num - loaded - 1;
+        char *snap_path = join_path(f->full_path, namelist[loaded]->d_name);
+        uint64_t size = get_size(snap_path);
+        int fd = open(snap_path, O_RDONLY);
+        if (size == 0 || fd == -1) {
+            bloom_log(LOG_ERR, "Failed to open snapshot: %s. %s", snap_path, strerror(errno));
+            if (fd != -1) close(fd);
+            free(snap_path);
+            res = -1;
+            break;
+        }
+
+        maps[idx] = malloc(sizeof(bloom_bitmap));
+        res = bloomf_sbf_callback(f, size, maps[idx]);
+        if (res) {
+            free(maps[idx]);
+            maps[idx] = NULL;
+            close(fd);
+            free(snap_path);
+            break;
+        }
+
+        uint64_t total = 0;
+        ssize_t n = 0;
+        while (total < size) {
+            n = read(fd, maps[idx]->mmap + total, size - total);
+            if (n <= 0) break;
+            total += n;
+        }
+        close(fd);
+
+        filters[idx] = malloc(sizeof(bloom_bloomfilter));
+        if (total == size) {
+            res = bf_from_bitmap(maps[idx], 1, 0, filters[idx]);
+        } else {
+            res = -1;
+        }
+        if (res) {
+            bloom_log(LOG_ERR, "Failed to load snapshot: %s. [%d]", snap_path, res);
+            free(filters[idx]);
+            filters[idx] = NULL;
+            bitmap_close(maps[idx]);
+            free(maps[idx]);
+            maps[idx] = NULL;
+            free(snap_path);
+            break;
+        }
+        free(snap_path);
+    }
+
+    // Free the memory associated with scandir
+    for (int i=0; i < num; i++) free(namelist[i]);
+    free(namelist);
+
+    // Create the SBF
+    if (!res) res = create_sbf(f, num, filters);
+    if (res) {
+        for (int i=0; i < num; i++) {
+            if (filters[i]) {
+                bf_close(filters[i]);
+                free(filters[i]);
+            }
+            if (maps[i]) {
+                bitmap_close(maps[i]);
+                free(maps[i]);
+            }
+        }
+    } else {
+        f->snapshot_size = sbf_size((bloom_sbf*)f->sbf);
+    }
+
+    free(maps);
+    free(filters);
+    return res;
+}
+
+/**
+ * Maps in the fuse filter of a sealed filter.
+ * @return 0 on success. -1 on error.
+ */
+static int load_fuse(bloom_filter *f) {
+    char *fuse_path = join_path(f->full_path, (char*)FUSE_FILENAME);
+    uint64_t size = get_size(fuse_path);
+
+    bloom_bitmap *map = malloc(sizeof(bloom_bitmap));
+    bloom_fuse *fuse = malloc(sizeof(bloom_fuse));
+    int res = -1;
+    if (size) {
+        res = bitmap_from_filename(fuse_path, size, 0, SHARED, map);
+        if (!res) {
+            place_bitmap(f, map);
+            res = fuse_from_bitmap(map, fuse);
+            if (res) bitmap_close(map);
+        }
+    }
+
+    if (res) {
+        bloom_log(LOG_ERR, "Failed to load fuse filter: %s. [%d]", fuse_path, res);
+        free(map);
+        free(fuse);
+    } else {
+        bloom_log(LOG_INFO, "Loaded fuse filter: %s. Keys: %llu.", f->filter_name,
+                (unsigned long long)fuse_size(fuse));
+        f->fuse = fuse;
+        f->counters.page_ins += 1;
+    }
+    free(fuse_path);
+    return res;
+}
+
+/**
+ * Maps in the stable filter, or creates it. A stable filter
+ * never grows, so it is always a single data file.
+ * @return 0 on success. -1 on error.
+ */
+static int load_stable(bloom_filter *f) {
+    bloom_stable_params params = {0, 0, 0, f->filter_config.initial_capacity,
+                                  f->filter_config.default_probability};
+    int res = stable_params_for_capacity(&params);
+    if (res) {
+        bloom_log(LOG_ERR, "Failed to size stable filter '%s'. Err: %d", f->filter_name, res);
+        return -1;
+    }
+
+    // Check for an existing data file
+    char *filename = NULL;
+    res = asprintf(&filename, DATA_FILE_NAME, 0);
+    assert(res != -1);
+    char *data_path = join_path(f->full_path, filename);
+    free(filename);
+    uint64_t size = (f->filter_config.in_memory) ? 0 : get_size(data_path);
+
+    // Load it, or let the callback create a new bitmap
+    bloom_bitmap *map = malloc(sizeof(bloom_bitmap));
+    if (size) {
+        bitmap_mode mode = (f->config->use_mmap) ? SHARED : PERSISTENT;
+        res = bitmap_from_filename(data_path, size, 0, mode, map);
+        if (!res) place_bitmap(f, map);
+    } else {
+        res = bloomf_sbf_callback(f, params.bytes, map);
+    }
+
+    bloom_stable *stable = malloc(sizeof(bloom_stable));
+    if (!res) {
+        res = stable_from_bitmap(map, &params, (size) ? 0 : 1, stable);
+        if (res) bitmap_close(map);
+    }
+
+    if (res) {
+        bloom_log(LOG_ERR, "Failed to load stable filter: %s. [%d]", data_path, res);
+        free(map);
+        free(stable);
+        res = -1;
+    } else {
+        bloom_log(LOG_INFO, "Loaded stable filter: %s. Keys: %llu.", f->filter_name,
+                (unsigned long long)stable_size(stable));
+        f->stable = stable;
+        f->counters.page_ins += 1;
+    }
+    free(data_path);
+    return res;
+}
+
+/**
+ * Reads newline separated keys and hashes them for a fuse filter.
+ * Reads at most len bytes, or until the end if len is 0.
+ * @return 0 on success. -1 on error.
+ */
+static int read_key_hashes(FILE *keys, uint64_t len, uint64_t **hashes, uint64_t *count) {
+    char *line = NULL;
+    size_t line_cap = 0;
+    ssize_t line_len;
+    uint64_t total = 0, max = 0;
+    while ((!len || total < len) && (line_len = getline(&line, &line_cap, keys)) > 0) {
+        total += line_len;
+        if (line[line_len - 1] == '\n') line[--line_len] = '\0';
+        if (!line_len) continue;
+
+        if (*count == max) {
+            max = (max) ? max * 2 : 1024;
+            uint64_t *resized = realloc(*hashes, max * sizeof(uint64_t));
+            if (!resized) {
+                free(line);
+                return -1;
+            }
+            *hashes = resized;
+        }
+        (*hashes)[(*count)++] = fuse_hash_key(line);
+    }
+    free(line);
+    return ferror(keys) ? -1 : 0;
+}
+
+/**
+ * Deletes the files of a filter matching a scandir filter
+ */
+static void delete_files(bloom_filter *f, int (*select)(CONST_DIRENT_T *)) {
+    struct dirent **namelist = NULL;
+    int num = scandir(f->full_path, &namelist, select, NULL);
+    for (int i=0; i < num; i++) {
+        char *file_path = join_path(f->full_path, namelist[i]->d_name);
+        if (unlink(file_path)) {
+            bloom_log(LOG_ERR, "Failed to delete: %s. %s", file_path, strerror(errno));
+        }
+        free(file_path);
+        free(namelist[i]);
+    }
+    if (namelist) free(namelist);
+}
+
+/**
+ * Returns the full path of a snapshot file
+ */
+static char* snapshot_path(bloom_filter *f, const char *format, int idx) {
+    char *filename = NULL;
+    int res = asprintf(&filename, format, idx);
+    assert(res != -1);
+    char *path = join_path(f->full_path, filename);
+    free(filename);
+    return path;
+}
+
+/**
+ * Writes a buffer out to a new file, and syncs it to disk.
+ */
+static int write_snapshot_layer(char *path, unsigned char *buf, uint64_t len) {
+    int fd = open(path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd == -1) return -1;
+
+    uint64_t total = 0;
+    ssize_t n;
+    while (total < len) {
+        n = write(fd, buf + total, len - total);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            close(fd);
+            return -1;
+        }
+        total += n;
+    }
+
+    int res = fsync(fd);
+    close(fd);
+    return res;
+}
+
 /**
  * Internal method to create the SBF
  */
@@ -551,29 +1836,91 @@ static int create_sbf(bloom_filter *f, int num, bloom_bloomfilter **filters) {
     f->sbf = malloc(sizeof(bloom_sbf));
     int res = sbf_from_filters(&params, bloomf_sbf_callback, f, num, filters, (bloom_sbf*)f->sbf);
 
+    // Size new layers from the insert history if configured
+    if (!res && f->filter_config.growth_horizon > 0) {
+        ((bloom_sbf*)f->sbf)->grow_callback = bloomf_grow_callback;
+    }
+
     // Handle a failure
     if (res != 0) {
-        syslog(LOG_ERR, "Failed to create SBF: %s. Err: %d", f->filter_name, res);
+        bloom_log(LOG_ERR, "Failed to create SBF: %s. Err: %d", f->filter_name, res);
         free((bloom_sbf*)f->sbf);
         f->sbf = NULL;
     } else {
-        syslog(LOG_INFO, "Loaded SBF: %s. Num filters: %d.", f->filter_name, num);
+        bloom_log(LOG_INFO, "Loaded SBF: %s. Num filters: %d.", f->filter_name, num);
     }
 
     return res;
 }
 
 /**
- * Callback used with SBF to generate file names.
+ * Callback used with SBF to create the bitmaps of new
+ * layers, which are placed on the node of the filter.
  */
 static int bloomf_sbf_callback(void* in, uint64_t bytes, bloom_bitmap *out) {
-    // Cast the input pointer
     bloom_filter *filt = in;
+    int res = new_bitmap(filt, bytes, out);
+    if (!res) place_bitmap(filt, out);
+    return res;
+}
+
+/**
+ * Callback used with SBF to size new layers from the
+ * insert history, including the keys since the last flush.
+ */
+static uint64_t bloomf_grow_callback(void* in, bloom_sbf *sbf) {
+    bloom_filter *filt = in;
+    bloom_sbf_history history;
+    record_growth(filt, sbf_size(sbf), &history, 0);
+    uint64_t capacity = sbf_growth_capacity(sbf, &history, filt->filter_config.growth_horizon);
+    if (capacity) {
+        bloom_log(LOG_INFO, "Growing filter '%s' by %llu keys, at %.1f keys/sec.",
+                filt->filter_name, (unsigned long long)capacity, history.keys / history.secs);
+    }
+    return capacity;
+}
+
+/**
+ * Adds the keys set since the history was last updated to the
+ * insert history of the filter. Flushes and the grow callback
+ * race, so the history is kept under the counter lock.
+ * @arg size The current size of the filter
+ * @arg history Output, the updated history. NULL if not needed.
+ * @arg update Stores the updated history if set
+ */
+static void record_growth(bloom_filter *f, uint64_t size, bloom_sbf_history *history, int update) {
+    uint64_t now = time(NULL);
+    bloom_filter_config *fc = &f->filter_config;
+    LOCK_BLOOM_SPIN(&f->counter_lock);
+    bloom_sbf_history h = {fc->growth_keys, fc->growth_secs, fc->growth_age};
+    if (now >= fc->growth_time) {
+        uint64_t keys = (size > f->growth_size) ? size - f->growth_size : 0;
+        sbf_record_history(&h, fc->growth_horizon, keys, now - fc->growth_time);
+        if (update) {
+            fc->growth_keys = h.keys;
+            fc->growth_secs = h.secs;
+            fc->growth_age = h.age;
+            fc->growth_time = now;
+            f->growth_size = size;
+        }
+    }
+    UNLOCK_BLOOM_SPIN(&f->counter_lock);
+    if (history) *history = h;
+}
 
+/**
+ * Creates a new bitmap for the filter, generating
+ * a new file name unless the filter is in-memory.
+ */
+static int new_bitmap(bloom_filter *filt, uint64_t bytes, bloom_bitmap *out) {
     // Check if we are in-memory
     if (filt->filter_config.in_memory) {
-        syslog(LOG_INFO, "Creating new in-memory bitmap for filter %s. Size: %llu",
+        bloom_log(LOG_INFO, "Creating new in-memory bitmap for filter %s. Size: %llu",
             filt->filter_name, (unsigned long long)bytes);
+
+        // Use shareable memory if we may hand over to a new process
+        if (filt->config->handover_socket)
+            return memfd_bitmap(filt, bytes, out);
         return bitmap_from_file(-1, bytes, ANONYMOUS, out);
     }
 
@@ -583,9 +1930,9 @@ static int bloomf_sbf_callback(void* in, uint64_t bytes, bloom_bitmap *out) {
 
     // Filter only data dirs, in sorted order
     num_files = scandir(filt->full_path, &namelist, filter_data_files, NULL);
-    syslog(LOG_INFO, "Found %d files for filter %s.", num_files, filt->filter_name);
+    bloom_log(LOG_INFO, "Found %d files for filter %s.", num_files, filt->filter_name);
     if (num_files < 0) {
-        syslog(LOG_ERR, "Error discovering files for filter '%s'. %s",
+        bloom_log(LOG_ERR, "Error discovering files for filter '%s'. %s",
                 filt->filter_name, strerror(errno));
         return -1;
     }
@@ -606,20 +1953,83 @@ static int bloomf_sbf_callback(void* in, uint64_t bytes, bloom_bitmap *out) {
     // Get the full path
     char *full_path = join_path(filt->full_path, filename);
     free(filename);
-    syslog(LOG_INFO, "Creating new file: %s for filter %s. Size: %llu",
+    bloom_log(LOG_INFO, "Creating new file: %s for filter %s. Size: %llu",
             full_path, filt->filter_name, (unsigned long long)bytes);
 
     // Create the bitmap
     bitmap_mode mode = (filt->config->use_mmap) ? SHARED : PERSISTENT;
     int res = bitmap_from_filename(full_path, bytes, 1, mode, out);
     if (res) {
-        syslog(LOG_CRIT, "Failed to create new file: %s for filter %s. Err: %s",
+        bloom_log(LOG_CRIT, "Failed to create new file: %s for filter %s. Err: %s",
             full_path, filt->filter_name, strerror(errno));
     }
     free(full_path);
     return res;
 }
 
+/**
+ * Binds a bitmap of the filter to its NUMA node, if it
+ * has one. Only anonymous memory and memory files can be
+ * placed, so shared mappings of other files, such as a
+ * compacted fuse layer, are left alone. Failures are only
+ * logged, since the bitmap is still usable wherever its
+ * pages are.
+ */
+static void place_bitmap(bloom_filter *f, bloom_bitmap *map) {
+    if (f->numa_node < 0) return;
+    if (map->mode == SHARED && !is_memory_file(map->fileno)) return;
+    int res = numa_bind_memory(map->mmap, map->size, f->numa_node);
+    if (res) {
+        bloom_log(LOG_WARNING, "Failed to place filter '%s' on NUMA node %d. Err: %d",
+                f->filter_name, f->numa_node, res);
+    }
+}
+
+/**
+ * Checks if a file is held in memory, like a memfd or a file
+ * on tmpfs, rather than in the page cache of a file system.
+ */
+static int is_memory_file(int fd) {
+#ifdef __linux__
+    struct statfs fs;
+    return fd >= 0 && !fstatfs(fd, &fs) && fs.f_type == TMPFS_MAGIC;
+#else
+    (void)fd;
+    return 0;
+#endif
+}
+
+/**
+ * Creates an in-memory bitmap that is backed by an anonymous
+ * memory file. Unlike an ANONYMOUS bitmap, the file descriptor
+ * can be passed to another process, which can then map the
+ * same pages. This is used to hand over in-memory filters.
+ */
+static int memfd_bitmap(bloom_filter *f, uint64_t bytes, bloom_bitmap *out) {
+#if defined(__linux__) && defined(SYS_memfd_create)
+    int fd = syscall(SYS_memfd_create, f->filter_name, 0);
+    if (fd < 0) {
+        bloom_log(LOG_WARNING, "Failed to create memfd for filter %s, using anonymous memory. %s",
+                f->filter_name, strerror(errno));
+        return bitmap_from_file(-1, bytes, ANONYMOUS, out);
+    }
+    if (ftruncate(fd, bytes)) {
+        bloom_log(LOG_ERR, "Failed to size memfd for filter %s. %s",
+                f->filter_name, strerror(errno));
+        close(fd);
+        return -1;
+    }
+
+    // The bitmap holds its own reference to the file
+    int res = bitmap_from_file(fd, bytes, SHARED, out);
+    close(fd);
+    return res;
+#else
+    (void)f;
+    return bitmap_from_file(-1, bytes, ANONYMOUS, out);
+#endif
+}
+
 /**
  * Computes the difference in time in milliseconds
  * between two timeval structures.
@@ -630,3 +2040,14 @@ static int timediff_msec(struct timeval *t1, struct timeval *t2) {
     return (micro2-micro1) / 1000;
 }
 
+/**
+ * Computes the false positive probability of a layer, the
+ * same way the SBF does when it adds the layer.
+ * @arg prob The probability of the whole filter
+ * @arg num The number of layers
+ * @arg idx The index of the layer, largest first
+ */
+static double layer_probability(bloom_filter *f, double prob, int num, int idx) {
+    double r = f->filter_config.probability_reduction;
+    return (1 - r) * prob * pow(r, num - idx - 1);
+}
@@ -1,9 +1,13 @@
 #ifndef BLOOM_FILTER_H
 #define BLOOM_FILTER_H
 #include <pthread.h>
+#include <stdio.h>
 #include "config.h"
 #include "spinlock.h"
+#include "ratelimit.h"
 #include "sbf.h"
+#include "fuse.h"
+#include "stable.h"
 
 /*
  * Functions are NOT thread safe unless explicitly documented
@@ -21,6 +25,9 @@ typedef struct {
     uint64_t set_misses;
     uint64_t page_ins;
     uint64_t page_outs;
+    uint64_t throttles;         // Commands that went over the rate limits
+    uint64_t throttle_msec;     // Time clients were deferred for
+    uint64_t checksum_errors;   // Pages the scrubber found corrupt
 } filter_counters;
 
 /**
@@ -34,12 +41,47 @@ typedef struct bloom_filter {
     char *full_path;                // Path to our data
 
     volatile bloom_sbf *sbf;        // Underlying SBF
+    volatile bloom_fuse *fuse;      // Fuse filter, once sealed
+    volatile bloom_stable *stable;  // Stable filter, used instead of an SBF
     pthread_mutex_t sbf_lock;       // Protects faulting in the SBF
 
+    FILE *key_log;                  // Log of the set keys, opened on demand
+
     filter_counters counters;       // Counters
     bloom_spinlock counter_lock;    // Protect the counters
+
+    bloom_bucket ops_bucket;        // Limits the keys each second
+    bloom_bucket bytes_bucket;      // Limits the bytes each second
+
+    uint64_t snapshot_size;         // Size as of the last snapshot
+    uint64_t growth_size;           // Size when the insert history was last updated
+    int numa_node;                  // Node the bitmaps are placed on, -1 if none
 } bloom_filter;
 
+/**
+ * A point-in-time copy of the layers of an
+ * in-memory filter, used to write a snapshot.
+ */
+typedef struct {
+    int num_layers;                 // Number of layers, largest first
+    uint64_t size;                  // Size of the filter in keys
+    uint64_t *bytes;                // Byte size of each layer
+    unsigned char **layers;         // Copy of each layer
+} bloom_snapshot;
+
+/**
+ * Folded copies of the layers of a filter,
+ * waiting to be swapped in by a shrink.
+ */
+typedef struct {
+    int num_layers;                 // Number of layers, largest first
+    double probability;             // The new probability of the filter
+    uint64_t size;                  // Size of the filter when folded
+    uint64_t *factors;              // Fold factor of each layer, 1 if not folded
+    bloom_bloomfilter **layers;     // Folded layers, NULL if not folded
+    char **paths;                   // Temporary files of the layers, if any
+} bloom_shrink;
+
 /**
  * Initializes a bloom filter wrapper.
  * @arg config The configuration to use
@@ -74,6 +116,45 @@ filter_counters* bloomf_counters(bloom_filter *filter);
  */
 int bloomf_is_proxied(bloom_filter *filter);
 
+/**
+ * Takes the keys and bytes of a command from the rate
+ * limits of the filter. Commands are not refused, but
+ * the client should wait before sending more.
+ * @notes Thread safe.
+ * @arg filter The filter
+ * @arg ops The number of keys checked or set
+ * @arg bytes The bytes of the keys
+ * @arg now The current time from bucket_clock
+ * @return The seconds the client should wait,
+ * 0 if the filter is within its limits.
+ */
+double bloomf_charge(bloom_filter *filter, uint64_t ops, uint64_t bytes, double now);
+
+/**
+ * Changes the rate limits of the filter, and
+ * persists them with the filter configuration.
+ * @arg filter The filter
+ * @arg ops The most keys each second, 0 for no limit
+ * @arg bytes The most bytes each second, 0 for no limit
+ * @return 0 on success.
+ */
+int bloomf_set_limits(bloom_filter *filter, uint64_t ops, uint64_t bytes);
+
+/**
+ * Checks part of the data files of a filter against their
+ * checksums. Only proxied filters are checked, since a loaded
+ * filter was checked when it was faulted in. Corrupt pages
+ * are logged and counted in the checksum_errors counter.
+ * @notes Thread safe.
+ * @arg filter The filter
+ * @arg page The page to start at, counting over all the data
+ * files in order. Advanced past the pages checked.
+ * @arg max_pages The most pages to check
+ * @return The number of pages checked, 0 once there are no
+ * more, or if the filter is loaded.
+ */
+uint64_t bloomf_scrub(bloom_filter *filter, uint64_t *page, uint64_t max_pages);
+
 /**
  * Flushes the filter. Idempotent if the
  * filter is proxied or not dirty.
@@ -106,14 +187,166 @@ int bloomf_delete(bloom_filter *filter);
  */
 int bloomf_contains(bloom_filter *filter, char *key);
 
+/**
+ * Checks if the filter contains many keys. Large batches
+ * have their probes sorted by location, and the counters
+ * are updated once.
+ * @note Thread safe, as long as bloomf_add is not invoked.
+ * @arg filter The filter to check
+ * @arg keys The keys to check
+ * @arg num_keys The number of keys
+ * @arg result Set to 1 for each key contained, 0 if not
+ * @return 0 on success, -1 on error.
+ */
+int bloomf_contains_keys(bloom_filter *filter, char **keys, int num_keys, char *result);
+
 /**
  * Adds a key to the given filter
  * @arg filter The filter to add to
  * @arg key The key to add
- * @return 0 if not added, 1 if added.
+ * @return 0 if not added, 1 if added, -1 on error,
+ * -2 if the filter is sealed. Adding to a stable filter
+ * always decays older keys, even if not added.
  */
 int bloomf_add(bloom_filter *filter, char *key);
 
+/**
+ * Adds many keys to the given filter. This hashes all the
+ * keys before adding any, and updates the counters once.
+ * @arg filter The filter to add to
+ * @arg keys The keys to add
+ * @arg num_keys The number of keys
+ * @arg result Set to 1 for each key added, 0 if not added
+ * @return 0 on success, -1 on error, -2 if the filter is sealed.
+ * On error, the results are set for the keys before the failure.
+ */
+int bloomf_add_keys(bloom_filter *filter, char **keys, int num_keys, char *result);
+
+/**
+ * Writes out any buffered keys to the key log, and syncs
+ * it to disk. This is done before the bitmaps are flushed,
+ * so that no bit on disk is missing its key in the log.
+ * @note The caller must prevent concurrent bloomf_add
+ * and bloomf_close calls.
+ * @arg filter The filter
+ * @return 0 on success.
+ */
+int bloomf_flush_key_log(bloom_filter *filter);
+
+/**
+ * Gets the length of the key log, which marks the keys
+ * that a compaction will include.
+ * @arg filter The filter
+ * @arg len Output, the length in bytes
+ * @return 0 on success, -1 if the filter has no key log
+ * or it could not be synced, -2 if the filter is sealed.
+ */
+int bloomf_key_log_size(bloom_filter *filter, uint64_t *len);
+
+/**
+ * Builds a fuse filter from a list of newline separated keys,
+ * and writes it to a temporary file in the filter directory.
+ * This can be slow, and does not access the filter data, so it
+ * may run concurrently with checks and sets.
+ * @arg filter The filter
+ * @arg keys The keys to read, or NULL to read the key log
+ * @arg len The number of bytes of keys to read, or 0 to read
+ * until the end of the keys
+ * @return 0 on success.
+ */
+int bloomf_compact_build(bloom_filter *filter, FILE *keys, uint64_t len);
+
+/**
+ * Replaces the filter data with the fuse filter written by
+ * bloomf_compact_build. The filter is read-only from then on.
+ * @note The caller must prevent concurrent use of the filter.
+ * @arg filter The filter
+ * @arg log_len The length of the key log when the keys were
+ * read, from bloomf_key_log_size. Ignored without a key log.
+ * @return 0 on success, -2 if the filter is sealed,
+ * -3 if keys were logged since log_len, -1 on error.
+ */
+int bloomf_compact_seal(bloom_filter *filter, uint64_t log_len);
+
+/**
+ * Folds the layers of the filter into smaller layers, so that
+ * the false positive rate stays under a new probability. The
+ * folded layers are written to temporary files in the filter
+ * directory, unless the filter is in-memory.
+ * @note The caller must prevent concurrent bloomf_add calls.
+ * @arg filter The filter to shrink
+ * @arg prob The false positive probability to shrink to
+ * @arg shrink Output, set to the folded layers
+ * @return 0 on success, 1 if no layer can be folded,
+ * -2 if the filter is sealed or stable, -1 on error.
+ */
+int bloomf_shrink_build(bloom_filter *filter, double prob, bloom_shrink **shrink);
+
+/**
+ * Swaps the folded layers in place of the layers of the
+ * filter. Keys added since the build are folded in first.
+ * @note The caller must prevent concurrent use of the filter.
+ * @arg filter The filter
+ * @arg shrink The folded layers from bloomf_shrink_build
+ * @return 0 on success, -3 if a layer was added since
+ * the build, -1 on error.
+ */
+int bloomf_shrink_swap(bloom_filter *filter, bloom_shrink *shrink);
+
+/**
+ * Frees the folded layers, and removes any
+ * that were not swapped in.
+ * @arg shrink The folded layers
+ */
+void bloomf_shrink_free(bloom_shrink *shrink);
+
+/**
+ * Adopts a set of shared memory layers that were handed
+ * over by a previous bloomd process. Only valid for in-memory
+ * filters which have not yet been faulted in.
+ * @arg filter The filter
+ * @arg num The number of layers, ordered from largest to smallest
+ * @arg fds The file descriptors of the layers. Not closed.
+ * @arg sizes The byte size of each layer
+ * @return 0 on success.
+ */
+int bloomf_adopt_layers(bloom_filter *filter, int num, int *fds, uint64_t *sizes);
+
+/**
+ * Copies the layers of an in-memory filter so that they can
+ * be written out as a snapshot without blocking writers.
+ * @note The caller must prevent concurrent bloomf_add calls.
+ * @arg filter The filter to copy
+ * @arg snap Output, set to the new copy
+ * @return 0 on success, 1 if nothing changed since the last
+ * snapshot, negative on error.
+ */
+int bloomf_snapshot_copy(bloom_filter *filter, bloom_snapshot **snap);
+
+/**
+ * Writes a copy of the layers out to the filter directory.
+ * The previous snapshot is replaced only once all the layers
+ * are safely on disk.
+ * @arg filter The filter that was copied
+ * @arg snap The copy to write out
+ * @return 0 on success.
+ */
+int bloomf_snapshot_write(bloom_filter *filter, bloom_snapshot *snap);
+
+/**
+ * Frees a copy made with bloomf_snapshot_copy.
+ * @arg snap The copy to free
+ */
+void bloomf_snapshot_free(bloom_snapshot *snap);
+
+/**
+ * Snapshots an in-memory filter if it has changed
+ * since the last snapshot. Used when closing.
+ * @arg filter The filter
+ * @return 0 on success.
+ */
+int bloomf_snapshot(bloom_filter *filter);
+
 /**
  * Gets the size of the filter in keys
  * @note Thread safe.
@@ -138,4 +371,13 @@ uint64_t bloomf_capacity(bloom_filter *filter);
  */
 uint64_t bloomf_byte_size(bloom_filter *filter);
 
+/**
+ * Estimates how many bytes closing the filter will
+ * write to disk. Used to schedule the largest flushes first.
+ * @note Thread safe, but may be inconsistent.
+ * @arg filter The filter
+ * @return The number of dirty bytes
+ */
+uint64_t bloomf_dirty_bytes(bloom_filter *filter);
+
 #endif
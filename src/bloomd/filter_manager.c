@@ -4,10 +4,13 @@
 #include <pthread.h>
 #include <dirent.h>
 #include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
 #include "spinlock.h"
 #include "filter_manager.h"
 #include "art.h"
 #include "filter.h"
+#include "logger.h"
 #include "type_compat.h"
 
 /**
@@ -25,6 +28,7 @@ typedef struct {
     volatile int is_active;         // Set to 0 when we are trying to delete it
     volatile int is_hot;            // Used to mark a filter as hot
     volatile int should_delete;     // Used to control deletion
+    volatile int is_rewriting;      // Set while a compaction or shrink runs
 
     bloom_filter *filter;    // The actual filter object
     pthread_rwlock_t rwlock; // Protects the filter
@@ -113,8 +117,50 @@ struct bloom_filtmgr {
 
     // Delta lists for non-merged operations
     filter_list *delta;
+
+    // Set once any filter has rate limits
+    volatile int has_limits;
 };
 
+/**
+ * Used to close the filters in parallel on shutdown.
+ * Workers claim filters in order, which is sorted so that
+ * the largest flushes are started first.
+ */
+typedef struct {
+    bloom_filter_wrapper *filter;
+    uint64_t dirty_bytes;
+} shutdown_filter;
+
+typedef struct {
+    shutdown_filter *filters;
+    int num_filters;
+    int max_filters;
+
+    pthread_mutex_t lock;   // Protects the fields below
+    int next;               // Next filter to claim
+    int closed;             // Number of closed filters
+    uint64_t total_bytes;   // Total dirty bytes
+    uint64_t closed_bytes;  // Dirty bytes of closed filters
+    int last_percent;       // Last logged progress
+} shutdown_pool;
+
+/**
+ * Used to iterate the filters in name order. Filters that
+ * are only in the delta list are merged in as we go.
+ */
+typedef struct {
+    char *prefix;
+    int prefix_len;
+    int stop_on_mismatch;   // Keys past the prefix end the iteration
+    bloom_filter_wrapper **deltas;
+    int num_deltas;
+    int next_delta;
+    filter_iter_cb cb;
+    void *data;
+    int res;                // Return of the callback that stopped
+} filter_iter;
+
 /**
  * We warn if there are this many outstanding versions
  * that cannot be vacuumed
@@ -134,6 +180,12 @@ static int add_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *confi
 static int filter_map_list_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
 static int filter_map_list_cold_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
 static int filter_map_delete_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int filter_map_iter_cb(void *data, const unsigned char *key, uint32_t key_len, void *value);
+static int iter_deltas_before(filter_iter *iter, const char *name);
+static int compare_wrapper_names(const void *a, const void *b);
+static void add_shutdown_filter(shutdown_pool *pool, bloom_filter_wrapper *filt);
+static void close_filters(bloom_filtmgr *mgr, shutdown_pool *pool);
+static int timediff_msec(struct timeval *t1, struct timeval *t2);
 static int load_existing_filters(bloom_filtmgr *mgr);
 static unsigned long long create_delta_update(bloom_filtmgr *mgr, delta_type type, bloom_filter_wrapper *filt);
 static void* filtmgr_thread_main(void *in);
@@ -166,7 +218,7 @@ int init_filter_manager(bloom_config *config, int vacuum, bloom_filtmgr **mgr) {
     // Allocate the initial art tree
     int res = init_art_tree(m->filter_map);
     if (res) {
-        syslog(LOG_ERR, "Failed to allocate filter map!");
+        bloom_log(LOG_ERR, "Failed to allocate filter map!");
         free(m);
         return -1;
     }
@@ -177,7 +229,7 @@ int init_filter_manager(bloom_config *config, int vacuum, bloom_filtmgr **mgr) {
     // Initialize the alternate map
     res = art_copy(m->alt_filter_map, m->filter_map);
     if (res) {
-        syslog(LOG_ERR, "Failed to copy filter map to alternate!");
+        bloom_log(LOG_ERR, "Failed to copy filter map to alternate!");
         destroy_filter_manager(m);
         return -1;
     }
@@ -204,8 +256,10 @@ int destroy_filter_manager(bloom_filtmgr *mgr) {
     mgr->should_run = 0;
     if (mgr->vacuum_thread) pthread_join(mgr->vacuum_thread, NULL);
 
-    // Nuke all the keys in the current version.
-    art_iter(mgr->filter_map, filter_map_delete_cb, mgr);
+    // Gather all the keys in the current version.
+    shutdown_pool pool;
+    memset(&pool, 0, sizeof(pool));
+    art_iter(mgr->filter_map, filter_map_delete_cb, &pool);
 
     // Handle any delta operations
     filter_list *next, *current = mgr->delta;
@@ -213,12 +267,15 @@ int destroy_filter_manager(bloom_filtmgr *mgr) {
         // Only delete pending creates, pending
         // deletes are still in the primary tree
         if (current->type == CREATE)
-            delete_filter(current->filter);
+            add_shutdown_filter(&pool, current->filter);
         next = current->next;
         free(current);
         current = next;
     }
 
+    // Close all the filters
+    close_filters(mgr, &pool);
+
     // Free the clients
     filtmgr_client *cl_next, *cl = mgr->clients;
     while (cl) {
@@ -317,11 +374,64 @@ int filtmgr_flush_filter(bloom_filtmgr *mgr, char *filter_name) {
     bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
     if (!filt) return -1;
 
+    // Sync the logged keys before the bits, so that a crash
+    // cannot leave set bits whose keys a compaction would miss.
+    // Sets may be writing to the log meanwhile.
+    if (filt->filter->filter_config.key_log) {
+        pthread_rwlock_rdlock(&filt->rwlock);
+        bloomf_flush_key_log(filt->filter);
+        pthread_rwlock_unlock(&filt->rwlock);
+    }
+
     // Flush
     bloomf_flush(filt->filter);
     return 0;
 }
 
+/**
+ * Checks part of the data files of a cold filter
+ * against their checksums.
+ * @arg filter_name The name of the filter
+ * @arg page The page to start at. Advanced past the pages checked.
+ * @arg max_pages The most pages to check
+ * @return The number of pages checked, 0 once there are
+ * no more. -1 if the filter does not exist.
+ */
+int64_t filtmgr_scrub_filter(bloom_filtmgr *mgr, char *filter_name, uint64_t *page, uint64_t max_pages) {
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+    return bloomf_scrub(filt->filter, page, max_pages);
+}
+
+/**
+ * Snapshots an in-memory filter to disk. The filter is
+ * copied under the read lock, so that sets are only blocked
+ * while copying, and the copy is written out without a lock.
+ * @arg filter_name The name of the filter
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 if the snapshot failed.
+ */
+int filtmgr_snapshot_filter(bloom_filtmgr *mgr, char *filter_name) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    // Skip if we are not in memory
+    if (!filt->filter->filter_config.in_memory) return 0;
+
+    // Copy the layers under the read lock
+    bloom_snapshot *snap;
+    pthread_rwlock_rdlock(&filt->rwlock);
+    int res = bloomf_snapshot_copy(filt->filter, &snap);
+    pthread_rwlock_unlock(&filt->rwlock);
+    if (res) return (res == 1) ? 0 : -2;
+
+    // Write out the copy
+    res = bloomf_snapshot_write(filt->filter, snap);
+    bloomf_snapshot_free(snap);
+    return (res) ? -2 : 0;
+}
+
 /**
  * Checks for the presence of keys in a given filter
  * @arg filter_name The name of the filter containing the keys
@@ -341,12 +451,7 @@ int filtmgr_check_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int n
     pthread_rwlock_rdlock(&filt->rwlock);
 
     // Check the keys, store the results
-    int res = 0;
-    for (int i=0; i<num_keys; i++) {
-        res = bloomf_contains(filt->filter, keys[i]);
-        if (res == -1) break;
-        *(result+i) = res;
-    }
+    int res = bloomf_contains_keys(filt->filter, keys, num_keys, result);
 
     // Mark as hot
     filt->is_hot = 1;
@@ -364,7 +469,7 @@ int filtmgr_check_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int n
  * @arg result Ouput array, stores a 0 if the key already is set
  * or 1 if the key is set.
  * * @return 0 on success, -1 if the filter does not exist.
- * -2 on internal error.
+ * -2 on internal error, -3 if the filter is read-only.
  */
 int filtmgr_set_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int num_keys, char *result) {
     // Get the filter
@@ -375,21 +480,109 @@ int filtmgr_set_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int num
     pthread_rwlock_wrlock(&filt->rwlock);
 
     // Set the keys, store the results
-    int res = 0;
-    for (int i=0; i<num_keys; i++) {
-        res = bloomf_add(filt->filter, keys[i]);
-        if (res == -1) break;
-        *(result+i) = res;
-    }
+    int res = bloomf_add_keys(filt->filter, keys, num_keys, result);
 
     // Mark as hot
     filt->is_hot = 1;
 
     // Release the lock
     pthread_rwlock_unlock(&filt->rwlock);
+    if (res == -2) return -3;
     return (res == -1) ? -2 : 0;
 }
 
+/**
+ * Compacts a filter into a read-only fuse filter built from its
+ * key log. The fuse filter is built without holding the lock, so
+ * the filter can be used meanwhile, but any sets made during the
+ * build cause the compaction to fail.
+ * @arg filter_name The name of the filter
+ * @return 0 on success, -1 if the filter does not exist,
+ * -2 on internal error, -3 if the filter is already sealed,
+ * -4 if the filter has no key log, -5 if keys were set during
+ * the compaction, -6 if a compaction is in progress.
+ */
+int filtmgr_compact_filter(bloom_filtmgr *mgr, char *filter_name) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    // Only one compaction at a time
+    if (!__sync_bool_compare_and_swap(&filt->is_rewriting, 0, 1)) return -6;
+
+    // Mark the end of the keys to include
+    uint64_t log_len;
+    pthread_rwlock_wrlock(&filt->rwlock);
+    int res = bloomf_key_log_size(filt->filter, &log_len);
+    pthread_rwlock_unlock(&filt->rwlock);
+    if (res) goto LEAVE;
+
+    // Build without the lock
+    res = bloomf_compact_build(filt->filter, NULL, log_len);
+    if (res) goto LEAVE;
+
+    // Swap in the fuse filter
+    pthread_rwlock_wrlock(&filt->rwlock);
+    res = bloomf_compact_seal(filt->filter, log_len);
+    pthread_rwlock_unlock(&filt->rwlock);
+
+LEAVE:
+    filt->is_rewriting = 0;
+    switch (res) {
+        case 0: return 0;
+        case -1: return (filt->filter->filter_config.key_log) ? -2 : -4;
+        case -2: return -3;
+        case -3: return -5;
+        default: return -2;
+    }
+}
+
+/**
+ * Shrinks a filter by folding its layers, so that its false
+ * positive rate stays under a probability. The layers are folded
+ * while holding the read lock, so checks continue meanwhile, and
+ * swapped in under the write lock.
+ * @arg filter_name The name of the filter
+ * @arg prob The probability to shrink to, or 0 to use
+ * the probability of the filter
+ * @return 0 on success, 1 if the filter is already as small as
+ * it can be, -1 if the filter does not exist, -2 on internal error,
+ * -3 if the filter is sealed or stable, -5 if the filter grew
+ * during the shrink, -6 if a compaction or shrink is in progress.
+ */
+int filtmgr_shrink_filter(bloom_filtmgr *mgr, char *filter_name, double prob) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    // Only one rewrite at a time
+    if (!__sync_bool_compare_and_swap(&filt->is_rewriting, 0, 1)) return -6;
+    if (prob == 0) prob = filt->filter->filter_config.default_probability;
+
+    // Fold the layers, blocking sets but not checks
+    bloom_shrink *shrink;
+    pthread_rwlock_rdlock(&filt->rwlock);
+    int res = bloomf_shrink_build(filt->filter, prob, &shrink);
+    pthread_rwlock_unlock(&filt->rwlock);
+    if (res) goto LEAVE;
+
+    // Swap in the folded layers
+    pthread_rwlock_wrlock(&filt->rwlock);
+    res = bloomf_shrink_swap(filt->filter, shrink);
+    pthread_rwlock_unlock(&filt->rwlock);
+    bloomf_shrink_free(shrink);
+
+LEAVE:
+    filt->is_rewriting = 0;
+    switch (res) {
+        case 0: return 0;
+        case 1: return 1;
+        case -2: return -3;
+        case -3: return -5;
+        default: return -2;
+    }
+}
+
 /**
  * Creates a new filter of the given name and parameters.
  * @arg filter_name The name of the filter
@@ -529,6 +722,79 @@ LEAVE:
     return 0;
 }
 
+/**
+ * Adopts shared memory layers that were handed over by
+ * a previous bloomd process into an in-memory filter.
+ * @arg filter_name The name of the filter
+ * @arg num_layers The number of layers, largest first
+ * @arg fds The file descriptors of the layers. Not closed.
+ * @arg sizes The byte size of each layer
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 if the layers could not be adopted.
+ */
+int filtmgr_adopt_filter(bloom_filtmgr *mgr, char *filter_name, int num_layers, int *fds, uint64_t *sizes) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    // Acquire the write lock
+    pthread_rwlock_wrlock(&filt->rwlock);
+    int res = bloomf_adopt_layers(filt->filter, num_layers, fds, sizes);
+    pthread_rwlock_unlock(&filt->rwlock);
+    return (res) ? -2 : 0;
+}
+
+/**
+ * Takes the keys and bytes of a command from the rate limits
+ * of a filter. Until some filter has limits, this returns
+ * without looking the filter up.
+ * @arg filter_name The name of the filter
+ * @arg ops The number of keys checked or set
+ * @arg bytes The bytes of the keys
+ * @arg now The current time from bucket_clock
+ * @arg wait Output, the seconds the client should wait
+ * before its next command, 0 if within the limits
+ * @return 0 on success, -1 if the filter does not exist.
+ */
+int filtmgr_charge(bloom_filtmgr *mgr, char *filter_name, uint64_t ops, uint64_t bytes, double now, double *wait) {
+    *wait = 0;
+    if (!mgr->has_limits) return 0;
+
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    *wait = bloomf_charge(filt->filter, ops, bytes, now);
+    return 0;
+}
+
+/**
+ * Changes the rate limits of a filter.
+ * @arg filter_name The name of the filter
+ * @arg ops The most keys each second, 0 for no limit,
+ * or -1 to leave it unchanged
+ * @arg bytes The most bytes each second, 0 for no limit,
+ * or -1 to leave it unchanged
+ * @return 0 on success, -1 if the filter does not exist,
+ * -2 if the limits could not be persisted.
+ */
+int filtmgr_limit_filter(bloom_filtmgr *mgr, char *filter_name, int64_t ops, int64_t bytes) {
+    // Get the filter
+    bloom_filter_wrapper *filt = take_filter(mgr, filter_name);
+    if (!filt) return -1;
+
+    // Serialize with other changes to the filter
+    pthread_rwlock_wrlock(&filt->rwlock);
+    bloom_filter_config *config = &filt->filter->filter_config;
+    if (ops < 0) ops = config->rate_ops;
+    if (bytes < 0) bytes = config->rate_bytes;
+    int res = bloomf_set_limits(filt->filter, ops, bytes);
+    pthread_rwlock_unlock(&filt->rwlock);
+
+    if (ops || bytes) mgr->has_limits = 1;
+    return (res) ? -2 : 0;
+}
+
 /**
  * Allocates space for and returns a linked
  * list of all the filters.
@@ -612,6 +878,64 @@ int filtmgr_filter_cb(bloom_filtmgr *mgr, char *filter_name, filter_cb cb, void*
 }
 
 
+/**
+ * Invokes a callback with each active filter, in name order,
+ * without copying the names. Like filtmgr_filter_cb, the filters
+ * must only be used to read metrics. The callback can stop
+ * the iteration by returning non-zero, which lets a caller
+ * read the filters a page at a time.
+ * @arg mgr The manager to list from
+ * @arg prefix The prefix to list or NULL
+ * @arg after Only filters named after this are listed, or NULL
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+int filtmgr_iter_filters(bloom_filtmgr *mgr, char *prefix, char *after, filter_iter_cb cb, void* data) {
+    filter_iter iter = {prefix, (prefix) ? strlen(prefix) : 0, 0, NULL, 0, 0, cb, data, 0};
+
+    // Gather the new filters that are not in the primary map yet.
+    // There are only a few, so they are sorted on each call.
+    int max_deltas = 0;
+    filter_list *current = (mgr->primary_vsn == mgr->vsn) ? NULL : mgr->delta;
+    while (current) {
+        bloom_filter_wrapper *f = current->filter;
+        if (current->type == CREATE && f->is_active &&
+            (!iter.prefix_len || !strncmp(f->filter->filter_name, prefix, iter.prefix_len)) &&
+            (!after || strcmp(f->filter->filter_name, after) > 0)) {
+            if (iter.num_deltas == max_deltas) {
+                max_deltas = (max_deltas) ? max_deltas * 2 : 8;
+                iter.deltas = realloc(iter.deltas, max_deltas * sizeof(bloom_filter_wrapper*));
+            }
+            iter.deltas[iter.num_deltas++] = f;
+        }
+
+        // Don't seek past what the primary map incorporates
+        if (current->vsn == mgr->primary_vsn + 1)
+            break;
+        current = current->next;
+    }
+    if (iter.num_deltas > 1)
+        qsort(iter.deltas, iter.num_deltas, sizeof(bloom_filter_wrapper*), compare_wrapper_names);
+
+    // Start from the cursor if it is past the start of the prefix,
+    // and end at the first name that leaves the prefix
+    if (after && (!iter.prefix_len || strcmp(after, prefix) >= 0)) {
+        iter.stop_on_mismatch = 1;
+        art_iter_after(mgr->filter_map, (unsigned char*)after, strlen(after)+1, filter_map_iter_cb, &iter);
+    } else if (iter.prefix_len) {
+        art_iter_prefix(mgr->filter_map, (unsigned char*)prefix, iter.prefix_len, filter_map_iter_cb, &iter);
+    } else {
+        art_iter(mgr->filter_map, filter_map_iter_cb, &iter);
+    }
+
+    // List the new filters after the last name in the map
+    if (!iter.res) iter_deltas_before(&iter, NULL);
+    if (iter.deltas) free(iter.deltas);
+    return iter.res;
+}
+
+
 /**
  * Convenience method to cleanup a filter list.
  */
@@ -670,8 +994,10 @@ static void delete_filter(bloom_filter_wrapper *filt) {
     // Delete or Close the filter
     if (filt->should_delete)
         bloomf_delete(filt->filter);
-    else
+    else {
+        bloomf_snapshot(filt->filter);
         bloomf_close(filt->filter);
+    }
 
     // Cleanup the filter
     destroy_bloom_filter(filt->filter);
@@ -715,6 +1041,10 @@ static int add_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *confi
         return -1;
     }
 
+    // Rate limits are only checked once a filter has them
+    bloom_filter_config *filt_config = &filt->filter->filter_config;
+    if (filt_config->rate_ops || filt_config->rate_bytes) mgr->has_limits = 1;
+
     // Check if we are adding a delta value or directly updating ART tree
     if (delta)
         create_delta_update(mgr, CREATE, filt);
@@ -723,6 +1053,52 @@ static int add_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *confi
     return 0;
 }
 
+/**
+ * Called as part of the ART iteration of filtmgr_iter_filters,
+ * to pass each active filter on to the callback in order.
+ */
+static int filter_map_iter_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
+    (void)key_len;
+    filter_iter *iter = data;
+    bloom_filter_wrapper *filt = value;
+    char *name = (char*)key;
+
+    // Stop once the names leave the prefix
+    if (iter->prefix_len && strncmp(name, iter->prefix, iter->prefix_len)) {
+        return iter->stop_on_mismatch;
+    }
+
+    // New filters that sort before this one go first
+    if (iter_deltas_before(iter, name)) return 1;
+    if (!filt->is_active) return 0;
+    iter->res = iter->cb(iter->data, name, filt->filter);
+    return iter->res;
+}
+
+/**
+ * Passes the new filters named before a given name
+ * on to the callback, or all of them if the name is NULL.
+ * @return Non-zero if the callback stopped the iteration.
+ */
+static int iter_deltas_before(filter_iter *iter, const char *name) {
+    bloom_filter_wrapper *f;
+    while (iter->next_delta < iter->num_deltas) {
+        f = iter->deltas[iter->next_delta];
+        if (name && strcmp(f->filter->filter_name, name) >= 0) break;
+        iter->next_delta++;
+        iter->res = iter->cb(iter->data, f->filter->filter_name, f->filter);
+        if (iter->res) return iter->res;
+    }
+    return 0;
+}
+
+// Sorts filter wrappers by name
+static int compare_wrapper_names(const void *a, const void *b) {
+    bloom_filter_wrapper *fa = *(bloom_filter_wrapper**)a;
+    bloom_filter_wrapper *fb = *(bloom_filter_wrapper**)b;
+    return strcmp(fa->filter->filter_name, fb->filter->filter_name);
+}
+
 /**
  * Called as part of the hashmap callback
  * to list all the filters. Only works if value is
@@ -795,22 +1171,141 @@ static int filter_map_list_cold_cb(void *data, const unsigned char *key, uint32_
 
 /**
  * Called as part of the hashmap callback
- * to cleanup the filters.
+ * to gather the filters for cleanup.
  */
 static int filter_map_delete_cb(void *data, const unsigned char *key, uint32_t key_len, void *value) {
-    (void)data;
     (void)key;
     (void)key_len;
 
     // Cast the inputs
+    shutdown_pool *pool = data;
     bloom_filter_wrapper *filt = value;
 
     // Delete, but not the underlying files
     filt->should_delete = 0;
-    delete_filter(filt);
+    add_shutdown_filter(pool, filt);
     return 0;
 }
 
+/**
+ * Adds a filter to be closed on shutdown
+ */
+static void add_shutdown_filter(shutdown_pool *pool, bloom_filter_wrapper *filt) {
+    if (pool->num_filters == pool->max_filters) {
+        pool->max_filters = (pool->max_filters) ? pool->max_filters * 2 : 64;
+        pool->filters = realloc(pool->filters, pool->max_filters * sizeof(shutdown_filter));
+    }
+    shutdown_filter *sf = pool->filters + pool->num_filters++;
+    sf->filter = filt;
+    sf->dirty_bytes = bloomf_dirty_bytes(filt->filter);
+    pool->total_bytes += sf->dirty_bytes;
+}
+
+/**
+ * Sorts the shutdown filters by descending dirty bytes
+ */
+static int shutdown_filter_cmp(const void *a, const void *b) {
+    uint64_t a_bytes = ((shutdown_filter*)a)->dirty_bytes;
+    uint64_t b_bytes = ((shutdown_filter*)b)->dirty_bytes;
+    if (a_bytes == b_bytes) return 0;
+    return (a_bytes > b_bytes) ? -1 : 1;
+}
+
+/**
+ * Worker that claims and closes filters until there are none left.
+ */
+static void* shutdown_worker_main(void *in) {
+    shutdown_pool *pool = in;
+    shutdown_filter *sf;
+    int percent;
+    while (1) {
+        // Claim the next filter
+        pthread_mutex_lock(&pool->lock);
+        if (pool->next == pool->num_filters) {
+            pthread_mutex_unlock(&pool->lock);
+            break;
+        }
+        sf = pool->filters + pool->next++;
+        pthread_mutex_unlock(&pool->lock);
+
+        // Close it
+        delete_filter(sf->filter);
+
+        // Update the progress, log every 10%
+        pthread_mutex_lock(&pool->lock);
+        pool->closed++;
+        pool->closed_bytes += sf->dirty_bytes;
+        if (pool->total_bytes)
+            percent = pool->closed_bytes * 100 / pool->total_bytes;
+        else
+            percent = pool->closed * 100 / pool->num_filters;
+        if (percent / 10 > pool->last_percent / 10) {
+            pool->last_percent = percent;
+            bloom_log(LOG_INFO, "Shutdown progress: %d%%. Closed %d of %d filters, %llu of %llu MB.",
+                    percent, pool->closed, pool->num_filters,
+                    (unsigned long long)(pool->closed_bytes >> 20),
+                    (unsigned long long)(pool->total_bytes >> 20));
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+/**
+ * Closes all the filters in the pool, using multiple
+ * threads so that shutdown is not bound by serial flushes.
+ */
+static void close_filters(bloom_filtmgr *mgr, shutdown_pool *pool) {
+    // Time how long this takes
+    struct timeval start, end;
+    gettimeofday(&start, NULL);
+
+    // Start the biggest flushes first, so they overlap the most
+    qsort(pool->filters, pool->num_filters, sizeof(shutdown_filter), shutdown_filter_cmp);
+
+    // Determine the number of workers
+    int workers = mgr->config->shutdown_workers;
+    if (workers <= 0) workers = sysconf(_SC_NPROCESSORS_ONLN);
+    if (workers > pool->num_filters) workers = pool->num_filters;
+    if (workers < 1) workers = 1;
+
+    bloom_log(LOG_INFO, "Closing %d filters with %d workers. Dirty: %llu MB.",
+            pool->num_filters, workers, (unsigned long long)(pool->total_bytes >> 20));
+
+    // Close the filters, using this thread as one of the workers
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_t *threads = calloc(workers, sizeof(pthread_t));
+    int started = 0;
+    for (int i=1; i < workers; i++) {
+        if (pthread_create(&threads[started], NULL, shutdown_worker_main, pool)) {
+            bloom_log(LOG_WARNING, "Failed to start shutdown worker!");
+            break;
+        }
+        started++;
+    }
+    shutdown_worker_main(pool);
+    for (int i=0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->filters);
+
+    // Compute the elapsed time
+    gettimeofday(&end, NULL);
+    bloom_log(LOG_INFO, "Closed all filters. Total time: %d msec.", timediff_msec(&start, &end));
+}
+
+/**
+ * Computes the difference in time in milliseconds
+ * between two timeval structures.
+ */
+static int timediff_msec(struct timeval *t1, struct timeval *t2) {
+    uint64_t micro1 = t1->tv_sec * 1000000 + t1->tv_usec;
+    uint64_t micro2= t2->tv_sec * 1000000 + t2->tv_usec;
+    return (micro2-micro1) / 1000;
+}
+
 /**
  * Works with scandir to filter out non-bloomd folders.
  */
@@ -843,17 +1338,17 @@ static int load_existing_filters(bloom_filtmgr *mgr) {
 
     num = scandir(mgr->config->data_dir, &namelist, filter_bloomd_folders, NULL);
     if (num == -1) {
-        syslog(LOG_ERR, "Failed to scan files for existing filters!");
+        bloom_log(LOG_ERR, "Failed to scan files for existing filters!");
         return -1;
     }
-    syslog(LOG_INFO, "Found %d existing filters", num);
+    bloom_log(LOG_INFO, "Found %d existing filters", num);
 
     // Add all the filters
     for (int i=0; i< num; i++) {
         char *folder_name = namelist[i]->d_name;
         char *filter_name = folder_name + FOLDER_PREFIX_LEN;
         if (add_filter(mgr, filter_name, mgr->config, 0, 0)) {
-            syslog(LOG_ERR, "Failed to load filter '%s'!", filter_name);
+            bloom_log(LOG_ERR, "Failed to load filter '%s'!", filter_name);
         }
     }
 
@@ -1079,7 +1574,7 @@ static void* filtmgr_thread_main(void *in) {
             // Release the lock and see if we should loop back
             pthread_mutex_unlock(&mgr->write_lock);
             if (should_continue) {
-                syslog(LOG_INFO, "All updates applied. (vsn: %llu)", mgr_vsn);
+                bloom_log(LOG_INFO, "All updates applied. (vsn: %llu)", mgr_vsn);
                 continue;
             }
         }
@@ -1089,10 +1584,10 @@ static void* filtmgr_thread_main(void *in) {
 
         // Warn if there are a lot of outstanding deltas
         if (mgr->vsn - min_vsn > WARN_THRESHOLD) {
-            syslog(LOG_WARNING, "Many delta versions detected! min: %llu (vsn: %llu)",
+            bloom_log(LOG_WARNING, "Many delta versions detected! min: %llu (vsn: %llu)",
                     min_vsn, mgr->vsn);
         } else {
-            syslog(LOG_DEBUG, "Applying delta update up to: %llu (vsn: %llu)",
+            bloom_log(LOG_DEBUG, "Applying delta update up to: %llu (vsn: %llu)",
                     min_vsn, mgr->vsn);
         }
 
@@ -1126,7 +1621,7 @@ static void* filtmgr_thread_main(void *in) {
         clear_pending_deletes(mgr);
 
         // Log that we finished
-        syslog(LOG_INFO, "Finished delta updates up to: %llu (vsn: %llu)",
+        bloom_log(LOG_INFO, "Finished delta updates up to: %llu (vsn: %llu)",
                 min_vsn, mgr->vsn);
     }
     return NULL;
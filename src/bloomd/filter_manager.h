@@ -65,6 +65,27 @@ void filtmgr_client_leave(bloom_filtmgr *mgr);
  */
 int filtmgr_flush_filter(bloom_filtmgr *mgr, char *filter_name);
 
+/**
+ * Checks part of the data files of a cold filter
+ * against their checksums.
+ * @arg filter_name The name of the filter
+ * @arg page The page to start at. Advanced past the pages checked.
+ * @arg max_pages The most pages to check
+ * @return The number of pages checked, 0 once there are
+ * no more. -1 if the filter does not exist.
+ */
+int64_t filtmgr_scrub_filter(bloom_filtmgr *mgr, char *filter_name, uint64_t *page, uint64_t max_pages);
+
+/**
+ * Snapshots an in-memory filter to disk. The filter is
+ * copied under the read lock, so that sets are only blocked
+ * while copying, and the copy is written out without a lock.
+ * @arg filter_name The name of the filter
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 if the snapshot failed.
+ */
+int filtmgr_snapshot_filter(bloom_filtmgr *mgr, char *filter_name);
+
 /**
  * Checks for the presence of keys in a given filter
  * @arg filter_name The name of the filter containing the keys
@@ -85,7 +106,7 @@ int filtmgr_check_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int n
  * @arg result Ouput array, stores a 0 if the key already is set
  * or 1 if the key is set.
  * @return 0 on success, -1 if the filter does not exist.
- * -2 on internal error.
+ * -2 on internal error, -3 if the filter is read-only.
  */
 int filtmgr_set_keys(bloom_filtmgr *mgr, char *filter_name, char **keys, int num_keys, char *result);
 
@@ -106,6 +127,34 @@ int filtmgr_create_filter(bloom_filtmgr *mgr, char *filter_name, bloom_config *c
  */
 int filtmgr_drop_filter(bloom_filtmgr *mgr, char *filter_name);
 
+/**
+ * Compacts a filter into a read-only fuse filter built from its
+ * key log. The fuse filter is built without holding the lock, so
+ * the filter can be used meanwhile, but any sets made during the
+ * build cause the compaction to fail.
+ * @arg filter_name The name of the filter
+ * @return 0 on success, -1 if the filter does not exist,
+ * -2 on internal error, -3 if the filter is already sealed,
+ * -4 if the filter has no key log, -5 if keys were set during
+ * the compaction, -6 if a compaction or shrink is in progress.
+ */
+int filtmgr_compact_filter(bloom_filtmgr *mgr, char *filter_name);
+
+/**
+ * Shrinks a filter by folding its layers, so that its false
+ * positive rate stays under a probability. The layers are folded
+ * while holding the read lock, so checks continue meanwhile, and
+ * swapped in under the write lock.
+ * @arg filter_name The name of the filter
+ * @arg prob The probability to shrink to, or 0 to use
+ * the probability of the filter
+ * @return 0 on success, 1 if the filter is already as small as
+ * it can be, -1 if the filter does not exist, -2 on internal error,
+ * -3 if the filter is sealed or stable, -5 if the filter grew
+ * during the shrink, -6 if a compaction or shrink is in progress.
+ */
+int filtmgr_shrink_filter(bloom_filtmgr *mgr, char *filter_name, double prob);
+
 /**
  * Unmaps the filter from memory, but leaves it
  * registered in the filter manager. This is rarely invoked
@@ -126,6 +175,44 @@ int filtmgr_unmap_filter(bloom_filtmgr *mgr, char *filter_name);
  */
 int filtmgr_clear_filter(bloom_filtmgr *mgr, char *filter_name);
 
+/**
+ * Adopts shared memory layers that were handed over by
+ * a previous bloomd process into an in-memory filter.
+ * @arg filter_name The name of the filter
+ * @arg num_layers The number of layers, largest first
+ * @arg fds The file descriptors of the layers. Not closed.
+ * @arg sizes The byte size of each layer
+ * @return 0 on success, -1 if the filter does not exist.
+ * -2 if the layers could not be adopted.
+ */
+int filtmgr_adopt_filter(bloom_filtmgr *mgr, char *filter_name, int num_layers, int *fds, uint64_t *sizes);
+
+/**
+ * Takes the keys and bytes of a command from the rate limits
+ * of a filter. Until some filter has limits, this returns
+ * without looking the filter up.
+ * @arg filter_name The name of the filter
+ * @arg ops The number of keys checked or set
+ * @arg bytes The bytes of the keys
+ * @arg now The current time from bucket_clock
+ * @arg wait Output, the seconds the client should wait
+ * before its next command, 0 if within the limits
+ * @return 0 on success, -1 if the filter does not exist.
+ */
+int filtmgr_charge(bloom_filtmgr *mgr, char *filter_name, uint64_t ops, uint64_t bytes, double now, double *wait);
+
+/**
+ * Changes the rate limits of a filter.
+ * @arg filter_name The name of the filter
+ * @arg ops The most keys each second, 0 for no limit,
+ * or -1 to leave it unchanged
+ * @arg bytes The most bytes each second, 0 for no limit,
+ * or -1 to leave it unchanged
+ * @return 0 on success, -1 if the filter does not exist,
+ * -2 if the limits could not be persisted.
+ */
+int filtmgr_limit_filter(bloom_filtmgr *mgr, char *filter_name, int64_t ops, int64_t bytes);
+
 /**
  * Allocates space for and returns a linked
  * list of all the filters. The memory should be free'd by
@@ -164,6 +251,22 @@ void filtmgr_cleanup_list(bloom_filter_list_head *head);
 typedef void(*filter_cb)(void* in, char *filter_name, bloom_filter *filter);
 int filtmgr_filter_cb(bloom_filtmgr *mgr, char *filter_name, filter_cb cb, void* data);
 
+/**
+ * Invokes a callback with each active filter, in name order,
+ * without copying the names. Like filtmgr_filter_cb, the filters
+ * must only be used to read metrics. The callback can stop
+ * the iteration by returning non-zero, which lets a caller
+ * read the filters a page at a time.
+ * @arg mgr The manager to list from
+ * @arg prefix The prefix to list or NULL
+ * @arg after Only filters named after this are listed, or NULL
+ * @arg cb The callback function to invoke
+ * @arg data Opaque handle passed to the callback
+ * @return 0 on success, or the return of the callback.
+ */
+typedef int(*filter_iter_cb)(void* in, char *filter_name, bloom_filter *filter);
+int filtmgr_iter_filters(bloom_filtmgr *mgr, char *prefix, char *after, filter_iter_cb cb, void* data);
+
 /**
  * This method is used to force a vacuum up to the current
  * version. It is generally unsafe to use in bloomd,
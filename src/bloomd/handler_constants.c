@@ -1,5 +1,3 @@
-#include <regex.h>
-
 /*
  * Various messages and responses
  */
@@ -18,6 +16,9 @@ static const int UNEXPECTED_ARGS_LEN = sizeof(UNEXPECTED_ARGS) - 1;
 static const char FILT_KEY_NEEDED[] = "Must provide filter name and key";
 static const int FILT_KEY_NEEDED_LEN = sizeof(FILT_KEY_NEEDED) - 1;
 
+static const char BATCH_ARGS_NEEDED[] = "Must provide filter name, op and key for each entry";
+static const int BATCH_ARGS_NEEDED_LEN = sizeof(BATCH_ARGS_NEEDED) - 1;
+
 static const char FILT_NEEDED[] = "Must provide filter name";
 static const int FILT_NEEDED_LEN = sizeof(FILT_NEEDED) - 1;
 
@@ -36,6 +37,30 @@ static const int FILT_NOT_PROXIED_LEN = sizeof(FILT_NOT_PROXIED) - 1;
 static const char DELETE_IN_PROGRESS[] = "Delete in progress\n";
 static const int DELETE_IN_PROGRESS_LEN = sizeof(DELETE_IN_PROGRESS) - 1;
 
+static const char FILT_READ_ONLY[] = "Filter is read-only\n";
+static const int FILT_READ_ONLY_LEN = sizeof(FILT_READ_ONLY) - 1;
+
+static const char FILT_NO_KEY_LOG[] = "Filter has no key log\n";
+static const int FILT_NO_KEY_LOG_LEN = sizeof(FILT_NO_KEY_LOG) - 1;
+
+static const char FILT_CHANGED[] = "Filter changed during compaction\n";
+static const int FILT_CHANGED_LEN = sizeof(FILT_CHANGED) - 1;
+
+static const char COMPACT_IN_PROGRESS[] = "Compaction in progress\n";
+static const int COMPACT_IN_PROGRESS_LEN = sizeof(COMPACT_IN_PROGRESS) - 1;
+
+static const char FILT_NOT_SHRUNK[] = "Filter cannot shrink further\n";
+static const int FILT_NOT_SHRUNK_LEN = sizeof(FILT_NOT_SHRUNK) - 1;
+
+static const char FILT_GREW[] = "Filter grew during shrink\n";
+static const int FILT_GREW_LEN = sizeof(FILT_GREW) - 1;
+
+static const char REWRITE_IN_PROGRESS[] = "Filter is being rewritten\n";
+static const int REWRITE_IN_PROGRESS_LEN = sizeof(REWRITE_IN_PROGRESS) - 1;
+
+static const char BACKEND_DOWN[] = "Backend unavailable\n";
+static const int BACKEND_DOWN_LEN = sizeof(BACKEND_DOWN) - 1;
+
 static const char DONE_RESP[] = "Done\n";
 static const int DONE_RESP_LEN = sizeof(DONE_RESP) - 1;
 
@@ -54,6 +79,15 @@ static const int YES_RESP_LEN = sizeof(YES_RESP) - 1;
 static const char NO_RESP[] = "No\n";
 static const int NO_RESP_LEN = sizeof(NO_RESP) - 1;
 
+static const char MISSING_RESP[] = "Missing";
+static const int MISSING_RESP_LEN = sizeof(MISSING_RESP) - 1;
+
+static const char READ_ONLY_RESP[] = "ReadOnly";
+static const int READ_ONLY_RESP_LEN = sizeof(READ_ONLY_RESP) - 1;
+
+static const char ERROR_RESP[] = "Error";
+static const int ERROR_RESP_LEN = sizeof(ERROR_RESP) - 1;
+
 static const char NEW_LINE[] = "\n";
 static const int NEW_LINE_LEN = sizeof(NEW_LINE) - 1;
 
@@ -76,9 +110,127 @@ typedef enum {
     CLOSE,          // Close a filter
     CLEAR,          // Clears a filter from the internals
     FLUSH,          // Force flush a filter
+    COMPACT,        // Seal a filter into a fuse filter
+    SHRINK,         // Fold the layers of a filter
+    STATS,          // Server wide counters
+    BATCH,          // Checks and sets over many filters
+    LIMIT,          // Changes the rate limits of a filter
 } conn_cmd_type;
 
-/* Static regexes */
-static regex_t VALID_FILTER_NAMES_RE;
-static const char *VALID_FILTER_NAMES_PATTERN = "^[^ \t\n\r]{1,200}$";
+/*
+ * Parsing and responses shared by the bloomd and
+ * proxy connection handlers
+ */
+
+/**
+ * Sends a client response message back. Simple convenience wrapper
+ * around handle_client_resp.
+ */
+static inline void handle_client_resp(bloom_conn_info *conn, char* resp_mesg, int resp_len) {
+    char *buffers[] = {resp_mesg};
+    int sizes[] = {resp_len};
+    send_client_response(conn, (char**)&buffers, (int*)&sizes, 1);
+}
+
 
+/**
+ * Sends a client error message back. Optimizes to use multiple
+ * output buffers so we can collapse this into a single write without
+ * needing to move our buffers around.
+ */
+static void handle_client_err(bloom_conn_info *conn, char* err_msg, int msg_len) {
+    char *buffers[] = {(char*)&CLIENT_ERR, err_msg, (char*)&NEW_LINE};
+    int sizes[] = {CLIENT_ERR_LEN, msg_len, NEW_LINE_LEN};
+    send_client_response(conn, (char**)&buffers, (int*)&sizes, 3);
+}
+
+
+/**
+ * Scans the input buffer of a given length up to a terminator.
+ * Then sets the start of the buffer after the terminator including
+ * the length of the after buffer.
+ * @arg buf The input buffer
+ * @arg buf_len The length of the input buffer
+ * @arg terminator The terminator to scan to. Replaced with the null terminator.
+ * @arg after_term Output. Set to the byte after the terminator.
+ * @arg after_len Output. Set to the length of the output buffer.
+ * @return 0 if terminator found. -1 otherwise.
+ */
+static int buffer_after_terminator(char *buf, int buf_len, char terminator, char **after_term, int *after_len) {
+    // Scan for a space
+    char *term_addr = memchr(buf, terminator, buf_len);
+    if (!term_addr) {
+        *after_term = NULL;
+        return -1;
+    }
+
+    // Convert the space to a null-seperator
+    *term_addr = '\0';
+
+    // Provide the arg buffer, and arg_len
+    *after_term = term_addr+1;
+    *after_len = buf_len - (term_addr - buf + 1);
+    return 0;
+}
+
+
+/**
+ * Determines the client command.
+ * @arg cmd_buf A command buffer
+ * @arg buf_len The length of the buffer
+ * @arg arg_buf Output. Sets the start address of the command arguments.
+ * @arg arg_len Output. Sets the length of arg_buf.
+ * @return The conn_cmd_type enum value.
+ * UNKNOWN if it doesn't match anything supported, or a proper command.
+ */
+static conn_cmd_type determine_client_command(char *cmd_buf, int buf_len, char **arg_buf, int *arg_len) {
+    // Check if we are ending with \r, and remove it.
+    if (cmd_buf[buf_len-2] == '\r') {
+        cmd_buf[buf_len-2] = '\0';
+        buf_len -= 1;
+    }
+
+    // Scan for a space. This will setup the arg_buf and arg_len
+    // if we do find the terminator. It will also insert a null terminator
+    // at the space, so we can compare the cmd_buf to the commands.
+    buffer_after_terminator(cmd_buf, buf_len, ' ', arg_buf, arg_len);
+
+    // Search for the command
+    conn_cmd_type type = UNKNOWN;
+    #define CMD_MATCH(name) (strcmp(name, cmd_buf) == 0)
+    if (CMD_MATCH("c") || CMD_MATCH("check")) {
+        type = CHECK;
+    } else if (CMD_MATCH("m") || CMD_MATCH("multi")) {
+        type = CHECK_MULTI;
+    } else if (CMD_MATCH("s") || CMD_MATCH("set")) {
+        type = SET;
+    } else if (CMD_MATCH("b") || CMD_MATCH("bulk")) {
+        type = SET_MULTI;
+    } else if (CMD_MATCH("list")) {
+        type = LIST;
+    } else if (CMD_MATCH("info")) {
+        type = INFO;
+    } else if (CMD_MATCH("create")) {
+        type = CREATE;
+    } else if (CMD_MATCH("drop")) {
+        type = DROP;
+    } else if (CMD_MATCH("close")) {
+        type = CLOSE;
+    } else if (CMD_MATCH("clear")) {
+        type = CLEAR;
+    } else if (CMD_MATCH("flush")) {
+        type = FLUSH;
+    } else if (CMD_MATCH("compact")) {
+        type = COMPACT;
+    } else if (CMD_MATCH("shrink")) {
+        type = SHRINK;
+    } else if (CMD_MATCH("stats")) {
+        type = STATS;
+    } else if (CMD_MATCH("batch")) {
+        type = BATCH;
+    } else if (CMD_MATCH("limit")) {
+        type = LIMIT;
+    }
+
+    return type;
+}
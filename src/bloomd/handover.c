@@ -0,0 +1,505 @@
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "handover.h"
+#include "filter.h"
+
+/**
+ * This defines how long we wait between checks
+ * of should_run while waiting for a new process
+ */
+#define HANDOVER_POLL_MSEC 250
+
+/**
+ * Magic value used to identify our messages
+ */
+#define HANDOVER_MAGIC 0xB100D0FF
+
+/**
+ * Maximum length of a filter name we can hand over.
+ * Filter names are limited to 200 characters.
+ */
+#define HANDOVER_NAME_LEN 256
+
+// Message types sent over the handover socket
+typedef enum {
+    HANDOVER_LISTEN = 1,    // Listening sockets are attached
+    HANDOVER_LAYER,         // A single filter layer is attached
+    HANDOVER_END,           // No more filter layers follow
+    HANDOVER_DONE           // Sender has closed all filters
+} handover_msg_type;
+
+/**
+ * Every message is a fixed size record. We use a
+ * SOCK_SEQPACKET socket, so message boundaries are kept
+ * and any attached descriptors arrive with their message.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t type;
+    uint32_t layer;         // Index of this layer
+    uint32_t num_layers;    // Total layers of the filter
+    uint64_t bytes;         // Size of this layer
+    char filter_name[HANDOVER_NAME_LEN];
+} handover_msg;
+
+// Layers received for a single filter
+typedef struct handover_filter {
+    char *filter_name;
+    uint32_t num_layers;
+    int *fds;
+    uint64_t *sizes;
+    struct handover_filter *next;
+} handover_filter;
+
+struct bloom_handover {
+    int sock;               // Connection to the other process
+    int is_sender;          // Are we the process being replaced
+    int listen_fds[HANDOVER_LISTENERS];
+    handover_filter *filters;
+};
+
+// Arguments to the handover thread
+typedef struct {
+    bloom_config *config;
+    bloom_filtmgr *mgr;
+    bloom_networking *netconf;
+    int *should_run;
+} handover_thread_args;
+
+/*
+ * Static declarations
+ */
+static int send_msg(int sock, handover_msg *msg, int *fds, int num_fds);
+static int recv_msg(int sock, handover_msg *msg, int *fds, int max_fds, int *num_fds);
+static void init_msg(handover_msg *msg, handover_msg_type type);
+static int send_state(bloom_handover *h, bloom_filtmgr *mgr, bloom_networking *netconf);
+static void export_filter_cb(void *in, char *filter_name, bloom_filter *filter);
+static void* handover_thread_main(void *in);
+
+/**
+ * Invoked on startup to take over from a running bloomd.
+ * Connects to the configured handover socket, and receives
+ * the listening sockets and any in-memory filter layers.
+ * @arg config The configuration
+ * @arg handover Output. Set to the handover state, or NULL
+ * if there is no process to take over from.
+ * @return 0 on success, negative on error.
+ */
+int handover_receive(bloom_config *config, bloom_handover **handover) {
+    *handover = NULL;
+    if (!config->handover_socket) return 0;
+
+    // Try to connect to a running process
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, config->handover_socket, sizeof(addr.sun_path) - 1);
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock < 0) {
+        syslog(LOG_ERR, "Failed to create handover socket! Err: %s", strerror(errno));
+        return -1;
+    }
+    if (connect(sock, (struct sockaddr*)&addr, sizeof(addr))) {
+        // Nobody to take over from is the common case
+        int err = errno;
+        close(sock);
+        if (err == ENOENT || err == ECONNREFUSED) return 0;
+        syslog(LOG_ERR, "Failed to connect to handover socket '%s'! Err: %s",
+                config->handover_socket, strerror(err));
+        return -1;
+    }
+    syslog(LOG_INFO, "Taking over from running bloomd on '%s'.", config->handover_socket);
+
+    bloom_handover *h = calloc(1, sizeof(bloom_handover));
+    h->sock = sock;
+    for (int i=0; i < HANDOVER_LISTENERS; i++) h->listen_fds[i] = -1;
+
+    // The listeners are always sent first
+    handover_msg msg;
+    int num_fds = 0;
+    if (recv_msg(sock, &msg, h->listen_fds, HANDOVER_LISTENERS, &num_fds) ||
+            msg.type != HANDOVER_LISTEN || num_fds != HANDOVER_LISTENERS) {
+        syslog(LOG_ERR, "Failed to receive listening sockets in handover!");
+        goto ERR;
+    }
+
+    // Receive the in-memory filter layers
+    handover_filter *filt = NULL;
+    int fd;
+    while (1) {
+        if (recv_msg(sock, &msg, &fd, 1, &num_fds)) {
+            syslog(LOG_ERR, "Failed to receive filter layers in handover!");
+            goto ERR;
+        }
+        if (msg.type == HANDOVER_END) break;
+        if (msg.type != HANDOVER_LAYER || num_fds != 1 || msg.layer >= msg.num_layers) {
+            syslog(LOG_ERR, "Unexpected message in handover!");
+            if (num_fds) close(fd);
+            goto ERR;
+        }
+
+        // The first layer starts a new filter
+        if (msg.layer == 0) {
+            filt = calloc(1, sizeof(handover_filter));
+            msg.filter_name[HANDOVER_NAME_LEN - 1] = '\0';
+            filt->filter_name = strdup(msg.filter_name);
+            filt->num_layers = msg.num_layers;
+            filt->fds = malloc(msg.num_layers * sizeof(int));
+            filt->sizes = malloc(msg.num_layers * sizeof(uint64_t));
+            for (uint32_t i=0; i < msg.num_layers; i++) filt->fds[i] = -1;
+            filt->next = h->filters;
+            h->filters = filt;
+        } else if (!filt || msg.num_layers != filt->num_layers) {
+            syslog(LOG_ERR, "Received filter layer out of order in handover!");
+            close(fd);
+            goto ERR;
+        }
+        filt->fds[msg.layer] = fd;
+        filt->sizes[msg.layer] = msg.bytes;
+    }
+
+    *handover = h;
+    return 0;
+
+ERR:
+    handover_done(h);
+    return -1;
+}
+
+/**
+ * Installs the in-memory filter layers received from
+ * the previous process into the filter manager.
+ * @arg handover The handover state
+ * @arg mgr The filter manager
+ * @return The number of filters adopted.
+ */
+int handover_adopt_filters(bloom_handover *handover, bloom_filtmgr *mgr) {
+    int adopted = 0;
+    for (handover_filter *f=handover->filters; f; f=f->next) {
+        int res = filtmgr_adopt_filter(mgr, f->filter_name, f->num_layers, f->fds, f->sizes);
+        if (res) {
+            syslog(LOG_WARNING, "Failed to adopt in-memory filter '%s' from handover.",
+                    f->filter_name);
+        } else {
+            syslog(LOG_INFO, "Adopted in-memory filter '%s' with %d layers.",
+                    f->filter_name, f->num_layers);
+            adopted++;
+        }
+    }
+    return adopted;
+}
+
+/**
+ * Waits until the previous process has flushed and closed
+ * all of its filters, and provides the inherited listening
+ * sockets.
+ * @arg handover The handover state
+ * @arg listen_fds Output. Set to the inherited listeners.
+ * @return 0 on success, negative if the previous process
+ * did not complete the handover cleanly.
+ */
+int handover_wait(bloom_handover *handover, int *listen_fds) {
+    // Take ownership of the listeners
+    for (int i=0; i < HANDOVER_LISTENERS; i++) {
+        listen_fds[i] = handover->listen_fds[i];
+        handover->listen_fds[i] = -1;
+    }
+
+    // Block until the previous process is done. If it
+    // exits without telling us, we go ahead regardless.
+    syslog(LOG_INFO, "Waiting for previous bloomd to close filters.");
+    handover_msg msg;
+    int num_fds;
+    if (recv_msg(handover->sock, &msg, NULL, 0, &num_fds) || msg.type != HANDOVER_DONE) {
+        syslog(LOG_WARNING, "Previous bloomd exited without completing handover!");
+        return -1;
+    }
+    syslog(LOG_INFO, "Previous bloomd completed handover.");
+    return 0;
+}
+
+/**
+ * Starts a thread which listens on the handover socket.
+ * When a new process connects, it is sent our listening
+ * sockets and in-memory filters, and should_run is cleared
+ * to begin our shutdown. The thread returns the handover
+ * state, which must be passed to handover_done.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg netconf The networking stack
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_handover_thread(bloom_config *config, bloom_filtmgr *mgr,
+        bloom_networking *netconf, int *should_run, pthread_t *t) {
+    // Return if we are not configured
+    if (!config->handover_socket) {
+        return 0;
+    }
+
+    // Start thread
+    handover_thread_args *args = malloc(sizeof(handover_thread_args));
+    args->config = config;
+    args->mgr = mgr;
+    args->netconf = netconf;
+    args->should_run = should_run;
+    pthread_create(t, NULL, handover_thread_main, args);
+    return 1;
+}
+
+/**
+ * Completes a handover and frees the state. On the sending
+ * side, this is invoked once all filters are closed to notify
+ * the new process that it can begin serving.
+ * @arg handover The handover state, may be NULL
+ */
+void handover_done(bloom_handover *handover) {
+    if (!handover) return;
+
+    // Let the new process start
+    if (handover->is_sender) {
+        handover_msg msg;
+        init_msg(&msg, HANDOVER_DONE);
+        if (send_msg(handover->sock, &msg, NULL, 0)) {
+            syslog(LOG_ERR, "Failed to notify new process of handover completion!");
+        } else {
+            syslog(LOG_INFO, "Handover completed.");
+        }
+    }
+    close(handover->sock);
+
+    // Close anything that was not taken
+    for (int i=0; i < HANDOVER_LISTENERS; i++) {
+        if (handover->listen_fds[i] >= 0) close(handover->listen_fds[i]);
+    }
+    handover_filter *next, *f = handover->filters;
+    while (f) {
+        next = f->next;
+        for (uint32_t i=0; i < f->num_layers; i++) {
+            if (f->fds[i] >= 0) close(f->fds[i]);
+        }
+        free(f->filter_name);
+        free(f->fds);
+        free(f->sizes);
+        free(f);
+        f = next;
+    }
+    free(handover);
+}
+
+static void* handover_thread_main(void *in) {
+    handover_thread_args *args = in;
+    bloom_config *config = args->config;
+    bloom_filtmgr *mgr = args->mgr;
+    bloom_networking *netconf = args->netconf;
+    int *should_run = args->should_run;
+    free(args);
+
+    // Setup the listener, replacing any stale socket
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, config->handover_socket, sizeof(addr.sun_path) - 1);
+    unlink(config->handover_socket);
+
+    int sock = socket(AF_UNIX, SOCK_SEQPACKET, 0);
+    if (sock < 0 || bind(sock, (struct sockaddr*)&addr, sizeof(addr)) || listen(sock, 1)) {
+        syslog(LOG_ERR, "Failed to listen on handover socket '%s'! Err: %s",
+                config->handover_socket, strerror(errno));
+        if (sock >= 0) close(sock);
+        return NULL;
+    }
+    syslog(LOG_INFO, "Handover thread started. Socket: %s", config->handover_socket);
+
+    // Wait for a new process to connect
+    int client = -1;
+    struct pollfd pfd = {sock, POLLIN, 0};
+    while (*should_run && client < 0) {
+        if (poll(&pfd, 1, HANDOVER_POLL_MSEC) <= 0) continue;
+        client = accept(sock, NULL, NULL);
+        if (client < 0 && errno != EINTR && errno != EAGAIN) {
+            syslog(LOG_ERR, "Failed to accept handover connection! Err: %s", strerror(errno));
+        }
+    }
+
+    // Remove the socket so the new process can bind it
+    close(sock);
+    unlink(config->handover_socket);
+    if (client < 0) return NULL;
+
+    // Send our state across
+    syslog(LOG_WARNING, "New bloomd process connected. Handing over...");
+    bloom_handover *h = calloc(1, sizeof(bloom_handover));
+    h->sock = client;
+    h->is_sender = 1;
+    for (int i=0; i < HANDOVER_LISTENERS; i++) h->listen_fds[i] = -1;
+    if (send_state(h, mgr, netconf)) {
+        syslog(LOG_ERR, "Failed to send state to new process. Aborting handover.");
+        h->is_sender = 0;
+        handover_done(h);
+        return NULL;
+    }
+
+    // Begin our shutdown. The new process waits for handover_done
+    // before it starts serving from the inherited listeners.
+    *should_run = 0;
+    return h;
+}
+
+/**
+ * Sends the listening sockets and all the in-memory
+ * filter layers to the new process.
+ */
+static int send_state(bloom_handover *h, bloom_filtmgr *mgr, bloom_networking *netconf) {
+    handover_msg msg;
+    int fds[HANDOVER_LISTENERS];
+    networking_listener_fds(netconf, fds);
+    init_msg(&msg, HANDOVER_LISTEN);
+    if (send_msg(h->sock, &msg, fds, HANDOVER_LISTENERS)) return -1;
+
+    // Register as a client while we walk the filters
+    filtmgr_client_checkpoint(mgr);
+    bloom_filter_list_head *head;
+    int res = filtmgr_list_filters(mgr, NULL, &head);
+    if (res == 0) {
+        bloom_filter_list *node = head->head;
+        while (node) {
+            filtmgr_filter_cb(mgr, node->filter_name, export_filter_cb, h);
+            node = node->next;
+        }
+        filtmgr_cleanup_list(head);
+    }
+    filtmgr_client_leave(mgr);
+
+    init_msg(&msg, HANDOVER_END);
+    return send_msg(h->sock, &msg, NULL, 0);
+}
+
+/**
+ * Sends the layers of an in-memory filter. Only layers backed
+ * by shareable memory can be handed over, others are skipped.
+ * Sets made before our shutdown remain visible to the new
+ * process, since the pages are shared.
+ */
+static void export_filter_cb(void *in, char *filter_name, bloom_filter *filter) {
+    bloom_handover *h = in;
+    if (!filter->filter_config.in_memory) return;
+    if (strlen(filter_name) >= HANDOVER_NAME_LEN) return;
+
+    pthread_mutex_lock(&filter->sbf_lock);
+    bloom_sbf *sbf = (bloom_sbf*)filter->sbf;
+    if (!sbf) goto LEAVE;
+
+    // Ensure all layers can be shared
+    for (uint32_t i=0; i < sbf->num_filters; i++) {
+        if (sbf->filters[i]->map->mode != SHARED) {
+            syslog(LOG_WARNING, "In-memory filter '%s' is not shareable, not handed over.",
+                    filter_name);
+            goto LEAVE;
+        }
+    }
+
+    handover_msg msg;
+    for (uint32_t i=0; i < sbf->num_filters; i++) {
+        init_msg(&msg, HANDOVER_LAYER);
+        msg.layer = i;
+        msg.num_layers = sbf->num_filters;
+        msg.bytes = sbf->filters[i]->map->size;
+        strncpy(msg.filter_name, filter_name, HANDOVER_NAME_LEN - 1);
+        if (send_msg(h->sock, &msg, &sbf->filters[i]->map->fileno, 1)) {
+            syslog(LOG_ERR, "Failed to send layer %d of filter '%s'.", i, filter_name);
+            break;
+        }
+    }
+
+LEAVE:
+    pthread_mutex_unlock(&filter->sbf_lock);
+}
+
+// Initializes an empty message
+static void init_msg(handover_msg *msg, handover_msg_type type) {
+    memset(msg, 0, sizeof(handover_msg));
+    msg->magic = HANDOVER_MAGIC;
+    msg->type = type;
+}
+
+/**
+ * Sends a message, with optional file descriptors attached.
+ * @return 0 on success.
+ */
+static int send_msg(int sock, handover_msg *msg, int *fds, int num_fds) {
+    struct iovec iov = {msg, sizeof(handover_msg)};
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+
+    // Attach the descriptors
+    char control[CMSG_SPACE(sizeof(int) * HANDOVER_LISTENERS)];
+    if (num_fds > 0) {
+        memset(control, 0, sizeof(control));
+        hdr.msg_control = control;
+        hdr.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * num_fds);
+    }
+
+    ssize_t sent;
+    do {
+        sent = sendmsg(sock, &hdr, MSG_NOSIGNAL);
+    } while (sent < 0 && errno == EINTR);
+    return (sent == sizeof(handover_msg)) ? 0 : -1;
+}
+
+/**
+ * Receives a message, and any attached file descriptors.
+ * @return 0 on success.
+ */
+static int recv_msg(int sock, handover_msg *msg, int *fds, int max_fds, int *num_fds) {
+    struct iovec iov = {msg, sizeof(handover_msg)};
+    struct msghdr hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.msg_iov = &iov;
+    hdr.msg_iovlen = 1;
+
+    char control[CMSG_SPACE(sizeof(int) * HANDOVER_LISTENERS)];
+    hdr.msg_control = control;
+    hdr.msg_controllen = sizeof(control);
+
+    ssize_t got;
+    do {
+        got = recvmsg(sock, &hdr, 0);
+    } while (got < 0 && errno == EINTR);
+
+    // Extract any descriptors
+    *num_fds = 0;
+    for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg; cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS) continue;
+        int count = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        int *recvd = (int*)CMSG_DATA(cmsg);
+        for (int i=0; i < count; i++) {
+            if (*num_fds < max_fds) fds[(*num_fds)++] = recvd[i];
+            else close(recvd[i]);
+        }
+    }
+
+    if (got != sizeof(handover_msg) || msg->magic != HANDOVER_MAGIC) {
+        for (int i=0; i < *num_fds; i++) close(fds[i]);
+        *num_fds = 0;
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,77 @@
+#ifndef BLOOM_HANDOVER_H
+#define BLOOM_HANDOVER_H
+#include <pthread.h>
+#include "config.h"
+#include "filter_manager.h"
+#include "networking.h"
+
+/**
+ * The number of listening sockets that are handed
+ * over. The TCP listener is first, followed by UDP.
+ */
+#define HANDOVER_LISTENERS 2
+
+/**
+ * Opaque handle to the state of a handover. The receiving
+ * side uses it to adopt the state of the previous process,
+ * while the sending side uses it to signal completion.
+ */
+typedef struct bloom_handover bloom_handover;
+
+/**
+ * Invoked on startup to take over from a running bloomd.
+ * Connects to the configured handover socket, and receives
+ * the listening sockets and any in-memory filter layers.
+ * @arg config The configuration
+ * @arg handover Output. Set to the handover state, or NULL
+ * if there is no process to take over from.
+ * @return 0 on success, negative on error.
+ */
+int handover_receive(bloom_config *config, bloom_handover **handover);
+
+/**
+ * Installs the in-memory filter layers received from
+ * the previous process into the filter manager.
+ * @arg handover The handover state
+ * @arg mgr The filter manager
+ * @return The number of filters adopted.
+ */
+int handover_adopt_filters(bloom_handover *handover, bloom_filtmgr *mgr);
+
+/**
+ * Waits until the previous process has flushed and closed
+ * all of its filters, and provides the inherited listening
+ * sockets.
+ * @arg handover The handover state
+ * @arg listen_fds Output. Set to the inherited listeners.
+ * @return 0 on success, negative if the previous process
+ * did not complete the handover cleanly.
+ */
+int handover_wait(bloom_handover *handover, int *listen_fds);
+
+/**
+ * Starts a thread which listens on the handover socket.
+ * When a new process connects, it is sent our listening
+ * sockets and in-memory filters, and should_run is cleared
+ * to begin our shutdown. The thread returns the handover
+ * state, which must be passed to handover_done.
+ * @arg config The configuration
+ * @arg mgr The filter manager to use
+ * @arg netconf The networking stack
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_handover_thread(bloom_config *config, bloom_filtmgr *mgr,
+        bloom_networking *netconf, int *should_run, pthread_t *t);
+
+/**
+ * Completes a handover and frees the state. On the sending
+ * side, this is invoked once all filters are closed to notify
+ * the new process that it can begin serving.
+ * @arg handover The handover state, may be NULL
+ */
+void handover_done(bloom_handover *handover);
+
+#endif
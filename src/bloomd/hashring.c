@@ -0,0 +1,97 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "hashring.h"
+
+extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t seed, void *out);
+
+/* Static declarations */
+static uint64_t hash_key(char *key, int key_len);
+static int compare_points(const void *a, const void *b);
+
+/**
+ * Creates a hash ring. The nodes are placed by their
+ * names, so the same names give the same ring no matter
+ * their order or which process builds it.
+ * @arg nodes The names of the nodes
+ * @arg num_nodes The number of nodes
+ * @arg replicas The number of points per node
+ * @arg ring Output, the new ring
+ * @return 0 on success.
+ */
+int init_hash_ring(char **nodes, int num_nodes, int replicas, bloom_hash_ring **ring) {
+    if (num_nodes <= 0 || replicas <= 0) return -1;
+
+    bloom_hash_ring *r = calloc(1, sizeof(bloom_hash_ring));
+    if (!r) return -1;
+    r->num_nodes = num_nodes;
+    r->num_points = num_nodes * replicas;
+    r->points = malloc(r->num_points * sizeof(ring_point));
+    if (!r->points) {
+        free(r);
+        return -1;
+    }
+
+    // Place each replica by the hash of "name#replica"
+    char buf[512];
+    int len;
+    for (int n=0; n < num_nodes; n++) {
+        for (int i=0; i < replicas; i++) {
+            len = snprintf(buf, sizeof(buf), "%s#%d", nodes[n], i);
+            if (len >= (int)sizeof(buf)) len = sizeof(buf) - 1;
+            r->points[n * replicas + i].point = hash_key(buf, len);
+            r->points[n * replicas + i].node = n;
+        }
+    }
+    qsort(r->points, r->num_points, sizeof(ring_point), compare_points);
+
+    *ring = r;
+    return 0;
+}
+
+/**
+ * Finds the node a key belongs to.
+ * @arg ring The ring
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return The index of the node.
+ */
+int hash_ring_lookup(bloom_hash_ring *ring, char *key, int key_len) {
+    uint64_t h = hash_key(key, key_len);
+
+    // Binary search for the first point at or after the hash
+    int low = 0, high = ring->num_points;
+    while (low < high) {
+        int mid = low + (high - low) / 2;
+        if (ring->points[mid].point < h)
+            low = mid + 1;
+        else
+            high = mid;
+    }
+
+    // Wrap around past the last point
+    if (low == ring->num_points) low = 0;
+    return ring->points[low].node;
+}
+
+/**
+ * Frees a hash ring.
+ * @arg ring The ring
+ */
+void destroy_hash_ring(bloom_hash_ring *ring) {
+    free(ring->points);
+    free(ring);
+}
+
+static uint64_t hash_key(char *key, int key_len) {
+    uint64_t out[2];
+    MurmurHash3_x64_128(key, key_len, 0, out);
+    return out[0];
+}
+
+static int compare_points(const void *a, const void *b) {
+    const ring_point *pa = a, *pb = b;
+    if (pa->point < pb->point) return -1;
+    if (pa->point > pb->point) return 1;
+    return pa->node - pb->node;
+}
@@ -0,0 +1,52 @@
+#ifndef BLOOM_HASHRING_H
+#define BLOOM_HASHRING_H
+#include <stdint.h>
+
+/**
+ * A point on the ring, owned by a node
+ */
+typedef struct {
+    uint64_t point;
+    int node;
+} ring_point;
+
+/**
+ * A consistent hash ring. Each node is placed on the ring
+ * many times, and a key belongs to the node of the first
+ * point at or after the hash of the key. Adding or removing
+ * a node only moves the keys of the points it owns.
+ */
+typedef struct {
+    int num_nodes;
+    int num_points;
+    ring_point *points;     // Sorted by point
+} bloom_hash_ring;
+
+/**
+ * Creates a hash ring. The nodes are placed by their
+ * names, so the same names give the same ring no matter
+ * their order or which process builds it.
+ * @arg nodes The names of the nodes
+ * @arg num_nodes The number of nodes
+ * @arg replicas The number of points per node
+ * @arg ring Output, the new ring
+ * @return 0 on success.
+ */
+int init_hash_ring(char **nodes, int num_nodes, int replicas, bloom_hash_ring **ring);
+
+/**
+ * Finds the node a key belongs to.
+ * @arg ring The ring
+ * @arg key The key
+ * @arg key_len The length of the key
+ * @return The index of the node.
+ */
+int hash_ring_lookup(bloom_hash_ring *ring, char *key, int key_len);
+
+/**
+ * Frees a hash ring.
+ * @arg ring The ring
+ */
+void destroy_hash_ring(bloom_hash_ring *ring);
+
+#endif
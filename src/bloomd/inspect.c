@@ -0,0 +1,319 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "inspect.h"
+#include "bloom.h"
+#include "fuse.h"
+#include "stable.h"
+
+/**
+ * The size of the chunks handed to the work pool
+ */
+#define INSPECT_CHUNK_BYTES (4 * 1024 * 1024)
+
+/**
+ * A chunked operation over one or two buffers
+ */
+typedef struct {
+    unsigned char *dst;
+    unsigned char *src;
+    uint64_t len;
+    uint64_t *counts;       // Result of each chunk
+} inspect_job;
+
+/* Static declarations */
+static int num_chunks(uint64_t len);
+static void chunk_bounds(inspect_job *job, int chunk, uint64_t *start, uint64_t *end);
+static void popcount_chunk(void *arg, int chunk);
+static void nonzero_cells_chunk(void *arg, int chunk);
+static void merge_chunk(void *arg, int chunk);
+static uint64_t sum_chunks(bloom_workpool *pool, bloom_work_func func, unsigned char *buf, uint64_t len);
+static int map_file(char *path, int writable, unsigned char **buf, uint64_t *len);
+static uint64_t bloom_bits(uint64_t bytes, uint32_t k_num);
+static int read_layer(char *path, bloom_workpool *pool, int count_bits, layer_stats *stats);
+
+/**
+ * Counts the set bits of a buffer.
+ * @arg pool The pool to split the work over, or NULL
+ * @arg buf The buffer
+ * @arg len The length of the buffer in bytes
+ * @return The number of set bits
+ */
+uint64_t inspect_popcount(bloom_workpool *pool, unsigned char *buf, uint64_t len) {
+    return sum_chunks(pool, popcount_chunk, buf, len);
+}
+
+/**
+ * ORs a buffer into another.
+ * @arg pool The pool to split the work over, or NULL
+ * @arg dst The buffer to update
+ * @arg src The buffer to OR in
+ * @arg len The length of both buffers in bytes
+ */
+void inspect_merge(bloom_workpool *pool, unsigned char *dst, unsigned char *src, uint64_t len) {
+    inspect_job job = {dst, src, len, NULL};
+    workpool_run(pool, num_chunks(len), merge_chunk, &job);
+}
+
+/**
+ * Reads the header of a data file and counts its set bits.
+ * @arg path The data file
+ * @arg pool The pool to split the work over, or NULL
+ * @arg stats Output, the stats of the file
+ * @return 0 on success, -1 if the file cannot be read,
+ * -2 if it is too small for its header.
+ */
+int inspect_layer(char *path, bloom_workpool *pool, layer_stats *stats) {
+    return read_layer(path, pool, 1, stats);
+}
+
+/**
+ * Reads the header of a data file, without counting
+ * its set bits, so cells_set is left at 0.
+ * @arg path The data file
+ * @arg stats Output, the stats of the file
+ * @return 0 on success, -1 if the file cannot be read,
+ * -2 if it is too small for its header.
+ */
+int inspect_header(char *path, layer_stats *stats) {
+    return read_layer(path, NULL, 0, stats);
+}
+
+/**
+ * Estimates the number of keys in a layer from the
+ * fraction of bits that are set.
+ * @arg stats The stats of a bloom filter layer
+ * @return The estimated keys, or the header count for
+ * other layer types.
+ */
+double inspect_estimate_keys(layer_stats *stats) {
+    if (stats->type != LAYER_BLOOM || !stats->cells || !stats->k_num) {
+        return stats->count;
+    }
+
+    // Each key sets one bit in each of the k partitions
+    double m = stats->cells;
+    double set = (stats->cells_set < stats->cells) ? stats->cells_set : stats->cells;
+    return -(m / stats->k_num) * log(1 - set / m);
+}
+
+/**
+ * Estimates the false positive rate of a layer from the
+ * fraction of bits or counters that are set.
+ * @arg stats The stats of a layer
+ * @return The false positive rate.
+ */
+double inspect_fp_rate(layer_stats *stats) {
+    switch (stats->type) {
+        case LAYER_BLOOM:
+        case LAYER_STABLE:
+            if (!stats->cells) return 1;
+            return pow((double)stats->cells_set / stats->cells, stats->k_num);
+        case LAYER_FUSE:
+            return pow(2, -(double)stats->k_num);
+        default:
+            return 1;
+    }
+}
+
+/**
+ * ORs the bits of a bloom filter layer into another with the
+ * same size and number of hash functions. The count of the
+ * destination is set to the estimated keys of the union.
+ * @arg dst_path The data file to update
+ * @arg src_path The data file to OR in
+ * @arg pool The pool to split the work over, or NULL
+ * @return 0 on success, -1 if a file cannot be read,
+ * -2 if the layers are not bloom filters of the same shape.
+ */
+int inspect_merge_layer(char *dst_path, char *src_path, bloom_workpool *pool) {
+    layer_stats dst_stats, src_stats;
+    int res = inspect_header(dst_path, &dst_stats);
+    if (!res) res = inspect_header(src_path, &src_stats);
+    if (res) return res;
+    if (dst_stats.type != LAYER_BLOOM || src_stats.type != LAYER_BLOOM ||
+            dst_stats.bytes != src_stats.bytes || dst_stats.k_num != src_stats.k_num) {
+        return -2;
+    }
+
+    // The bits change behind the page checksums, so
+    // drop them to be rebuilt when the layer is loaded
+    if (bitmap_drop_checksums(dst_path)) return -1;
+
+    unsigned char *dst, *src;
+    uint64_t len;
+    if (map_file(dst_path, 1, &dst, &len)) return -1;
+    if (map_file(src_path, 0, &src, &len)) {
+        munmap(dst, len);
+        return -1;
+    }
+
+    // Merge the bits, then count the keys of the union
+    uint64_t header = sizeof(bloom_filter_header);
+    inspect_merge(pool, dst + header, src + header, len - header);
+    dst_stats.cells_set = inspect_popcount(pool, dst + header, len - header);
+    double keys = inspect_estimate_keys(&dst_stats);
+    bloom_filter_header *dst_header = (bloom_filter_header*)dst;
+    dst_header->count = (isinf(keys)) ? dst_stats.cells : (uint64_t)round(keys);
+
+    res = msync(dst, len, MS_SYNC);
+    munmap(src, len);
+    munmap(dst, len);
+    return (res) ? -1 : 0;
+}
+
+static int num_chunks(uint64_t len) {
+    return (len + INSPECT_CHUNK_BYTES - 1) / INSPECT_CHUNK_BYTES;
+}
+
+static void chunk_bounds(inspect_job *job, int chunk, uint64_t *start, uint64_t *end) {
+    *start = (uint64_t)chunk * INSPECT_CHUNK_BYTES;
+    *end = *start + INSPECT_CHUNK_BYTES;
+    if (*end > job->len) *end = job->len;
+}
+
+static void popcount_chunk(void *arg, int chunk) {
+    inspect_job *job = arg;
+    uint64_t start, end, set = 0;
+    chunk_bounds(job, chunk, &start, &end);
+
+    // Chunks start on a word boundary, so only the tail is in bytes
+    uint64_t *words = (uint64_t*)(job->dst + start);
+    uint64_t num_words = (end - start) / 8;
+    for (uint64_t i=0; i < num_words; i++) {
+        set += __builtin_popcountll(words[i]);
+    }
+    for (uint64_t i=start + num_words * 8; i < end; i++) {
+        set += __builtin_popcount(job->dst[i]);
+    }
+    job->counts[chunk] = set;
+}
+
+static void nonzero_cells_chunk(void *arg, int chunk) {
+    inspect_job *job = arg;
+    uint64_t start, end, set = 0;
+    chunk_bounds(job, chunk, &start, &end);
+    for (uint64_t i=start; i < end; i++) {
+        set += ((job->dst[i] & 0x0F) != 0) + ((job->dst[i] & 0xF0) != 0);
+    }
+    job->counts[chunk] = set;
+}
+
+static void merge_chunk(void *arg, int chunk) {
+    inspect_job *job = arg;
+    uint64_t start, end;
+    chunk_bounds(job, chunk, &start, &end);
+    for (uint64_t i=start; i < end; i++) {
+        job->dst[i] |= job->src[i];
+    }
+}
+
+/**
+ * Runs a counting function over the chunks of a
+ * buffer, and returns the total of the counts.
+ */
+static uint64_t sum_chunks(bloom_workpool *pool, bloom_work_func func, unsigned char *buf, uint64_t len) {
+    int chunks = num_chunks(len);
+    if (!chunks) return 0;
+    inspect_job job = {buf, NULL, len, calloc(chunks, sizeof(uint64_t))};
+    workpool_run(pool, chunks, func, &job);
+
+    uint64_t total = 0;
+    for (int i=0; i < chunks; i++) total += job.counts[i];
+    free(job.counts);
+    return total;
+}
+
+/**
+ * Maps a whole file into memory, read-only unless
+ * writable is set, in which case changes are shared.
+ * @return 0 on success, -1 on error.
+ */
+static int map_file(char *path, int writable, unsigned char **buf, uint64_t *len) {
+    int fd = open(path, (writable) ? O_RDWR : O_RDONLY);
+    if (fd < 0) return -1;
+
+    struct stat st;
+    if (fstat(fd, &st) || st.st_size <= 0) {
+        close(fd);
+        return -1;
+    }
+
+    int prot = PROT_READ | ((writable) ? PROT_WRITE : 0);
+    void *addr = mmap(NULL, st.st_size, prot, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) return -1;
+    madvise(addr, st.st_size, MADV_SEQUENTIAL);
+
+    *buf = addr;
+    *len = st.st_size;
+    return 0;
+}
+
+/**
+ * Returns the number of bits in the partitions of a
+ * bloom filter, as computed by bf_from_bitmap.
+ */
+static uint64_t bloom_bits(uint64_t bytes, uint32_t k_num) {
+    if (!k_num) return 0;
+    uint64_t bitmap_size = (bytes - sizeof(bloom_filter_header)) * 8;
+    return (bitmap_size / k_num) * k_num;
+}
+
+/**
+ * Maps a data file and reads its header, counting
+ * the set bits if count_bits is set.
+ */
+static int read_layer(char *path, bloom_workpool *pool, int count_bits, layer_stats *stats) {
+    unsigned char *buf;
+    uint64_t len;
+    memset(stats, 0, sizeof(layer_stats));
+    if (map_file(path, 0, &buf, &len)) return -1;
+    stats->bytes = len;
+
+    int res = 0;
+    uint32_t magic = 0;
+    if (len >= sizeof(uint32_t)) memcpy(&magic, buf, sizeof(uint32_t));
+
+    if (magic == BLOOM_MAGIC && len > sizeof(bloom_filter_header)) {
+        bloom_filter_header *header = (bloom_filter_header*)buf;
+        stats->type = LAYER_BLOOM;
+        stats->k_num = header->k_num;
+        stats->count = header->count;
+        stats->capacity = header->capacity;
+
+        // The padding after the partitions is never set
+        stats->cells = bloom_bits(len, header->k_num);
+        if (count_bits) stats->cells_set = inspect_popcount(pool, buf + sizeof(bloom_filter_header),
+                len - sizeof(bloom_filter_header));
+
+    } else if (magic == FUSE_MAGIC && len >= sizeof(bloom_fuse_header)) {
+        bloom_fuse_header *header = (bloom_fuse_header*)buf;
+        stats->type = LAYER_FUSE;
+        stats->k_num = header->fingerprint_bits;
+        stats->count = header->count;
+        stats->capacity = header->count;
+        stats->cells = header->array_length;
+
+    } else if (magic == STABLE_MAGIC && len > sizeof(bloom_stable_header)) {
+        bloom_stable_header *header = (bloom_stable_header*)buf;
+        stats->type = LAYER_STABLE;
+        stats->k_num = header->k_num;
+        stats->count = header->count;
+        stats->capacity = header->capacity;
+        stats->cells = (len - sizeof(bloom_stable_header)) * STABLE_CELLS_PER_BYTE;
+        if (count_bits) stats->cells_set = sum_chunks(pool, nonzero_cells_chunk,
+                buf + sizeof(bloom_stable_header), len - sizeof(bloom_stable_header));
+
+    } else if (magic == BLOOM_MAGIC || magic == FUSE_MAGIC || magic == STABLE_MAGIC) {
+        res = -2;
+    }
+
+    munmap(buf, len);
+    return res;
+}
@@ -0,0 +1,104 @@
+#ifndef BLOOM_INSPECT_H
+#define BLOOM_INSPECT_H
+#include <inttypes.h>
+#include "workpool.h"
+
+/**
+ * Offline access to the data files of a filter, used by
+ * bloomd-tool. The files are mapped directly, without loading
+ * the filter, so they can be checked even if they are damaged.
+ * Large files are split into chunks that run on a work pool.
+ */
+
+/**
+ * The kinds of data files, told apart by their magic
+ */
+typedef enum {
+    LAYER_UNKNOWN = 0,
+    LAYER_BLOOM,
+    LAYER_FUSE,
+    LAYER_STABLE
+} layer_type;
+
+/**
+ * The header fields and bit counts of a data file
+ */
+typedef struct {
+    layer_type type;
+    uint64_t bytes;         // Size of the file
+    uint32_t k_num;         // Hash functions, or fingerprint bits of a fuse filter
+    uint64_t count;         // Count of items from the header
+    uint64_t capacity;      // Capacity from the header, 0 if unknown
+    uint64_t cells;         // Bits of a bloom filter, counters of a stable filter
+    uint64_t cells_set;     // Set bits, or non-zero counters
+} layer_stats;
+
+/**
+ * Counts the set bits of a buffer.
+ * @arg pool The pool to split the work over, or NULL
+ * @arg buf The buffer
+ * @arg len The length of the buffer in bytes
+ * @return The number of set bits
+ */
+uint64_t inspect_popcount(bloom_workpool *pool, unsigned char *buf, uint64_t len);
+
+/**
+ * ORs a buffer into another.
+ * @arg pool The pool to split the work over, or NULL
+ * @arg dst The buffer to update
+ * @arg src The buffer to OR in
+ * @arg len The length of both buffers in bytes
+ */
+void inspect_merge(bloom_workpool *pool, unsigned char *dst, unsigned char *src, uint64_t len);
+
+/**
+ * Reads the header of a data file and counts its set bits.
+ * @arg path The data file
+ * @arg pool The pool to split the work over, or NULL
+ * @arg stats Output, the stats of the file
+ * @return 0 on success, -1 if the file cannot be read,
+ * -2 if it is too small for its header.
+ */
+int inspect_layer(char *path, bloom_workpool *pool, layer_stats *stats);
+
+/**
+ * Reads the header of a data file, without counting
+ * its set bits, so cells_set is left at 0.
+ * @arg path The data file
+ * @arg stats Output, the stats of the file
+ * @return 0 on success, -1 if the file cannot be read,
+ * -2 if it is too small for its header.
+ */
+int inspect_header(char *path, layer_stats *stats);
+
+/**
+ * Estimates the number of keys in a layer from the
+ * fraction of bits that are set.
+ * @arg stats The stats of a bloom filter layer
+ * @return The estimated keys, or the header count for
+ * other layer types.
+ */
+double inspect_estimate_keys(layer_stats *stats);
+
+/**
+ * Estimates the false positive rate of a layer from the
+ * fraction of bits or counters that are set.
+ * @arg stats The stats of a layer
+ * @return The false positive rate.
+ */
+double inspect_fp_rate(layer_stats *stats);
+
+/**
+ * ORs the bits of a bloom filter layer into another with the
+ * same size and number of hash functions. The count of the
+ * destination is set to the estimated keys of the union,
+ * and its page checksums are dropped.
+ * @arg dst_path The data file to update
+ * @arg src_path The data file to OR in
+ * @arg pool The pool to split the work over, or NULL
+ * @return 0 on success, -1 if a file cannot be read,
+ * -2 if the layers are not bloom filters of the same shape.
+ */
+int inspect_merge_layer(char *dst_path, char *src_path, bloom_workpool *pool);
+
+#endif
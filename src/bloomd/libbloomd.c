@@ -0,0 +1,331 @@
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <pthread.h>
+#include "libbloomd.h"
+#include "config.h"
+#include "filter_manager.h"
+#include "background.h"
+
+/**
+ * The maximum length of a filter name. This
+ * matches the names accepted by the server.
+ */
+#define MAX_FILTER_NAME_LEN 200
+
+/**
+ * Embedded engine state
+ */
+struct bloomd_engine {
+    bloom_config *config;
+    bloom_filtmgr *mgr;
+
+    int should_run;         // Stops the background threads
+    int flush_on, unmap_on, snapshot_on, scrub_on;
+    pthread_t flush_thread, unmap_thread, snapshot_thread, scrub_thread;
+};
+
+/* Static declarations */
+static int valid_filter_name(char *filter_name);
+static void info_filter_cb(void *data, char *filter_name, bloom_filter *filter);
+
+/**
+ * Opens an engine, loading any existing filters, and
+ * starts the background flush and unmap threads.
+ * @arg config_file Path of a bloomd INI file, or NULL for defaults
+ * @arg engine Output, the new engine
+ * @return 0 on success, negative on error.
+ */
+int bloomd_open(char *config_file, bloomd_engine **engine) {
+    *engine = NULL;
+
+    // Parse and validate the config file
+    bloom_config *config = calloc(1, sizeof(bloom_config));
+    if (config_from_filename(config_file, config)) {
+        syslog(LOG_ERR, "Failed to read the configuration file!");
+        free(config);
+        return -1;
+    }
+    if (validate_config(config)) {
+        syslog(LOG_ERR, "Invalid configuration!");
+        free(config);
+        return -1;
+    }
+
+    // Initialize the filters
+    bloomd_engine *e = calloc(1, sizeof(bloomd_engine));
+    e->config = config;
+    if (init_filter_manager(config, 1, &e->mgr)) {
+        syslog(LOG_ERR, "Failed to initialize bloomd filter manager!");
+        free(config);
+        free(e);
+        return -2;
+    }
+
+    // Start the background tasks
+    e->should_run = 1;
+    e->flush_on = start_flush_thread(config, e->mgr, &e->should_run, &e->flush_thread);
+    e->unmap_on = start_cold_unmap_thread(config, e->mgr, &e->should_run, &e->unmap_thread);
+    e->snapshot_on = start_snapshot_thread(config, e->mgr, &e->should_run, &e->snapshot_thread);
+    e->scrub_on = start_scrub_thread(config, e->mgr, &e->should_run, &e->scrub_thread);
+
+    *engine = e;
+    return 0;
+}
+
+/**
+ * Stops the background threads, flushes and closes all the
+ * filters, and frees the engine. No other thread may be
+ * using the engine.
+ * @arg engine The engine to close
+ * @return 0 on success.
+ */
+int bloomd_close(bloomd_engine *engine) {
+    // Shutdown the background tasks
+    engine->should_run = 0;
+    if (engine->flush_on) pthread_join(engine->flush_thread, NULL);
+    if (engine->unmap_on) pthread_join(engine->unmap_thread, NULL);
+    if (engine->snapshot_on) pthread_join(engine->snapshot_thread, NULL);
+    if (engine->scrub_on) pthread_join(engine->scrub_thread, NULL);
+
+    // Cleanup the filters
+    destroy_filter_manager(engine->mgr);
+    free(engine->config);
+    free(engine);
+    return 0;
+}
+
+/**
+ * Must be invoked by each thread that used the engine, other
+ * than the one that closes it, before the thread exits or stops
+ * using the engine for a long time.
+ * @arg engine The engine
+ */
+void bloomd_thread_leave(bloomd_engine *engine) {
+    filtmgr_client_leave(engine->mgr);
+}
+
+/**
+ * Creates a new filter.
+ * @arg engine The engine
+ * @arg filter_name The name of the filter
+ * @arg capacity The initial capacity, or 0 for the configured default
+ * @arg prob The false positive probability, or 0 for the configured default
+ * @arg in_memory 1 to keep the filter in memory only, 0 to persist
+ * it, or -1 for the configured default
+ * @return 0 on success, -1 if the filter already exists,
+ * -2 on internal error, -3 if a delete is in progress, -4 if
+ * the arguments are invalid.
+ */
+int bloomd_create(bloomd_engine *engine, char *filter_name, uint64_t capacity, double prob, int in_memory) {
+    if (!valid_filter_name(filter_name)) return -4;
+    filtmgr_client_checkpoint(engine->mgr);
+
+    // Use the defaults unless something is overridden
+    bloom_config *config = NULL;
+    if (capacity || prob || in_memory >= 0) {
+        config = malloc(sizeof(bloom_config));
+        memcpy(config, engine->config, sizeof(bloom_config));
+        if (capacity) config->initial_capacity = capacity;
+        if (prob) config->default_probability = prob;
+        if (in_memory >= 0) config->in_memory = in_memory;
+
+        // Validate the params
+        int invalid_config = 0;
+        invalid_config |= sane_initial_capacity(config->initial_capacity);
+        invalid_config |= sane_default_probability(config->default_probability);
+        invalid_config |= sane_in_memory(config->in_memory);
+        if (invalid_config) {
+            free(config);
+            return -4;
+        }
+    }
+
+    // The manager owns the config on success
+    int res = filtmgr_create_filter(engine->mgr, filter_name, config);
+    if (res && config) free(config);
+    return res;
+}
+
+/**
+ * Deletes a filter and its data.
+ * @arg engine The engine
+ * @arg filter_name The name of the filter
+ * @return 0 on success, -1 if the filter does not exist.
+ */
+int bloomd_drop(bloomd_engine *engine, char *filter_name) {
+    filtmgr_client_checkpoint(engine->mgr);
+    return filtmgr_drop_filter(engine->mgr, filter_name);
+}
+
+/**
+ * Unmaps a filter from memory, leaving it on disk.
+ * @arg engine The engine
+ * @arg filter_name The name of the filter
+ * @return 0 on success, -1 if the filter does not exist.
+ */
+int bloomd_unmap(bloomd_engine *engine, char *filter_name) {
+    filtmgr_client_checkpoint(engine->mgr);
+    return filtmgr_unmap_filter(engine->mgr, filter_name);
+}
+
+/**
+ * Removes an unmapped filter from the engine, leaving
+ * its data on disk.
+ * @arg engine The engine
+ * @arg filter_name The name of the filter
+ * @return 0 on success, -1 if the filter does not exist,
+ * -2 if the filter is not unmapped.
+ */
+int bloomd_clear(bloomd_engine *engine, char *filter_name) {
+    filtmgr_client_checkpoint(engine->mgr);
+    return filtmgr_clear_filter(engine->mgr, filter_name);
+}
+
+/**
+ * Flushes a filter to disk.
+ * @arg engine The engine
+ * @arg filter_name The name of the filter, or NULL to flush all
+ * @return 0 on success, -1 if the filter does not exist.
+ */
+int bloomd_flush(bloomd_engine *engine, char *filter_name) {
+    filtmgr_client_checkpoint(engine->mgr);
+    if (filter_name) return filtmgr_flush_filter(engine->mgr, filter_name);
+
+    // List all the filters
+    bloom_filter_list_head *head;
+    int res = filtmgr_list_filters(engine->mgr, NULL, &head);
+    if (res != 0) return -2;
+
+    // Flush all, ignore errors since
+    // filters might get deleted in the process
+    bloom_filter_list *node = head->head;
+    while (node) {
+        filtmgr_flush_filter(engine->mgr, node->filter_name);
+        node = node->next;
+    }
+
+    filtmgr_cleanup_list(head);
+    return 0;
+}
+
+/**
+ * Checks for keys in a filter.
+ * @arg engine The engine
+ * @arg filter_name The name of the filter
+ * @arg keys The null terminated keys to check
+ * @arg num_keys The number of keys
+ * @arg result Output, set to 1 for each key that may be
+ * present, or 0 if it is not.
+ * @return 0 on success, -1 if the filter does not exist,
+ * -2 on internal error.
+ */
+int bloomd_check(bloomd_engine *engine, char *filter_name, char **keys, int num_keys, char *result) {
+    filtmgr_client_checkpoint(engine->mgr);
+    return filtmgr_check_keys(engine->mgr, filter_name, keys, num_keys, result);
+}
+
+/**
+ * Adds keys to a filter.
+ * @arg engine The engine
+ * @arg filter_name The name of the filter
+ * @arg keys The null terminated keys to add
+ * @arg num_keys The number of keys
+ * @arg result Output, set to 1 for each key that was added,
+ * or 0 if it may have been present already.
+ * @return 0 on success, -1 if the filter does not exist,
+ * -2 on internal error, -3 if the filter is read-only.
+ */
+int bloomd_set(bloomd_engine *engine, char *filter_name, char **keys, int num_keys, char *result) {
+    filtmgr_client_checkpoint(engine->mgr);
+    return filtmgr_set_keys(engine->mgr, filter_name, keys, num_keys, result);
+}
+
+/**
+ * Compacts a filter into a read-only fuse filter, built from
+ * the keys in its key log. Blocks until the filter is built.
+ * @arg engine The engine
+ * @arg filter_name The name of the filter
+ * @return 0 on success, -1 if the filter does not exist,
+ * -2 on internal error, -3 if the filter is already read-only,
+ * -4 if the filter has no key log, -5 if keys were set during
+ * the compaction, -6 if a compaction is in progress.
+ */
+int bloomd_compact(bloomd_engine *engine, char *filter_name) {
+    filtmgr_client_checkpoint(engine->mgr);
+    return filtmgr_compact_filter(engine->mgr, filter_name);
+}
+
+/**
+ * Invokes a callback with the name of each filter.
+ * @arg engine The engine
+ * @arg prefix Only list filters starting with this prefix, or NULL
+ * @arg cb The callback
+ * @arg data Opaque pointer passed to the callback
+ * @return 0 on success.
+ */
+int bloomd_list(bloomd_engine *engine, char *prefix, bloomd_list_cb cb, void *data) {
+    filtmgr_client_checkpoint(engine->mgr);
+
+    bloom_filter_list_head *head;
+    int res = filtmgr_list_filters(engine->mgr, prefix, &head);
+    if (res != 0) return -2;
+
+    bloom_filter_list *node = head->head;
+    while (node) {
+        cb(data, node->filter_name);
+        node = node->next;
+    }
+
+    filtmgr_cleanup_list(head);
+    return 0;
+}
+
+/**
+ * Gets the statistics of a filter.
+ * @arg engine The engine
+ * @arg filter_name The name of the filter
+ * @arg info Output, the statistics
+ * @return 0 on success, -1 if the filter does not exist.
+ */
+int bloomd_info(bloomd_engine *engine, char *filter_name, bloomd_filter_info *info) {
+    filtmgr_client_checkpoint(engine->mgr);
+    return filtmgr_filter_cb(engine->mgr, filter_name, info_filter_cb, info);
+}
+
+/**
+ * Copies the filter statistics out
+ */
+static void info_filter_cb(void *data, char *filter_name, bloom_filter *filter) {
+    (void)filter_name;
+    bloomd_filter_info *info = data;
+    filter_counters *counters = bloomf_counters(filter);
+
+    info->capacity = bloomf_capacity(filter);
+    info->size = bloomf_size(filter);
+    info->bytes = bloomf_byte_size(filter);
+    info->probability = filter->filter_config.default_probability;
+    info->in_memory = filter->filter_config.in_memory;
+    info->sealed = filter->filter_config.sealed;
+    info->stable = filter->filter_config.stable;
+    info->check_hits = counters->check_hits;
+    info->check_misses = counters->check_misses;
+    info->set_hits = counters->set_hits;
+    info->set_misses = counters->set_misses;
+    info->page_ins = counters->page_ins;
+    info->page_outs = counters->page_outs;
+}
+
+/**
+ * Filter names follow the same rules as the server,
+ * 1 to 200 characters without any whitespace.
+ */
+static int valid_filter_name(char *filter_name) {
+    if (!filter_name) return 0;
+    int len = 0;
+    for (char *c = filter_name; *c; c++, len++) {
+        if (*c == ' ' || *c == '\t' || *c == '\n' || *c == '\r') return 0;
+        if (len == MAX_FILTER_NAME_LEN) return 0;
+    }
+    return len > 0;
+}
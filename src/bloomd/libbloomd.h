@@ -0,0 +1,180 @@
+#ifndef BLOOMD_LIBBLOOMD_H
+#define BLOOMD_LIBBLOOMD_H
+#include <stdint.h>
+
+/**
+ * libbloomd embeds the bloomd filter manager in-process,
+ * providing named filters that scale, flush and unmap just
+ * like a bloomd server, without the network. Data directories
+ * are compatible with the server.
+ *
+ * All the functions are thread safe. Each thread that uses an
+ * engine is tracked so that filter state can be safely reclaimed,
+ * and threads should call bloomd_thread_leave before exiting.
+ *
+ * Unless noted, functions return 0 on success, -1 if the filter
+ * does not exist, -2 on an internal error and -4 if the arguments
+ * are invalid.
+ */
+
+/**
+ * Opaque handle to an embedded engine
+ */
+typedef struct bloomd_engine bloomd_engine;
+
+/**
+ * Statistics about a single filter
+ */
+typedef struct {
+    uint64_t capacity;
+    uint64_t size;
+    uint64_t bytes;
+    double probability;
+    int in_memory;
+    int sealed;
+    int stable;
+    uint64_t check_hits;
+    uint64_t check_misses;
+    uint64_t set_hits;
+    uint64_t set_misses;
+    uint64_t page_ins;
+    uint64_t page_outs;
+} bloomd_filter_info;
+
+/**
+ * Callback invoked once per filter when listing
+ */
+typedef void(*bloomd_list_cb)(void *data, char *filter_name);
+
+/**
+ * Opens an engine, loading any existing filters, and
+ * starts the background flush and unmap threads.
+ * @arg config_file Path of a bloomd INI file, or NULL for defaults
+ * @arg engine Output, the new engine
+ * @return 0 on success, negative on error.
+ */
+int bloomd_open(char *config_file, bloomd_engine **engine);
+
+/**
+ * Stops the background threads, flushes and closes all the
+ * filters, and frees the engine. No other thread may be
+ * using the engine.
+ * @arg engine The engine to close
+ * @return 0 on success.
+ */
+int bloomd_close(bloomd_engine *engine);
+
+/**
+ * Must be invoked by each thread that used the engine, other
+ * than the one that closes it, before the thread exits or stops
+ * using the engine for a long time.
+ * @arg engine The engine
+ */
+void bloomd_thread_leave(bloomd_engine *engine);
+
+/**
+ * Creates a new filter.
+ * @arg engine The engine
+ * @arg filter_name The name of the filter
+ * @arg capacity The initial capacity, or 0 for the configured default
+ * @arg prob The false positive probability, or 0 for the configured default
+ * @arg in_memory 1 to keep the filter in memory only, 0 to persist
+ * it, or -1 for the configured default
+ * @return 0 on success, -1 if the filter already exists,
+ * -2 on internal error, -3 if a delete is in progress, -4 if
+ * the arguments are invalid.
+ */
+int bloomd_create(bloomd_engine *engine, char *filter_name, uint64_t capacity, double prob, int in_memory);
+
+/**
+ * Deletes a filter and its data.
+ * @arg engine The engine
+ * @arg filter_name The name of the filter
+ * @return 0 on success, -1 if the filter does not exist.
+ */
+int bloomd_drop(bloomd_engine *engine, char *filter_name);
+
+/**
+ * Unmaps a filter from memory, leaving it on disk.
+ * @arg engine The engine
+ * @arg filter_name The name of the filter
+ * @return 0 on success, -1 if the filter does not exist.
+ */
+int bloomd_unmap(bloomd_engine *engine, char *filter_name);
+
+/**
+ * Removes an unmapped filter from the engine, leaving
+ * its data on disk.
+ * @arg engine The engine
+ * @arg filter_name The name of the filter
+ * @return 0 on success, -1 if the filter does not exist,
+ * -2 if the filter is not unmapped.
+ */
+int bloomd_clear(bloomd_engine *engine, char *filter_name);
+
+/**
+ * Flushes a filter to disk.
+ * @arg engine The engine
+ * @arg filter_name The name of the filter, or NULL to flush all
+ * @return 0 on success, -1 if the filter does not exist.
+ */
+int bloomd_flush(bloomd_engine *engine, char *filter_name);
+
+/**
+ * Checks for keys in a filter.
+ * @arg engine The engine
+ * @arg filter_name The name of the filter
+ * @arg keys The null terminated keys to check
+ * @arg num_keys The number of keys
+ * @arg result Output, set to 1 for each key that may be
+ * present, or 0 if it is not.
+ * @return 0 on success, -1 if the filter does not exist,
+ * -2 on internal error.
+ */
+int bloomd_check(bloomd_engine *engine, char *filter_name, char **keys, int num_keys, char *result);
+
+/**
+ * Adds keys to a filter.
+ * @arg engine The engine
+ * @arg filter_name The name of the filter
+ * @arg keys The null terminated keys to add
+ * @arg num_keys The number of keys
+ * @arg result Output, set to 1 for each key that was added,
+ * or 0 if it may have been present already.
+ * @return 0 on success, -1 if the filter does not exist,
+ * -2 on internal error, -3 if the filter is read-only.
+ */
+int bloomd_set(bloomd_engine *engine, char *filter_name, char **keys, int num_keys, char *result);
+
+/**
+ * Compacts a filter into a read-only fuse filter, built from
+ * the keys in its key log. Blocks until the filter is built.
+ * @arg engine The engine
+ * @arg filter_name The name of the filter
+ * @return 0 on success, -1 if the filter does not exist,
+ * -2 on internal error, -3 if the filter is already read-only,
+ * -4 if the filter has no key log, -5 if keys were set during
+ * the compaction, -6 if a compaction is in progress.
+ */
+int bloomd_compact(bloomd_engine *engine, char *filter_name);
+
+/**
+ * Invokes a callback with the name of each filter.
+ * @arg engine The engine
+ * @arg prefix Only list filters starting with this prefix, or NULL
+ * @arg cb The callback
+ * @arg data Opaque pointer passed to the callback
+ * @return 0 on success.
+ */
+int bloomd_list(bloomd_engine *engine, char *prefix, bloomd_list_cb cb, void *data);
+
+/**
+ * Gets the statistics of a filter.
+ * @arg engine The engine
+ * @arg filter_name The name of the filter
+ * @arg info Output, the statistics
+ * @return 0 on success, -1 if the filter does not exist.
+ */
+int bloomd_info(bloomd_engine *engine, char *filter_name, bloomd_filter_info *info);
+
+#endif
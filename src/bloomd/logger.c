@@ -0,0 +1,361 @@
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "logger.h"
+
+/**
+ * Number of messages each thread can have waiting,
+ * and the longest message. Longer messages are cut short.
+ */
+#define LOG_RING_SLOTS 64
+#define LOG_MSG_SIZE 512
+
+/**
+ * Each thread logs a format at most this many
+ * times a second, the rest are counted and summarized.
+ * The rate is tracked for this many formats per thread,
+ * and any others share a single limit.
+ */
+#define LOG_RATE_LIMIT 20
+#define LOG_RATE_FORMATS 16
+
+/**
+ * How long the log thread sleeps between drains
+ * in microseconds
+ */
+#define LOG_DRAIN_USEC 50000
+
+/**
+ * How often the log thread summarizes the
+ * suppressed messages, in drains
+ */
+#define LOG_SUMMARY_DRAINS 20
+
+typedef struct {
+    int priority;
+    char msg[LOG_MSG_SIZE];
+} log_entry;
+
+typedef struct {
+    const char *volatile fmt;   // Compared by pointer, formats are literals
+    time_t second;              // Second the count is for
+    uint32_t count;             // Messages logged this second
+    volatile uint32_t suppressed;   // Skipped since the last summary
+} log_rate;
+
+/**
+ * A single producer, single consumer ring. Only the owning
+ * thread moves the head, and only the log thread the tail.
+ */
+typedef struct log_ring {
+    volatile uint32_t head;     // Next slot to fill
+    volatile uint32_t tail;     // Next slot to drain
+    volatile int closed;        // Set once the owning thread exits
+    log_rate rates[LOG_RATE_FORMATS + 1];  // The last is shared by other formats
+    struct log_ring *volatile next;
+    log_entry slots[LOG_RING_SLOTS];
+} log_ring;
+
+/**
+ * Global logger state
+ */
+static struct {
+    pthread_mutex_t lock;       // Serializes registering, closing and freeing rings
+    volatile int running;
+    int generation;             // Started log threads, rings are freed by each
+    int mask;                   // Syslog mask when the thread started
+    log_ring *volatile rings;   // Every registered ring
+    uint64_t written;
+    uint64_t dropped;
+    uint64_t suppressed;
+    uint64_t summarized;
+} LOGGER = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/**
+ * The ring of the calling thread, and the log thread it was
+ * registered with. The key marks the ring closed when the
+ * thread exits.
+ */
+static __thread log_ring *RING = NULL;
+static __thread int RING_GENERATION = 0;
+static pthread_key_t RING_KEY;
+static pthread_once_t RING_KEY_ONCE = PTHREAD_ONCE_INIT;
+
+/* Static declarations */
+static void* log_thread_main(void *in);
+static log_ring* thread_ring(void);
+static void create_ring_key(void);
+static void close_ring(void *in);
+static int rate_limited(log_ring *ring, const char *fmt);
+static int push_entry(log_ring *ring, int priority, const char *fmt, va_list args);
+static void summarize_ring(log_ring *ring);
+static void drain_rings(int summarize);
+static void free_rings(void);
+
+/**
+ * Logs a message like syslog, without blocking the caller.
+ * Once the log thread is started, the message is formatted
+ * into a ring buffer owned by the calling thread, and the
+ * log thread passes it on to syslog. Messages are dropped
+ * if the ring is full, and a format that is logged too often
+ * by a thread is rate limited. Before the log thread starts,
+ * or after it stops, this calls syslog directly.
+ * @note Thread safe.
+ * @arg priority The syslog priority
+ * @arg fmt The format string, as for printf
+ */
+void bloom_log(int priority, const char *fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    log_ring *ring;
+    if (!LOGGER.running || !(ring = thread_ring())) {
+        vsyslog(priority, fmt, args);
+    } else if (LOG_MASK(LOG_PRI(priority)) & LOGGER.mask) {
+        if (!rate_limited(ring, fmt)) push_entry(ring, priority, fmt, args);
+    }
+    va_end(args);
+}
+
+/**
+ * Starts the log thread which drains the ring buffers
+ * into syslog. Once should_run is cleared, the remaining
+ * messages are written and bloom_log reverts to calling
+ * syslog directly. Uses the current syslog mask.
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_log_thread(int *should_run, pthread_t *t) {
+    pthread_mutex_lock(&LOGGER.lock);
+    LOGGER.mask = setlogmask(0);
+    LOGGER.generation++;
+    LOGGER.running = 1;
+    pthread_mutex_unlock(&LOGGER.lock);
+    if (pthread_create(t, NULL, log_thread_main, should_run)) {
+        LOGGER.running = 0;
+        syslog(LOG_ERR, "Failed to start the log thread!");
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Returns the counts of the messages logged so far.
+ * @arg stats Output, the counts
+ */
+void log_stats(bloom_log_stats *stats) {
+    stats->written = LOGGER.written;
+    stats->dropped = LOGGER.dropped;
+    stats->suppressed = LOGGER.suppressed;
+    stats->summarized = LOGGER.summarized;
+}
+
+static void* log_thread_main(void *in) {
+    int *should_run = in;
+    for (int drains=1; *should_run; drains++) {
+        drain_rings(drains % LOG_SUMMARY_DRAINS == 0);
+        usleep(LOG_DRAIN_USEC);
+    }
+
+    // Stop taking new messages, and give any thread that
+    // is still filling a slot the time to finish
+    pthread_mutex_lock(&LOGGER.lock);
+    LOGGER.running = 0;
+    pthread_mutex_unlock(&LOGGER.lock);
+    drain_rings(0);
+    usleep(LOG_DRAIN_USEC);
+    drain_rings(1);
+    free_rings();
+    return NULL;
+}
+
+/**
+ * Returns the ring of the calling thread,
+ * creating and registering it on first use.
+ */
+static log_ring* thread_ring(void) {
+    if (RING && RING_GENERATION == LOGGER.generation) return RING;
+    pthread_once(&RING_KEY_ONCE, create_ring_key);
+    log_ring *ring = calloc(1, sizeof(log_ring));
+    if (!ring) return NULL;
+
+    // Only register while the log thread runs, as it frees
+    // every ring once it stops
+    pthread_mutex_lock(&LOGGER.lock);
+    if (!LOGGER.running) {
+        pthread_mutex_unlock(&LOGGER.lock);
+        free(ring);
+        return NULL;
+    }
+    pthread_setspecific(RING_KEY, ring);
+
+    // Push onto the list of rings
+    log_ring *head;
+    do {
+        head = LOGGER.rings;
+        ring->next = head;
+    } while (!__sync_bool_compare_and_swap(&LOGGER.rings, head, ring));
+    RING = ring;
+    RING_GENERATION = LOGGER.generation;
+    pthread_mutex_unlock(&LOGGER.lock);
+    return ring;
+}
+
+static void create_ring_key(void) {
+    pthread_key_create(&RING_KEY, close_ring);
+}
+
+/**
+ * Invoked as a thread exits. The log thread frees
+ * the ring once it has been drained. Rings of a log
+ * thread that stopped are already freed.
+ */
+static void close_ring(void *in) {
+    log_ring *ring = in;
+    pthread_mutex_lock(&LOGGER.lock);
+    if (LOGGER.running && RING_GENERATION == LOGGER.generation) {
+        __sync_synchronize();
+        ring->closed = 1;
+    }
+    pthread_mutex_unlock(&LOGGER.lock);
+}
+
+/**
+ * Checks if a format has been logged too often this second
+ * by the calling thread. The skipped messages are counted,
+ * and summarized by the log thread.
+ * @return 1 if the message should be skipped.
+ */
+static int rate_limited(log_ring *ring, const char *fmt) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    // Find the slot of the format, probing from its address.
+    // A slot keeps its format, so the log thread can read it.
+    log_rate *rate = ring->rates + LOG_RATE_FORMATS;
+    uint32_t start = ((uintptr_t)fmt >> 3) % LOG_RATE_FORMATS;
+    for (uint32_t i=0; i < LOG_RATE_FORMATS; i++) {
+        log_rate *slot = ring->rates + (start + i) % LOG_RATE_FORMATS;
+        if (slot->fmt == fmt) {
+            rate = slot;
+            break;
+        } else if (!slot->fmt) {
+            slot->fmt = fmt;
+            rate = slot;
+            break;
+        }
+    }
+
+    if (rate->second != now.tv_sec) {
+        rate->second = now.tv_sec;
+        rate->count = 0;
+    }
+    if (rate->count < LOG_RATE_LIMIT) {
+        rate->count++;
+        return 0;
+    }
+    __sync_fetch_and_add(&rate->suppressed, 1);
+    __sync_fetch_and_add(&LOGGER.suppressed, 1);
+    return 1;
+}
+
+/**
+ * Formats a message into the next slot of the ring.
+ * @return 0 on success, -1 if the ring is full.
+ */
+static int push_entry(log_ring *ring, int priority, const char *fmt, va_list args) {
+    uint32_t head = ring->head;
+    if (head - ring->tail >= LOG_RING_SLOTS) {
+        __sync_fetch_and_add(&LOGGER.dropped, 1);
+        return -1;
+    }
+    log_entry *entry = ring->slots + head % LOG_RING_SLOTS;
+    entry->priority = priority;
+    vsnprintf(entry->msg, LOG_MSG_SIZE, fmt, args);
+
+    // Publish the slot after it is filled
+    __sync_synchronize();
+    ring->head = head + 1;
+    return 0;
+}
+
+/**
+ * Logs how many messages of each format of a ring were
+ * skipped since the last summary. The format is written
+ * as is, not expanded.
+ */
+static void summarize_ring(log_ring *ring) {
+    for (int i=0; i <= LOG_RATE_FORMATS; i++) {
+        log_rate *rate = ring->rates + i;
+        uint32_t suppressed = __sync_fetch_and_and(&rate->suppressed, 0);
+        if (!suppressed) continue;
+        if (i < LOG_RATE_FORMATS) {
+            syslog(LOG_WARNING, "Suppressed %u messages like: %s", suppressed, rate->fmt);
+        } else {
+            syslog(LOG_WARNING, "Suppressed %u messages of other formats", suppressed);
+        }
+        LOGGER.written++;
+        LOGGER.summarized += suppressed;
+    }
+}
+
+/**
+ * Writes the waiting messages of every ring to syslog,
+ * and frees the rings of threads that have exited.
+ * @arg summarize Also summarize the suppressed messages
+ */
+static void drain_rings(int summarize) {
+    log_ring *prev = NULL, *ring = LOGGER.rings, *next;
+    int closed;
+    while (ring) {
+        next = ring->next;
+        closed = ring->closed;
+        __sync_synchronize();
+
+        // Write out everything published so far
+        uint32_t head = ring->head;
+        __sync_synchronize();
+        for (uint32_t i = ring->tail; i != head; i++) {
+            log_entry *entry = ring->slots + i % LOG_RING_SLOTS;
+            syslog(entry->priority, "%s", entry->msg);
+            LOGGER.written++;
+        }
+        __sync_synchronize();
+        ring->tail = head;
+
+        // Count the skipped messages before the ring goes away
+        if (summarize || closed) summarize_ring(ring);
+
+        // Unlink the rings of exited threads. New rings are
+        // only pushed onto the head, so only it can race.
+        if (closed && !prev && __sync_bool_compare_and_swap(&LOGGER.rings, ring, next)) {
+            free(ring);
+        } else if (closed && prev) {
+            prev->next = next;
+            free(ring);
+        } else {
+            prev = ring;
+        }
+        ring = next;
+    }
+}
+
+/**
+ * Frees every ring once the log thread has stopped. Threads
+ * that log afterwards call syslog directly, and register a new
+ * ring if the log thread is started again.
+ */
+static void free_rings(void) {
+    pthread_mutex_lock(&LOGGER.lock);
+    log_ring *ring = __sync_lock_test_and_set(&LOGGER.rings, NULL);
+    while (ring) {
+        log_ring *next = ring->next;
+        free(ring);
+        ring = next;
+    }
+    pthread_mutex_unlock(&LOGGER.lock);
+}
@@ -0,0 +1,49 @@
+#ifndef BLOOM_LOGGER_H
+#define BLOOM_LOGGER_H
+#include <stdint.h>
+#include <pthread.h>
+#include <syslog.h>
+
+/**
+ * Logs a message like syslog, without blocking the caller.
+ * Once the log thread is started, the message is formatted
+ * into a ring buffer owned by the calling thread, and the
+ * log thread passes it on to syslog. Messages are dropped
+ * if the ring is full, and a format that is logged too often
+ * by a thread is rate limited. Before the log thread starts,
+ * or after it stops, this calls syslog directly.
+ * @note Thread safe.
+ * @arg priority The syslog priority
+ * @arg fmt The format string, as for printf
+ */
+void bloom_log(int priority, const char *fmt, ...) __attribute__ ((format (printf, 2, 3)));
+
+/**
+ * Starts the log thread which drains the ring buffers
+ * into syslog. Once should_run is cleared, the remaining
+ * messages are written and bloom_log reverts to calling
+ * syslog directly. Uses the current syslog mask.
+ * @arg should_run Pointer to an integer that is set to 0 to
+ * indicate the thread should exit.
+ * @arg t The output thread
+ * @return 1 if the thread was started
+ */
+int start_log_thread(int *should_run, pthread_t *t);
+
+/**
+ * Counts of the messages that went through the rings
+ */
+typedef struct {
+    uint64_t written;       // Passed on to syslog
+    uint64_t dropped;       // Lost because a ring was full
+    uint64_t suppressed;    // Skipped by the rate limit
+    uint64_t summarized;    // Skipped and counted in a summary
+} bloom_log_stats;
+
+/**
+ * Returns the counts of the messages logged so far.
+ * @arg stats Output, the counts
+ */
+void log_stats(bloom_log_stats *stats);
+
+#endif
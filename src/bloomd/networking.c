@@ -29,6 +29,10 @@
 #include "conn_handler.h"
 #include "spinlock.h"
 #include "barrier.h"
+#include "workpool.h"
+#include "numa.h"
+#include "ratelimit.h"
+#include "logger.h"
 
 
 /**
@@ -54,6 +58,15 @@
  */
 #define CONN_BUF_MULTIPLIER 8
 
+/**
+ * Connections only hold buffers while data is in flight.
+ * Each worker keeps up to this many drained buffers of the
+ * default size for reuse, so idle connections cost no buffer
+ * memory and busy ones rarely go to malloc. Buffers that grew
+ * are freed once drained.
+ */
+#define CONN_BUF_POOL_SIZE 256
+
 
 /**
  * This defines how often we invoke the
@@ -75,18 +88,34 @@ typedef struct {
     ev_io pipe_client;
     ev_timer periodic;
     int should_run;
+    int index;
+
+    // Owned commands sent to or answered by this worker
+    owner_queue queue;
+
+    // Owned commands to execute at the end of this pass
+    // of the event loop. Only used by this worker.
+    owned_cmd *pending;
 
     // Used to free inactive connections
     conn_info *inactive;
+
+    // Watchers of the connection handler, freed on exit
+    bloom_watcher *watchers;
+
+    // Drained connection buffers, for reuse
+    char *free_bufs[CONN_BUF_POOL_SIZE];
+    int num_free_bufs;
 } worker_ev_userdata;
 
 /**
- * Represents a simple circular buffer
+ * Represents a simple circular buffer. The
+ * buffer is NULL while there is nothing in it.
  */
 typedef struct {
-    int write_cursor;
-    int read_cursor;
-    uint32_t buf_size;
+    uint64_t write_cursor;
+    uint64_t read_cursor;
+    uint64_t buf_size;
     char *buffer;
 } circular_buffer;
 
@@ -112,6 +141,13 @@ typedef struct {
 struct conn_info {
     worker_ev_userdata *thread_ev;
     int active;
+    int suspended;  // Waiting on a filter owner, input is not processed
+    int output_paused;  // Too much output is unsent, input is not read
+    int throttled;      // Over a rate limit, input is not read until the timer
+
+    ev_timer throttle;
+    bloom_bucket ops_bucket;
+    bloom_bucket bytes_bucket;
 
     ev_io client;
     circular_buffer input;
@@ -123,6 +159,19 @@ struct conn_info {
     struct conn_info *next;
 };
 
+/**
+ * Stores a watcher of the connection handler. The
+ * socket and the time out are watched separately.
+ */
+struct bloom_watcher {
+    worker_ev_userdata *thread_ev;
+    ev_io io;
+    ev_timer timer;
+    bloom_watcher_cb cb;
+    void *arg;
+    struct bloom_watcher *next;
+};
+
 
 /**
  * Defines a structure that is
@@ -135,15 +184,24 @@ struct bloom_networking {
 
     int ev_mode;
     ev_loop *default_loop;
+    int *should_run;
     ev_io tcp_client;
     ev_io udp_client;
 
     barrier_t thread_barrier;
+    barrier_t quit_barrier; // Workers drain their owned commands before exiting
     pthread_t *threads; // Reference to all the workers
+    bloom_workpool *pool;   // Shared by the workers for large commands
     worker_ev_userdata **workers;
     unsigned last_assign;    // Last thread we assigned to
 };
 
+/**
+ * Counts of the client connections, updated
+ * atomically since every worker has clients.
+ */
+static bloom_conn_stats CONN_STATS = {0, 0, 0, 0, 0};
+
 
 // Static typedefs
 static void handle_new_client(ev_loop *lp, ev_io *watcher, int ready_events);
@@ -153,6 +211,13 @@ static void handle_client_writebuf(ev_loop *lp, ev_io *watcher, int ready_events
 static int read_client_data(conn_info *conn);
 static void handle_worker_notification(ev_loop *lp, ev_io *watcher, int ready_events);
 static void handle_periodic_timeout(ev_loop *lp, ev_timer *t, int ready_events);
+static void handle_throttle_timeout(ev_loop *lp, ev_timer *t, int ready_events);
+static void handle_watcher_io(ev_loop *lp, ev_io *watcher, int ready_events);
+static void handle_watcher_timeout(ev_loop *lp, ev_timer *t, int ready_events);
+static void handle_owned_cmds(worker_ev_userdata *data);
+static void handle_pending_cmds(worker_ev_userdata *data);
+static void resume_owned_cmd(worker_ev_userdata *data, bloom_conn_handler *handle, owned_cmd *cmd);
+static void push_owned_cmd(bloom_networking *netconf, int worker, owned_cmd *cmd);
 
 static void close_client_connection(conn_info *conn);
 static void deactivate_client_connection(conn_info *conn);
@@ -164,12 +229,18 @@ static int send_client_response_direct(conn_info *conn, char **response_buffers,
 
 // Utility methods
 static int set_client_sockopts(int client_fd);
-static conn_info* get_conn();
+static conn_info* get_conn(bloom_config *config);
 
 
 // Circular buffer method
+static void check_output_backlog(conn_info *conn);
+static void resume_client_input(worker_ev_userdata *data, conn_info *conn);
+static void resume_client(worker_ev_userdata *data, conn_info *conn);
 static void circbuf_init(circular_buffer *buf);
-static void circbuf_free(circular_buffer *buf);
+static uint64_t circbuf_used(circular_buffer *buf);
+static void circbuf_acquire(worker_ev_userdata *data, circular_buffer *buf);
+static void circbuf_release(worker_ev_userdata *data, circular_buffer *buf);
+static void circbuf_free(worker_ev_userdata *data, circular_buffer *buf);
 static uint64_t circbuf_avail_buf(circular_buffer *buf);
 static void circbuf_grow_buf(circular_buffer *buf);
 static void circbuf_setup_readv_iovec(circular_buffer *buf, struct iovec *vectors, int *num_vectors);
@@ -181,9 +252,18 @@ static int circbuf_write(circular_buffer *buf, char *in, uint64_t bytes);
 /**
  * Initializes the TCP listener
  * @arg netconf The network configuration
+ * @arg inherited_fd An already listening socket to use, or -1
  * @return 0 on success.
  */
-static int setup_tcp_listener(bloom_networking *netconf) {
+static int setup_tcp_listener(bloom_networking *netconf, int inherited_fd) {
+    // Use a listener handed over by a previous process
+    if (inherited_fd >= 0) {
+        ev_io_init(&netconf->tcp_client, handle_new_client,
+                    inherited_fd, EV_READ);
+        ev_io_start(netconf->default_loop, &netconf->tcp_client);
+        return 0;
+    }
+
     struct sockaddr_in addr;
     struct in_addr bind_addr;
     bzero(&addr, sizeof(addr));
@@ -193,7 +273,7 @@ static int setup_tcp_listener(bloom_networking *netconf) {
 
     int ret = inet_pton(AF_INET, netconf->config->bind_address, &bind_addr);
     if (ret != 1) {
-        syslog(LOG_ERR, "Invalid IPv4 address '%s'!", netconf->config->bind_address);
+        bloom_log(LOG_ERR, "Invalid IPv4 address '%s'!", netconf->config->bind_address);
         return 1;
     }
     addr.sin_addr = bind_addr;
@@ -203,17 +283,17 @@ static int setup_tcp_listener(bloom_networking *netconf) {
     int optval = 1;
     if (setsockopt(tcp_listener_fd, SOL_SOCKET,
                 SO_REUSEADDR, &optval, sizeof(optval))) {
-        syslog(LOG_ERR, "Failed to set SO_REUSEADDR! Err: %s", strerror(errno));
+        bloom_log(LOG_ERR, "Failed to set SO_REUSEADDR! Err: %s", strerror(errno));
         close(tcp_listener_fd);
         return 1;
     }
     if (bind(tcp_listener_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
-        syslog(LOG_ERR, "Failed to bind on TCP socket! Err: %s", strerror(errno));
+        bloom_log(LOG_ERR, "Failed to bind on TCP socket! Err: %s", strerror(errno));
         close(tcp_listener_fd);
         return 1;
     }
     if (listen(tcp_listener_fd, BACKLOG_SIZE) != 0) {
-        syslog(LOG_ERR, "Failed to listen on TCP socket! Err: %s", strerror(errno));
+        bloom_log(LOG_ERR, "Failed to listen on TCP socket! Err: %s", strerror(errno));
         close(tcp_listener_fd);
         return 1;
     }
@@ -228,9 +308,18 @@ static int setup_tcp_listener(bloom_networking *netconf) {
 /**
  * Initializes the UDP Listener.
  * @arg netconf The network configuration
+ * @arg inherited_fd An already bound socket to use, or -1
  * @return 0 on success.
  */
-static int setup_udp_listener(bloom_networking *netconf) {
+static int setup_udp_listener(bloom_networking *netconf, int inherited_fd) {
+    // Use a listener handed over by a previous process
+    if (inherited_fd >= 0) {
+        ev_io_init(&netconf->udp_client, handle_new_udp_mesg,
+                    inherited_fd, EV_READ);
+        ev_io_start(netconf->default_loop, &netconf->udp_client);
+        return 0;
+    }
+
     struct sockaddr_in addr;
     struct in_addr bind_addr;
     bzero(&addr, sizeof(addr));
@@ -240,7 +329,7 @@ static int setup_udp_listener(bloom_networking *netconf) {
 
     int ret = inet_pton(AF_INET, netconf->config->bind_address, &bind_addr);
     if (ret != 1) {
-        syslog(LOG_ERR, "Invalid IPv4 address '%s'!", netconf->config->bind_address);
+        bloom_log(LOG_ERR, "Invalid IPv4 address '%s'!", netconf->config->bind_address);
         return 1;
     }
     addr.sin_addr = bind_addr;
@@ -250,12 +339,12 @@ static int setup_udp_listener(bloom_networking *netconf) {
     int optval = 1;
     if (setsockopt(udp_listener_fd, SOL_SOCKET,
                 SO_REUSEADDR, &optval, sizeof(optval))) {
-        syslog(LOG_ERR, "Failed to set SO_REUSEADDR! Err: %s", strerror(errno));
+        bloom_log(LOG_ERR, "Failed to set SO_REUSEADDR! Err: %s", strerror(errno));
         close(udp_listener_fd);
         return 1;
     }
     if (bind(udp_listener_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
-        syslog(LOG_ERR, "Failed to bind on UDP socket! Err: %s", strerror(errno));
+        bloom_log(LOG_ERR, "Failed to bind on UDP socket! Err: %s", strerror(errno));
         close(udp_listener_fd);
         return 1;
     }
@@ -271,9 +360,11 @@ static int setup_udp_listener(bloom_networking *netconf) {
  * Initializes the networking interfaces
  * @arg config Takes the bloom server configuration
  * @arg mgr The filter manager to pass up to the connection handlers
+ * @arg listen_fds Optional, the TCP and UDP sockets handed over
+ * by a previous process. NULL to bind new sockets.
  * @arg netconf Output. The configuration for the networking stack.
  */
-int init_networking(bloom_config *config, bloom_filtmgr *mgr, bloom_networking **netconf_out) {
+int init_networking(bloom_config *config, bloom_filtmgr *mgr, int *listen_fds, bloom_networking **netconf_out) {
     // Make the netconf structure
     bloom_networking *netconf = calloc(1, sizeof(struct bloom_networking));
 
@@ -288,7 +379,8 @@ int init_networking(bloom_config *config, bloom_filtmgr *mgr, bloom_networking *
     }
 
     // Setup the barrier
-    if (barrier_init(&netconf->thread_barrier, config->worker_threads + 1)) {
+    if (barrier_init(&netconf->thread_barrier, config->worker_threads + 1) ||
+            barrier_init(&netconf->quit_barrier, config->worker_threads)) {
         free(netconf->workers);
         free(netconf);
         return 1;
@@ -307,20 +399,20 @@ int init_networking(bloom_config *config, bloom_filtmgr *mgr, bloom_networking *
     netconf->ev_mode = ev_mode;
 
     if (!(netconf->default_loop = ev_loop_new (ev_mode))) {
-        syslog(LOG_CRIT, "Failed to initialize libev!");
+        bloom_log(LOG_CRIT, "Failed to initialize libev!");
         free(netconf);
         return 1;
     }
 
     // Setup the TCP listener
-    int res = setup_tcp_listener(netconf);
+    int res = setup_tcp_listener(netconf, (listen_fds) ? listen_fds[0] : -1);
     if (res != 0) {
         free(netconf);
         return 1;
     }
 
     // Setup the UDP listener
-    res = setup_udp_listener(netconf);
+    res = setup_udp_listener(netconf, (listen_fds) ? listen_fds[1] : -1);
     if (res != 0) {
         ev_io_stop(netconf->default_loop, &netconf->tcp_client);
         close(netconf->tcp_client.fd);
@@ -328,6 +420,16 @@ int init_networking(bloom_config *config, bloom_filtmgr *mgr, bloom_networking *
         return 1;
     }
 
+    // Start the pool for large commands
+    if (config->parallel_threads > 0 && init_workpool(config->parallel_threads, &netconf->pool)) {
+        ev_io_stop(netconf->default_loop, &netconf->tcp_client);
+        ev_io_stop(netconf->default_loop, &netconf->udp_client);
+        close(netconf->tcp_client.fd);
+        close(netconf->udp_client.fd);
+        free(netconf);
+        return 1;
+    }
+
     // Prepare the conn handlers
     init_conn_handler();
 
@@ -337,6 +439,18 @@ int init_networking(bloom_config *config, bloom_filtmgr *mgr, bloom_networking *
 }
 
 
+/**
+ * Provides the listening sockets, so that they can be
+ * handed over to a new process.
+ * @arg netconf The configuration for the networking stack.
+ * @arg fds Output. Set to the TCP and UDP listener sockets.
+ */
+void networking_listener_fds(bloom_networking *netconf, int *fds) {
+    fds[0] = netconf->tcp_client.fd;
+    fds[1] = netconf->udp_client.fd;
+}
+
+
 /**
  * Invoked when a TCP listening socket fd is ready
  * to accept a new client. Accepts the client, initializes
@@ -347,6 +461,13 @@ static void handle_new_client(ev_loop *lp, ev_io *watcher, int ready_events) {
     // Get the network configuration
     bloom_networking *netconf = ev_userdata(lp);
 
+    // Leave new clients in the backlog if we are shutting down,
+    // since our listener may have been handed to a new process
+    if (netconf->should_run && !*netconf->should_run) {
+        ev_io_stop(lp, watcher);
+        return;
+    }
+
     // Accept the client connection
     struct sockaddr_in client_addr;
     int client_addr_len = sizeof(client_addr);
@@ -356,7 +477,7 @@ static void handle_new_client(ev_loop *lp, ev_io *watcher, int ready_events) {
 
     // Check for an error
     if (client_fd == -1) {
-        syslog(LOG_ERR, "Failed to accept() connection! %s.", strerror(errno));
+        bloom_log(LOG_ERR, "Failed to accept() connection! %s.", strerror(errno));
         return;
     }
 
@@ -366,11 +487,11 @@ static void handle_new_client(ev_loop *lp, ev_io *watcher, int ready_events) {
     }
 
     // Debug info
-    syslog(LOG_DEBUG, "Accepted client connection: %s %d [%d]",
+    bloom_log(LOG_DEBUG, "Accepted client connection: %s %d [%d]",
             inet_ntoa(client_addr.sin_addr), ntohs(client_addr.sin_port), client_fd);
 
     // Get the associated conn object
-    conn_info *conn = get_conn();
+    conn_info *conn = get_conn(netconf->config);
 
     // Initialize the libev stuff
     ev_io_init(&conn->client, invoke_event_handler, client_fd, EV_READ);
@@ -380,9 +501,12 @@ static void handle_new_client(ev_loop *lp, ev_io *watcher, int ready_events) {
     int next_thread = netconf->last_assign++ % netconf->config->worker_threads;
     worker_ev_userdata *data = netconf->workers[next_thread];
 
-    // Sent accept along with the connection
-    write(data->pipefd[1], "a", 1);
-    write(data->pipefd[1], &conn, sizeof(conn_info*));
+    // Sent accept along with the connection. This must be a
+    // single write, since other workers also notify using the pipe
+    char notify[1 + sizeof(conn_info*)];
+    notify[0] = 'a';
+    memcpy(notify + 1, &conn, sizeof(conn_info*));
+    write(data->pipefd[1], notify, sizeof(notify));
 }
 
 
@@ -391,7 +515,7 @@ static void handle_new_client(ev_loop *lp, ev_io *watcher, int ready_events) {
  */
 static void handle_new_udp_mesg(ev_loop *lp, ev_io *watcher, int ready_events) {
     // TODO: Handle UDP clients
-    syslog(LOG_WARNING, "UDP clients not currently supported!");
+    bloom_log(LOG_WARNING, "UDP clients not currently supported!");
 }
 
 
@@ -402,12 +526,15 @@ static void handle_new_udp_mesg(ev_loop *lp, ev_io *watcher, int ready_events) {
  * of what to do.
  */
 static int read_client_data(conn_info *conn) {
+    // Take a buffer for the input
+    circbuf_acquire(conn->thread_ev, &conn->input);
+
     /**
      * Figure out how much space we have to write.
      * If we have < 50% free, we resize the buffer using
      * a multiplier.
      */
-    int avail_buf = circbuf_avail_buf(&conn->input);
+    uint64_t avail_buf = circbuf_avail_buf(&conn->input);
     if (avail_buf < conn->input.buf_size / 2) {
         circbuf_grow_buf(&conn->input);
     }
@@ -422,11 +549,11 @@ static int read_client_data(conn_info *conn) {
 
     // Make sure we actually read something
     if (read_bytes == 0) {
-        syslog(LOG_DEBUG, "Closed client connection. [%d]\n", conn->client.fd);
+        bloom_log(LOG_DEBUG, "Closed client connection. [%d]\n", conn->client.fd);
         return 1;
     } else if (read_bytes == -1) {
         if (errno != EAGAIN && errno != EINTR) {
-            syslog(LOG_ERR, "Failed to read() from connection [%d]! %s.",
+            bloom_log(LOG_ERR, "Failed to read() from connection [%d]! %s.",
                     conn->client.fd, strerror(errno));
         }
         return 1;
@@ -465,12 +592,19 @@ static void handle_client_writebuf(ev_loop *lp, ev_io *watcher, int ready_events
         if (conn->output.read_cursor == conn->output.write_cursor) {
             conn->use_write_buf = 0;
             ev_io_stop(lp, &conn->write_client);
+            circbuf_release(conn->thread_ev, &conn->output);
+        }
+
+        // Read from the client again once the backlog is small
+        if (conn->output_paused &&
+            circbuf_used(&conn->output) <= conn->thread_ev->netconf->config->output_low_watermark) {
+            resume_client_input(conn->thread_ev, conn);
         }
     }
 
     // Handle any errors
     if (write_bytes <= 0 && (errno != EAGAIN && errno != EINTR)) {
-        syslog(LOG_ERR, "Failed to write() to connection [%d]! %s.",
+        bloom_log(LOG_ERR, "Failed to write() to connection [%d]! %s.",
                 conn->client.fd, strerror(errno));
         deactivate_client_connection(conn);
         return;
@@ -502,11 +636,15 @@ static void invoke_event_handler(ev_loop *lp, ev_io *watcher, int ready_events)
     bloom_conn_handler handle;
     handle.config = data->netconf->config;
     handle.mgr = data->netconf->mgr;
+    handle.pool = data->netconf->pool;
     handle.conn = conn;
 
     // Reschedule the watcher, unless it's non-active now
     if (handle_client_connect(&handle))
         deactivate_client_connection(conn);
+
+    // Give back the input buffer if it was all handled
+    circbuf_release(data, &conn->input);
 }
 
 
@@ -538,6 +676,11 @@ static void handle_worker_notification(ev_loop *lp, ev_io *watcher, int ready_ev
             ev_io_start(data->loop, &conn->client);
             break;
 
+        // Owned commands are queued
+        case 'o':
+            handle_owned_cmds(data);
+            break;
+
         // Quit
         case 'q':
             data->should_run = 0;
@@ -545,7 +688,104 @@ static void handle_worker_notification(ev_loop *lp, ev_io *watcher, int ready_ev
             break;
 
         default:
-            syslog(LOG_WARNING, "Received unknown comand: %c", cmd);
+            bloom_log(LOG_WARNING, "Received unknown comand: %c", cmd);
+    }
+}
+
+
+/**
+ * Invoked to handle the owned commands queued for this worker.
+ * Commands from other workers are left pending until the end of
+ * the event loop pass, and completed commands are answered and
+ * their clients resumed.
+ */
+static void handle_owned_cmds(worker_ev_userdata *data) {
+    // Prepare to invoke the handler
+    bloom_conn_handler handle;
+    handle.config = data->netconf->config;
+    handle.mgr = data->netconf->mgr;
+    handle.pool = data->netconf->pool;
+
+    owned_cmd *cmd = owner_queue_take(&data->queue);
+    owned_cmd *next;
+    while (cmd) {
+        next = cmd->next;
+
+        // Execute commands we own with the deferred commands
+        if (!cmd->done) {
+            cmd->next = data->pending;
+            data->pending = cmd;
+        } else {
+            resume_owned_cmd(data, &handle, cmd);
+        }
+        cmd = next;
+    }
+}
+
+
+/**
+ * Invoked at the end of each pass of the event loop to execute
+ * the pending commands together. Commands from other workers
+ * are sent back, and those of our clients are answered. Resumed
+ * clients may defer more commands, so we repeat until none are left.
+ */
+static void handle_pending_cmds(worker_ev_userdata *data) {
+    // Prepare to invoke the handler
+    bloom_conn_handler handle;
+    handle.config = data->netconf->config;
+    handle.mgr = data->netconf->mgr;
+    handle.pool = data->netconf->pool;
+
+    owned_cmd *cmd, *next;
+    while (data->pending) {
+        cmd = data->pending;
+        data->pending = NULL;
+
+        handle.conn = NULL;
+        execute_owned_cmds(&handle, cmd);
+        while (cmd) {
+            next = cmd->next;
+            if (cmd->origin != data->index)
+                push_owned_cmd(data->netconf, cmd->origin, cmd);
+            else
+                resume_owned_cmd(data, &handle, cmd);
+            cmd = next;
+        }
+    }
+}
+
+
+/**
+ * Answers a completed command of one of our clients,
+ * and resumes the client.
+ */
+static void resume_owned_cmd(worker_ev_userdata *data, bloom_conn_handler *handle, owned_cmd *cmd) {
+    // Respond to our client
+    conn_info *conn = cmd->conn;
+    conn->suspended = 0;
+    handle->conn = conn;
+    finish_owned_cmd(handle, cmd);
+    owned_cmd_free(cmd);
+
+    // Resume the client, handling any buffered commands. Once
+    // we are exiting, clients are answered but not resumed.
+    if (data->should_run && conn->active && !client_suspended(conn)) {
+        ev_io_start(data->loop, &conn->client);
+        if (handle_client_connect(handle))
+            deactivate_client_connection(conn);
+        circbuf_release(data, &conn->input);
+    }
+}
+
+
+/**
+ * Pushes an owned command onto the queue of a
+ * worker, and wakes it up if needed.
+ */
+static void push_owned_cmd(bloom_networking *netconf, int worker, owned_cmd *cmd) {
+    worker_ev_userdata *data = netconf->workers[worker];
+    if (owner_queue_push(&data->queue, cmd)) {
+        write(data->pipefd[1], "o", 1);
     }
 }
 
@@ -562,6 +802,7 @@ static void handle_periodic_timeout(ev_loop *lp, ev_timer *t, int ready_events)
     bloom_conn_handler handle;
     handle.config = data->netconf->config;
     handle.mgr = data->netconf->mgr;
+    handle.pool = data->netconf->pool;
     handle.conn = NULL;
 
     // Invoke the connection handler layer
@@ -569,6 +810,40 @@ static void handle_periodic_timeout(ev_loop *lp, ev_timer *t, int ready_events)
 }
 
 
+/**
+ * Invoked once a throttled client has waited out
+ * its rate limits, to handle its next commands.
+ */
+static void handle_throttle_timeout(ev_loop *lp, ev_timer *t, int ready_events) {
+    worker_ev_userdata *data = ev_userdata(lp);
+    conn_info *conn = t->data;
+    conn->throttled = 0;
+    __sync_fetch_and_sub(&CONN_STATS.throttled, 1);
+    resume_client(data, conn);
+}
+
+
+/**
+ * Invoked when the socket of a watcher is ready
+ */
+static void handle_watcher_io(ev_loop *lp, ev_io *watcher, int ready_events) {
+    bloom_watcher *w = watcher->data;
+    int events = 0;
+    if (ready_events & EV_READ) events |= WATCH_READ;
+    if (ready_events & EV_WRITE) events |= WATCH_WRITE;
+    w->cb(w->arg, events);
+}
+
+
+/**
+ * Invoked when a watcher times out
+ */
+static void handle_watcher_timeout(ev_loop *lp, ev_timer *t, int ready_events) {
+    bloom_watcher *w = t->data;
+    w->cb(w->arg, WATCH_TIMEOUT);
+}
+
+
 /**
  * Entry point for threads to join the networking
  * stack. This method blocks indefinitely until the
@@ -576,36 +851,46 @@ static void handle_periodic_timeout(ev_loop *lp, ev_timer *t, int ready_events)
  * @arg netconf The configuration for the networking stack.
  */
 void start_networking_worker(bloom_networking *netconf) {
-    // Allocate our user data
-    worker_ev_userdata data;
-    data.netconf = netconf;
-    data.should_run = 1;
-    data.inactive = NULL;
+    // Allocate our user data. It is freed once every worker
+    // has exited, since the others may push commands to us.
+    worker_ev_userdata *data = calloc(1, sizeof(worker_ev_userdata));
+    data->netconf = netconf;
+    data->should_run = 1;
+    data->inactive = NULL;
+    data->watchers = NULL;
+    data->index = -1;
+    data->queue.head = NULL;
+    data->pending = NULL;
+    data->num_free_bufs = 0;
 
     // Allocate our pipe
-    if (pipe(data.pipefd)) {
+    if (pipe(data->pipefd)) {
         perror("failed to allocate worker pipes!");
+        free(data);
         return;
     }
 
     // Create the event loop
-    if (!(data.loop = ev_loop_new(netconf->ev_mode))) {
-        syslog(LOG_ERR, "Failed to create event loop for worker!");
+    if (!(data->loop = ev_loop_new(netconf->ev_mode))) {
+        bloom_log(LOG_ERR, "Failed to create event loop for worker!");
+        close(data->pipefd[0]);
+        close(data->pipefd[1]);
+        free(data);
         return;
     }
 
     // Set the user data to be for this thread
-    ev_set_userdata(data.loop, &data);
+    ev_set_userdata(data->loop, data);
 
     // Setup the pipe listener
-    ev_io_init(&data.pipe_client, handle_worker_notification,
-                data.pipefd[0], EV_READ);
-    ev_io_start(data.loop, &data.pipe_client);
+    ev_io_init(&data->pipe_client, handle_worker_notification,
+                data->pipefd[0], EV_READ);
+    ev_io_start(data->loop, &data->pipe_client);
 
     // Setup the periodic timers,
-    ev_timer_init(&data.periodic, handle_periodic_timeout,
+    ev_timer_init(&data->periodic, handle_periodic_timeout,
                 PERIODIC_TIME_SEC, 1);
-    ev_timer_start(data.loop, &data.periodic);
+    ev_timer_start(data->loop, &data->periodic);
 
     // Syncronize until netconf->threads is available
     barrier_wait(&netconf->thread_barrier);
@@ -616,34 +901,69 @@ void start_networking_worker(bloom_networking *netconf) {
     for (int i=0; i < netconf->config->worker_threads; i++) {
         if (pthread_equal(id, netconf->threads[i])) {
             // Provide a pointer to our data
-            netconf->workers[i] = &data;
+            netconf->workers[i] = data;
+            data->index = i;
             break;
         }
     }
 
+    // Run on the CPUs of our node, near the filters we own
+    if (netconf->config->numa_aware) {
+        int node = numa_worker_node(data->index);
+        if (node < 0 || numa_pin_thread(node)) {
+            bloom_log(LOG_WARNING, "Failed to pin worker %d to NUMA node %d.", data->index, node);
+        } else {
+            bloom_log(LOG_INFO, "Pinned worker %d to NUMA node %d.", data->index, node);
+        }
+    }
+
     // Wait for everybody to be registered
     barrier_wait(&netconf->thread_barrier);
 
     // Run the event loop
-    while (data.should_run) {
-        ev_run(data.loop, EVRUN_ONCE);
-
-        // Free inactive connections
-        conn_info *c = data.inactive;
+    while (data->should_run) {
+        ev_run(data->loop, EVRUN_ONCE);
+        handle_pending_cmds(data);
+
+        // Free inactive connections, unless an owned
+        // command still refers to them
+        conn_info *c = data->inactive;
+        data->inactive = NULL;
         while (c) {
             conn_info *n = c->next;
-            close_client_connection(c);
+            if (c->suspended) {
+                c->next = data->inactive;
+                data->inactive = c;
+            } else {
+                close_client_connection(c);
+            }
             c = n;
         }
-        data.inactive = NULL;
     }
 
-    // Cleanup after exit
-    ev_timer_stop(data.loop, &data.periodic);
-    ev_io_stop(data.loop, &data.pipe_client);
-    close(data.pipefd[0]);
-    close(data.pipefd[1]);
-    ev_loop_destroy(data.loop);
+    // Execute the owned commands left in the queues, sending
+    // those of other workers back. Once no loop runs, clients
+    // are no longer resumed, so no more commands are forwarded.
+    barrier_wait(&netconf->quit_barrier);
+    handle_owned_cmds(data);
+    handle_pending_cmds(data);
+
+    // Every command has been executed, answer the rest
+    barrier_wait(&netconf->quit_barrier);
+    handle_owned_cmds(data);
+
+    // Cleanup after exit. The pipe and loop are kept until
+    // shutdown_networking, once no worker can push to us.
+    for (int i=0; i < data->num_free_bufs; i++) free(data->free_bufs[i]);
+    while (data->watchers) {
+        bloom_watcher *w = data->watchers;
+        data->watchers = w->next;
+        ev_io_stop(data->loop, &w->io);
+        ev_timer_stop(data->loop, &w->timer);
+        free(w);
+    }
+    ev_timer_stop(data->loop, &data->periodic);
+    ev_io_stop(data->loop, &data->pipe_client);
 }
 
 
@@ -656,6 +976,7 @@ void start_networking_worker(bloom_networking *netconf) {
 void enter_main_loop(bloom_networking *netconf, int *should_run, pthread_t *threads) {
     // Store a reference to the threads
     netconf->threads = threads;
+    netconf->should_run = should_run;
 
     // Set the user data of the main loop to netconf
     ev_set_userdata(netconf->default_loop, netconf);
@@ -698,6 +1019,17 @@ int shutdown_networking(bloom_networking *netconf, pthread_t *threads) {
         if (thread) pthread_join(thread, NULL);
     }
 
+    // Free the workers, now that none can push to another
+    worker_ev_userdata *data;
+    for (int i=0; i < netconf->config->worker_threads; i++) {
+        data = netconf->workers[i];
+        if (!data) continue;
+        close(data->pipefd[0]);
+        close(data->pipefd[1]);
+        ev_loop_destroy(data->loop);
+        free(data);
+    }
+
     // TODO: Close all the client connections
     // ??? For now, we just leak the memory
     // since we are shutdown down anyways...
@@ -705,6 +1037,9 @@ int shutdown_networking(bloom_networking *netconf, pthread_t *threads) {
     // Shutdown the event loo
     ev_loop_destroy(netconf->default_loop);
 
+    // Stop the pool, now that no worker uses it
+    if (netconf->pool) destroy_workpool(netconf->pool);
+
     // Free the netconf
     free(netconf->workers);
     free(netconf);
@@ -728,13 +1063,17 @@ static void close_client_connection(conn_info *conn) {
     // Stop the libev clients
     ev_io_stop(conn->thread_ev->loop, &conn->client);
     ev_io_stop(conn->thread_ev->loop, &conn->write_client);
+    ev_timer_stop(conn->thread_ev->loop, &conn->throttle);
 
     // Clear everything out
-    circbuf_free(&conn->input);
-    circbuf_free(&conn->output);
+    if (conn->output_paused) __sync_fetch_and_sub(&CONN_STATS.paused, 1);
+    if (conn->throttled) __sync_fetch_and_sub(&CONN_STATS.throttled, 1);
+    __sync_fetch_and_sub(&CONN_STATS.connections, 1);
+    circbuf_free(conn->thread_ev, &conn->input);
+    circbuf_free(conn->thread_ev, &conn->output);
 
     // Close the fd
-    syslog(LOG_DEBUG, "Closed connection. [%d]", conn->client.fd);
+    bloom_log(LOG_DEBUG, "Closed connection. [%d]", conn->client.fd);
     close(conn->client.fd);
     free(conn);
 }
@@ -750,6 +1089,212 @@ static void deactivate_client_connection(conn_info *conn) {
     conn->thread_ev->inactive = conn;
 }
 
+/**
+ * Returns the worker serving a client.
+ * @arg conn The client connection
+ * @return The index of the worker
+ */
+int client_worker(conn_info *conn) {
+    return conn->thread_ev->index;
+}
+
+/**
+ * Checks if a client is waiting on an owned command.
+ * @arg conn The client connection
+ * @return 1 if suspended.
+ */
+int client_suspended(conn_info *conn) {
+    return conn->suspended || conn->output_paused || conn->throttled;
+}
+
+/**
+ * Returns the counts of the client connections.
+ * @arg stats Output, the counts
+ */
+void client_stats(bloom_conn_stats *stats) {
+    stats->connections = CONN_STATS.connections;
+    stats->paused = CONN_STATS.paused;
+    stats->pauses = CONN_STATS.pauses;
+    stats->throttled = CONN_STATS.throttled;
+    stats->throttles = CONN_STATS.throttles;
+}
+
+/**
+ * Sends a command to the worker that owns the filter. The
+ * client is suspended, and no more of its input is processed
+ * until the owner has executed the command and it has been
+ * answered with finish_owned_cmd.
+ * @arg conn The client connection
+ * @arg owner The worker that owns the filter
+ * @arg cmd The command to execute
+ */
+void forward_owned_cmd(conn_info *conn, int owner, owned_cmd *cmd) {
+    cmd->conn = conn;
+    cmd->origin = conn->thread_ev->index;
+    conn->suspended = 1;
+    ev_io_stop(conn->thread_ev->loop, &conn->client);
+    push_owned_cmd(conn->thread_ev->netconf, owner, cmd);
+}
+
+/**
+ * Defers a command until the end of the current pass of the
+ * event loop, when it is executed along with the other commands
+ * deferred by clients of the same worker. The client is suspended
+ * until the command has been answered with finish_owned_cmd.
+ * @arg conn The client connection
+ * @arg cmd The command to execute
+ */
+void defer_owned_cmd(conn_info *conn, owned_cmd *cmd) {
+    worker_ev_userdata *data = conn->thread_ev;
+    cmd->conn = conn;
+    cmd->origin = data->index;
+    conn->suspended = 1;
+    ev_io_stop(data->loop, &conn->client);
+    cmd->next = data->pending;
+    data->pending = cmd;
+}
+
+/**
+ * Suspends a client while a command runs outside of the
+ * workers, such as on the rewrite thread. Once it is handed
+ * back with return_owned_cmd, it is answered with
+ * finish_owned_cmd and the client is resumed.
+ * @arg conn The client connection
+ * @arg cmd The command to run
+ */
+void detach_owned_cmd(conn_info *conn, owned_cmd *cmd) {
+    cmd->conn = conn;
+    cmd->origin = conn->thread_ev->index;
+    conn->suspended = 1;
+    ev_io_stop(conn->thread_ev->loop, &conn->client);
+}
+
+/**
+ * Marks a command that ran outside of the workers as done,
+ * and hands it back to the worker serving its client.
+ * @note Thread safe.
+ * @arg cmd The command from detach_owned_cmd
+ */
+void return_owned_cmd(owned_cmd *cmd) {
+    conn_info *conn = cmd->conn;
+    cmd->done = 1;
+    push_owned_cmd(conn->thread_ev->netconf, cmd->origin, cmd);
+}
+
+/**
+ * Suspends a client while its commands wait on something
+ * outside of the worker, such as the backends of the proxy.
+ * No more of its input is processed until wake_client.
+ * @arg conn The client connection
+ */
+void suspend_client(conn_info *conn) {
+    conn->suspended = 1;
+    ev_io_stop(conn->thread_ev->loop, &conn->client);
+}
+
+/**
+ * Resumes a client suspended by suspend_client, handling the
+ * commands it sent meanwhile. A client that disconnected while
+ * suspended is only freed once it has been woken up.
+ * @arg conn The client connection
+ */
+void wake_client(conn_info *conn) {
+    conn->suspended = 0;
+    resume_client(conn->thread_ev, conn);
+}
+
+/**
+ * Creates a watcher on the worker serving a client. The
+ * watcher stays with the worker, and is freed when it exits.
+ * @arg conn A client connection of the worker
+ * @arg cb The callback to invoke
+ * @arg arg Passed to the callback
+ * @return The new watcher, or NULL on failure.
+ */
+bloom_watcher* watcher_new(conn_info *conn, bloom_watcher_cb cb, void *arg) {
+    bloom_watcher *w = calloc(1, sizeof(bloom_watcher));
+    if (!w) return NULL;
+    w->thread_ev = conn->thread_ev;
+    w->cb = cb;
+    w->arg = arg;
+    ev_io_init(&w->io, handle_watcher_io, -1, 0);
+    w->io.data = w;
+    ev_timer_init(&w->timer, handle_watcher_timeout, 0, 0);
+    w->timer.data = w;
+    w->next = w->thread_ev->watchers;
+    w->thread_ev->watchers = w;
+    return w;
+}
+
+/**
+ * Sets the socket and the events a watcher waits for.
+ * @arg w The watcher
+ * @arg fd The socket, or -1 to stop watching it
+ * @arg events WATCH_READ and WATCH_WRITE, or 0 to stop
+ */
+void watcher_io(bloom_watcher *w, int fd, int events) {
+    int ev_events = 0;
+    if (events & WATCH_READ) ev_events |= EV_READ;
+    if (events & WATCH_WRITE) ev_events |= EV_WRITE;
+    if (fd == -1) ev_events = 0;
+
+    // Leave the watcher alone if nothing changes
+    int active = ev_is_active(&w->io);
+    if (active && w->io.fd == fd && (w->io.events & (EV_READ | EV_WRITE)) == ev_events) return;
+    if (!active && !ev_events) return;
+
+    ev_io_stop(w->thread_ev->loop, &w->io);
+    if (!ev_events) return;
+    ev_io_set(&w->io, fd, ev_events);
+    ev_io_start(w->thread_ev->loop, &w->io);
+}
+
+/**
+ * Sets a watcher to time out once, after the given time.
+ * This replaces any earlier time out.
+ * @arg w The watcher
+ * @arg timeout The time in seconds, or 0 to stop
+ */
+void watcher_timeout(bloom_watcher *w, double timeout) {
+    ev_timer_stop(w->thread_ev->loop, &w->timer);
+    if (timeout <= 0) return;
+    ev_timer_set(&w->timer, timeout, 0);
+    ev_timer_start(w->thread_ev->loop, &w->timer);
+}
+
+/**
+ * Takes the keys and bytes of a command from the rate limits
+ * of a client. If the client is over its limits, or must wait
+ * for others such as those of a filter, its next commands are
+ * deferred until the wait is over.
+ * @arg conn The client connection
+ * @arg ops The number of keys checked or set
+ * @arg bytes The bytes of the keys
+ * @arg now The current time from bucket_clock
+ * @arg min_wait The seconds to wait for other limits, or 0
+ */
+void throttle_client(conn_info *conn, uint64_t ops, uint64_t bytes, double now, double min_wait) {
+    double wait = bucket_take(&conn->ops_bucket, ops, now);
+    double bytes_wait = bucket_take(&conn->bytes_bucket, bytes, now);
+    if (bytes_wait > wait) wait = bytes_wait;
+    if (min_wait > wait) wait = min_wait;
+    if (wait <= 0) return;
+
+    // Stop reading, and wake up once the wait is over
+    ev_loop *loop = conn->thread_ev->loop;
+    if (!conn->throttled) {
+        conn->throttled = 1;
+        ev_io_stop(loop, &conn->client);
+        __sync_fetch_and_add(&CONN_STATS.throttled, 1);
+        __sync_fetch_and_add(&CONN_STATS.throttles, 1);
+    } else if (ev_timer_remaining(loop, &conn->throttle) >= wait) {
+        return;
+    }
+    ev_timer_stop(loop, &conn->throttle);
+    ev_timer_set(&conn->throttle, wait, 0);
+    ev_timer_start(loop, &conn->throttle);
+}
+
 /**
  * Sends a response to a client.
  * @arg conn The client connection
@@ -777,13 +1322,61 @@ int send_client_response(conn_info *conn, char **response_buffers, int *buf_size
 
     // Disable the connection on error
     if (res) deactivate_client_connection(conn);
+    else if (conn->use_write_buf) check_output_backlog(conn);
     return res;
 }
 
+/**
+ * Stops reading from a client once its unsent output
+ * is over the high watermark. Any commands already read
+ * are left until the output falls below the low watermark.
+ */
+static void check_output_backlog(conn_info *conn) {
+    uint64_t high = conn->thread_ev->netconf->config->output_high_watermark;
+    if (!high || conn->output_paused || circbuf_used(&conn->output) <= high) return;
+    conn->output_paused = 1;
+    ev_io_stop(conn->thread_ev->loop, &conn->client);
+    __sync_fetch_and_add(&CONN_STATS.paused, 1);
+    __sync_fetch_and_add(&CONN_STATS.pauses, 1);
+}
+
+/**
+ * Reads from a paused client again, and handles the
+ * commands it sent while paused. A client waiting on
+ * an owned command is resumed once that is answered.
+ */
+static void resume_client_input(worker_ev_userdata *data, conn_info *conn) {
+    conn->output_paused = 0;
+    __sync_fetch_and_sub(&CONN_STATS.paused, 1);
+    resume_client(data, conn);
+}
+
+/**
+ * Reads from a client again, and handles the commands it
+ * sent meanwhile, unless it is still suspended for another
+ * reason.
+ */
+static void resume_client(worker_ev_userdata *data, conn_info *conn) {
+    if (!conn->active || client_suspended(conn)) return;
+
+    // Prepare to invoke the handler
+    bloom_conn_handler handle;
+    handle.config = data->netconf->config;
+    handle.mgr = data->netconf->mgr;
+    handle.pool = data->netconf->pool;
+    handle.conn = conn;
+
+    ev_io_start(data->loop, &conn->client);
+    if (handle_client_connect(&handle))
+        deactivate_client_connection(conn);
+    circbuf_release(data, &conn->input);
+}
+
 
 static int send_client_response_buffered(conn_info *conn, char **response_buffers, int *buf_sizes, int num_bufs) {
     // Copy the buffers to the output buffer
     int res = 0;
+    circbuf_acquire(conn->thread_ev, &conn->output);
     for (int i=0; i< num_bufs; i++) {
         res = circbuf_write(&conn->output, response_buffers[i], buf_sizes[i]);
         if (res) break;
@@ -811,7 +1404,7 @@ static int send_client_response_direct(conn_info *conn, char **response_buffers,
     // Check for a fatal error
     if (sent == -1) {
         if (errno != EAGAIN && errno != EINTR && errno != EWOULDBLOCK) {
-            syslog(LOG_ERR, "Failed to send() to connection [%d]! %s.",
+            bloom_log(LOG_ERR, "Failed to send() to connection [%d]! %s.",
                     conn->client.fd, strerror(errno));
             return 1;
         }
@@ -830,6 +1423,7 @@ static int send_client_response_direct(conn_info *conn, char **response_buffers,
 
     // Copy the buffers
     int res, offset;
+    circbuf_acquire(conn->thread_ev, &conn->output);
     for (int i=index; i < num_bufs; i++) {
         offset = 0;
         if (i == index && skip_bytes < sent) {
@@ -864,6 +1458,9 @@ static int send_client_response_direct(conn_info *conn, char **response_buffers,
  * @return 0 on success, -1 if the terminator is not found.
  */
 int extract_to_terminator(bloom_conn_info *conn, char terminator, char **buf, int *buf_len, int *should_free) {
+    // Nothing to scan without a buffer
+    if (!conn->input.buffer) return -1;
+
     // First we need to find the terminator...
     char *term_addr = NULL;
     if (conn->input.write_cursor < conn->input.read_cursor) {
@@ -952,12 +1549,12 @@ static int set_client_sockopts(int client_fd) {
     // Setup the socket to be non-blocking
     int sock_flags = fcntl(client_fd, F_GETFL, 0);
     if (sock_flags < 0) {
-        syslog(LOG_ERR, "Failed to get socket flags on connection! %s.", strerror(errno));
+        bloom_log(LOG_ERR, "Failed to get socket flags on connection! %s.", strerror(errno));
         close(client_fd);
         return 1;
     }
     if (fcntl(client_fd, F_SETFL, sock_flags | O_NONBLOCK)) {
-        syslog(LOG_ERR, "Failed to set O_NONBLOCK on connection! %s.", strerror(errno));
+        bloom_log(LOG_ERR, "Failed to set O_NONBLOCK on connection! %s.", strerror(errno));
         close(client_fd);
         return 1;
     }
@@ -968,12 +1565,12 @@ static int set_client_sockopts(int client_fd) {
      */
     int flag = 1;
     if (setsockopt(client_fd, IPPROTO_TCP, TCP_NODELAY, (char *) &flag, sizeof(int))) {
-        syslog(LOG_WARNING, "Failed to set TCP_NODELAY on connection! %s.", strerror(errno));
+        bloom_log(LOG_WARNING, "Failed to set TCP_NODELAY on connection! %s.", strerror(errno));
     }
 
     // Set keep alive
     if(setsockopt(client_fd, SOL_SOCKET, SO_KEEPALIVE, &flag, sizeof(int))) {
-        syslog(LOG_WARNING, "Failed to set SO_KEEPALIVE on connection! %s.", strerror(errno));
+        bloom_log(LOG_WARNING, "Failed to set SO_KEEPALIVE on connection! %s.", strerror(errno));
     }
 
     return 0;
@@ -983,12 +1580,16 @@ static int set_client_sockopts(int client_fd) {
 /**
  * Returns a new conn_info struct
  */
-static conn_info* get_conn() {
+static conn_info* get_conn(bloom_config *config) {
     // Allocate space
     conn_info *conn = malloc(sizeof(conn_info));
 
     // Setup variables
     conn->active = 1;
+    conn->suspended = 0;
+    conn->output_paused = 0;
+    conn->throttled = 0;
+    __sync_fetch_and_add(&CONN_STATS.connections, 1);
     conn->use_write_buf = 0;
 
     // Prepare the buffers
@@ -999,6 +1600,12 @@ static conn_info* get_conn() {
     conn->client.data = conn;
     conn->write_client.data = conn;
 
+    // Limit the rates of the client
+    ev_timer_init(&conn->throttle, handle_throttle_timeout, 0, 0);
+    conn->throttle.data = conn;
+    bucket_init(&conn->ops_bucket, config->conn_rate_ops);
+    bucket_init(&conn->bytes_bucket, config->conn_rate_bytes);
+
     return conn;
 }
 
@@ -1006,18 +1613,48 @@ static conn_info* get_conn() {
  * Methods for manipulating our circular buffers
  */
 
-// Conditionally allocates if there is no buffer
+// Initializes an empty buffer, memory is taken on first use
 static void circbuf_init(circular_buffer *buf) {
     buf->read_cursor = 0;
     buf->write_cursor = 0;
+    buf->buf_size = 0;
+    buf->buffer = NULL;
+}
+
+// Takes a buffer from the worker pool if there is none
+static void circbuf_acquire(worker_ev_userdata *data, circular_buffer *buf) {
+    if (buf->buffer) return;
+    if (data->num_free_bufs)
+        buf->buffer = data->free_bufs[--data->num_free_bufs];
+    else
+        buf->buffer = malloc(INIT_CONN_BUF_SIZE * sizeof(char));
     buf->buf_size = INIT_CONN_BUF_SIZE * sizeof(char);
-    buf->buffer = malloc(buf->buf_size);
+    buf->read_cursor = 0;
+    buf->write_cursor = 0;
 }
 
-// Frees a buffer
-static void circbuf_free(circular_buffer *buf) {
-    if (buf->buffer) free(buf->buffer);
-    buf->buffer = NULL;
+// Gives the buffer back to the worker pool once it is drained
+static void circbuf_release(worker_ev_userdata *data, circular_buffer *buf) {
+    if (buf->buffer && buf->read_cursor == buf->write_cursor) {
+        circbuf_free(data, buf);
+    }
+}
+
+// Frees a buffer, keeping those of the default size for reuse
+static void circbuf_free(worker_ev_userdata *data, circular_buffer *buf) {
+    if (!buf->buffer) return;
+    if (buf->buf_size == INIT_CONN_BUF_SIZE && data->num_free_bufs < CONN_BUF_POOL_SIZE)
+        data->free_bufs[data->num_free_bufs++] = buf->buffer;
+    else
+        free(buf->buffer);
+    circbuf_init(buf);
+}
+
+// Calculates the bytes waiting in the buffer
+static uint64_t circbuf_used(circular_buffer *buf) {
+    if (buf->write_cursor < buf->read_cursor)
+        return buf->buf_size - buf->read_cursor + buf->write_cursor;
+    return buf->write_cursor - buf->read_cursor;
 }
 
 // Calculates the available buffer size
@@ -1033,9 +1670,9 @@ static uint64_t circbuf_avail_buf(circular_buffer *buf) {
 
 // Grows the circular buffer to make room for more data
 static void circbuf_grow_buf(circular_buffer *buf) {
-    int new_size = buf->buf_size * CONN_BUF_MULTIPLIER * sizeof(char);
+    uint64_t new_size = buf->buf_size * CONN_BUF_MULTIPLIER * sizeof(char);
     char *new_buf = malloc(new_size);
-    int bytes_written = 0;
+    uint64_t bytes_written = 0;
 
     // Check if the write has wrapped around
     if (buf->write_cursor < buf->read_cursor) {
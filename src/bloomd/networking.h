@@ -2,6 +2,7 @@
 #define BLOOM_NETWORKING_H
 #include "config.h"
 #include "filter_manager.h"
+#include "owner.h"
 
 // Network configuration struct
 typedef struct bloom_networking bloom_networking;
@@ -11,9 +12,19 @@ typedef struct conn_info bloom_conn_info;
  * Initializes the networking interfaces
  * @arg config Takes the bloom server configuration
  * @arg mgr The filter manager to pass up to the connection handlers
+ * @arg listen_fds Optional, the TCP and UDP sockets handed over
+ * by a previous process. NULL to bind new sockets.
  * @arg netconf Output. The configuration for the networking stack.
  */
-int init_networking(bloom_config *config, bloom_filtmgr *mgr, bloom_networking **netconf_out);
+int init_networking(bloom_config *config, bloom_filtmgr *mgr, int *listen_fds, bloom_networking **netconf_out);
+
+/**
+ * Provides the listening sockets, so that they can be
+ * handed over to a new process.
+ * @arg netconf The configuration for the networking stack.
+ * @arg fds Output. Set to the TCP and UDP listener sockets.
+ */
+void networking_listener_fds(bloom_networking *netconf, int *fds);
 
 /**
  * Entry point for the main thread to start accepting
@@ -44,6 +55,131 @@ int shutdown_networking(bloom_networking *netconf, pthread_t *threads);
  * that the connection handlers can manipulate the buffers.
  */
 
+/**
+ * Returns the worker serving a client.
+ * @arg conn The client connection
+ * @return The index of the worker
+ */
+int client_worker(bloom_conn_info *conn);
+
+/**
+ * Checks if no more input of a client should be processed
+ * for now, because it is waiting on an owned command, too
+ * much of its output has not been sent, or it is throttled.
+ * @arg conn The client connection
+ * @return 1 if suspended.
+ */
+int client_suspended(bloom_conn_info *conn);
+
+/**
+ * Sends a command to the worker that owns the filter. The
+ * client is suspended, and no more of its input is processed
+ * until the owner has executed the command and it has been
+ * answered with finish_owned_cmd.
+ * @arg conn The client connection
+ * @arg owner The worker that owns the filter
+ * @arg cmd The command to execute
+ */
+void forward_owned_cmd(bloom_conn_info *conn, int owner, owned_cmd *cmd);
+
+/**
+ * Defers a command until the end of the current pass of the
+ * event loop, when it is executed along with the other commands
+ * deferred by clients of the same worker. The client is suspended
+ * until the command has been answered with finish_owned_cmd.
+ * @arg conn The client connection
+ * @arg cmd The command to execute
+ */
+void defer_owned_cmd(bloom_conn_info *conn, owned_cmd *cmd);
+
+/**
+ * Suspends a client while a command runs outside of the
+ * workers, such as on the rewrite thread. Once it is handed
+ * back with return_owned_cmd, it is answered with
+ * finish_owned_cmd and the client is resumed.
+ * @arg conn The client connection
+ * @arg cmd The command to run
+ */
+void detach_owned_cmd(bloom_conn_info *conn, owned_cmd *cmd);
+
+/**
+ * Marks a command that ran outside of the workers as done,
+ * and hands it back to the worker serving its client.
+ * @note Thread safe.
+ * @arg cmd The command from detach_owned_cmd
+ */
+void return_owned_cmd(owned_cmd *cmd);
+
+/**
+ * Suspends a client while its commands wait on something
+ * outside of the worker, such as the backends of the proxy.
+ * No more of its input is processed until wake_client.
+ * @arg conn The client connection
+ */
+void suspend_client(bloom_conn_info *conn);
+
+/**
+ * Resumes a client suspended by suspend_client, handling the
+ * commands it sent meanwhile. A client that disconnected while
+ * suspended is only freed once it has been woken up.
+ * @arg conn The client connection
+ */
+void wake_client(bloom_conn_info *conn);
+
+/**
+ * Events of a watcher
+ */
+#define WATCH_READ 1
+#define WATCH_WRITE 2
+#define WATCH_TIMEOUT 4
+
+/**
+ * A watcher lets a connection handler wait on sockets of its
+ * own on the event loop of a worker, instead of blocking it.
+ * The callback is invoked with the events that are ready.
+ */
+typedef struct bloom_watcher bloom_watcher;
+typedef void (*bloom_watcher_cb)(void *arg, int events);
+
+/**
+ * Creates a watcher on the worker serving a client. The
+ * watcher stays with the worker, and is freed when it exits.
+ * @arg conn A client connection of the worker
+ * @arg cb The callback to invoke
+ * @arg arg Passed to the callback
+ * @return The new watcher, or NULL on failure.
+ */
+bloom_watcher* watcher_new(bloom_conn_info *conn, bloom_watcher_cb cb, void *arg);
+
+/**
+ * Sets the socket and the events a watcher waits for.
+ * @arg w The watcher
+ * @arg fd The socket, or -1 to stop watching it
+ * @arg events WATCH_READ and WATCH_WRITE, or 0 to stop
+ */
+void watcher_io(bloom_watcher *w, int fd, int events);
+
+/**
+ * Sets a watcher to time out once, after the given time.
+ * This replaces any earlier time out.
+ * @arg w The watcher
+ * @arg timeout The time in seconds, or 0 to stop
+ */
+void watcher_timeout(bloom_watcher *w, double timeout);
+
+/**
+ * Takes the keys and bytes of a command from the rate limits
+ * of a client. If the client is over its limits, or must wait
+ * for others such as those of a filter, its next commands are
+ * deferred until the wait is over.
+ * @arg conn The client connection
+ * @arg ops The number of keys checked or set
+ * @arg bytes The bytes of the keys
+ * @arg now The current time from bucket_clock
+ * @arg min_wait The seconds to wait for other limits, or 0
+ */
+void throttle_client(bloom_conn_info *conn, uint64_t ops, uint64_t bytes, double now, double min_wait);
+
 /**
  * Sends a response to a client.
  * @arg conn The client connection
@@ -71,4 +207,21 @@ int send_client_response(bloom_conn_info *conn, char **response_buffers, int *bu
  */
 int extract_to_terminator(bloom_conn_info *conn, char terminator, char **buf, int *buf_len, int *should_free);
 
+/**
+ * Counts of the client connections
+ */
+typedef struct {
+    uint64_t connections;   // Open connections
+    uint64_t paused;        // Connections not read due to their output
+    uint64_t pauses;        // Times a connection was paused
+    uint64_t throttled;     // Connections deferred by rate limits
+    uint64_t throttles;     // Times a connection was throttled
+} bloom_conn_stats;
+
+/**
+ * Returns the counts of the client connections.
+ * @arg stats Output, the counts
+ */
+void client_stats(bloom_conn_stats *stats);
+
 #endif
@@ -0,0 +1,180 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+#include <syslog.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#include "numa.h"
+#include "owner.h"
+#include "logger.h"
+
+/**
+ * Most nodes we track, which is plenty
+ * for the machines we run on.
+ */
+#define MAX_NODES 64
+
+/**
+ * Memory policy values from the kernel's mempolicy.h,
+ * which is not always installed.
+ */
+#define MPOL_PREFERRED 1
+#define MPOL_MF_MOVE (1 << 1)
+
+static const char NODE_ONLINE_PATH[] = "/sys/devices/system/node/online";
+static const char NODE_CPULIST_PATH[] = "/sys/devices/system/node/node%d/cpulist";
+
+/* Static declarations */
+static void read_nodes(void);
+static int read_list(const char *path, int *out, int max);
+
+// The online nodes, read once
+static pthread_once_t NODES_ONCE = PTHREAD_ONCE_INIT;
+static int NODES[MAX_NODES];
+static int NUM_NODES = 0;
+
+/**
+ * Returns the number of online NUMA nodes. Systems
+ * without NUMA support have a single node.
+ */
+int numa_num_nodes(void) {
+    pthread_once(&NODES_ONCE, read_nodes);
+    return (NUM_NODES > 0) ? NUM_NODES : 1;
+}
+
+/**
+ * Returns the node a worker is placed on.
+ * @arg worker The index of the worker
+ * @return The node, or -1 if the node is unknown.
+ */
+int numa_worker_node(int worker) {
+    pthread_once(&NODES_ONCE, read_nodes);
+    if (NUM_NODES == 0) return -1;
+    return NODES[worker % NUM_NODES];
+}
+
+/**
+ * Returns the node a filter is placed on, which is the
+ * node of the worker that owns it.
+ * @arg filter_name The name of the filter
+ * @arg num_workers The number of workers
+ * @return The node, or -1 if the node is unknown.
+ */
+int numa_filter_node(char *filter_name, int num_workers) {
+    return numa_worker_node(filter_owner(filter_name, num_workers));
+}
+
+/**
+ * Pins the calling thread to the CPUs of a node.
+ * CPUs numbered past CPU_SETSIZE are left out.
+ * @arg node The node
+ * @return 0 on success, negative on failure.
+ */
+int numa_pin_thread(int node) {
+#ifdef __linux__
+    char path[sizeof(NODE_CPULIST_PATH) + 16];
+    snprintf(path, sizeof(path), NODE_CPULIST_PATH, node);
+    int *cpus = malloc(CPU_SETSIZE * sizeof(int));
+    int num_cpus = read_list(path, cpus, CPU_SETSIZE);
+    if (num_cpus <= 0) {
+        free(cpus);
+        return -1;
+    }
+
+    // CPUs past the end of a cpu_set_t cannot be pinned to
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    int skipped = 0;
+    for (int i=0; i < num_cpus; i++) {
+        if (cpus[i] < CPU_SETSIZE) CPU_SET(cpus[i], &set);
+        else skipped++;
+    }
+    free(cpus);
+    if (skipped) {
+        bloom_log(LOG_WARNING, "Skipped %d CPUs of node %d numbered past %d.",
+                skipped, node, CPU_SETSIZE - 1);
+    }
+    if (skipped == num_cpus) return -1;
+    return -pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+#else
+    (void)node;
+    return -ENOSYS;
+#endif
+}
+
+/**
+ * Prefers a node for the pages of a region of memory.
+ * Pages that are already faulted in are moved where
+ * possible. If the node runs out of memory, other
+ * nodes are used instead of failing.
+ * @arg addr The start of the region, page aligned
+ * @arg len The length of the region
+ * @arg node The node
+ * @return 0 on success, negative on failure.
+ */
+int numa_bind_memory(void *addr, uint64_t len, int node) {
+#if defined(__linux__) && defined(SYS_mbind)
+    if (node < 0 || node >= MAX_NODES) return -EINVAL;
+    unsigned long mask[MAX_NODES / (8 * sizeof(unsigned long))];
+    memset(mask, 0, sizeof(mask));
+    mask[node / (8 * sizeof(unsigned long))] = 1UL << (node % (8 * sizeof(unsigned long)));
+
+    // The kernel reads one less bit than the max node given
+    if (syscall(SYS_mbind, addr, len, MPOL_PREFERRED, mask, MAX_NODES + 1, MPOL_MF_MOVE))
+        return -errno;
+    return 0;
+#else
+    (void)addr;
+    (void)len;
+    (void)node;
+    return -ENOSYS;
+#endif
+}
+
+/**
+ * Reads the online nodes. If they are not
+ * known, we run as if NUMA is not supported.
+ */
+static void read_nodes(void) {
+    NUM_NODES = read_list(NODE_ONLINE_PATH, NODES, MAX_NODES);
+    if (NUM_NODES < 0) {
+        bloom_log(LOG_WARNING, "Failed to read the NUMA nodes from %s.", NODE_ONLINE_PATH);
+        NUM_NODES = 0;
+    }
+}
+
+/**
+ * Reads a list of numbers in the sysfs format,
+ * such as "0-3,8-11", from a file.
+ * @arg path The file to read
+ * @arg out Output, the numbers in the list
+ * @arg max The most numbers to read
+ * @return The number of numbers read, or -1 on error.
+ */
+static int read_list(const char *path, int *out, int max) {
+    FILE *f = fopen(path, "r");
+    if (!f) return -1;
+    char buf[4096];
+    char *line = fgets(buf, sizeof(buf), f);
+    fclose(f);
+    if (!line) return -1;
+
+    int num = 0, start, end;
+    char *pos = buf;
+    while (*pos && *pos != '\n') {
+        start = end = strtol(pos, &pos, 10);
+        if (*pos == '-') end = strtol(pos + 1, &pos, 10);
+        if (start < 0 || end < start) return -1;
+        for (int i=start; i <= end && num < max; i++) {
+            out[num++] = i;
+        }
+        if (*pos == ',') pos++;
+        else if (*pos && *pos != '\n') return -1;
+    }
+    return num;
+}
@@ -0,0 +1,55 @@
+#ifndef BLOOM_NUMA_H
+#define BLOOM_NUMA_H
+#include <stdint.h>
+
+/**
+ * With numa_aware set, each worker is pinned to the CPUs of
+ * a NUMA node, taking the online nodes in turn. Each filter
+ * is placed on the node of the worker that owns it, which
+ * is where its bitmaps are bound and its commands run.
+ * The topology is read from sysfs, without libnuma.
+ */
+
+/**
+ * Returns the number of online NUMA nodes. Systems
+ * without NUMA support have a single node.
+ */
+int numa_num_nodes(void);
+
+/**
+ * Returns the node a worker is placed on.
+ * @arg worker The index of the worker
+ * @return The node, or -1 if the node is unknown.
+ */
+int numa_worker_node(int worker);
+
+/**
+ * Returns the node a filter is placed on, which is the
+ * node of the worker that owns it.
+ * @arg filter_name The name of the filter
+ * @arg num_workers The number of workers
+ * @return The node, or -1 if the node is unknown.
+ */
+int numa_filter_node(char *filter_name, int num_workers);
+
+/**
+ * Pins the calling thread to the CPUs of a node.
+ * CPUs numbered past CPU_SETSIZE are left out.
+ * @arg node The node
+ * @return 0 on success, negative on failure.
+ */
+int numa_pin_thread(int node);
+
+/**
+ * Prefers a node for the pages of a region of memory.
+ * Pages that are already faulted in are moved where
+ * possible. If the node runs out of memory, other
+ * nodes are used instead of failing.
+ * @arg addr The start of the region, page aligned
+ * @arg len The length of the region
+ * @arg node The node
+ * @return 0 on success, negative on failure.
+ */
+int numa_bind_memory(void *addr, uint64_t len, int node);
+
+#endif
@@ -0,0 +1,120 @@
+#include <stdlib.h>
+#include <string.h>
+#include "owner.h"
+
+/**
+ * Allocates a command for the given filter and keys. The
+ * arguments are copied, so the caller can release them.
+ * @arg filter_name The name of the filter
+ * @arg keys The keys, separated by spaces
+ * @arg keys_len The length of the keys, not including the
+ * null terminator
+ * @arg split Should the keys be split on spaces, or
+ * treated as a single key
+ * @return The new command
+ */
+owned_cmd* owned_cmd_new(char *filter_name, char *keys, int keys_len, int split) {
+    // Count the keys first
+    int num_keys = 1;
+    if (split) {
+        for (int i=0; i < keys_len; i++) {
+            if (keys[i] == ' ') num_keys++;
+        }
+    }
+
+    // Allocate everything at once, the key pointers,
+    // results and strings follow the struct
+    int name_len = strlen(filter_name) + 1;
+    owned_cmd *cmd = malloc(sizeof(owned_cmd) + num_keys * (sizeof(char*) + 1) +
+                            name_len + keys_len + 1);
+    cmd->is_set = 0;
+    cmd->rewrite = 0;
+    cmd->prob = 0;
+    cmd->done = 0;
+    cmd->res = 0;
+    cmd->num_done = 0;
+    cmd->keys = (char**)(cmd + 1);
+    cmd->result = (char*)(cmd->keys + num_keys);
+    cmd->filter_name = cmd->result + num_keys;
+    cmd->next = NULL;
+    memcpy(cmd->filter_name, filter_name, name_len);
+
+    // Copy and split the keys
+    char *key = cmd->filter_name + name_len;
+    memcpy(key, keys, keys_len);
+    key[keys_len] = '\0';
+    cmd->keys[0] = key;
+    cmd->num_keys = 1;
+    if (split) {
+        for (int i=0; i < keys_len; i++) {
+            if (key[i] != ' ') continue;
+            key[i] = '\0';
+
+            // Like the multi commands, stop at an empty key
+            if (key[i+1] == '\0' || key[i+1] == ' ') break;
+            cmd->keys[cmd->num_keys++] = key + i + 1;
+        }
+    }
+    return cmd;
+}
+
+/**
+ * Frees a command
+ */
+void owned_cmd_free(owned_cmd *cmd) {
+    free(cmd);
+}
+
+/**
+ * Pushes a command onto a queue.
+ * @note Thread safe.
+ * @arg q The queue
+ * @arg cmd The command to push
+ * @return 1 if the queue was empty, and the consumer
+ * must be woken up.
+ */
+int owner_queue_push(owner_queue *q, owned_cmd *cmd) {
+    owned_cmd *head;
+    do {
+        head = q->head;
+        cmd->next = head;
+    } while (!__sync_bool_compare_and_swap(&q->head, head, cmd));
+    return head == NULL;
+}
+
+/**
+ * Takes all the commands from a queue. Must only
+ * be invoked by the consumer.
+ * @arg q The queue
+ * @return The commands in the order they were pushed,
+ * linked by next, or NULL if empty.
+ */
+owned_cmd* owner_queue_take(owner_queue *q) {
+    owned_cmd *cmd = __sync_lock_test_and_set(&q->head, NULL);
+
+    // Reverse the list, since it was pushed LIFO
+    owned_cmd *prev = NULL, *next;
+    while (cmd) {
+        next = cmd->next;
+        cmd->next = prev;
+        prev = cmd;
+        cmd = next;
+    }
+    return prev;
+}
+
+/**
+ * Returns the worker that owns a filter.
+ * @arg filter_name The name of the filter
+ * @arg num_workers The number of workers
+ * @return The index of the owning worker
+ */
+int filter_owner(char *filter_name, int num_workers) {
+    // FNV-1a is plenty for spreading filter names
+    uint32_t hash = 2166136261U;
+    for (unsigned char *c = (unsigned char*)filter_name; *c; c++) {
+        hash ^= *c;
+        hash *= 16777619U;
+    }
+    return hash % num_workers;
+}
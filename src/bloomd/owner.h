@@ -0,0 +1,90 @@
+#ifndef BLOOM_OWNER_H
+#define BLOOM_OWNER_H
+#include <stdint.h>
+
+/**
+ * In shared nothing mode, each filter is owned by a single
+ * worker. Check and set commands received by other workers
+ * are packaged as an owned_cmd and pushed onto the queue of
+ * the owner, which executes it and pushes it back onto the
+ * queue of the worker serving the client.
+ *
+ * Shrinks and compactions are packaged the same way, but
+ * executed by the rewrite thread instead of a worker.
+ */
+#define REWRITE_SHRINK 1
+#define REWRITE_COMPACT 2
+
+typedef struct owned_cmd {
+    int is_set;             // Set the keys instead of checking
+    int rewrite;            // REWRITE_SHRINK or REWRITE_COMPACT, 0 for checks and sets
+    double prob;            // Probability to shrink to
+    int done;               // Set once the owner has executed it
+    int res;                // Result of the filter manager call
+    int num_done;           // Number of keys with a result
+
+    char *filter_name;
+    char **keys;
+    int num_keys;
+    char *result;
+
+    void *conn;             // Client connection waiting on the result
+    int origin;             // Worker serving the client connection
+    struct owned_cmd *next;
+} owned_cmd;
+
+/**
+ * A lock-free multiple producer, single consumer queue.
+ * Producers push onto the head, and the consumer takes
+ * the whole list at once.
+ */
+typedef struct {
+    owned_cmd *volatile head;
+} owner_queue;
+
+/**
+ * Allocates a command for the given filter and keys. The
+ * arguments are copied, so the caller can release them.
+ * @arg filter_name The name of the filter
+ * @arg keys The keys, separated by spaces
+ * @arg keys_len The length of the keys, not including the
+ * null terminator
+ * @arg split Should the keys be split on spaces, or
+ * treated as a single key
+ * @return The new command
+ */
+owned_cmd* owned_cmd_new(char *filter_name, char *keys, int keys_len, int split);
+
+/**
+ * Frees a command
+ */
+void owned_cmd_free(owned_cmd *cmd);
+
+/**
+ * Pushes a command onto a queue.
+ * @note Thread safe.
+ * @arg q The queue
+ * @arg cmd The command to push
+ * @return 1 if the queue was empty, and the consumer
+ * must be woken up.
+ */
+int owner_queue_push(owner_queue *q, owned_cmd *cmd);
+
+/**
+ * Takes all the commands from a queue. Must only
+ * be invoked by the consumer.
+ * @arg q The queue
+ * @return The commands in the order they were pushed,
+ * linked by next, or NULL if empty.
+ */
+owned_cmd* owner_queue_take(owner_queue *q);
+
+/**
+ * Returns the worker that owns a filter.
+ * @arg filter_name The name of the filter
+ * @arg num_workers The number of workers
+ * @return The index of the owning worker
+ */
+int filter_owner(char *filter_name, int num_workers);
+
+#endif
@@ -0,0 +1,1158 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "conn_handler.h"
+#include "proxy_handler.h"
+#include "hashring.h"
+#include "logger.h"
+#include "handler_constants.c"
+
+/**
+ * Number of points each backend has on the hash ring.
+ * More points spread the filters more evenly.
+ */
+#define PROXY_RING_REPLICAS 160
+
+/**
+ * Most commands, and about the most bytes, of a client
+ * that are sent to the backends at once, before the
+ * client is suspended to wait for the responses.
+ */
+#define PROXY_BATCH_CMDS 128
+#define PROXY_BATCH_BYTES (1024*1024)
+
+/**
+ * How long to wait on a backend in seconds before
+ * its connection is dropped, and how long to wait in
+ * seconds before connecting to it again after a failure.
+ */
+#define PROXY_TIMEOUT_SEC 5.0
+#define PROXY_RETRY_SEC 1
+
+/**
+ * Least space to have free before reading from a backend
+ */
+#define PROXY_READ_SIZE 4096
+
+/**
+ * A backend bloomd process
+ */
+typedef struct {
+    char *name;                 // host:port, as placed on the ring
+    struct sockaddr_storage addr;
+    socklen_t addr_len;
+} proxy_backend;
+
+/**
+ * States of a connection to a backend
+ */
+typedef enum {
+    BACKEND_CLOSED,         // Not connected, until retry_at
+    BACKEND_CONNECTING,
+    BACKEND_OPEN
+} backend_state;
+
+/**
+ * A connection from a worker to a backend, shared by its
+ * clients. Commands are queued on the output, and responses
+ * are read into the input until the clients are answered.
+ *
+ * Responses are counted in the order their commands were
+ * queued. Those expected but not received are lost if the
+ * connection closes, and no new connection is made until
+ * every one has been answered, so a response is never
+ * taken for that of another command.
+ */
+typedef struct {
+    int index;              // Index of the backend
+    int fd;                 // -1 if not connected
+    backend_state state;
+    time_t retry_at;        // Earliest time to connect again
+    bloom_watcher *watcher;
+    int timing;             // The time out is running
+
+    uint64_t expected;      // Responses of the queued commands
+    uint64_t received;      // Complete responses read
+    uint64_t answered;      // Responses taken by the clients
+
+    char *out;
+    int out_start;          // Start of the unsent output
+    int out_len;
+    int out_size;
+
+    char *in;
+    int in_start;           // Start of the unanswered responses
+    int in_done;            // End of the complete responses
+    int in_len;             // End of the data read
+    int in_size;
+    int in_list;            // The response being read is a list
+    int in_scanned;         // Bytes of it searched for the END
+} backend_conn;
+
+/**
+ * A client command waiting on the backends
+ */
+typedef struct {
+    conn_cmd_type type;
+    int has_args;
+    int backend;            // Backend that answers it, -1 for all of them
+    int limit;              // Most lines of a list, 0 for all
+    int num_entries;        // Entries of a split batch
+    int *entry_backends;    // Backend of each entry, NULL if not split
+} proxy_cmd;
+
+/**
+ * The responses a batch expects of a backend,
+ * after first and up to last. None if equal.
+ */
+typedef struct {
+    uint64_t first;
+    uint64_t last;
+} proxy_span;
+
+/**
+ * A batch of commands of a client. The client is suspended
+ * until the responses of the batch have been received.
+ */
+typedef struct proxy_req {
+    bloom_conn_info *conn;
+    int num_cmds;
+    proxy_cmd cmds[PROXY_BATCH_CMDS];
+    struct proxy_req *next;
+    proxy_span spans[];     // Responses expected of each backend
+} proxy_req;
+
+/**
+ * The state of a worker. The batches of its clients are
+ * queued in the order they were sent, which is the order of
+ * the responses on every backend. A batch is answered once
+ * the batches before it on the same backends have been.
+ */
+typedef struct {
+    backend_conn *conns;
+    proxy_req *head;
+    proxy_req *tail;
+    char *blocked;          // Backends with an earlier batch waiting
+    int answering;          // Set while batches are answered
+} proxy_worker;
+
+/**
+ * A line of a list response from a backend
+ */
+typedef struct {
+    char *line;
+    int len;                // Including the new line
+    int name_len;
+} list_line;
+
+/**
+ * Global proxy state
+ */
+static struct {
+    int num_backends;
+    proxy_backend *backends;
+    bloom_hash_ring *ring;
+    uint64_t backend_errors;
+} PROXY;
+
+/**
+ * The state of the calling worker.
+ * The key frees it when the worker exits.
+ */
+static __thread proxy_worker *WORKER = NULL;
+static pthread_key_t WORKER_KEY;
+static pthread_once_t WORKER_KEY_ONCE = PTHREAD_ONCE_INIT;
+
+/* Static declarations */
+static int parse_backend(char *spec, proxy_backend *backend);
+static proxy_worker* worker_state(bloom_conn_info *conn);
+static void create_worker_key(void);
+static void close_worker(void *in);
+static int queue_command(backend_conn *conns, char *buf, int buf_len, proxy_cmd *cmd);
+static int list_limit(char *args);
+static int split_batch(backend_conn *conns, char *args, proxy_cmd *cmd);
+static void answer_ready(proxy_worker *pw);
+static int request_ready(proxy_worker *pw, proxy_req *req);
+static void answer_command(bloom_conn_handler *handle, backend_conn *conns, proxy_cmd *cmd);
+static void answer_list(bloom_conn_handler *handle, backend_conn *conns, int limit);
+static void answer_flush(bloom_conn_handler *handle, backend_conn *conns);
+static void answer_batch(bloom_conn_handler *handle, backend_conn *conns, proxy_cmd *cmd);
+static void answer_stats(bloom_conn_handler *handle, int has_args);
+static int compare_list_lines(const void *a, const void *b);
+static void backend_connect(backend_conn *bc);
+static void backend_fail(backend_conn *bc, int err);
+static void backend_event(void *arg, int events);
+static void backend_watch(backend_conn *bc, int progress);
+static void backend_append(backend_conn *bc, const char *data, int len);
+static void backend_queue(backend_conn *bc, char *line, int len);
+static int backend_send(backend_conn *bc);
+static int backend_read(backend_conn *bc);
+static void backend_scan(backend_conn *bc);
+static int backend_response(backend_conn *bc, char **resp, int *resp_len);
+static void backend_consume(backend_conn *bc, int len);
+
+/**
+ * Prepares the proxy to route commands to the backends
+ * in the proxy_backends setting. Must be called before
+ * the networking is initialized.
+ * @arg config The proxy configuration
+ * @return 0 on success.
+ */
+int init_proxy(bloom_config *config) {
+    if (!config->proxy_backends) {
+        bloom_log(LOG_ERR, "No proxy_backends are configured!");
+        return -1;
+    }
+
+    // Count the backends, there is at most one per separator
+    int max_backends = 1;
+    for (char *c = config->proxy_backends; *c; c++) {
+        if (*c == ',') max_backends++;
+    }
+    PROXY.backends = calloc(max_backends, sizeof(proxy_backend));
+    char **names = calloc(max_backends, sizeof(char*));
+
+    // Resolve each of the backends once
+    char *spec = strdup(config->proxy_backends);
+    char *save = NULL, *entry;
+    for (entry = strtok_r(spec, ", ", &save); entry; entry = strtok_r(NULL, ", ", &save)) {
+        proxy_backend *b = PROXY.backends + PROXY.num_backends;
+        if (parse_backend(entry, b)) {
+            bloom_log(LOG_ERR, "Failed to resolve proxy backend %s!", entry);
+            free(spec);
+            free(names);
+            destroy_proxy();
+            return -1;
+        }
+        names[PROXY.num_backends++] = b->name;
+    }
+    free(spec);
+
+    // Place the backends on the ring by name, so every
+    // proxy with the same backends routes the same way
+    int res = init_hash_ring(names, PROXY.num_backends, PROXY_RING_REPLICAS, &PROXY.ring);
+    free(names);
+    if (res) {
+        bloom_log(LOG_ERR, "Failed to create the hash ring!");
+        destroy_proxy();
+        return -1;
+    }
+
+    bloom_log(LOG_INFO, "Proxying to %d backends.", PROXY.num_backends);
+    return 0;
+}
+
+/**
+ * Frees the routing state, once the workers have exited.
+ */
+void destroy_proxy() {
+    for (int i=0; i < PROXY.num_backends; i++) {
+        free(PROXY.backends[i].name);
+    }
+    free(PROXY.backends);
+    if (PROXY.ring) destroy_hash_ring(PROXY.ring);
+    PROXY.backends = NULL;
+    PROXY.ring = NULL;
+    PROXY.num_backends = 0;
+}
+
+/**
+ * Splits a host:port and resolves it to an address.
+ * Only IPv4 is used, like the bloomd listener.
+ * @return 0 on success.
+ */
+static int parse_backend(char *spec, proxy_backend *backend) {
+    char *port = strrchr(spec, ':');
+    if (!port || port == spec) return -1;
+
+    backend->name = strdup(spec);
+    char *host = strndup(spec, port - spec);
+    struct addrinfo hints, *info = NULL;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    int res = getaddrinfo(host, port + 1, &hints, &info);
+    free(host);
+    if (res || !info) return -1;
+
+    memcpy(&backend->addr, info->ai_addr, info->ai_addrlen);
+    backend->addr_len = info->ai_addrlen;
+    freeaddrinfo(info);
+    return 0;
+}
+
+/**
+ * Invoked to initialize the conn handler layer.
+ */
+void init_conn_handler() {
+    // Filter names are checked by the backends
+}
+
+/**
+ * Invoked by the networking layer when there is new
+ * data to be handled. A batch of the commands is sent to
+ * the backends, pipelined on the connections of this worker,
+ * and the client is suspended until the responses are back.
+ * It is then answered in order, and woken up for the next batch.
+ * @arg handle The connection related information
+ * @return 0 on success.
+ */
+int handle_client_connect(bloom_conn_handler *handle) {
+    proxy_worker *pw = worker_state(handle->conn);
+    if (!pw) return 1;
+    backend_conn *conns = pw->conns;
+
+    char *buf;
+    int buf_len, should_free, queued;
+    time_t now = time(NULL);
+    while (1) {
+        // Connect to the backends we are not connected to, once
+        // every response of the old connection has been answered
+        for (int i=0; i < PROXY.num_backends; i++) {
+            backend_conn *bc = conns + i;
+            if (bc->state == BACKEND_CLOSED && now >= bc->retry_at && bc->answered == bc->expected) {
+                backend_connect(bc);
+            }
+        }
+
+        // Queue up a batch of commands
+        proxy_req *req = malloc(sizeof(proxy_req) + PROXY.num_backends * sizeof(proxy_span));
+        if (!req) return 1;
+        req->conn = handle->conn;
+        req->num_cmds = 0;
+        req->next = NULL;
+        for (int i=0; i < PROXY.num_backends; i++) req->spans[i].first = conns[i].expected;
+        queued = 0;
+        while (req->num_cmds < PROXY_BATCH_CMDS && queued < PROXY_BATCH_BYTES) {
+            if (extract_to_terminator(handle->conn, '\n', &buf, &buf_len, &should_free) == -1) break;
+            queued += queue_command(conns, buf, buf_len, req->cmds + req->num_cmds);
+            req->num_cmds++;
+            if (should_free) free(buf);
+        }
+        if (!req->num_cmds) {
+            free(req);
+            break;
+        }
+
+        // Send the batch to every backend that has a part in it
+        int remote = 0;
+        for (int i=0; i < PROXY.num_backends; i++) {
+            backend_conn *bc = conns + i;
+            req->spans[i].last = bc->expected;
+            if (req->spans[i].first == bc->expected) continue;
+            remote = 1;
+            if (bc->state == BACKEND_OPEN && backend_send(bc)) {
+                backend_fail(bc, errno);
+            } else if (bc->state != BACKEND_CLOSED) {
+                backend_watch(bc, 0);
+            }
+        }
+
+        // Answer the commands of the proxy itself at once
+        if (!remote) {
+            for (int i=0; i < req->num_cmds; i++) {
+                answer_command(handle, conns, req->cmds + i);
+            }
+            free(req);
+            if (client_suspended(handle->conn)) break;
+            continue;
+        }
+
+        // Wait for the responses, after those sent before
+        if (pw->tail) pw->tail->next = req;
+        else pw->head = req;
+        pw->tail = req;
+        suspend_client(handle->conn);
+        answer_ready(pw);
+        break;
+    }
+
+    return 0;
+}
+
+/**
+ * Invoked by the networking layer periodically.
+ * The proxy has no state to update.
+ */
+void periodic_update(bloom_conn_handler *handle) {
+    (void)handle;
+}
+
+/**
+ * The proxy never hands commands to other workers,
+ * so there are no owned commands to execute.
+ */
+void execute_owned_cmds(bloom_conn_handler *handle, owned_cmd *cmds) {
+    (void)handle;
+    (void)cmds;
+}
+
+/**
+ * The proxy never hands commands to other workers,
+ * so there are no owned commands to finish.
+ */
+void finish_owned_cmd(bloom_conn_handler *handle, owned_cmd *cmd) {
+    (void)handle;
+    (void)cmd;
+}
+
+/**
+ * Returns the state of the calling worker, creating
+ * it on first use by one of the clients of the worker.
+ */
+static proxy_worker* worker_state(bloom_conn_info *conn) {
+    if (WORKER) return WORKER;
+    pthread_once(&WORKER_KEY_ONCE, create_worker_key);
+    proxy_worker *pw = calloc(1, sizeof(proxy_worker));
+    if (!pw) return NULL;
+    pw->conns = calloc(PROXY.num_backends, sizeof(backend_conn));
+    pw->blocked = calloc(PROXY.num_backends, sizeof(char));
+    if (!pw->conns || !pw->blocked) {
+        free(pw->conns);
+        free(pw->blocked);
+        free(pw);
+        return NULL;
+    }
+    for (int i=0; i < PROXY.num_backends; i++) {
+        pw->conns[i].index = i;
+        pw->conns[i].fd = -1;
+        pw->conns[i].state = BACKEND_CLOSED;
+        pw->conns[i].watcher = watcher_new(conn, backend_event, pw->conns + i);
+        if (!pw->conns[i].watcher) {
+            free(pw->conns);
+            free(pw->blocked);
+            free(pw);
+            return NULL;
+        }
+    }
+    pthread_setspecific(WORKER_KEY, pw);
+    WORKER = pw;
+    return pw;
+}
+
+static void create_worker_key(void) {
+    pthread_key_create(&WORKER_KEY, close_worker);
+}
+
+/**
+ * Invoked as a worker exits to close its connections.
+ * The watchers were already freed with the worker.
+ */
+static void close_worker(void *in) {
+    proxy_worker *pw = in;
+    for (int i=0; i < PROXY.num_backends; i++) {
+        if (pw->conns[i].fd != -1) close(pw->conns[i].fd);
+        free(pw->conns[i].out);
+        free(pw->conns[i].in);
+    }
+    while (pw->head) {
+        proxy_req *req = pw->head;
+        pw->head = req->next;
+        for (int i=0; i < req->num_cmds; i++) free(req->cmds[i].entry_backends);
+        free(req);
+    }
+    free(pw->conns);
+    free(pw->blocked);
+    free(pw);
+}
+
+/**
+ * Parses a command and queues it on the backends
+ * that answer it. Commands on a filter go to the owner
+ * of the filter on the ring, and commands on every filter
+ * go to all the backends. A batch is split up by filter.
+ * @arg conns The connections of the worker
+ * @arg buf The command line
+ * @arg buf_len The length of the line
+ * @arg cmd Output, the command to answer
+ * @return The number of bytes queued on each backend.
+ */
+static int queue_command(backend_conn *conns, char *buf, int buf_len, proxy_cmd *cmd) {
+    char *args;
+    int args_len;
+    cmd->type = determine_client_command(buf, buf_len, &args, &args_len);
+    cmd->has_args = (args && *args);
+    cmd->backend = 0;
+    cmd->limit = 0;
+    cmd->num_entries = 0;
+    cmd->entry_backends = NULL;
+    if (cmd->type == UNKNOWN || cmd->type == STATS) return 0;
+
+    // Put back the space taken out by the parsing,
+    // so the line is forwarded as it was sent
+    if (args) args[-1] = ' ';
+    int line_len = strlen(buf);
+
+    // Route by the filter name. Commands without one go
+    // to the first backend, which explains what is missing.
+    if (cmd->type == LIST) {
+        cmd->backend = -1;
+        cmd->limit = list_limit(args);
+    } else if (cmd->type == FLUSH && !cmd->has_args) {
+        cmd->backend = -1;
+    } else if (cmd->type == BATCH && cmd->has_args && !split_batch(conns, args, cmd)) {
+        return line_len + 1;
+    } else if (cmd->has_args) {
+        cmd->backend = hash_ring_lookup(PROXY.ring, args, strcspn(args, " "));
+    }
+
+    for (int i=0; i < PROXY.num_backends; i++) {
+        if (cmd->backend != -1 && cmd->backend != i) continue;
+        backend_queue(conns + i, buf, line_len);
+    }
+    return line_len + 1;
+}
+
+/**
+ * Finds the limit of a list command. A bad
+ * limit is refused by the backends.
+ */
+static int list_limit(char *args) {
+    int limit = 0;
+    char *param = args;
+    while (param && *param) {
+        if (!strncmp(param, "limit=", 6)) limit = atoi(param + 6);
+        param = strchr(param, ' ');
+        if (param) param++;
+    }
+    return (limit > 0) ? limit : 0;
+}
+
+/**
+ * Splits a batch command into a batch for each backend
+ * holding some of its filters. The entries keep the order
+ * they were sent in, and the backend of each is kept to put
+ * the results back together.
+ * @return 0 on success, -1 if the batch is malformed and
+ * should be sent on as it is, to be refused.
+ */
+static int split_batch(backend_conn *conns, char *args, proxy_cmd *cmd) {
+    // Every entry has 3 words
+    int num_words = 1;
+    for (char *c = args; *c; c++) {
+        if (*c == ' ') num_words++;
+    }
+    if (num_words % 3) return -1;
+
+    // Find where each entry is, and the owner of its filter
+    int num_entries = num_words / 3;
+    char **starts = malloc(num_entries * sizeof(char*));
+    int *lens = malloc(num_entries * sizeof(int));
+    int *backends = malloc(num_entries * sizeof(int));
+    char *entry = args, *end;
+    for (int i=0; i < num_entries; i++) {
+        end = entry;
+        for (int w=0; w < 3; w++) end += strcspn(end, " ") + ((w < 2) ? 1 : 0);
+        starts[i] = entry;
+        lens[i] = end - entry;
+        backends[i] = hash_ring_lookup(PROXY.ring, entry, strcspn(entry, " "));
+        entry = end + 1;
+    }
+
+    // Queue a batch of the entries of each backend
+    for (int b=0; b < PROXY.num_backends; b++) {
+        int queued = 0;
+        for (int i=0; i < num_entries; i++) {
+            if (backends[i] != b) continue;
+            if (!queued++) backend_append(conns + b, "batch", 5);
+            backend_append(conns + b, " ", 1);
+            backend_append(conns + b, starts[i], lens[i]);
+        }
+        if (queued) {
+            backend_append(conns + b, "\n", 1);
+            conns[b].expected++;
+        }
+    }
+
+    cmd->num_entries = num_entries;
+    cmd->entry_backends = backends;
+    free(starts);
+    free(lens);
+    return 0;
+}
+
+/**
+ * Answers the batches of a worker whose responses are all
+ * back, and wakes up their clients. A batch waits for those
+ * before it that share a backend, as their responses come
+ * first, but not for the others. A woken client may queue
+ * its next batch, which is answered by the same loop.
+ */
+static void answer_ready(proxy_worker *pw) {
+    if (pw->answering) return;
+    pw->answering = 1;
+
+    bloom_conn_handler handle;
+    memset(&handle, 0, sizeof(handle));
+    int answered = 1;
+    while (answered) {
+        answered = 0;
+        memset(pw->blocked, 0, PROXY.num_backends);
+        proxy_req *prev = NULL, *req = pw->head;
+        while (req) {
+            if (!request_ready(pw, req)) {
+                for (int i=0; i < PROXY.num_backends; i++) {
+                    if (req->spans[i].first != req->spans[i].last) pw->blocked[i] = 1;
+                }
+                prev = req;
+                req = req->next;
+                continue;
+            }
+
+            // Take the batch out of the queue
+            proxy_req *next = req->next;
+            if (prev) prev->next = next;
+            else pw->head = next;
+            if (pw->tail == req) pw->tail = prev;
+
+            handle.conn = req->conn;
+            for (int i=0; i < req->num_cmds; i++) {
+                answer_command(&handle, pw->conns, req->cmds + i);
+            }
+            free(req);
+            wake_client(handle.conn);
+            answered = 1;
+
+            // The woken client may have queued behind prev
+            req = (prev) ? prev->next : pw->head;
+        }
+    }
+    pw->answering = 0;
+}
+
+/**
+ * Checks if a batch can be answered. Every response of it
+ * must be received, or lost with the connection to its
+ * backend, and no earlier batch may wait on its backends.
+ */
+static int request_ready(proxy_worker *pw, proxy_req *req) {
+    for (int i=0; i < PROXY.num_backends; i++) {
+        backend_conn *bc = pw->conns + i;
+        if (req->spans[i].first == req->spans[i].last) continue;
+        if (pw->blocked[i]) return 0;
+        if (bc->state != BACKEND_CLOSED && bc->received < req->spans[i].last) return 0;
+    }
+    return 1;
+}
+
+/**
+ * Answers a command once the backends have responded
+ */
+static void answer_command(bloom_conn_handler *handle, backend_conn *conns, proxy_cmd *cmd) {
+    char *resp;
+    int resp_len;
+    if (cmd->type == UNKNOWN) {
+        handle_client_err(handle->conn, (char*)&CMD_NOT_SUP, CMD_NOT_SUP_LEN);
+    } else if (cmd->type == STATS) {
+        answer_stats(handle, cmd->has_args);
+    } else if (cmd->entry_backends) {
+        answer_batch(handle, conns, cmd);
+    } else if (cmd->backend == -1 && cmd->type == LIST) {
+        answer_list(handle, conns, cmd->limit);
+    } else if (cmd->backend == -1) {
+        answer_flush(handle, conns);
+    } else if (backend_response(conns + cmd->backend, &resp, &resp_len)) {
+        handle_client_resp(handle->conn, (char*)BACKEND_DOWN, BACKEND_DOWN_LEN);
+    } else {
+        handle_client_resp(handle->conn, resp, resp_len);
+        backend_consume(conns + cmd->backend, resp_len);
+    }
+}
+
+/**
+ * Merges the lists of every backend into one, in order
+ * of the filter names. Each backend applies the limit
+ * on its own, so the merged list is cut to the limit.
+ */
+static void answer_list(bloom_conn_handler *handle, backend_conn *conns, int limit) {
+    char **resps = calloc(PROXY.num_backends, sizeof(char*));
+    int *lens = calloc(PROXY.num_backends, sizeof(int));
+    char *err = NULL;
+    int down = 0, err_len = 0, num_lines = 0;
+
+    // Collect every response, counting the lines in them
+    for (int i=0; i < PROXY.num_backends; i++) {
+        if (backend_response(conns + i, resps + i, lens + i)) {
+            resps[i] = NULL;
+            down = 1;
+            continue;
+        }
+        if (lens[i] < START_RESP_LEN + END_RESP_LEN || memcmp(resps[i], START_RESP, START_RESP_LEN)) {
+            if (!err) {
+                err = resps[i];
+                err_len = lens[i];
+            }
+            continue;
+        }
+        for (int j=START_RESP_LEN; j < lens[i] - END_RESP_LEN; j++) {
+            if (resps[i][j] == '\n') num_lines++;
+        }
+    }
+
+    if (down) {
+        handle_client_resp(handle->conn, (char*)BACKEND_DOWN, BACKEND_DOWN_LEN);
+    } else if (err) {
+        handle_client_resp(handle->conn, err, err_len);
+    } else {
+        // Split out the lines between the START and END
+        list_line *lines = malloc((num_lines + 1) * sizeof(list_line));
+        int n = 0;
+        for (int i=0; i < PROXY.num_backends; i++) {
+            char *line = resps[i] + START_RESP_LEN;
+            char *end = resps[i] + lens[i] - END_RESP_LEN;
+            while (line < end) {
+                char *nl = memchr(line, '\n', end - line);
+                char *space = memchr(line, ' ', nl - line);
+                lines[n].line = line;
+                lines[n].len = nl - line + 1;
+                lines[n].name_len = (space) ? space - line : nl - line;
+                n++;
+                line = nl + 1;
+            }
+        }
+        qsort(lines, num_lines, sizeof(list_line), compare_list_lines);
+        if (limit && limit < num_lines) num_lines = limit;
+
+        // Write out the merged list at once
+        int out_len = START_RESP_LEN + END_RESP_LEN;
+        for (int i=0; i < num_lines; i++) out_len += lines[i].len;
+        char *out = malloc(out_len);
+        memcpy(out, START_RESP, START_RESP_LEN);
+        int pos = START_RESP_LEN;
+        for (int i=0; i < num_lines; i++) {
+            memcpy(out + pos, lines[i].line, lines[i].len);
+            pos += lines[i].len;
+        }
+        memcpy(out + pos, END_RESP, END_RESP_LEN);
+        handle_client_resp(handle->conn, out, out_len);
+        free(out);
+        free(lines);
+    }
+
+    for (int i=0; i < PROXY.num_backends; i++) {
+        if (resps[i]) backend_consume(conns + i, lens[i]);
+    }
+    free(resps);
+    free(lens);
+}
+
+/**
+ * Answers a flush of every filter. Done if every
+ * backend is done, or else the first failure.
+ */
+static void answer_flush(bloom_conn_handler *handle, backend_conn *conns) {
+    char *resp, *err = NULL;
+    int resp_len, err_len = 0, down = 0;
+    for (int i=0; i < PROXY.num_backends; i++) {
+        if (backend_response(conns + i, &resp, &resp_len)) {
+            down = 1;
+            continue;
+        }
+        if (!err && (resp_len != DONE_RESP_LEN || memcmp(resp, DONE_RESP, DONE_RESP_LEN))) {
+            err = strndup(resp, resp_len);
+            err_len = resp_len;
+        }
+        backend_consume(conns + i, resp_len);
+    }
+
+    if (down) {
+        handle_client_resp(handle->conn, (char*)BACKEND_DOWN, BACKEND_DOWN_LEN);
+    } else if (err) {
+        handle_client_resp(handle->conn, err, err_len);
+    } else {
+        handle_client_resp(handle->conn, (char*)DONE_RESP, DONE_RESP_LEN);
+    }
+    free(err);
+}
+
+/**
+ * Answers a split batch by taking the result of each entry
+ * from the response of its backend, in the order sent. If a
+ * backend fails its part, the batch fails.
+ */
+static void answer_batch(bloom_conn_handler *handle, backend_conn *conns, proxy_cmd *cmd) {
+    char **resps = calloc(PROXY.num_backends, sizeof(char*));
+    int *lens = calloc(PROXY.num_backends, sizeof(int));
+    int *counts = calloc(PROXY.num_backends, sizeof(int));
+    char *err = NULL;
+    int down = 0, err_len = 0, out_len = 0;
+    for (int i=0; i < cmd->num_entries; i++) counts[cmd->entry_backends[i]]++;
+
+    // Each backend answers with a word for each of its entries,
+    // errors are sentences with a colon
+    for (int b=0; b < PROXY.num_backends; b++) {
+        if (!counts[b]) continue;
+        if (backend_response(conns + b, resps + b, lens + b)) {
+            resps[b] = NULL;
+            down = 1;
+            continue;
+        }
+        int words = 1;
+        for (int j=0; j < lens[b]; j++) {
+            if (resps[b][j] == ' ') words++;
+        }
+        if ((words != counts[b] || memchr(resps[b], ':', lens[b])) && !err) {
+            err = resps[b];
+            err_len = lens[b];
+        }
+        out_len += lens[b];
+    }
+
+    if (down) {
+        handle_client_resp(handle->conn, (char*)BACKEND_DOWN, BACKEND_DOWN_LEN);
+    } else if (err) {
+        handle_client_resp(handle->conn, err, err_len);
+    } else {
+        // Take the next word from the backend of each entry
+        char **next = calloc(PROXY.num_backends, sizeof(char*));
+        memcpy(next, resps, PROXY.num_backends * sizeof(char*));
+        char *out = malloc(out_len);
+        int pos = 0;
+        for (int i=0; i < cmd->num_entries; i++) {
+            int b = cmd->entry_backends[i];
+            int word_len = strcspn(next[b], " \n");
+            memcpy(out + pos, next[b], word_len);
+            pos += word_len;
+            out[pos++] = (i + 1 < cmd->num_entries) ? ' ' : '\n';
+            next[b] += word_len + 1;
+        }
+        handle_client_resp(handle->conn, out, pos);
+        free(out);
+        free(next);
+    }
+
+    for (int b=0; b < PROXY.num_backends; b++) {
+        if (resps[b]) backend_consume(conns + b, lens[b]);
+    }
+    free(resps);
+    free(lens);
+    free(counts);
+    free(cmd->entry_backends);
+}
+
+/**
+ * Answers with the counters of the proxy itself
+ */
+static void answer_stats(bloom_conn_handler *handle, int has_args) {
+    if (has_args) {
+        handle_client_err(handle->conn, (char*)&UNEXPECTED_ARGS, UNEXPECTED_ARGS_LEN);
+        return;
+    }
+
+    bloom_conn_stats conns;
+    client_stats(&conns);
+
+    char *output[] = {(char*)&START_RESP, NULL, (char*)&END_RESP};
+    int lens[] = {START_RESP_LEN, 0, END_RESP_LEN};
+    int res = asprintf(&output[1], "connections %llu\n\
+connections_paused %llu\n\
+connection_pauses %llu\n\
+backends %d\n\
+backend_errors %llu\n",
+    (unsigned long long)conns.connections,
+    (unsigned long long)conns.paused,
+    (unsigned long long)conns.pauses,
+    PROXY.num_backends,
+    (unsigned long long)PROXY.backend_errors);
+    if (res == -1) {
+        handle_client_resp(handle->conn, (char*)INTERNAL_ERR, INTERNAL_ERR_LEN);
+        return;
+    }
+    lens[1] = res;
+    send_client_response(handle->conn, (char**)&output, (int*)&lens, 3);
+    free(output[1]);
+}
+
+/**
+ * Orders the lines of a list by the filter names,
+ * in the same byte order the backends list them.
+ */
+static int compare_list_lines(const void *a, const void *b) {
+    const list_line *la = a, *lb = b;
+    int len = (la->name_len < lb->name_len) ? la->name_len : lb->name_len;
+    int res = memcmp(la->line, lb->line, len);
+    if (res) return res;
+    return la->name_len - lb->name_len;
+}
+
+/**
+ * Starts to connect to a backend. Commands are queued
+ * while it connects, and sent once it is done.
+ */
+static void backend_connect(backend_conn *bc) {
+    proxy_backend *b = PROXY.backends + bc->index;
+    int fd = socket(b->addr.ss_family, SOCK_STREAM, 0);
+    int res = (fd == -1) ? -1 : fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+    if (!res) res = connect(fd, (struct sockaddr*)&b->addr, b->addr_len);
+    if (res && errno != EINPROGRESS) {
+        bloom_log(LOG_ERR, "Failed to connect to backend %s: %s", b->name, strerror(errno));
+        if (fd != -1) close(fd);
+        bc->retry_at = time(NULL) + PROXY_RETRY_SEC;
+        __sync_fetch_and_add(&PROXY.backend_errors, 1);
+        return;
+    }
+
+    int flag = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+    bc->fd = fd;
+    bc->state = (res) ? BACKEND_CONNECTING : BACKEND_OPEN;
+
+    // Every response of the old connection was answered
+    bc->received = bc->expected;
+    bc->in_start = bc->in_done = bc->in_len = 0;
+    bc->in_list = 0;
+    backend_watch(bc, 1);
+}
+
+/**
+ * Drops the connection to a backend. Anything queued
+ * on it is dropped, and the responses not yet received
+ * are lost. Those already received are still answered.
+ * @arg bc The backend connection
+ * @arg err The error number of the failure
+ */
+static void backend_fail(backend_conn *bc, int err) {
+    char *name = PROXY.backends[bc->index].name;
+    if (bc->state == BACKEND_CONNECTING)
+        bloom_log(LOG_ERR, "Failed to connect to backend %s: %s", name, strerror(err));
+    else
+        bloom_log(LOG_ERR, "Lost connection to backend %s: %s", name, strerror(err));
+
+    watcher_io(bc->watcher, -1, 0);
+    watcher_timeout(bc->watcher, 0);
+    bc->timing = 0;
+    close(bc->fd);
+    bc->fd = -1;
+    bc->state = BACKEND_CLOSED;
+    bc->retry_at = time(NULL) + PROXY_RETRY_SEC;
+    bc->out_start = 0;
+    bc->out_len = 0;
+    bc->in_len = bc->in_done;
+    bc->in_list = 0;
+    __sync_fetch_and_add(&PROXY.backend_errors, 1);
+}
+
+/**
+ * Invoked by the worker when a backend connection is ready,
+ * or has timed out. Any batches that were waiting on it
+ * and are now complete are answered.
+ */
+static void backend_event(void *arg, int events) {
+    backend_conn *bc = arg;
+    if (events & WATCH_TIMEOUT) {
+        backend_fail(bc, ETIMEDOUT);
+        answer_ready(WORKER);
+        return;
+    }
+
+    // Check how the connection went
+    int err = 0;
+    if (bc->state == BACKEND_CONNECTING) {
+        socklen_t err_len = sizeof(err);
+        getsockopt(bc->fd, SOL_SOCKET, SO_ERROR, &err, &err_len);
+        if (!err) bc->state = BACKEND_OPEN;
+    }
+
+    // Read the responses and send the rest of the commands
+    uint64_t before = bc->received;
+    int sent = bc->out_start;
+    if (!err && (events & WATCH_READ) && backend_read(bc)) err = errno;
+    if (!err && backend_send(bc)) err = errno;
+
+    if (err) {
+        backend_fail(bc, err);
+    } else {
+        backend_watch(bc, (events & WATCH_WRITE) || bc->received != before || bc->out_start != sent);
+    }
+    answer_ready(WORKER);
+}
+
+/**
+ * Sets what to wait for on a backend connection. The time
+ * out runs while responses are missing, and starts over
+ * when the backend makes progress.
+ * @arg bc The backend connection
+ * @arg progress Set if data was read or written
+ */
+static void backend_watch(backend_conn *bc, int progress) {
+    int events = WATCH_READ;
+    if (bc->state == BACKEND_CONNECTING) events = WATCH_WRITE;
+    else if (bc->out_start < bc->out_len) events |= WATCH_WRITE;
+    watcher_io(bc->watcher, bc->fd, events);
+
+    int waiting = bc->state == BACKEND_CONNECTING || bc->received < bc->expected;
+    if (!waiting) {
+        if (bc->timing) watcher_timeout(bc->watcher, 0);
+        bc->timing = 0;
+    } else if (progress || !bc->timing) {
+        watcher_timeout(bc->watcher, PROXY_TIMEOUT_SEC);
+        bc->timing = 1;
+    }
+}
+
+/**
+ * Adds bytes to the output of a backend. Nothing
+ * is added while the backend is not connected.
+ */
+static void backend_append(backend_conn *bc, const char *data, int len) {
+    if (bc->state == BACKEND_CLOSED) return;
+    if (bc->out_len + len > bc->out_size) {
+        int size = (bc->out_size) ? bc->out_size : PROXY_READ_SIZE;
+        while (bc->out_len + len > size) size *= 2;
+        bc->out = realloc(bc->out, size);
+        bc->out_size = size;
+    }
+    memcpy(bc->out + bc->out_len, data, len);
+    bc->out_len += len;
+}
+
+/**
+ * Adds a command line to the output of a backend,
+ * and expects a response to it.
+ */
+static void backend_queue(backend_conn *bc, char *line, int len) {
+    backend_append(bc, line, len);
+    backend_append(bc, "\n", 1);
+    bc->expected++;
+}
+
+/**
+ * Sends as much of the output of a backend as
+ * it takes, without waiting. The rest is sent
+ * once the backend is ready for more.
+ * @return 0 on success, -1 if the connection failed.
+ */
+static int backend_send(backend_conn *bc) {
+    if (bc->state != BACKEND_OPEN) return 0;
+    while (bc->out_start < bc->out_len) {
+        int n = write(bc->fd, bc->out + bc->out_start, bc->out_len - bc->out_start);
+        if (n > 0) {
+            bc->out_start += n;
+            continue;
+        }
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && errno == EAGAIN) return 0;
+        return -1;
+    }
+    bc->out_start = 0;
+    bc->out_len = 0;
+    return 0;
+}
+
+/**
+ * Reads what a backend has sent so far, and
+ * counts the responses that are complete.
+ * @return 0 on success, -1 if the connection failed.
+ */
+static int backend_read(backend_conn *bc) {
+    while (1) {
+        // Make room, first by moving out the answered responses
+        if (bc->in_size - bc->in_len < PROXY_READ_SIZE) {
+            if (bc->in_start) {
+                memmove(bc->in, bc->in + bc->in_start, bc->in_len - bc->in_start);
+                bc->in_len -= bc->in_start;
+                bc->in_done -= bc->in_start;
+                bc->in_start = 0;
+            }
+            if (bc->in_size - bc->in_len < PROXY_READ_SIZE) {
+                bc->in_size = (bc->in_size) ? bc->in_size * 2 : 4 * PROXY_READ_SIZE;
+                bc->in = realloc(bc->in, bc->in_size);
+            }
+        }
+
+        int avail = bc->in_size - bc->in_len;
+        int n = read(bc->fd, bc->in + bc->in_len, avail);
+        if (n > 0) {
+            bc->in_len += n;
+            backend_scan(bc);
+            if (n < avail) return 0;
+            continue;
+        }
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && errno == EAGAIN) return 0;
+        if (n == 0) errno = ECONNRESET;
+        return -1;
+    }
+}
+
+/**
+ * Counts the responses that have been read completely.
+ * A response is a single line, or every line from
+ * a START to an END.
+ */
+static void backend_scan(backend_conn *bc) {
+    char *start, *end;
+    int avail;
+    while (bc->in_done < bc->in_len) {
+        start = bc->in + bc->in_done;
+        avail = bc->in_len - bc->in_done;
+        if (!bc->in_list) {
+            end = memchr(start, '\n', avail);
+            if (!end) return;
+            if (end - start + 1 != START_RESP_LEN || memcmp(start, START_RESP, START_RESP_LEN)) {
+                bc->in_done += end - start + 1;
+                bc->received++;
+                continue;
+            }
+            bc->in_list = 1;
+            bc->in_scanned = START_RESP_LEN - 1;
+        }
+
+        // Look for the END line, starting at the end of the last line
+        end = memmem(start + bc->in_scanned, avail - bc->in_scanned, "\nEND\n", 5);
+        if (!end) {
+            if (avail - 4 > bc->in_scanned) bc->in_scanned = avail - 4;
+            return;
+        }
+        bc->in_done += end + 5 - start;
+        bc->in_list = 0;
+        bc->received++;
+    }
+}
+
+/**
+ * Returns the next response of a backend. The response
+ * is left in the buffer until it is consumed.
+ * @arg bc The backend connection
+ * @arg resp Output, the start of the response
+ * @arg resp_len Output, the length of the response
+ * @return 0 on success, -1 if the response was lost
+ * with the connection. It is skipped.
+ */
+static int backend_response(backend_conn *bc, char **resp, int *resp_len) {
+    if (bc->answered >= bc->received) {
+        bc->answered++;
+        return -1;
+    }
+
+    char *start = bc->in + bc->in_start;
+    char *end = memchr(start, '\n', bc->in_done - bc->in_start);
+    if (end - start + 1 == START_RESP_LEN && !memcmp(start, START_RESP, START_RESP_LEN)) {
+        end = memmem(end, bc->in_done - bc->in_start - (end - start), "\nEND\n", 5) + 4;
+    }
+    *resp = start;
+    *resp_len = end - start + 1;
+    return 0;
+}
+
+/**
+ * Releases a response once the client has been answered
+ */
+static void backend_consume(backend_conn *bc, int len) {
+    bc->answered++;
+    bc->in_start += len;
+    if (bc->in_start == bc->in_len) {
+        bc->in_start = 0;
+        bc->in_done = 0;
+        bc->in_len = 0;
+    }
+}
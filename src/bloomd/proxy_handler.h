@@ -0,0 +1,26 @@
+#ifndef BLOOM_PROXY_HANDLER_H
+#define BLOOM_PROXY_HANDLER_H
+#include "config.h"
+
+/**
+ * The proxy is a connection handler that takes the place of
+ * the bloomd one. Instead of using a filter manager, each
+ * command is sent to the backend bloomd that owns the filter
+ * on a consistent hash ring, and the response is passed back.
+ */
+
+/**
+ * Prepares the proxy to route commands to the backends
+ * in the proxy_backends setting. Must be called before
+ * the networking is initialized.
+ * @arg config The proxy configuration
+ * @return 0 on success.
+ */
+int init_proxy(bloom_config *config);
+
+/**
+ * Frees the routing state, once the workers have exited.
+ */
+void destroy_proxy();
+
+#endif
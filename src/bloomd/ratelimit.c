@@ -0,0 +1,69 @@
+#include <time.h>
+#include "ratelimit.h"
+
+/**
+ * Returns the time used to refill buckets.
+ * @return A monotonic time in seconds
+ */
+double bucket_clock() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * Initializes a full bucket.
+ * @arg bucket The bucket
+ * @arg rate The tokens added each second, 0 for no limit
+ */
+void bucket_init(bloom_bucket *bucket, double rate) {
+    INIT_BLOOM_SPIN(&bucket->lock);
+    bucket->rate = rate;
+    bucket->tokens = rate;
+    bucket->last = bucket_clock();
+}
+
+/**
+ * Changes the rate of a bucket. The bucket starts
+ * out full at the new rate.
+ * @arg bucket The bucket
+ * @arg rate The tokens added each second, 0 for no limit
+ */
+void bucket_set_rate(bloom_bucket *bucket, double rate) {
+    LOCK_BLOOM_SPIN(&bucket->lock);
+    bucket->rate = rate;
+    bucket->tokens = rate;
+    bucket->last = bucket_clock();
+    UNLOCK_BLOOM_SPIN(&bucket->lock);
+}
+
+/**
+ * Takes tokens from a bucket, going into debt if
+ * there are not enough.
+ * @notes Thread safe.
+ * @arg bucket The bucket
+ * @arg tokens The tokens to take
+ * @arg now The current time from bucket_clock
+ * @return The seconds until the bucket is out of debt,
+ * or 0 if it is not in debt.
+ */
+double bucket_take(bloom_bucket *bucket, double tokens, double now) {
+    // Unlimited buckets are never locked
+    if (!bucket->rate) return 0;
+
+    LOCK_BLOOM_SPIN(&bucket->lock);
+    double rate = bucket->rate;
+    double wait = 0;
+    if (rate) {
+        // Refill for the time passed, up to a second worth
+        if (now > bucket->last) {
+            bucket->tokens += (now - bucket->last) * rate;
+            if (bucket->tokens > rate) bucket->tokens = rate;
+            bucket->last = now;
+        }
+        bucket->tokens -= tokens;
+        if (bucket->tokens < 0) wait = -bucket->tokens / rate;
+    }
+    UNLOCK_BLOOM_SPIN(&bucket->lock);
+    return wait;
+}
@@ -0,0 +1,54 @@
+#ifndef BLOOM_RATELIMIT_H
+#define BLOOM_RATELIMIT_H
+#include "spinlock.h"
+
+/**
+ * A token bucket that limits a rate, such as the keys or
+ * bytes a filter or client may use each second. Tokens are
+ * taken after the work is done, so the bucket can go into
+ * debt. The caller then waits for the debt to be repaid
+ * before doing more work, so over-limit work is deferred
+ * rather than rejected. The bucket holds at most a second
+ * worth of tokens, which bounds the size of a burst.
+ */
+typedef struct {
+    volatile double rate;   // Tokens added each second, 0 for no limit
+    double tokens;          // Tokens available, negative when in debt
+    double last;            // Time of the last refill, in seconds
+    bloom_spinlock lock;    // Protects the tokens
+} bloom_bucket;
+
+/**
+ * Returns the time used to refill buckets.
+ * @return A monotonic time in seconds
+ */
+double bucket_clock();
+
+/**
+ * Initializes a full bucket.
+ * @arg bucket The bucket
+ * @arg rate The tokens added each second, 0 for no limit
+ */
+void bucket_init(bloom_bucket *bucket, double rate);
+
+/**
+ * Changes the rate of a bucket. The bucket starts
+ * out full at the new rate.
+ * @arg bucket The bucket
+ * @arg rate The tokens added each second, 0 for no limit
+ */
+void bucket_set_rate(bloom_bucket *bucket, double rate);
+
+/**
+ * Takes tokens from a bucket, going into debt if
+ * there are not enough.
+ * @notes Thread safe.
+ * @arg bucket The bucket
+ * @arg tokens The tokens to take
+ * @arg now The current time from bucket_clock
+ * @return The seconds until the bucket is out of debt,
+ * or 0 if it is not in debt.
+ */
+double bucket_take(bloom_bucket *bucket, double tokens, double now);
+
+#endif
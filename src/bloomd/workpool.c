@@ -0,0 +1,138 @@
+#include <stdlib.h>
+#include <syslog.h>
+#include "workpool.h"
+#include "logger.h"
+
+/* Static declarations */
+static void* workpool_thread_main(void *in);
+static int run_next_task(bloom_workpool *pool, bloom_work_job *job);
+
+/**
+ * Initializes a work pool and starts its threads.
+ * @arg num_threads The number of threads to start
+ * @arg pool Output, the new pool
+ * @return 0 on success.
+ */
+int init_workpool(int num_threads, bloom_workpool **pool) {
+    bloom_workpool *p = *pool = calloc(1, sizeof(bloom_workpool));
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->work_cond, NULL);
+    pthread_cond_init(&p->done_cond, NULL);
+    p->should_run = 1;
+    p->threads = calloc(num_threads, sizeof(pthread_t));
+
+    for (int i=0; i < num_threads; i++) {
+        if (pthread_create(p->threads + i, NULL, workpool_thread_main, p)) {
+            bloom_log(LOG_ERR, "Failed to start work pool thread!");
+            destroy_workpool(p);
+            *pool = NULL;
+            return -1;
+        }
+        p->num_threads++;
+    }
+    return 0;
+}
+
+/**
+ * Runs a job on the pool, and returns once every task is
+ * done. The calling thread also runs tasks, so a job makes
+ * progress even if the pool threads are busy with other jobs.
+ * @note Thread safe.
+ * @arg pool The pool, or NULL to run every task on the caller
+ * @arg num_tasks The number of tasks
+ * @arg func Invoked with arg and the index of each task
+ * @arg arg Opaque argument to func
+ */
+void workpool_run(bloom_workpool *pool, int num_tasks, bloom_work_func func, void *arg) {
+    // Run on the caller if there is nothing to split
+    if (!pool || num_tasks <= 1) {
+        for (int i=0; i < num_tasks; i++) func(arg, i);
+        return;
+    }
+
+    // The job lives on our stack, since we
+    // wait for every task to finish
+    bloom_work_job job = {func, arg, num_tasks, 0, 0, NULL};
+    pthread_mutex_lock(&pool->lock);
+    job.next = pool->jobs;
+    pool->jobs = &job;
+    pthread_cond_broadcast(&pool->work_cond);
+
+    // Help out until every task is handed out
+    while (run_next_task(pool, &job)) ;
+
+    // Wait for the other threads to finish
+    while (job.done_tasks < job.num_tasks) {
+        pthread_cond_wait(&pool->done_cond, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Stops the pool threads and frees the pool.
+ * Must not be called while jobs are running.
+ * @return 0 on success.
+ */
+int destroy_workpool(bloom_workpool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->should_run = 0;
+    pthread_cond_broadcast(&pool->work_cond);
+    pthread_mutex_unlock(&pool->lock);
+
+    for (int i=0; i < pool->num_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    pthread_cond_destroy(&pool->work_cond);
+    pthread_cond_destroy(&pool->done_cond);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool->threads);
+    free(pool);
+    return 0;
+}
+
+/**
+ * Runs the next task of a job, unlinking the job once
+ * its last task is handed out. Must be called with the
+ * lock held, which is released while the task runs.
+ * @return 1 if a task was run, 0 if none were left.
+ */
+static int run_next_task(bloom_workpool *pool, bloom_work_job *job) {
+    if (job->next_task == job->num_tasks) return 0;
+    int task = job->next_task++;
+
+    // Unlink the job once there is nothing left to hand out
+    if (job->next_task == job->num_tasks) {
+        bloom_work_job **prev = &pool->jobs;
+        while (*prev != job) prev = &(*prev)->next;
+        *prev = job->next;
+    }
+
+    pthread_mutex_unlock(&pool->lock);
+    job->func(job->arg, task);
+    pthread_mutex_lock(&pool->lock);
+
+    // Wake the submitter once the last task is done
+    if (++job->done_tasks == job->num_tasks) {
+        pthread_cond_broadcast(&pool->done_cond);
+    }
+    return 1;
+}
+
+/**
+ * Main loop of the pool threads. Runs the tasks of
+ * the newest job until the pool is destroyed.
+ */
+static void* workpool_thread_main(void *in) {
+    bloom_workpool *pool = in;
+    pthread_mutex_lock(&pool->lock);
+    while (pool->should_run) {
+        if (!pool->jobs) {
+            pthread_cond_wait(&pool->work_cond, &pool->lock);
+            continue;
+        }
+        run_next_task(pool, pool->jobs);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
@@ -0,0 +1,59 @@
+#ifndef BLOOM_WORKPOOL_H
+#define BLOOM_WORKPOOL_H
+#include <pthread.h>
+
+/**
+ * A work pool is a set of threads shared by all the
+ * networking workers, used to split up very large commands.
+ * A job is a number of tasks that are run in any order, on
+ * the pool threads and the thread that submitted the job.
+ */
+typedef void(*bloom_work_func)(void *arg, int task);
+
+typedef struct bloom_work_job {
+    bloom_work_func func;
+    void *arg;
+    int num_tasks;
+    int next_task;          // Next task to hand out
+    int done_tasks;         // Number of tasks finished
+    struct bloom_work_job *next;
+} bloom_work_job;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t work_cond;   // Signaled when jobs are added
+    pthread_cond_t done_cond;   // Signaled when jobs finish
+    bloom_work_job *jobs;       // Jobs with tasks to hand out
+    int should_run;
+    int num_threads;
+    pthread_t *threads;
+} bloom_workpool;
+
+/**
+ * Initializes a work pool and starts its threads.
+ * @arg num_threads The number of threads to start
+ * @arg pool Output, the new pool
+ * @return 0 on success.
+ */
+int init_workpool(int num_threads, bloom_workpool **pool);
+
+/**
+ * Runs a job on the pool, and returns once every task is
+ * done. The calling thread also runs tasks, so a job makes
+ * progress even if the pool threads are busy with other jobs.
+ * @note Thread safe.
+ * @arg pool The pool, or NULL to run every task on the caller
+ * @arg num_tasks The number of tasks
+ * @arg func Invoked with arg and the index of each task
+ * @arg arg Opaque argument to func
+ */
+void workpool_run(bloom_workpool *pool, int num_tasks, bloom_work_func func, void *arg);
+
+/**
+ * Stops the pool threads and frees the pool.
+ * Must not be called while jobs are running.
+ * @return 0 on success.
+ */
+int destroy_workpool(bloom_workpool *pool);
+
+#endif
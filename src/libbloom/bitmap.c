@@ -9,15 +9,50 @@
 #include <sys/errno.h>
 #include <sys/stat.h>
 #include <syslog.h>
+#include <string.h>
 #include "bitmap.h"
+#include "crc32c.h"
+
+/**
+ * The header of the checksum file of a PERSISTENT bitmap.
+ * It is followed by the CRC32C of each page of the bitmap.
+ * The sequence is made odd before a flush writes any pages,
+ * and even once their checksums are on disk, so pages left
+ * by an interrupted flush are not taken for corruption. The
+ * inode ties the checksums to the bitmap file they were
+ * written for, so a file left behind by another bitmap of
+ * the same size is rebuilt instead of reported as corrupt.
+ */
+typedef struct {
+    uint32_t magic;         // Magic 4 bytes
+    uint32_t page_size;     // Bytes covered by each checksum
+    uint64_t bytes;         // Size of the bitmap file
+    uint64_t seq;           // Odd while a flush is writing pages
+    uint64_t inode;         // Inode of the bitmap file
+} __attribute__ ((packed)) checksum_header;
+
+static const uint32_t CHECKSUM_MAGIC = 0xCB1005CC;
+static const int MAX_LOGGED_PAGES = 8;    // Bad pages logged per file
 
 /* Static declarations */
 static void* alloc_dirty_page_bitmap(uint64_t len);
 static int fill_buffer(int fileno, unsigned char* buf, uint64_t len);
-static int flush_dirty_pages(bloom_bitmap *map);
+static int flush_dirty_pages(bloom_bitmap *map, uint64_t *first, uint64_t *last);
 static int flush_page(bloom_bitmap *map, uint64_t page, uint64_t size, uint64_t max_page);
+static int flush_checked_page(bloom_bitmap *map, uint64_t page, uint64_t max_page, int dirty,
+        uint64_t *first, uint64_t *last);
+static int write_fully(int fileno, const void *buf, uint64_t len, uint64_t offset);
+static char* checksum_path(char *filename);
+static uint64_t page_count(uint64_t len);
+static uint32_t page_crc(unsigned char *buf, uint64_t page, uint64_t size);
+static int read_checksum_header(int fileno, uint64_t len, uint64_t inode, checksum_header *header);
+static int write_checksum_header(bloom_bitmap *map);
+static int write_checksums(bloom_bitmap *map, uint64_t first, uint64_t last);
+static int load_checksums(char *filename, bloom_bitmap *map, int new_bitmap);
+static void discard_bitmap(bloom_bitmap *map);
 extern inline int bitmap_getbit(bloom_bitmap *map, uint64_t idx);
 extern inline void bitmap_setbit(bloom_bitmap *map, uint64_t idx);
+extern inline void bitmap_setbyte(bloom_bitmap *map, uint64_t idx, unsigned char byte);
 
 /**
  * Returns a bloom_bitmap pointer from a file handle
@@ -113,6 +148,10 @@ int bitmap_from_file(int fileno, uint64_t len, bitmap_mode mode, bloom_bitmap *m
     map->size = len;
     map->mmap = addr;
     map->dirty_pages = dirty;
+    map->crc_fileno = -1;
+    map->crcs = NULL;
+    map->crc_seq = 0;
+    map->crc_inode = 0;
     return 0;
 }
 
@@ -219,6 +258,16 @@ int bitmap_from_filename(char* filename, uint64_t len, int create, bitmap_mode m
     // Handle is dup'ed, we can close
     close(fileno);
 
+    // Check the pages we read in against their checksums.
+    // The kernel writes back SHARED maps behind our back,
+    // so any checksums would go stale.
+    if (!res && mode == PERSISTENT) {
+        res = load_checksums(filename, map, extra_flags & NEW_BITMAP);
+        if (res) discard_bitmap(map);
+    } else if (!res && mode == SHARED) {
+        bitmap_drop_checksums(filename);
+    }
+
     // Delete the file if we created it and had an error
     if (res && extra_flags & NEW_BITMAP && unlink(filename)) {
         perror("unlink failed!");
@@ -241,6 +290,7 @@ int bitmap_flush(bloom_bitmap *map) {
 
     // Do nothing for anonymous maps
     int res;
+    uint64_t first = UINT64_MAX, last = 0;
     if (map->mode == ANONYMOUS || map->mmap == NULL)
         return 0;
 
@@ -250,25 +300,57 @@ int bitmap_flush(bloom_bitmap *map) {
         if (res == -1) return -errno;
 
     } else if (map->mode == PERSISTENT) {
-        if ((res = flush_dirty_pages(map)))
+        if ((res = flush_dirty_pages(map, &first, &last)))
             return res;
     }
 
     // SHARED / PERSISTENT both have a file backing
     res = fsync(map->fileno);
     if (res == -1) return -errno;
+
+    // The checksums are written once the pages they cover are
+    // on disk. Nothing is written if no page changed.
+    if (map->crcs && first <= last)
+        return write_checksums(map, first, last);
     return 0;
 }
 
 
+/**
+ * Estimates how many bytes a flush of the bitmap
+ * would write. For PERSISTENT bitmaps, this is the size
+ * of the dirty pages. SHARED bitmaps are managed by the kernel,
+ * so the whole bitmap is assumed dirty. ANONYMOUS bitmaps are
+ * never written.
+ * @arg map The bitmap
+ * @returns The number of dirty bytes.
+ */
+uint64_t bitmap_dirty_bytes(bloom_bitmap *map) {
+    if (map == NULL || map->mmap == NULL) return 0;
+    if (map->mode == ANONYMOUS) return 0;
+    if (map->mode == SHARED) return map->size;
+
+    // Count the dirty pages
+    uint64_t pages = map->size / 4096 + ((map->size % 4096) ? 1 : 0);
+    uint64_t dirty = 0;
+    for (uint64_t i=0; i < pages; i += 8) {
+        dirty += __builtin_popcount(map->dirty_pages[i >> 3]);
+    }
+
+    uint64_t bytes = dirty * 4096;
+    return (bytes > map->size) ? map->size : bytes;
+}
+
+
 /**
  * Flushes all the dirty pages of the bitmap. We just
  * scan the dirty_pages bitfield and flush every 4K
  * block that is considered dirty. As a bit of a jank hack,
  * we always flush the first block, since it contains headers,
- * and is not reliably marked as dirty.
+ * and is not reliably marked as dirty. When checksums are
+ * kept, the range of pages written is returned in first and last.
  */
-static int flush_dirty_pages(bloom_bitmap *map) {
+static int flush_dirty_pages(bloom_bitmap *map, uint64_t *first, uint64_t *last) {
     /**
      * The dirty page bitmap is a problematic
      * shared data structure since reads and writes are
@@ -298,7 +380,10 @@ static int flush_dirty_pages(bloom_bitmap *map) {
 
         if (dirty || i == 0) {
             // Flush the page
-            res = flush_page(map, i, map->size, pages - 1);
+            if (map->crcs)
+                res = flush_checked_page(map, i, pages - 1, dirty, first, last);
+            else
+                res = flush_page(map, i, map->size, pages - 1);
             if (res) goto LEAVE;
         }
     }
@@ -334,6 +419,344 @@ static int flush_page(bloom_bitmap *map, uint64_t page, uint64_t size, uint64_t
 }
 
 
+/**
+ * Flushes out a single page of a bitmap that keeps checksums.
+ * The page is copied first, so the checksum covers exactly the
+ * bytes written even if bits are set meanwhile. The first page
+ * is skipped if it was not changed. The checksum file is marked
+ * before the first page is written.
+ */
+static int flush_checked_page(bloom_bitmap *map, uint64_t page, uint64_t max_page, int dirty,
+        uint64_t *first, uint64_t *last) {
+    unsigned char buf[4096];
+    uint64_t offset = page * 4096;
+    uint64_t len = (page == max_page && map->size % 4096) ? map->size % 4096 : 4096;
+    memcpy(buf, map->mmap + offset, len);
+    uint32_t crc = crc32c(0, buf, len);
+    if (!dirty && crc == map->crcs[page]) return 0;
+
+    int res;
+    if (!(map->crc_seq & 1)) {
+        map->crc_seq++;
+        if ((res = write_checksum_header(map))) return res;
+        if (fdatasync(map->crc_fileno)) return -errno;
+    }
+
+    if ((res = write_fully(map->fileno, buf, len, offset))) return res;
+    map->crcs[page] = crc;
+    if (page < *first) *first = page;
+    if (page > *last) *last = page;
+    return 0;
+}
+
+
+/**
+ * Writes a whole buffer at an offset
+ */
+static int write_fully(int fileno, const void *buf, uint64_t len, uint64_t offset) {
+    uint64_t total = 0;
+    ssize_t res;
+    while (total < len) {
+        res = pwrite(fileno, (const char*)buf + total, len - total, offset + total);
+        if (res == -1 && errno != EINTR)
+            return -errno;
+        else if (res > 0)
+            total += res;
+    }
+    return 0;
+}
+
+
+/**
+ * Returns the path of the checksum file of a bitmap file.
+ * The caller should free() it.
+ */
+static char* checksum_path(char *filename) {
+    char *path = NULL;
+    if (asprintf(&path, "%s.crc", filename) == -1) return NULL;
+    return path;
+}
+
+
+/**
+ * Returns the number of pages in a bitmap of len bytes
+ */
+static uint64_t page_count(uint64_t len) {
+    return len / 4096 + ((len % 4096) ? 1 : 0);
+}
+
+
+/**
+ * Returns the checksum of a page of a buffer of size bytes
+ */
+static uint32_t page_crc(unsigned char *buf, uint64_t page, uint64_t size) {
+    uint64_t offset = page * 4096;
+    uint64_t len = (size - offset < 4096) ? size - offset : 4096;
+    return crc32c(0, buf + offset, len);
+}
+
+
+/**
+ * Reads the header of a checksum file, and checks that it
+ * covers a bitmap of len bytes stored at the given inode.
+ * @return 0 if the checksums are usable, 1 if the file is
+ * empty, 2 if it is for another bitmap, 3 if a flush was
+ * interrupted, negative on error.
+ */
+static int read_checksum_header(int fileno, uint64_t len, uint64_t inode, checksum_header *header) {
+    struct stat buf;
+    if (fstat(fileno, &buf)) return -errno;
+    if (buf.st_size == 0) return 1;
+
+    uint64_t expect = sizeof(checksum_header) + page_count(len) * sizeof(uint32_t);
+    if ((uint64_t)buf.st_size != expect) return 2;
+
+    ssize_t res = pread(fileno, header, sizeof(checksum_header), 0);
+    if (res < 0) return -errno;
+    if (res != sizeof(checksum_header) || header->magic != CHECKSUM_MAGIC ||
+            header->page_size != 4096 || header->bytes != len ||
+            header->inode != inode) return 2;
+    return (header->seq & 1) ? 3 : 0;
+}
+
+
+/**
+ * Writes out the header of the checksum file
+ */
+static int write_checksum_header(bloom_bitmap *map) {
+    checksum_header header = {CHECKSUM_MAGIC, 4096, map->size, map->crc_seq, map->crc_inode};
+    return write_fully(map->crc_fileno, &header, sizeof(header), 0);
+}
+
+
+/**
+ * Writes out the checksums of a range of pages, and
+ * then marks the checksum file as complete.
+ */
+static int write_checksums(bloom_bitmap *map, uint64_t first, uint64_t last) {
+    int res = write_fully(map->crc_fileno, map->crcs + first,
+            (last - first + 1) * sizeof(uint32_t),
+            sizeof(checksum_header) + first * sizeof(uint32_t));
+    if (res) return res;
+    if (fdatasync(map->crc_fileno)) return -errno;
+
+    if (map->crc_seq & 1) map->crc_seq++;
+    if ((res = write_checksum_header(map))) return res;
+    if (fdatasync(map->crc_fileno)) return -errno;
+    return 0;
+}
+
+
+/**
+ * Opens the checksum file of a PERSISTENT bitmap that was
+ * just read in, and checks every page. A new bitmap, or one
+ * without usable checksums, gets a new checksum file.
+ * @return 0 on success, -EBADMSG if a page does not match.
+ */
+static int load_checksums(char *filename, bloom_bitmap *map, int new_bitmap) {
+    char *path = checksum_path(filename);
+    if (!path) return -ENOMEM;
+    int fileno = open(path, O_RDWR|O_CREAT, 0644);
+    if (fileno == -1) {
+        int err = errno;
+        syslog(LOG_ERR, "Failed to open checksums %s. %s", path, strerror(err));
+        free(path);
+        return -err;
+    }
+
+    uint64_t pages = page_count(map->size);
+    uint32_t *crcs = malloc(pages * sizeof(uint32_t));
+    if (!crcs) {
+        close(fileno);
+        free(path);
+        return -ENOMEM;
+    }
+
+    // Check if the existing checksums can be used
+    checksum_header header = {0, 0, 0, 0, 0};
+    struct stat buf;
+    int res = fstat(map->fileno, &buf) ? -errno : 0;
+    int rebuild = 1;
+    uint64_t bad = 0;
+    if (!res && !new_bitmap) {
+        res = read_checksum_header(fileno, map->size, buf.st_ino, &header);
+        if (res == 0) {
+            rebuild = 0;
+            ssize_t more = pread(fileno, crcs, pages * sizeof(uint32_t), sizeof(checksum_header));
+            if (more != (ssize_t)(pages * sizeof(uint32_t))) res = (more < 0) ? -errno : -EIO;
+        } else if (res == 2) {
+            syslog(LOG_WARNING, "Checksums %s do not match the bitmap, rebuilding.", path);
+        } else if (res == 3) {
+            syslog(LOG_WARNING, "Flush of %s was interrupted, rebuilding checksums.", filename);
+        }
+        if (res > 0) res = 0;
+    }
+
+    // Check or compute the checksum of every page
+    for (uint64_t i=0; i < pages && !res; i++) {
+        uint32_t crc = page_crc(map->mmap, i, map->size);
+        if (!rebuild && crc != crcs[i]) {
+            if (bad++ < (uint64_t)MAX_LOGGED_PAGES) {
+                syslog(LOG_ERR, "Page %llu of %s does not match its checksum.",
+                        (unsigned long long)i, filename);
+            }
+        }
+        crcs[i] = crc;
+    }
+    if (bad) {
+        syslog(LOG_ERR, "%s has %llu corrupt pages, not loading. Remove %s to accept the data.",
+                filename, (unsigned long long)bad, path);
+        res = -EBADMSG;
+    }
+
+    map->crc_fileno = fileno;
+    map->crcs = crcs;
+    map->crc_seq = (rebuild) ? 0 : header.seq;
+    map->crc_inode = (res) ? 0 : buf.st_ino;
+    if (!res && rebuild) {
+        if (!(res = write_checksums(map, 0, pages - 1))) res = ftruncate(fileno,
+                sizeof(checksum_header) + pages * sizeof(uint32_t)) ? -errno : 0;
+    }
+    if (res) {
+        free(crcs);
+        close(fileno);
+        map->crc_fileno = -1;
+        map->crcs = NULL;
+    }
+    free(path);
+    return res;
+}
+
+
+/**
+ * Releases a bitmap without flushing it
+ */
+static void discard_bitmap(bloom_bitmap *map) {
+    munmap(map->mmap, map->size);
+    close(map->fileno);
+    free(map->dirty_pages);
+    map->mmap = NULL;
+    map->fileno = -1;
+    map->dirty_pages = NULL;
+}
+
+
+/**
+ * Checks a range of pages of a bitmap file against its
+ * checksum file, reading both from disk. A flush that runs
+ * at the same time makes the check inconclusive.
+ * @arg filename The bitmap file
+ * @arg page The first page to check
+ * @arg num The most pages to check
+ * @arg bad Output, incremented for each page that does not match
+ * @return The number of pages checked, 0 past the last page,
+ * -1 if the files cannot be read, -2 if there are no usable
+ * checksums, or a flush got in the way.
+ */
+int64_t bitmap_verify_file(char *filename, uint64_t page, uint64_t num, uint64_t *bad) {
+    char *path = checksum_path(filename);
+    if (!path) return -1;
+    int crc_fileno = open(path, O_RDONLY);
+    free(path);
+    if (crc_fileno == -1) return (errno == ENOENT) ? -2 : -1;
+    int fileno = open(filename, O_RDONLY);
+    if (fileno == -1) {
+        close(crc_fileno);
+        return -1;
+    }
+
+    // The header is read before and after the pages, so a
+    // flush that wrote any of them in between is noticed
+    struct stat buf;
+    checksum_header header, after;
+    int64_t res = -1;
+    unsigned char *data = NULL;
+    uint32_t *crcs = NULL;
+    if (fstat(fileno, &buf)) goto LEAVE;
+    uint64_t size = buf.st_size;
+    int hres = read_checksum_header(crc_fileno, size, buf.st_ino, &header);
+    if (hres) {
+        res = (hres < 0) ? -1 : -2;
+        goto LEAVE;
+    }
+
+    uint64_t pages = page_count(size);
+    if (page >= pages) {
+        res = 0;
+        goto LEAVE;
+    }
+    if (num > pages - page) num = pages - page;
+    uint64_t offset = page * 4096;
+    uint64_t len = (offset + num * 4096 > size) ? size - offset : num * 4096;
+    data = malloc(len);
+    crcs = malloc(num * sizeof(uint32_t));
+    if (!data || !crcs) goto LEAVE;
+
+    ssize_t more = pread(fileno, data, len, offset);
+    if (more != (ssize_t)len) goto LEAVE;
+    more = pread(crc_fileno, crcs, num * sizeof(uint32_t),
+            sizeof(checksum_header) + page * sizeof(uint32_t));
+    if (more != (ssize_t)(num * sizeof(uint32_t))) goto LEAVE;
+    if (pread(crc_fileno, &after, sizeof(after), 0) != sizeof(after)) goto LEAVE;
+    if (after.seq != header.seq) {
+        res = -2;
+        goto LEAVE;
+    }
+
+    for (uint64_t i=0; i < num; i++) {
+        if (page_crc(data, i, len) != crcs[i]) (*bad)++;
+    }
+    res = num;
+
+LEAVE:
+    free(data);
+    free(crcs);
+    close(fileno);
+    close(crc_fileno);
+    return res;
+}
+
+
+/**
+ * Renames a bitmap file along with its checksum file.
+ * @arg from The current name of the bitmap file
+ * @arg to The new name, replaced if it exists
+ * @return 0 on success, negative on failure.
+ */
+int bitmap_rename_file(char *from, char *to) {
+    // Drop the old checksums first, so that if we are
+    // interrupted they are rebuilt instead of mismatched
+    int res = bitmap_drop_checksums(to);
+    if (res) return res;
+    if (rename(from, to)) return -errno;
+
+    char *from_crc = checksum_path(from);
+    char *to_crc = checksum_path(to);
+    if (!from_crc || !to_crc) res = -ENOMEM;
+    else if (rename(from_crc, to_crc) && errno != ENOENT) res = -errno;
+    free(from_crc);
+    free(to_crc);
+    return res;
+}
+
+
+/**
+ * Removes the checksum file of a bitmap file. This must be
+ * done when the bitmap is changed other than by a PERSISTENT
+ * flush. The checksums are rebuilt when it is next loaded.
+ * @arg filename The bitmap file
+ * @return 0 on success, negative on failure.
+ */
+int bitmap_drop_checksums(char *filename) {
+    char *path = checksum_path(filename);
+    if (!path) return -ENOMEM;
+    int res = 0;
+    if (unlink(path) && errno != ENOENT) res = -errno;
+    free(path);
+    return res;
+}
+
+
 /**
  * Closes and flushes the bitmap. This is
  * a syncronous operation. It is a no-op for
@@ -366,6 +789,14 @@ int bitmap_close(bloom_bitmap *map) {
         map->dirty_pages = NULL;
     }
 
+    // Close the checksums if any
+    if (map->crcs) {
+        close(map->crc_fileno);
+        free(map->crcs);
+        map->crc_fileno = -1;
+        map->crcs = NULL;
+    }
+
     // Cleanup
     map->mmap = NULL;
     map->fileno = -1;
@@ -17,6 +17,10 @@ typedef struct {
     uint64_t size;       // Size of bitmap in bytes
     unsigned char* mmap; // Starting address of the bitmap region
     unsigned char* dirty_pages; // Used for the PERSISTENT mode.
+    int crc_fileno;      // Checksum file of a PERSISTENT bitmap, -1 if none
+    uint32_t* crcs;      // CRC32C of each page, as written to the file
+    uint64_t crc_seq;    // Odd while a flush is writing pages
+    uint64_t crc_inode;  // Inode of the file the checksums cover
 } bloom_bitmap;
 
 /**
@@ -35,12 +39,20 @@ int bitmap_from_file(int fileno, uint64_t len, bitmap_mode mode, bloom_bitmap *m
  * Opens the file with read/write privileges. If create
  * is true, then a file will be created if it does not exist.
  * If the file cannot be opened, NULL will be returned.
+ *
+ * PERSISTENT bitmaps keep a CRC32C of each page in a checksum
+ * file beside the bitmap, named with a ".crc" suffix. The pages
+ * are checked when the file is read in, and a file with a bad
+ * page is not loaded. A missing checksum file, or one written
+ * for another file, is rebuilt from the bitmap. SHARED bitmaps are written by the kernel, so any
+ * checksum file is removed instead.
  * @arg fileno The fileno
  * @arg len The length of the bitmap in bytes.
  * @arg create If 1, then the file will be created if it does not exist.
  * @arg mode The mode to use for the bitmap.
  * @arg map The output map. Will be initialized.
- * @return 0 on success. Negative on error.
+ * @return 0 on success. -EBADMSG if a page does not match
+ * its checksum. Negative on error.
  */
 int bitmap_from_filename(char* filename, uint64_t len, int create, bitmap_mode mode, bloom_bitmap *map);
 
@@ -53,6 +65,48 @@ int bitmap_from_filename(char* filename, uint64_t len, int create, bitmap_mode m
  */
 int bitmap_flush(bloom_bitmap *map);
 
+/**
+ * Estimates how many bytes a flush of the bitmap
+ * would write. For PERSISTENT bitmaps, this is the size
+ * of the dirty pages. SHARED bitmaps are managed by the kernel,
+ * so the whole bitmap is assumed dirty. ANONYMOUS bitmaps are
+ * never written.
+ * @arg map The bitmap
+ * @returns The number of dirty bytes.
+ */
+uint64_t bitmap_dirty_bytes(bloom_bitmap *map);
+
+/**
+ * Checks a range of pages of a bitmap file against its
+ * checksum file, reading both from disk. A flush that runs
+ * at the same time makes the check inconclusive.
+ * @arg filename The bitmap file
+ * @arg page The first page to check
+ * @arg num The most pages to check
+ * @arg bad Output, incremented for each page that does not match
+ * @return The number of pages checked, 0 past the last page,
+ * -1 if the files cannot be read, -2 if there are no usable
+ * checksums, or a flush got in the way.
+ */
+int64_t bitmap_verify_file(char *filename, uint64_t page, uint64_t num, uint64_t *bad);
+
+/**
+ * Renames a bitmap file along with its checksum file.
+ * @arg from The current name of the bitmap file
+ * @arg to The new name, replaced if it exists
+ * @return 0 on success, negative on failure.
+ */
+int bitmap_rename_file(char *from, char *to);
+
+/**
+ * Removes the checksum file of a bitmap file. This must be
+ * done when the bitmap is changed other than by a PERSISTENT
+ * flush. The checksums are rebuilt when it is next loaded.
+ * @arg filename The bitmap file
+ * @return 0 on success, negative on failure.
+ */
+int bitmap_drop_checksums(char *filename);
+
 /**
  * * Closes and flushes the bitmap. This is
  * a syncronous operation. It is a no-op for
@@ -92,6 +146,23 @@ inline void bitmap_setbit(bloom_bitmap *map, uint64_t idx) {
     }
 }
 
+/*
+ * Used to write a whole byte of the bitmap, and as a side affect,
+ * mark the page as dirty if we are in the PERSISTENT mode
+ */
+inline void bitmap_setbyte(bloom_bitmap *map, uint64_t idx, unsigned char byte) {
+    map->mmap[idx] = byte;
+
+    // Check if we need to dirty the page
+    if (map->mode == PERSISTENT) {
+        // >> 12 for 4096 (bytes/page)
+        uint64_t page = idx >> 12;
+        byte = map->dirty_pages[page >> 3];
+        byte |= 1 << (7 - page % 8);
+        map->dirty_pages[page >> 3] = byte;
+    }
+}
+
 #endif
 
 
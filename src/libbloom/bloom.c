@@ -9,11 +9,91 @@
 /*
  * Static definitions
  */
-static const uint32_t MAGIC_HEADER = 0xCB1005DD;  // Vaguely like CBLOOMDD
+static const uint64_t MIN_FOLD_BITS = 64;         // Smallest partition we fold to
+static const uint64_t SORT_MAX_BUCKETS = 65536;   // Most buckets used to sort probes
 extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t seed, void *out);
 extern void SpookyHash128(const void *key, size_t len, uint64_t seed1, uint64_t seed2,
         uint64_t *hash1, uint64_t *hash2);
 
+/*
+ * Static declarations
+ */
+static int bf_internal_contains(bloom_bloomfilter *filter, uint64_t *hashes);
+static void bf_internal_set_bits(bloom_bloomfilter *filter, uint64_t *hashes);
+static void bf_choose_probes(bloom_bloomfilter *filter);
+
+/*
+ * Fully unrolls the probe loops of the specialized k_num
+ * values, where the compiler lets us ask for it.
+ */
+#if defined(__clang__)
+#define BF_UNROLL _Pragma("unroll")
+#elif defined(__GNUC__) && __GNUC__ >= 8
+#define BF_UNROLL _Pragma("GCC unroll 32")
+#else
+#define BF_UNROLL
+#endif
+
+/*
+ * Defines the probe functions for a fixed k_num. With a
+ * constant number of partitions the loops are unrolled, and
+ * the header is not read through the mmap on every probe.
+ */
+#define BF_DEFINE_PROBES(K) \
+static int bf_contains_k##K(bloom_bloomfilter *filter, uint64_t *hashes) { \
+    uint64_t m = filter->offset; \
+    uint64_t offset = 8*sizeof(bloom_filter_header); \
+    BF_UNROLL \
+    for (uint32_t i=0; i < K; i++, offset += m) { \
+        if (!bitmap_getbit(filter->map, offset + (hashes[i] % m))) return 0; \
+    } \
+    return 1; \
+} \
+static void bf_set_bits_k##K(bloom_bloomfilter *filter, uint64_t *hashes) { \
+    uint64_t m = filter->offset; \
+    uint64_t offset = 8*sizeof(bloom_filter_header); \
+    BF_UNROLL \
+    for (uint32_t i=0; i < K; i++, offset += m) { \
+        bitmap_setbit(filter->map, offset + (hashes[i] % m)); \
+    } \
+}
+
+/*
+ * Our layers use only a few k_num values. A probability
+ * of 1e-4 with the default probability reduction gives
+ * 13 to 16, and 1e-2 to 1e-3 gives 7 to 10.
+ */
+BF_DEFINE_PROBES(4)
+BF_DEFINE_PROBES(5)
+BF_DEFINE_PROBES(6)
+BF_DEFINE_PROBES(7)
+BF_DEFINE_PROBES(8)
+BF_DEFINE_PROBES(9)
+BF_DEFINE_PROBES(10)
+BF_DEFINE_PROBES(11)
+BF_DEFINE_PROBES(12)
+BF_DEFINE_PROBES(13)
+BF_DEFINE_PROBES(14)
+BF_DEFINE_PROBES(15)
+BF_DEFINE_PROBES(16)
+BF_DEFINE_PROBES(17)
+BF_DEFINE_PROBES(18)
+BF_DEFINE_PROBES(19)
+BF_DEFINE_PROBES(20)
+
+#define BF_PROBES(K) {bf_contains_k##K, bf_set_bits_k##K}
+static const uint32_t MIN_PROBE_K = 4;
+static const struct {
+    int (*contains)(bloom_bloomfilter *filter, uint64_t *hashes);
+    void (*set_bits)(bloom_bloomfilter *filter, uint64_t *hashes);
+} PROBES[] = {
+    BF_PROBES(4), BF_PROBES(5), BF_PROBES(6), BF_PROBES(7),
+    BF_PROBES(8), BF_PROBES(9), BF_PROBES(10), BF_PROBES(11),
+    BF_PROBES(12), BF_PROBES(13), BF_PROBES(14), BF_PROBES(15),
+    BF_PROBES(16), BF_PROBES(17), BF_PROBES(18), BF_PROBES(19),
+    BF_PROBES(20)
+};
+
 /**
  * Creates a new bloom filter using a given bitmap and k-value.
  * @arg map A bloom_bitmap pointer.
@@ -42,9 +122,10 @@ int bf_from_bitmap(bloom_bitmap *map, uint32_t k_num, int new_filter, bloom_bloo
 
     // Setup the header if it is new
     if (new_filter) {
-        filter->header->magic = MAGIC_HEADER;
+        filter->header->magic = BLOOM_MAGIC;
         filter->header->k_num = k_num;
         filter->header->count = 0;
+        filter->header->capacity = 0;
 
         // Since this is a new filter, force a flush of
         // the headers. This mainly affects bitmaps that
@@ -55,13 +136,14 @@ int bf_from_bitmap(bloom_bitmap *map, uint32_t k_num, int new_filter, bloom_bloo
         bf_flush(filter);
 
     // Check for the header if not new
-    } else if (filter->header->magic != MAGIC_HEADER) {
+    } else if (filter->header->magic != BLOOM_MAGIC) {
         syslog(LOG_ERR, "Magic byte for bloom filter is wrong! Aborting load.");
         return -1;
     }
 
     // Setup the offset
     filter->offset = filter->bitmap_size / filter->header->k_num;
+    bf_choose_probes(filter);
 
     // Done, return
     return 0;
@@ -95,6 +177,41 @@ static int bf_internal_contains(bloom_bloomfilter *filter, uint64_t *hashes) {
     return 1;
 }
 
+/**
+ * Internal method to set the bits of a key.
+ * @arg filter The filter
+ * @arg hashes Contains at least K num hashes
+ */
+static void bf_internal_set_bits(bloom_bloomfilter *filter, uint64_t *hashes) {
+    uint64_t m = filter->offset;
+    uint64_t offset;
+    uint64_t h;
+    uint32_t i;
+    uint64_t bit;
+
+    for (i=0; i< filter->header->k_num; i++) {
+        h = hashes[i];                                  // Get the hash value
+        offset = 8*sizeof(bloom_filter_header) + i * m; // Get the partition offset
+        bit = offset + (h % m);                         // Compute the bit offset
+        bitmap_setbit(filter->map, bit);
+    }
+}
+
+/**
+ * Picks the probe functions for the k_num of the filter,
+ * using the generic loops if it is not specialized.
+ */
+static void bf_choose_probes(bloom_bloomfilter *filter) {
+    uint32_t k_num = filter->header->k_num;
+    if (k_num >= MIN_PROBE_K && k_num - MIN_PROBE_K < sizeof(PROBES) / sizeof(PROBES[0])) {
+        filter->contains = PROBES[k_num - MIN_PROBE_K].contains;
+        filter->set_bits = PROBES[k_num - MIN_PROBE_K].set_bits;
+    } else {
+        filter->contains = bf_internal_contains;
+        filter->set_bits = bf_internal_set_bits;
+    }
+}
+
 
 /**
  * Adds a new key to the bloom filter.
@@ -104,30 +221,28 @@ static int bf_internal_contains(bloom_bloomfilter *filter, uint64_t *hashes) {
  */
 int bf_add(bloom_bloomfilter *filter, char* key) {
     // Allocate the hash space
-    uint64_t *hashes = alloca(filter->header->k_num * sizeof(uint64_t));
+    uint64_t *hashes = alloca(BF_NUM_HASHES(filter->header->k_num) * sizeof(uint64_t));
 
     // Compute the hashes
     bf_compute_hashes(filter->header->k_num, key, hashes);
+    return bf_add_hashes(filter, hashes);
+}
 
+/**
+ * Adds a key to the bloom filter, using hashes
+ * that were already computed by bf_compute_hashes.
+ * @arg filter The filter to add to
+ * @arg hashes Contains at least K num hashes
+ * @returns 1 if the key was added, 0 if present.
+ */
+int bf_add_hashes(bloom_bloomfilter *filter, uint64_t *hashes) {
     // Check if the item exists
-    int res = bf_internal_contains(filter, hashes);
+    int res = filter->contains(filter, hashes);
     if (res == 1) {
         return 0;  // Key already present, do not add.
     }
 
-    uint64_t m = filter->offset;
-    uint64_t offset;
-    uint64_t h;
-    uint32_t i;
-    uint64_t bit;
-
-    for (i=0; i< filter->header->k_num; i++) {
-        h = hashes[i];                                  // Get the hash value
-        offset = 8*sizeof(bloom_filter_header) + i * m; // Get the partition offset
-        bit = offset + (h % m);                         // Compute the bit offset
-        bitmap_setbit(filter->map, bit);
-    }
-
+    filter->set_bits(filter, hashes);
     filter->header->count += 1;
     return 1;
 }
@@ -140,13 +255,115 @@ int bf_add(bloom_bloomfilter *filter, char* key) {
  */
 int bf_contains(bloom_bloomfilter *filter, char* key) {
     // Allocate the hash space
-    uint64_t *hashes = alloca(filter->header->k_num * sizeof(uint64_t));
+    uint64_t *hashes = alloca(BF_NUM_HASHES(filter->header->k_num) * sizeof(uint64_t));
 
     // Compute the hashes
     bf_compute_hashes(filter->header->k_num, key, hashes);
 
-    // Use the internal contains method
-    return bf_internal_contains(filter, hashes);
+    // Use the probe for our k_num
+    return filter->contains(filter, hashes);
+}
+
+/**
+ * Checks the filter for a key, using hashes
+ * that were already computed by bf_compute_hashes.
+ * @arg filter The filter to check
+ * @arg hashes Contains at least K num hashes
+ * @returns 1 if present, 0 if not present.
+ */
+int bf_contains_hashes(bloom_bloomfilter *filter, uint64_t *hashes) {
+    return filter->contains(filter, hashes);
+}
+
+/**
+ * Checks many keys against the filter. Rather than probing
+ * each key in turn, all the probes are sorted by their location
+ * in the bitmap and made in that order, so each page is touched
+ * once. This avoids random page faults when the filter is much
+ * larger than memory.
+ * @arg filter The filter to check
+ * @arg hashes The hashes of every key, at least K num each
+ * @arg stride The number of hashes per key
+ * @arg keys The indexes of the keys to check
+ * @arg num_keys The number of keys to check
+ * @arg present Output, indexed like the hashes. Set to
+ * 1 for each key that is present, 0 if not.
+ * @returns 0 on success, negative on failure.
+ */
+int bf_contains_sorted(bloom_bloomfilter *filter, uint64_t *hashes, uint32_t stride,
+        uint32_t *keys, uint32_t num_keys, char *present) {
+    // Sort into buckets of at least a page, with no more
+    // than SORT_MAX_BUCKETS buckets
+    uint64_t bits = filter->map->size * 8;
+    uint32_t shift = 15;
+    while ((bits >> shift) >= SORT_MAX_BUCKETS) shift++;
+    uint64_t num_buckets = (bits >> shift) + 1;
+
+    uint32_t k_num = filter->header->k_num;
+    uint64_t num_probes = (uint64_t)num_keys * k_num;
+    uint64_t *probe_bits = malloc(num_probes * sizeof(uint64_t));
+    uint64_t *sorted_bits = malloc(num_probes * sizeof(uint64_t));
+    uint32_t *sorted_keys = malloc(num_probes * sizeof(uint32_t));
+    uint32_t *counts = calloc(num_buckets + 1, sizeof(uint32_t));
+    if (!probe_bits || !sorted_bits || !sorted_keys || !counts) {
+        free(probe_bits);
+        free(sorted_bits);
+        free(sorted_keys);
+        free(counts);
+        return -ENOMEM;
+    }
+
+    // Compute the bit of every probe, and count the buckets
+    uint64_t m = filter->offset;
+    uint64_t *key_hashes, bit, probe = 0;
+    for (uint32_t j=0; j < num_keys; j++) {
+        key_hashes = hashes + (uint64_t)keys[j] * stride;
+        for (uint32_t i=0; i < k_num; i++) {
+            bit = 8*sizeof(bloom_filter_header) + i * m + (key_hashes[i] % m);
+            probe_bits[probe++] = bit;
+            counts[(bit >> shift) + 1]++;
+        }
+        present[keys[j]] = 1;
+    }
+
+    // Counting sort the probes by bucket
+    for (uint64_t b=1; b <= num_buckets; b++) counts[b] += counts[b-1];
+    probe = 0;
+    uint32_t pos;
+    for (uint32_t j=0; j < num_keys; j++) {
+        for (uint32_t i=0; i < k_num; i++, probe++) {
+            pos = counts[probe_bits[probe] >> shift]++;
+            sorted_bits[pos] = probe_bits[probe];
+            sorted_keys[pos] = keys[j];
+        }
+    }
+
+    // Probe in order, a single unset bit means not present
+    for (uint64_t p=0; p < num_probes; p++) {
+        if (present[sorted_keys[p]] && !bitmap_getbit(filter->map, sorted_bits[p]))
+            present[sorted_keys[p]] = 0;
+    }
+
+    free(probe_bits);
+    free(sorted_bits);
+    free(sorted_keys);
+    free(counts);
+    return 0;
+}
+
+/**
+ * Prefetches the bytes holding the bits of a key, so
+ * that a later add or check does not stall on them.
+ * @arg filter The filter that will be probed
+ * @arg hashes Contains at least K num hashes
+ */
+void bf_prefetch_hashes(bloom_bloomfilter *filter, uint64_t *hashes) {
+    uint64_t m = filter->offset;
+    uint64_t bit;
+    for (uint32_t i=0; i < filter->header->k_num; i++) {
+        bit = 8*sizeof(bloom_filter_header) + i * m + (hashes[i] % m);
+        __builtin_prefetch(filter->map->mmap + (bit >> 3), 1);
+    }
 }
 
 /**
@@ -195,6 +412,127 @@ int bf_close(bloom_bloomfilter *filter) {
     return 0;
 }
 
+/**
+ * Finds the largest factor the filter can be folded by while
+ * keeping its false positive rate under a probability. Folding
+ * ORs together equal parts of each hash partition, so the factor
+ * must divide the partition size. The rate is estimated from both
+ * the fraction of bits set and the count of items.
+ * @arg filter The filter to fold
+ * @arg fp_prob The maximum false positive rate after folding
+ * @return The factor, 1 if the filter cannot be folded.
+ */
+uint64_t bf_fold_factor(bloom_bloomfilter *filter, double fp_prob) {
+    uint64_t m = filter->offset;
+    uint32_t k = filter->header->k_num;
+    if (m < 2 * MIN_FOLD_BITS || fp_prob <= 0 || fp_prob >= 1) return 1;
+
+    // Count the set bits, the padding after the partitions is never set
+    uint64_t set = 0;
+    uint64_t *words = (uint64_t*)(filter->map->mmap + sizeof(bloom_filter_header));
+    uint64_t num_words = filter->bitmap_size / 64;
+    for (uint64_t i=0; i < num_words; i++) {
+        set += __builtin_popcountll(words[i]);
+    }
+    for (uint64_t i=num_words * 8; i < filter->bitmap_size / 8; i++) {
+        set += __builtin_popcount(filter->map->mmap[sizeof(bloom_filter_header) + i]);
+    }
+
+    /*
+     * A bit of a folded partition is zero only if all of the
+     * factor bits it is made from are zero. If a fraction z of the
+     * bits are zero, a fold by f leaves z^f of them zero. The count
+     * predicts (1 - 1/m)^n are zero, and we use the worse of both.
+     */
+    double zero_bits = 1 - (double)set / ((double)m * k);
+    double zero_count = pow(1 - 1.0 / m, filter->header->count);
+    double zero = (zero_bits < zero_count) ? zero_bits : zero_count;
+    if (zero <= 0) return 1;
+
+    // The fill we can reach, and the largest factor that stays under it
+    double max_fill = pow(fp_prob, 1.0 / k);
+    uint64_t max_factor = m / MIN_FOLD_BITS;
+    if (zero < 1) {
+        double f = log(1 - max_fill) / log(zero);
+        if (f < max_factor) max_factor = f;
+    }
+
+    // The factor must divide the partitions, and the folded
+    // bitmap size must give back the folded partition size
+    for (uint64_t f=max_factor; f > 1; f--) {
+        if (m % f) continue;
+        uint64_t bits = (bf_fold_bytes(filter, f) - sizeof(bloom_filter_header)) * 8;
+        if (bits / k == m / f) return f;
+    }
+    return 1;
+}
+
+/**
+ * Returns the byte size of the filter once folded by a
+ * factor from bf_fold_factor. Includes the header size.
+ */
+uint64_t bf_fold_bytes(bloom_bloomfilter *filter, uint64_t factor) {
+    uint64_t bits = (filter->offset / factor) * filter->header->k_num;
+    return sizeof(bloom_filter_header) + (bits + 7) / 8;
+}
+
+/**
+ * Folds a filter into a smaller filter. The bits are ORed into
+ * the output, so folding again after more keys are added to the
+ * filter brings the output up to date.
+ * @arg filter The filter to fold
+ * @arg factor The factor from bf_fold_factor
+ * @arg out A new filter with the same k_num, using a bitmap
+ * of bf_fold_bytes bytes.
+ * @return 0 on success, negative on error.
+ */
+int bf_fold(bloom_bloomfilter *filter, uint64_t factor, bloom_bloomfilter *out) {
+    uint64_t m = filter->offset;
+    uint64_t folded = out->offset;
+    uint32_t k = filter->header->k_num;
+    if (factor < 1 || out->header->k_num != k || folded * factor != m) {
+        return -EINVAL;
+    }
+
+    uint64_t header_bits = 8 * sizeof(bloom_filter_header);
+    uint64_t bit, j;
+    for (uint32_t i=0; i < k; i++) {
+        uint64_t in_offset = header_bits + i * m;
+        uint64_t out_offset = header_bits + i * folded;
+        j = 0;
+        for (uint64_t q=0; q < m;) {
+            // Skip over zero bytes, since most bits are not set
+            bit = in_offset + q;
+            if (!(bit & 7) && q + 8 <= m && folded >= 8 && !filter->map->mmap[bit >> 3]) {
+                q += 8;
+                j += 8;
+                if (j >= folded) j -= folded;
+                continue;
+            }
+            if (bitmap_getbit(filter->map, bit)) {
+                bitmap_setbit(out->map, out_offset + j);
+            }
+            q++;
+            if (++j == folded) j = 0;
+        }
+    }
+    out->header->count = filter->header->count;
+    return 0;
+}
+
+/**
+ * Returns the number of items the filter can hold before its
+ * false positive rate passes a probability. Unlike
+ * bf_capacity_for_size_prob, this uses the actual k_num.
+ */
+uint64_t bf_capacity_for_prob(bloom_bloomfilter *filter, double fp_prob) {
+    // Each partition has m bits, and n items set a bit in
+    // each of them. The rate is (1 - e^(-n/m))^k, solved for n.
+    double m = filter->offset;
+    double fill = pow(fp_prob, 1.0 / filter->header->k_num);
+    return -m * log(1 - fill);
+}
+
 /*
  * Utility methods
  */
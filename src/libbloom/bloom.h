@@ -9,22 +9,28 @@
 /**
  * We use a magic header to identify the bloom filters.
  */
+#define BLOOM_MAGIC 0xCB1005DD  // Vaguely like CBLOOMDD
 struct bloom_filter_header {
     uint32_t magic;     // Magic 4 bytes
     uint32_t k_num;     // K_num value
     uint64_t count;     // Count of items
-    char __buf[496];     // Pad out to 512 bytes
+    uint64_t capacity;  // Capacity of the filter, 0 if unknown
+    char __buf[488];     // Pad out to 512 bytes
 } __attribute__ ((packed));
 typedef struct bloom_filter_header bloom_filter_header;
 
 /*
  * This is the struct we use to represent a bloom filter.
+ * The probe functions are chosen for the k_num when the
+ * filter is created, so the common values are unrolled.
  */
-typedef struct {
+typedef struct bloom_bloomfilter {
     bloom_filter_header *header;   // Pointer to the header in the bitmap region
     bloom_bitmap *map;             // Underlying bitmap
     uint64_t offset;                // The offset size between hash regions
     uint64_t bitmap_size;           // The size of the bitmap to use, minus buffers
+    int (*contains)(struct bloom_bloomfilter *filter, uint64_t *hashes);  // Checks the bits of a key
+    void (*set_bits)(struct bloom_bloomfilter *filter, uint64_t *hashes); // Sets the bits of a key
 } bloom_bloomfilter;
 
 /*
@@ -65,6 +71,50 @@ int bf_add(bloom_bloomfilter *filter, char* key);
  */
 int bf_contains(bloom_bloomfilter *filter, char* key);
 
+/**
+ * Adds a key to the bloom filter, using hashes
+ * that were already computed by bf_compute_hashes.
+ * @arg filter The filter to add to
+ * @arg hashes Contains at least K num hashes
+ * @returns 1 if the key was added, 0 if present.
+ */
+int bf_add_hashes(bloom_bloomfilter *filter, uint64_t *hashes);
+
+/**
+ * Checks the filter for a key, using hashes
+ * that were already computed by bf_compute_hashes.
+ * @arg filter The filter to check
+ * @arg hashes Contains at least K num hashes
+ * @returns 1 if present, 0 if not present.
+ */
+int bf_contains_hashes(bloom_bloomfilter *filter, uint64_t *hashes);
+
+/**
+ * Checks many keys against the filter. Rather than probing
+ * each key in turn, all the probes are sorted by their location
+ * in the bitmap and made in that order, so each page is touched
+ * once. This avoids random page faults when the filter is much
+ * larger than memory.
+ * @arg filter The filter to check
+ * @arg hashes The hashes of every key, at least K num each
+ * @arg stride The number of hashes per key
+ * @arg keys The indexes of the keys to check
+ * @arg num_keys The number of keys to check
+ * @arg present Output, indexed like the hashes. Set to
+ * 1 for each key that is present, 0 if not.
+ * @returns 0 on success, negative on failure.
+ */
+int bf_contains_sorted(bloom_bloomfilter *filter, uint64_t *hashes, uint32_t stride,
+        uint32_t *keys, uint32_t num_keys, char *present);
+
+/**
+ * Prefetches the bytes holding the bits of a key, so
+ * that a later add or check does not stall on them.
+ * @arg filter The filter that will be probed
+ * @arg hashes Contains at least K num hashes
+ */
+void bf_prefetch_hashes(bloom_bloomfilter *filter, uint64_t *hashes);
+
 /**
  * Returns the size of the bloom filter in item count
  */
@@ -83,11 +133,55 @@ int bf_flush(bloom_bloomfilter *filter);
  */
 int bf_close(bloom_bloomfilter *filter);
 
+/**
+ * Finds the largest factor the filter can be folded by while
+ * keeping its false positive rate under a probability. Folding
+ * ORs together equal parts of each hash partition, so the factor
+ * must divide the partition size. The rate is estimated from both
+ * the fraction of bits set and the count of items.
+ * @arg filter The filter to fold
+ * @arg fp_prob The maximum false positive rate after folding
+ * @return The factor, 1 if the filter cannot be folded.
+ */
+uint64_t bf_fold_factor(bloom_bloomfilter *filter, double fp_prob);
+
+/**
+ * Returns the byte size of the filter once folded by a
+ * factor from bf_fold_factor. Includes the header size.
+ */
+uint64_t bf_fold_bytes(bloom_bloomfilter *filter, uint64_t factor);
+
+/**
+ * Folds a filter into a smaller filter. The bits are ORed into
+ * the output, so folding again after more keys are added to the
+ * filter brings the output up to date.
+ * @arg filter The filter to fold
+ * @arg factor The factor from bf_fold_factor
+ * @arg out A new filter with the same k_num, using a bitmap
+ * of bf_fold_bytes bytes.
+ * @return 0 on success, negative on error.
+ */
+int bf_fold(bloom_bloomfilter *filter, uint64_t factor, bloom_bloomfilter *out);
+
+/**
+ * Returns the number of items the filter can hold before its
+ * false positive rate passes a probability. Unlike
+ * bf_capacity_for_size_prob, this uses the actual k_num.
+ */
+uint64_t bf_capacity_for_prob(bloom_bloomfilter *filter, double fp_prob);
+
+/*
+ * The number of hashes written by bf_compute_hashes for
+ * a k_num. At least 4 are always written, so the arrays
+ * passed to it must be at least this long.
+ */
+#define BF_NUM_HASHES(k_num) ((k_num) < 4 ? 4 : (k_num))
+
 /*
  * Computes the hashes for a bloom filter
  * @arg k_num the number of hashes to compute
  * @arg key The key to hash
- * @arg hashes Array to write to
+ * @arg hashes Array to write to, of at least BF_NUM_HASHES(k_num)
  */
 void bf_compute_hashes(uint32_t k_num, char *key, uint64_t *hashes);
 
@@ -0,0 +1,89 @@
+#include <string.h>
+#include "crc32c.h"
+
+/*
+ * Static definitions
+ */
+static const uint32_t CRC32C_POLY = 0x82F63B78;  // Reversed Castagnoli polynomial
+static uint32_t crc_table[256];
+static uint32_t (*crc_impl)(uint32_t crc, const unsigned char *buf, size_t len) = NULL;
+
+/*
+ * Static declarations
+ */
+static uint32_t crc32c_table(uint32_t crc, const unsigned char *buf, size_t len);
+static void crc32c_init(void);
+
+/*
+ * The crc32 instruction is only used when the CPU reports
+ * SSE4.2, so it is compiled for that target alone and the
+ * rest of the library keeps the default flags.
+ */
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAS_HW_CRC 1
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const unsigned char *buf, size_t len) {
+    uint64_t c = crc;
+    while (len && ((uintptr_t)buf & 7)) {
+        c = __builtin_ia32_crc32qi(c, *buf++);
+        len--;
+    }
+    uint64_t word;
+    while (len >= 8) {
+        memcpy(&word, buf, 8);
+        c = __builtin_ia32_crc32di(c, word);
+        buf += 8;
+        len -= 8;
+    }
+    while (len--) {
+        c = __builtin_ia32_crc32qi(c, *buf++);
+    }
+    return c;
+}
+#endif
+
+/**
+ * Computes the CRC32C (Castagnoli) of a buffer. Uses the
+ * SSE4.2 crc32 instruction when the CPU has it, and a
+ * lookup table otherwise.
+ * @arg crc The CRC of the data before the buffer, 0 to start
+ * @arg buf The buffer
+ * @arg len The length of the buffer in bytes
+ * @return The CRC of the data up to the end of the buffer
+ */
+uint32_t crc32c(uint32_t crc, const unsigned char *buf, size_t len) {
+    if (!crc_impl) crc32c_init();
+    return ~crc_impl(~crc, buf, len);
+}
+
+/**
+ * Picks the implementation, and fills the table if
+ * it is needed. Racing callers pick the same one.
+ */
+static void crc32c_init(void) {
+#ifdef HAS_HW_CRC
+    if (__builtin_cpu_supports("sse4.2")) {
+        crc_impl = crc32c_hw;
+        return;
+    }
+#endif
+    for (uint32_t i=0; i < 256; i++) {
+        uint32_t c = i;
+        for (int j=0; j < 8; j++) {
+            c = (c & 1) ? (c >> 1) ^ CRC32C_POLY : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+    __sync_synchronize();
+    crc_impl = crc32c_table;
+}
+
+/**
+ * Computes the CRC a byte at a time
+ */
+static uint32_t crc32c_table(uint32_t crc, const unsigned char *buf, size_t len) {
+    while (len--) {
+        crc = crc_table[(crc ^ *buf++) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
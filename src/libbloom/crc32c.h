@@ -0,0 +1,17 @@
+#ifndef BLOOM_CRC32C_H
+#define BLOOM_CRC32C_H
+#include <stddef.h>
+#include <inttypes.h>
+
+/**
+ * Computes the CRC32C (Castagnoli) of a buffer. Uses the
+ * SSE4.2 crc32 instruction when the CPU has it, and a
+ * lookup table otherwise.
+ * @arg crc The CRC of the data before the buffer, 0 to start
+ * @arg buf The buffer
+ * @arg len The length of the buffer in bytes
+ * @return The CRC of the data up to the end of the buffer
+ */
+uint32_t crc32c(uint32_t crc, const unsigned char *buf, size_t len);
+
+#endif
@@ -0,0 +1,402 @@
+#include <math.h>
+#include <inttypes.h>
+#include <string.h>
+#include <syslog.h>
+#include "fuse.h"
+
+/*
+ * Static definitions
+ */
+extern void MurmurHash3_x64_128(const void * key, const int len, const uint32_t seed, void *out);
+
+/**
+ * Number of seeds to try before giving up on a build.
+ * Each seed fails with a small constant probability.
+ */
+#define MAX_BUILD_ATTEMPTS 100
+
+/**
+ * Largest segment length, limits the memory
+ * locality lost to very large filters.
+ */
+#define MAX_SEGMENT_LENGTH 262144
+
+/*
+ * Static declarations
+ */
+static void fuse_params(uint64_t count, uint32_t *segment_length, uint32_t *segment_count);
+static inline uint64_t fuse_mix(uint64_t h);
+static inline uint64_t fuse_next_seed(uint64_t *state);
+static inline uint32_t fuse_fingerprint(uint64_t hash, uint32_t bits);
+static inline uint32_t fuse_get(bloom_fuse *filter, uint32_t slot);
+static inline void fuse_set(bloom_fuse *filter, uint32_t slot, uint32_t fp);
+static inline uint32_t fuse_slot(int index, uint64_t hash, bloom_fuse_header *header);
+static int cmp_hashes(const void *a, const void *b);
+
+/**
+ * Hashes a key for use with a fuse filter.
+ * @arg key The key to hash
+ * @return The 64bit hash of the key
+ */
+uint64_t fuse_hash_key(char *key) {
+    uint64_t out[2];
+    MurmurHash3_x64_128(key, strlen(key), 0, out);
+    return out[0];
+}
+
+/**
+ * Sorts a list of key hashes and removes any duplicates,
+ * which must be done before building a filter.
+ * @arg hashes The key hashes, modified in place
+ * @arg count The number of hashes
+ * @return The number of unique hashes
+ */
+uint64_t fuse_unique_hashes(uint64_t *hashes, uint64_t count) {
+    if (count == 0) return 0;
+    qsort(hashes, count, sizeof(uint64_t), cmp_hashes);
+
+    uint64_t unique = 1;
+    for (uint64_t i=1; i < count; i++) {
+        if (hashes[i] != hashes[unique-1]) hashes[unique++] = hashes[i];
+    }
+    return unique;
+}
+
+/**
+ * Computes the size of the bitmap needed to
+ * build a fuse filter, including the header.
+ * @arg count The number of unique keys
+ * @arg bits The fingerprint size, 8 or 16
+ * @return The size in bytes
+ */
+uint64_t fuse_bytes_for_count(uint64_t count, int bits) {
+    uint32_t segment_length, segment_count;
+    fuse_params(count, &segment_length, &segment_count);
+    return sizeof(bloom_fuse_header) + (uint64_t)(segment_count + 2) * segment_length * (bits / 8);
+}
+
+/**
+ * Picks the smallest fingerprint size that has a
+ * false positive rate no more than a given rate.
+ * @arg fp_prob The false positive probability
+ * @return 8 or 16
+ */
+int fuse_bits_for_prob(double fp_prob) {
+    return (fp_prob >= 1.0 / 256) ? 8 : 16;
+}
+
+/**
+ * Builds a new fuse filter in a bitmap.
+ * @arg map A bloom_bitmap of at least fuse_bytes_for_count bytes
+ * @arg hashes The unique key hashes. Reordered.
+ * @arg count The number of hashes
+ * @arg bits The fingerprint size, 8 or 16
+ * @arg filter The filter to setup
+ * @return 0 for success. Negative for error.
+ */
+int fuse_build(bloom_bitmap *map, uint64_t *hashes, uint64_t count, int bits, bloom_fuse *filter) {
+    // Check our args
+    if (map == NULL || count >= UINT32_MAX || (bits != 8 && bits != 16)) {
+        return -EINVAL;
+    }
+    if (map->size < fuse_bytes_for_count(count, bits)) {
+        return -ENOMEM;
+    }
+
+    // Setup the pointers and the header
+    filter->map = map;
+    filter->header = (bloom_fuse_header*)map->mmap;
+    filter->fingerprints = map->mmap + sizeof(bloom_fuse_header);
+
+    bloom_fuse_header *header = filter->header;
+    memset(header, 0, sizeof(bloom_fuse_header));
+    uint32_t segment_length, segment_count;
+    fuse_params(count, &segment_length, &segment_count);
+    header->segment_length = segment_length;
+    header->segment_count = segment_count;
+    header->array_length = (header->segment_count + 2) * header->segment_length;
+    header->count = count;
+    header->fingerprint_bits = bits;
+    uint32_t size = count;
+    uint32_t capacity = header->array_length;
+
+    // Each slot tracks the number of keys mapped to it, which of
+    // the 3 slots of the key it is (2 bits), and the xor of the keys
+    uint64_t *order = calloc(size + 1, sizeof(uint64_t));
+    uint8_t *order_slot = malloc(size + 1);
+    uint32_t *alone = malloc(capacity * sizeof(uint32_t));
+    uint8_t *t2count = calloc(capacity, sizeof(uint8_t));
+    uint64_t *t2hash = calloc(capacity, sizeof(uint64_t));
+    if (!order || !order_slot || !alone || !t2count || !t2hash) {
+        free(order); free(order_slot); free(alone); free(t2count); free(t2hash);
+        return -ENOMEM;
+    }
+
+    uint64_t seed_state = 0x726b2b9d438b9d4dULL;
+    uint32_t h012[5];
+    int res = -1;
+    for (int attempt=0; attempt < MAX_BUILD_ATTEMPTS; attempt++) {
+        header->seed = fuse_next_seed(&seed_state);
+        memset(t2count, 0, capacity);
+        memset(t2hash, 0, capacity * sizeof(uint64_t));
+
+        // Map every key onto its 3 slots
+        int error = 0;
+        for (uint32_t i=0; i < size; i++) {
+            uint64_t hash = fuse_mix(hashes[i] + header->seed);
+            for (int j=0; j < 3; j++) {
+                uint32_t h = fuse_slot(j, hash, header);
+                t2count[h] += 4;
+                t2count[h] ^= j;
+                t2hash[h] ^= hash;
+                error |= (t2count[h] < 4);
+            }
+        }
+        if (error) continue;
+
+        // Peel off the slots with a single key
+        uint32_t qsize = 0;
+        for (uint32_t i=0; i < capacity; i++) {
+            alone[qsize] = i;
+            qsize += ((t2count[i] >> 2) == 1) ? 1 : 0;
+        }
+        uint32_t stack_size = 0;
+        while (qsize > 0) {
+            uint32_t index = alone[--qsize];
+            if ((t2count[index] >> 2) != 1) continue;
+
+            uint64_t hash = t2hash[index];
+            uint8_t found = t2count[index] & 3;
+            h012[0] = fuse_slot(0, hash, header);
+            h012[1] = fuse_slot(1, hash, header);
+            h012[2] = fuse_slot(2, hash, header);
+            h012[3] = h012[0];
+            h012[4] = h012[1];
+            order_slot[stack_size] = found;
+            order[stack_size++] = hash;
+
+            // Remove the key from its other slots
+            for (int j=1; j < 3; j++) {
+                uint32_t other = h012[found + j];
+                alone[qsize] = other;
+                qsize += ((t2count[other] >> 2) == 2) ? 1 : 0;
+                t2count[other] -= 4;
+                t2count[other] ^= (found + j) % 3;
+                t2hash[other] ^= hash;
+            }
+        }
+
+        // Every key must be peeled, otherwise try another seed
+        if (stack_size == size) {
+            res = 0;
+            break;
+        }
+    }
+
+    // Assign the fingerprints in reverse peeling order
+    if (!res) {
+        memset(filter->fingerprints, 0, (uint64_t)capacity * (bits / 8));
+        for (uint32_t i = size; i > 0; i--) {
+            uint64_t hash = order[i-1];
+            uint8_t found = order_slot[i-1];
+            h012[0] = fuse_slot(0, hash, header);
+            h012[1] = fuse_slot(1, hash, header);
+            h012[2] = fuse_slot(2, hash, header);
+            h012[3] = h012[0];
+            h012[4] = h012[1];
+            fuse_set(filter, h012[found], fuse_fingerprint(hash, bits) ^
+                fuse_get(filter, h012[found + 1]) ^ fuse_get(filter, h012[found + 2]));
+        }
+        header->magic = FUSE_MAGIC;
+    } else {
+        syslog(LOG_ERR, "Failed to build fuse filter of %u keys!", size);
+    }
+
+    free(order);
+    free(order_slot);
+    free(alone);
+    free(t2count);
+    free(t2hash);
+    return res;
+}
+
+/**
+ * Loads an existing fuse filter from a bitmap.
+ * @arg map A bloom_bitmap pointer.
+ * @arg filter The filter to setup
+ * @return 0 for success. Negative for error.
+ */
+int fuse_from_bitmap(bloom_bitmap *map, bloom_fuse *filter) {
+    // Check our args
+    if (map == NULL) {
+        return -EINVAL;
+    }
+
+    // Check the size of the map
+    if (map->size < sizeof(bloom_fuse_header)) {
+        return -ENOMEM;
+    }
+
+    bloom_fuse_header *header = (bloom_fuse_header*)map->mmap;
+    if (header->magic != FUSE_MAGIC) {
+        syslog(LOG_ERR, "Magic byte for fuse filter is wrong! Aborting load.");
+        return -1;
+    }
+    if (header->fingerprint_bits != 8 && header->fingerprint_bits != 16) {
+        syslog(LOG_ERR, "Fuse filter has invalid fingerprint size! Aborting load.");
+        return -1;
+    }
+    if (map->size < sizeof(bloom_fuse_header) +
+            (uint64_t)header->array_length * (header->fingerprint_bits / 8)) {
+        syslog(LOG_ERR, "Fuse filter is truncated! Aborting load.");
+        return -1;
+    }
+
+    filter->map = map;
+    filter->header = header;
+    filter->fingerprints = map->mmap + sizeof(bloom_fuse_header);
+    return 0;
+}
+
+/**
+ * Checks the filter for a key
+ * @arg filter The filter to check
+ * @arg key The key to check
+ * @returns 1 if present, 0 if not present.
+ */
+int fuse_contains(bloom_fuse *filter, char *key) {
+    return fuse_contains_hash(filter, fuse_hash_key(key));
+}
+
+/**
+ * Checks the filter for a key hash
+ * @arg filter The filter to check
+ * @arg hash The hash from fuse_hash_key
+ * @returns 1 if present, 0 if not present.
+ */
+int fuse_contains_hash(bloom_fuse *filter, uint64_t hash) {
+    bloom_fuse_header *header = filter->header;
+    uint64_t h = fuse_mix(hash + header->seed);
+    uint32_t f = fuse_fingerprint(h, header->fingerprint_bits);
+    f ^= fuse_get(filter, fuse_slot(0, h, header));
+    f ^= fuse_get(filter, fuse_slot(1, h, header));
+    f ^= fuse_get(filter, fuse_slot(2, h, header));
+    return f == 0;
+}
+
+/**
+ * Returns the size of the fuse filter in item count
+ */
+uint64_t fuse_size(bloom_fuse *filter) {
+    return filter->header->count;
+}
+
+/**
+ * Flushes the filter.
+ * @return 0 on success, negative on failure.
+ */
+int fuse_flush(bloom_fuse *filter) {
+    // Flush the bitmap if we have one
+    if (filter == NULL || filter->map == NULL) {
+        return -1;
+    }
+    return bitmap_flush(filter->map);
+}
+
+/**
+ * Flushes and closes the filter. Closes the underlying bitmap,
+ * but does not free it.
+ * @return 0 on success, negative on failure.
+ */
+int fuse_close(bloom_fuse *filter) {
+    // Make sure we have a filter
+    if (filter == NULL || filter->map == NULL) {
+        return -1;
+    }
+
+    // Clean up the map
+    bitmap_close(filter->map);
+    filter->map = NULL;
+    filter->header = NULL;
+    filter->fingerprints = NULL;
+    return 0;
+}
+
+/**
+ * Computes the segment length and count for a number of keys.
+ * Segments are sized so that 3 consecutive segments hold the
+ * slots of each key, and ~1.13x as many slots as keys suffice
+ * for large filters.
+ */
+static void fuse_params(uint64_t count, uint32_t *segment_length, uint32_t *segment_count) {
+    uint32_t length = 4;
+    double size_factor = 1.125;
+    if (count > 1) {
+        length = (uint32_t)1 << (int)floor(log((double)count) / log(3.33) + 2.25);
+        if (length > MAX_SEGMENT_LENGTH) length = MAX_SEGMENT_LENGTH;
+        double factor = 0.875 + 0.25 * log(1000000.0) / log((double)count);
+        if (factor > size_factor) size_factor = factor;
+    }
+
+    uint64_t capacity = (count > 1) ? (uint64_t)round(count * size_factor) : 0;
+    uint64_t segments = (capacity + length - 1) / length;
+    *segment_length = length;
+    *segment_count = (segments > 2) ? segments - 2 : 1;
+}
+
+/**
+ * Murmur3 finalizer, mixes the key hash with the seed
+ */
+static inline uint64_t fuse_mix(uint64_t h) {
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+/**
+ * Splitmix64, generates the seeds to try
+ */
+static inline uint64_t fuse_next_seed(uint64_t *state) {
+    uint64_t z = (*state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+static inline uint32_t fuse_fingerprint(uint64_t hash, uint32_t bits) {
+    return (uint32_t)(hash ^ (hash >> 32)) & ((1U << bits) - 1);
+}
+
+static inline uint32_t fuse_get(bloom_fuse *filter, uint32_t slot) {
+    if (filter->header->fingerprint_bits == 8)
+        return filter->fingerprints[slot];
+    return ((uint16_t*)filter->fingerprints)[slot];
+}
+
+static inline void fuse_set(bloom_fuse *filter, uint32_t slot, uint32_t fp) {
+    if (filter->header->fingerprint_bits == 8)
+        filter->fingerprints[slot] = fp;
+    else
+        ((uint16_t*)filter->fingerprints)[slot] = fp;
+}
+
+/**
+ * Computes one of the 3 slots of a key. The first slot picks
+ * a segment, and each slot lies in one of 3 consecutive segments.
+ */
+static inline uint32_t fuse_slot(int index, uint64_t hash, bloom_fuse_header *header) {
+    uint64_t segments_length = (uint64_t)header->segment_count * header->segment_length;
+    uint64_t h = (uint64_t)(((__uint128_t)hash * segments_length) >> 64);
+    h += index * header->segment_length;
+    uint64_t hh = hash & ((1ULL << 36) - 1);
+    h ^= (hh >> (36 - 18 * index)) & (header->segment_length - 1);
+    return (uint32_t)h;
+}
+
+static int cmp_hashes(const void *a, const void *b) {
+    uint64_t x = *(uint64_t*)a, y = *(uint64_t*)b;
+    return (x > y) - (x < y);
+}
@@ -0,0 +1,123 @@
+#ifndef BLOOM_FUSE_H
+#define BLOOM_FUSE_H
+#include <stdlib.h>
+#include <inttypes.h>
+#include <errno.h>
+#include "bitmap.h"
+
+/**
+ * Binary fuse filters (Graf and Lemire) are static filters
+ * that are built once from a complete set of keys. With 8 bit
+ * fingerprints they use about 9 bits per key for a false
+ * positive rate of 1/256, and with 16 bit fingerprints about
+ * 18 bits per key for 1/65536. A lookup is always 3 probes.
+ */
+#define FUSE_MAGIC 0xCF05E8DD   // Vaguely like CFUSE8DD
+struct bloom_fuse_header {
+    uint32_t magic;                 // Magic 4 bytes
+    uint32_t segment_length;        // Slots per segment, a power of 2
+    uint64_t seed;                  // Seed that made the keys peelable
+    uint32_t segment_count;         // Number of segments
+    uint32_t array_length;          // Number of fingerprints
+    uint64_t count;                 // Count of items
+    uint32_t fingerprint_bits;      // 8 or 16
+    char __buf[28];                 // Pad out to 64 bytes
+} __attribute__ ((packed));
+typedef struct bloom_fuse_header bloom_fuse_header;
+
+/*
+ * This is the struct we use to represent a fuse filter.
+ */
+typedef struct {
+    bloom_fuse_header *header;      // Pointer to the header in the bitmap region
+    bloom_bitmap *map;              // Underlying bitmap
+    unsigned char *fingerprints;    // Fingerprints following the header
+} bloom_fuse;
+
+/**
+ * Hashes a key for use with a fuse filter.
+ * @arg key The key to hash
+ * @return The 64bit hash of the key
+ */
+uint64_t fuse_hash_key(char *key);
+
+/**
+ * Sorts a list of key hashes and removes any duplicates,
+ * which must be done before building a filter.
+ * @arg hashes The key hashes, modified in place
+ * @arg count The number of hashes
+ * @return The number of unique hashes
+ */
+uint64_t fuse_unique_hashes(uint64_t *hashes, uint64_t count);
+
+/**
+ * Computes the size of the bitmap needed to
+ * build a fuse filter, including the header.
+ * @arg count The number of unique keys
+ * @arg bits The fingerprint size, 8 or 16
+ * @return The size in bytes
+ */
+uint64_t fuse_bytes_for_count(uint64_t count, int bits);
+
+/**
+ * Picks the smallest fingerprint size that has a
+ * false positive rate no more than a given rate.
+ * @arg fp_prob The false positive probability
+ * @return 8 or 16
+ */
+int fuse_bits_for_prob(double fp_prob);
+
+/**
+ * Builds a new fuse filter in a bitmap.
+ * @arg map A bloom_bitmap of at least fuse_bytes_for_count bytes
+ * @arg hashes The unique key hashes. Reordered.
+ * @arg count The number of hashes
+ * @arg bits The fingerprint size, 8 or 16
+ * @arg filter The filter to setup
+ * @return 0 for success. Negative for error.
+ */
+int fuse_build(bloom_bitmap *map, uint64_t *hashes, uint64_t count, int bits, bloom_fuse *filter);
+
+/**
+ * Loads an existing fuse filter from a bitmap.
+ * @arg map A bloom_bitmap pointer.
+ * @arg filter The filter to setup
+ * @return 0 for success. Negative for error.
+ */
+int fuse_from_bitmap(bloom_bitmap *map, bloom_fuse *filter);
+
+/**
+ * Checks the filter for a key
+ * @arg filter The filter to check
+ * @arg key The key to check
+ * @returns 1 if present, 0 if not present.
+ */
+int fuse_contains(bloom_fuse *filter, char *key);
+
+/**
+ * Checks the filter for a key hash
+ * @arg filter The filter to check
+ * @arg hash The hash from fuse_hash_key
+ * @returns 1 if present, 0 if not present.
+ */
+int fuse_contains_hash(bloom_fuse *filter, uint64_t hash);
+
+/**
+ * Returns the size of the fuse filter in item count
+ */
+uint64_t fuse_size(bloom_fuse *filter);
+
+/**
+ * Flushes the filter.
+ * @return 0 on success, negative on failure.
+ */
+int fuse_flush(bloom_fuse *filter);
+
+/**
+ * Flushes and closes the filter. Closes the underlying bitmap,
+ * but does not free it.
+ * @return 0 on success, negative on failure.
+ */
+int fuse_close(bloom_fuse *filter);
+
+#endif
@@ -10,6 +10,29 @@
 static int sbf_append_filter(bloom_sbf *sbf);
 static void sbf_init_capacities(bloom_sbf *sbf);
 static double sbf_inital_probability(double fp_prob, double r);
+static uint32_t sbf_max_k_num(bloom_sbf *sbf);
+static int sbf_check_hashes(bloom_sbf *sbf, uint64_t *hashes, uint32_t k_num,
+        int num_keys, char *result);
+
+/**
+ * How many keys ahead of the current one
+ * sbf_add_keys prefetches the bits of
+ */
+#define SBF_PREFETCH_KEYS 4
+
+/**
+ * Batches of at least this many keys have their
+ * probes sorted by location for filters of at
+ * least sort_min_bytes.
+ */
+#define SBF_SORT_MIN_KEYS 1024
+
+/**
+ * New filters are only sized from the history
+ * once it covers at least this many seconds,
+ * so the first burst of keys is not taken as a rate.
+ */
+#define SBF_HISTORY_MIN_SECS 60
 
 int sbf_from_filters(bloom_sbf_params *params,
                      bloom_sbf_callback cb,
@@ -24,6 +47,8 @@ int sbf_from_filters(bloom_sbf_params *params,
     // Set the callback and its args
     sbf->callback = cb;
     sbf->callback_input = cb_in;
+    sbf->grow_callback = NULL;
+    sbf->sort_min_bytes = SBF_SORT_MIN_BYTES;
 
     // Copy the filters
     if (num_filters > 0) {
@@ -80,6 +105,90 @@ int sbf_add(bloom_sbf *sbf, char* key) {
     return res;
 }
 
+/**
+ * Adds many keys to the bloom filter. The keys are all hashed
+ * up front, and the bits of the next few keys are prefetched
+ * while each key is added, so the memory stalls overlap.
+ * @arg sbf The filter to add to
+ * @arg keys The keys to add
+ * @arg num_keys The number of keys
+ * @arg result Set to 1 for each key added, 0 if present
+ * @returns 0 on success. Negative on failure, with the
+ * results set for the keys before the failure.
+ */
+int sbf_add_keys(bloom_sbf *sbf, char **keys, int num_keys, char *result) {
+    if (num_keys == 0) return 0;
+
+    // Hashes are a prefix of those for a larger k_num,
+    // so hash once for the filter using the most
+    uint32_t k_num = sbf_max_k_num(sbf);
+    uint64_t *hashes = malloc(num_keys * k_num * sizeof(uint64_t));
+    if (!hashes) return -ENOMEM;
+    for (int i=0; i < num_keys; i++) {
+        bf_compute_hashes(k_num, keys[i], hashes + i * k_num);
+    }
+
+    // Large batches find the keys already present with
+    // sorted probes. Those that are not may still be added
+    // by an earlier key of the batch, so are checked again.
+    int res = 0, present;
+    char *found = NULL;
+    if (num_keys >= SBF_SORT_MIN_KEYS && sbf->filters[0]->map->size >= sbf->sort_min_bytes) {
+        found = malloc(num_keys);
+        if (!found || (res = sbf_check_hashes(sbf, hashes, k_num, num_keys, found))) {
+            free(found);
+            free(hashes);
+            return found ? res : -ENOMEM;
+        }
+    }
+    for (int i=0; i < num_keys && i < SBF_PREFETCH_KEYS; i++) {
+        bf_prefetch_hashes(sbf->filters[0], hashes + i * k_num);
+    }
+
+    uint64_t *key_hashes;
+    for (int i=0; i < num_keys; i++) {
+        if (i + SBF_PREFETCH_KEYS < num_keys) {
+            bf_prefetch_hashes(sbf->filters[0], hashes + (i + SBF_PREFETCH_KEYS) * k_num);
+        }
+        key_hashes = hashes + i * k_num;
+        if (found && found[i]) {
+            result[i] = 0;
+            continue;
+        }
+
+        // Check if the key is contained first
+        present = 0;
+        for (uint32_t j=0; j < sbf->num_filters && !present; j++) {
+            present = bf_contains_hashes(sbf->filters[j], key_hashes);
+        }
+        if (present) {
+            result[i] = 0;
+            continue;
+        }
+
+        // Check if we are over capacity. A new filter
+        // may need more hashes than we computed.
+        if (bf_size(sbf->filters[0]) >= sbf->capacities[0]) {
+            res = sbf_append_filter(sbf);
+            if (res != 0) break;
+            if (sbf->filters[0]->header->k_num > k_num) {
+                free(found);
+                free(hashes);
+                res = sbf_add_keys(sbf, keys + i, num_keys - i, result + i);
+                return res;
+            }
+        }
+
+        // Mark as dirty, add to the largest filter
+        sbf->dirty_filters[0] = 1;
+        result[i] = bf_add_hashes(sbf->filters[0], key_hashes);
+    }
+
+    free(found);
+    free(hashes);
+    return res;
+}
+
 /**
  * Checks the filter for a key
  * @arg sbf The filter to check
@@ -96,6 +205,30 @@ int sbf_contains(bloom_sbf *sbf, char* key) {
     return 0;
 }
 
+/**
+ * Checks the filter for many keys. The keys are all hashed
+ * up front, and each filter is checked in turn for the keys
+ * not yet found. For large batches against large filters, the
+ * probes are sorted by location so the pages are walked in order.
+ * @arg sbf The filter to check
+ * @arg keys The keys to check
+ * @arg num_keys The number of keys
+ * @arg result Set to 1 for each key present, 0 if not
+ * @returns 0 on success, negative on error.
+ */
+int sbf_contains_keys(bloom_sbf *sbf, char **keys, int num_keys, char *result) {
+    if (num_keys == 0) return 0;
+    uint32_t k_num = sbf_max_k_num(sbf);
+    uint64_t *hashes = malloc(num_keys * k_num * sizeof(uint64_t));
+    if (!hashes) return -ENOMEM;
+    for (int i=0; i < num_keys; i++) {
+        bf_compute_hashes(k_num, keys[i], hashes + i * k_num);
+    }
+    int res = sbf_check_hashes(sbf, hashes, k_num, num_keys, result);
+    free(hashes);
+    return res;
+}
+
 /**
  * Returns the size of the bloom filter in item count
  */
@@ -163,10 +296,91 @@ int sbf_close(bloom_sbf *sbf) {
     sbf->num_filters = 0;
     sbf->callback = NULL;
     sbf->callback_input = NULL;
+    sbf->grow_callback = NULL;
 
     return res;
 }
 
+/**
+ * Replaces one of the filters of the SBF, for example with a
+ * folded copy. The old filter and its bitmap are closed and freed.
+ * @arg sbf The SBF
+ * @arg idx The index of the filter to replace
+ * @arg filter The new filter. Its capacity is read from the header
+ * if set, otherwise the old capacity is kept.
+ * @return 0 on success, negative on failure.
+ */
+int sbf_replace_filter(bloom_sbf *sbf, uint32_t idx, bloom_bloomfilter *filter) {
+    if (sbf == NULL || filter == NULL || idx >= sbf->num_filters) {
+        return -1;
+    }
+
+    bloom_bloomfilter *old = sbf->filters[idx];
+    bloom_bitmap *map = old->map;
+    int res = bf_close(old);
+    free(old);
+    free(map);
+
+    sbf->filters[idx] = filter;
+    sbf->dirty_filters[idx] = 1;
+    if (filter->header->capacity) {
+        sbf->capacities[idx] = filter->header->capacity;
+    }
+    return res;
+}
+
+/**
+ * Adds a period of inserts to the history of an SBF.
+ * Both sums decay by e^(-t/horizon), with the seconds
+ * integrated over the period, so a long period decays the
+ * same as many short ones. The keys are taken as added at
+ * the end of the period.
+ * @arg history The history to update
+ * @arg horizon The seconds over which old inserts decay
+ * @arg keys The keys added in the period
+ * @arg secs The length of the period in seconds
+ */
+void sbf_record_history(bloom_sbf_history *history, double horizon, uint64_t keys, double secs) {
+    if (secs < 0) secs = 0;
+    if (horizon > 0) {
+        double decay = exp(-secs / horizon);
+        history->keys = history->keys * decay + keys;
+        history->secs = history->secs * decay + horizon * (1 - decay);
+    } else {
+        history->keys += keys;
+        history->secs += secs;
+    }
+    history->age += secs;
+}
+
+/**
+ * Sizes the next filter of an SBF for the keys expected before
+ * the horizon, at the recent insert rate. Once the SBF is older
+ * than the horizon, as many keys are expected as it has seen,
+ * so filters still grow geometrically. The capacity is at least
+ * the initial capacity, and at most the cube of the scale size
+ * times the last filter, so a burst cannot size a huge filter.
+ * @arg sbf The SBF
+ * @arg history The insert history of the SBF
+ * @arg horizon The seconds the SBF is expected to take keys for
+ * @return The capacity, or 0 to scale by scale_size if there
+ * is too little history.
+ */
+uint64_t sbf_growth_capacity(bloom_sbf *sbf, bloom_sbf_history *history, double horizon) {
+    if (horizon <= 0 || sbf->num_filters == 0 || history->age < SBF_HISTORY_MIN_SECS) {
+        return 0;
+    }
+    double rate = history->keys / history->secs;
+    double remaining = (history->age < horizon) ? horizon - history->age : history->age;
+    double capacity = rate * remaining;
+
+    double scale = sbf->params.scale_size;
+    double most = (double)sbf->capacities[0] * scale * scale * scale;
+    if (capacity > most) capacity = most;
+    if (capacity < sbf->params.initial_capacity) capacity = sbf->params.initial_capacity;
+    return capacity;
+}
+
 /**
  * Returns the total capacity of the SBF currently.
  */
@@ -191,6 +405,18 @@ uint64_t sbf_total_byte_size(bloom_sbf *sbf) {
     return size;
 }
 
+/**
+ * Returns an estimate of the bytes a flush of the SBF would write.
+ */
+uint64_t sbf_dirty_bytes(bloom_sbf *sbf) {
+    uint64_t size = 0;
+    for (uint32_t i=0;i<sbf->num_filters;i++) {
+        if (sbf->dirty_filters[i] == 1)
+            size += bitmap_dirty_bytes(sbf->filters[i]->map);
+    }
+    return size;
+}
+
 /**
  * Appends a new filter to the SBF
  */
@@ -199,8 +425,15 @@ static int sbf_append_filter(bloom_sbf *sbf) {
     uint64_t capacity = sbf->params.initial_capacity;
     double fp_prob = sbf_inital_probability(sbf->params.fp_probability, sbf->params.probability_reduction);
 
-    // Get the settings for the new filter
-    capacity *= pow(sbf->params.scale_size, sbf->num_filters);
+    // Get the settings for the new filter. Scale from the last
+    // filter, since it may have been folded to a smaller capacity
+    if (sbf->num_filters > 0) {
+        capacity = sbf->capacities[0] * sbf->params.scale_size;
+        if (sbf->grow_callback) {
+            uint64_t grown = sbf->grow_callback(sbf->callback_input, sbf);
+            if (grown) capacity = grown;
+        }
+    }
     fp_prob *= pow(sbf->params.probability_reduction, sbf->num_filters);
 
     // Compute the new parameters
@@ -232,6 +465,7 @@ static int sbf_append_filter(bloom_sbf *sbf) {
         free(map);
         return res;
     }
+    filter->header->capacity = capacity;
 
     // Hold onto the old filters and dirty state
     bloom_bloomfilter **old_filters = sbf->filters;
@@ -280,8 +514,70 @@ static void sbf_init_capacities(bloom_sbf *sbf) {
     uint64_t capacity;
 
     for (uint32_t i=0;i<sbf->num_filters;i++) {
+        // Use the capacity in the header, unless the
+        // filter was created before it was stored
+        if (sbf->filters[i]->header->capacity) {
+            sbf->capacities[i] = sbf->filters[i]->header->capacity;
+            continue;
+        }
+
         // Compute the capacity of the ith filter
         capacity = init_capacity * pow(sbf->params.scale_size, (sbf->num_filters - i - 1));
         sbf->capacities[i] = capacity;
     }
 }
+
+/**
+ * Returns the largest k_num of the filters. This is at
+ * least 4, since bf_compute_hashes always writes 4 hashes.
+ */
+static uint32_t sbf_max_k_num(bloom_sbf *sbf) {
+    uint32_t k_num = 4;
+    for (uint32_t i=0;i<sbf->num_filters;i++) {
+        if (sbf->filters[i]->header->k_num > k_num)
+            k_num = sbf->filters[i]->header->k_num;
+    }
+    return k_num;
+}
+
+/**
+ * Checks each filter for the hashed keys not yet found,
+ * sorting the probes if there are enough keys and the
+ * filter is large.
+ * @arg hashes K num hashes for each key
+ * @arg result Set to 1 for each key present, 0 if not
+ * @return 0 on success, negative on error.
+ */
+static int sbf_check_hashes(bloom_sbf *sbf, uint64_t *hashes, uint32_t k_num,
+        int num_keys, char *result) {
+    uint32_t *missing = malloc(num_keys * sizeof(uint32_t));
+    if (!missing) return -ENOMEM;
+    for (int i=0; i < num_keys; i++) {
+        missing[i] = i;
+        result[i] = 0;
+    }
+
+    int res = 0;
+    uint32_t num_missing = num_keys, left;
+    bloom_bloomfilter *filter;
+    for (uint32_t j=0; j < sbf->num_filters && num_missing; j++) {
+        filter = sbf->filters[j];
+        if (num_missing >= SBF_SORT_MIN_KEYS && filter->map->size >= sbf->sort_min_bytes) {
+            res = bf_contains_sorted(filter, hashes, k_num, missing, num_missing, result);
+            if (res) break;
+        } else {
+            for (uint32_t i=0; i < num_missing; i++) {
+                result[missing[i]] = bf_contains_hashes(filter, hashes + missing[i] * k_num);
+            }
+        }
+
+        // Keep the keys that are still missing
+        left = 0;
+        for (uint32_t i=0; i < num_missing; i++) {
+            if (!result[missing[i]]) missing[left++] = missing[i];
+        }
+        num_missing = left;
+    }
+    free(missing);
+    return res;
+}
@@ -10,6 +10,15 @@
  */
 typedef int(*bloom_sbf_callback)(void* in, uint64_t bytes, bloom_bitmap *out);
 
+struct bloom_sbf;
+
+/**
+ * Defines a callback function that picks the capacity of a
+ * new filter. It takes the callback input and the SBF, and
+ * returns the capacity, or 0 to scale by scale_size.
+ */
+typedef uint64_t(*bloom_sbf_grow_callback)(void* in, struct bloom_sbf *sbf);
+
 /**
  * The parameters to configure a scalable bloom filter.
  * See DEFAULT_PARAMS and SLOW_GROW_PARAMS.
@@ -41,13 +50,32 @@ typedef struct {
 #define SBF_SLOW_GROW_PARAMS {1e5, 1e-4, 2, 0.8}
 
 /**
- * Represents a scalable bloom filters
+ * The insert history of a scalable bloom filter, used to size
+ * new filters for the keys still to come. The keys and seconds
+ * decay with their age, so their ratio is the recent insert rate.
  */
 typedef struct {
+    double keys;        // Keys added, decayed by age
+    double secs;        // Seconds observed, decayed by age
+    double age;         // Seconds observed in total
+} bloom_sbf_history;
+
+/**
+ * Large batches have their probes sorted by location for
+ * filters of at least this many bytes. Smaller filters are
+ * likely to be resident, so sorting is a waste.
+ */
+#define SBF_SORT_MIN_BYTES (64 * 1024 * 1024)
+
+/**
+ * Represents a scalable bloom filters
+ */
+typedef struct bloom_sbf {
     bloom_sbf_params params;              // Our parameters
 
     bloom_sbf_callback callback;    // Callback, or NULL for auto
     void *callback_input;           // Callback input if any
+    bloom_sbf_grow_callback grow_callback;  // Sizes new filters, or NULL to scale
 
     uint32_t num_filters;           // The number of filters
     bloom_bloomfilter **filters;     // Array into the filters
@@ -55,6 +83,7 @@ typedef struct {
     unsigned char *dirty_filters;   // Used to set a dirty flag
 
     uint64_t *capacities;            // Tracks the per-filter capacity
+    uint64_t sort_min_bytes;        // Smallest filter probed in sorted order
 } bloom_sbf;
 
 /**
@@ -83,6 +112,32 @@ int sbf_from_filters(bloom_sbf_params *params,
  */
 int sbf_add(bloom_sbf *sbf, char* key);
 
+/**
+ * Adds many keys to the bloom filter. The keys are all hashed
+ * up front, and the bits of the next few keys are prefetched
+ * while each key is added, so the memory stalls overlap.
+ * @arg sbf The filter to add to
+ * @arg keys The keys to add
+ * @arg num_keys The number of keys
+ * @arg result Set to 1 for each key added, 0 if present
+ * @returns 0 on success. Negative on failure, with the
+ * results set for the keys before the failure.
+ */
+int sbf_add_keys(bloom_sbf *sbf, char **keys, int num_keys, char *result);
+
+/**
+ * Checks the filter for many keys. The keys are all hashed
+ * up front, and each filter is checked in turn for the keys
+ * not yet found. For large batches against large filters, the
+ * probes are sorted by location so the pages are walked in order.
+ * @arg sbf The filter to check
+ * @arg keys The keys to check
+ * @arg num_keys The number of keys
+ * @arg result Set to 1 for each key present, 0 if not
+ * @returns 0 on success, negative on error.
+ */
+int sbf_contains_keys(bloom_sbf *sbf, char **keys, int num_keys, char *result);
+
 /**
  * Checks the filter for a key
  * @arg sbf The filter to check
@@ -110,6 +165,41 @@ int sbf_flush(bloom_sbf *sbf);
 
 int sbf_close(bloom_sbf *sbf);
 
+/**
+ * Replaces one of the filters of the SBF, for example with a
+ * folded copy. The old filter and its bitmap are closed and freed.
+ * @arg sbf The SBF
+ * @arg idx The index of the filter to replace
+ * @arg filter The new filter. Its capacity is read from the header
+ * if set, otherwise the old capacity is kept.
+ * @return 0 on success, negative on failure.
+ */
+int sbf_replace_filter(bloom_sbf *sbf, uint32_t idx, bloom_bloomfilter *filter);
+
+/**
+ * Adds a period of inserts to the history of an SBF.
+ * @arg history The history to update
+ * @arg horizon The seconds over which old inserts decay
+ * @arg keys The keys added in the period
+ * @arg secs The length of the period in seconds
+ */
+void sbf_record_history(bloom_sbf_history *history, double horizon, uint64_t keys, double secs);
+
+/**
+ * Sizes the next filter of an SBF for the keys expected before
+ * the horizon, at the recent insert rate. Once the SBF is older
+ * than the horizon, as many keys are expected as it has seen,
+ * so filters still grow geometrically. The capacity is at least
+ * the initial capacity, and at most the cube of the scale size
+ * times the last filter, so a burst cannot size a huge filter.
+ * @arg sbf The SBF
+ * @arg history The insert history of the SBF
+ * @arg horizon The seconds the SBF is expected to take keys for
+ * @return The capacity, or 0 to scale by scale_size if there
+ * is too little history.
+ */
+uint64_t sbf_growth_capacity(bloom_sbf *sbf, bloom_sbf_history *history, double horizon);
+
 /**
  * Returns the total capacity of the SBF currently.
  */
@@ -120,4 +210,9 @@ uint64_t sbf_total_capacity(bloom_sbf *sbf);
  */
 uint64_t sbf_total_byte_size(bloom_sbf *sbf);
 
+/**
+ * Returns an estimate of the bytes a flush of the SBF would write.
+ */
+uint64_t sbf_dirty_bytes(bloom_sbf *sbf);
+
 #endif
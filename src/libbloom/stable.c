@@ -0,0 +1,265 @@
+#include <math.h>
+#include <inttypes.h>
+#include <string.h>
+#include <syslog.h>
+#include "bloom.h"
+#include "stable.h"
+
+/*
+ * Static definitions
+ */
+static const uint64_t RAND_SEED = 0x9E3779B97F4A7C15ULL;
+
+/*
+ * Static declarations
+ */
+static int stable_internal_contains(bloom_stable *filter, uint64_t *hashes);
+static inline int stable_get_cell(bloom_stable *filter, uint64_t cell);
+static inline void stable_set_cell(bloom_stable *filter, uint64_t cell, int value);
+static inline uint64_t stable_next_rand(bloom_stable_header *header);
+
+/**
+ * Creates a new stable bloom filter using a given bitmap.
+ * @arg map A bloom_bitmap pointer.
+ * @arg params The parameters to use. Ignored unless new_filter is set.
+ * @arg new_filter 1 if new, sets the magic byte and does not check it.
+ * @arg filter The filter to setup
+ * @return 0 for success. Negative for error.
+ */
+int stable_from_bitmap(bloom_bitmap *map, bloom_stable_params *params, int new_filter, bloom_stable *filter) {
+    // Check our args
+    if (map == NULL || (new_filter && (params == NULL || params->k_num < 1 || params->p_num < 1))) {
+        return -EINVAL;
+    }
+
+    // Check the size of the map
+    if (map->size <= sizeof(bloom_stable_header)) {
+        return -ENOMEM;
+    }
+
+    // Setup the pointers
+    filter->map = map;
+    filter->header = (bloom_stable_header*)map->mmap;
+    filter->cells = (map->size - sizeof(bloom_stable_header)) * STABLE_CELLS_PER_BYTE;
+
+    // Setup the header if it is new
+    if (new_filter) {
+        filter->header->magic = STABLE_MAGIC;
+        filter->header->k_num = params->k_num;
+        filter->header->p_num = params->p_num;
+        filter->header->count = 0;
+        filter->header->capacity = params->capacity;
+        filter->header->rand_state = RAND_SEED;
+
+        // Force a flush of the headers, like bf_from_bitmap
+        stable_flush(filter);
+
+    // Check for the header if not new
+    } else if (filter->header->magic != STABLE_MAGIC) {
+        syslog(LOG_ERR, "Magic byte for stable bloom filter is wrong! Aborting load.");
+        return -1;
+    }
+    return 0;
+}
+
+/**
+ * Adds a new key to the stable bloom filter. This decays
+ * other keys, even if the key is already present.
+ * @arg filter The filter to add to
+ * @arg key The key to add
+ * @returns 1 if the key was added, 0 if present. Negative on failure.
+ */
+int stable_add(bloom_stable *filter, char* key) {
+    // Allocate the hash space
+    uint32_t k_num = filter->header->k_num;
+    uint64_t *hashes = alloca(BF_NUM_HASHES(k_num) * sizeof(uint64_t));
+
+    // Compute the hashes
+    bf_compute_hashes(k_num, key, hashes);
+    int res = stable_internal_contains(filter, hashes);
+
+    // Decay P consecutive counters from a random start
+    uint64_t cell = stable_next_rand(filter->header) % filter->cells;
+    int value;
+    for (uint32_t i=0; i < filter->header->p_num; i++) {
+        value = stable_get_cell(filter, cell);
+        if (value) stable_set_cell(filter, cell, value - 1);
+        if (++cell == filter->cells) cell = 0;
+    }
+
+    // Refresh the counters of our key
+    for (uint32_t i=0; i < k_num; i++) {
+        cell = hashes[i] % filter->cells;
+        if (stable_get_cell(filter, cell) != STABLE_CELL_MAX)
+            stable_set_cell(filter, cell, STABLE_CELL_MAX);
+    }
+
+    if (res == 1) return 0;
+    filter->header->count += 1;
+    return 1;
+}
+
+/**
+ * Checks the filter for a key
+ * @arg filter The filter to check
+ * @arg key The key to check
+ * @returns 1 if present, 0 if not present, negative on error.
+ */
+int stable_contains(bloom_stable *filter, char* key) {
+    // Allocate the hash space
+    uint64_t *hashes = alloca(BF_NUM_HASHES(filter->header->k_num) * sizeof(uint64_t));
+
+    // Compute the hashes
+    bf_compute_hashes(filter->header->k_num, key, hashes);
+    return stable_internal_contains(filter, hashes);
+}
+
+/**
+ * Returns the number of new items that were added
+ */
+uint64_t stable_size(bloom_stable *filter) {
+    return filter->header->count;
+}
+
+/**
+ * Returns the number of recent items the filter retains
+ */
+uint64_t stable_capacity(bloom_stable *filter) {
+    return filter->header->capacity;
+}
+
+/**
+ * Flushes the filter, and updates the metadata.
+ * @return 0 on success, negative on failure.
+ */
+int stable_flush(bloom_stable *filter) {
+    // Flush the bitmap if we have one
+    if (filter == NULL || filter->map == NULL) {
+        return -1;
+    }
+    return bitmap_flush(filter->map);
+}
+
+/**
+ * Flushes and closes the filter. Closes the underlying bitmap,
+ * but does not free it.
+ * @return 0 on success, negative on failure.
+ */
+int stable_close(bloom_stable *filter) {
+    // Make sure we have a filter
+    if (filter == NULL || filter->map == NULL) {
+        return -1;
+    }
+
+    // Flush first
+    stable_flush(filter);
+
+    // Clean up the map
+    bitmap_close(filter->map);
+    filter->map = NULL;
+    filter->header = NULL;
+    filter->cells = 0;
+    return 0;
+}
+
+/*
+ * Expects capacity and probability to be set, and sets the
+ * bytes, k_num and p_num that should be used. P is chosen so
+ * that the false positive rate converges to the probability,
+ * and there are enough counters that a key is still present
+ * after capacity newer keys are added about 90% of the time.
+ * This byte size accounts for the headers we need.
+ * @return 0 on success, negative on error.
+ */
+int stable_params_for_capacity(bloom_stable_params *params) {
+    // Use the same k as a bloom filter
+    bloom_filter_params bf_params = {0, 0, params->capacity, params->fp_probability};
+    int res = bf_size_for_capacity_prob(&bf_params);
+    if (res != 0) return res;
+    res = bf_ideal_k_num(&bf_params);
+    if (res != 0) return res;
+    if (bf_params.k_num < 1) bf_params.k_num = 1;
+    double k = bf_params.k_num;
+
+    /*
+     * At the stable point, the false positive rate is
+     * (1 - (1 / (1 + 1 / (P * (1/k - 1/m))))^Max)^k
+     * which we solve for P given the probability, while
+     * ignoring the 1/m term which is tiny.
+     */
+    double zeroed = 1 - pow(params->fp_probability, 1 / k);
+    double p = 1 / ((1 / k) * (pow(zeroed, -1.0 / STABLE_CELL_MAX) - 1));
+    if (p < 1) p = 1;
+    p = round(p);
+
+    /*
+     * Each counter is decremented P/m times per add. A key is
+     * lost once one of its k counters is decremented Max times,
+     * so we find the largest mean number of decrements that loses
+     * a counter with probability at most 0.1/k, and size m so that
+     * is the mean after capacity adds.
+     */
+    double target = 0.1 / k;
+    double low = 0, high = STABLE_CELL_MAX;
+    for (int i=0; i < 50; i++) {
+        double lambda = (low + high) / 2;
+        double term = exp(-lambda), below = 0;
+        for (int j=0; j < STABLE_CELL_MAX; j++) {
+            below += term;
+            term *= lambda / (j + 1);
+        }
+        if (1 - below > target)
+            high = lambda;
+        else
+            low = lambda;
+    }
+    uint64_t cells = ceil(params->capacity * p / low);
+
+    params->k_num = bf_params.k_num;
+    params->p_num = p;
+    params->bytes = (cells + STABLE_CELLS_PER_BYTE - 1) / STABLE_CELLS_PER_BYTE;
+    params->bytes += sizeof(bloom_stable_header);
+    return 0;
+}
+
+/**
+ * Internal stable_contains method.
+ * @arg filter The filter
+ * @arg hashes Contains at least K num hashes
+ * @return 0 if not contained, 1 if contained.
+ */
+static int stable_internal_contains(bloom_stable *filter, uint64_t *hashes) {
+    for (uint32_t i=0; i < filter->header->k_num; i++) {
+        if (!stable_get_cell(filter, hashes[i] % filter->cells)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+static inline int stable_get_cell(bloom_stable *filter, uint64_t cell) {
+    unsigned char byte = filter->map->mmap[sizeof(bloom_stable_header) + cell / STABLE_CELLS_PER_BYTE];
+    return (byte >> ((cell % STABLE_CELLS_PER_BYTE) * STABLE_CELL_BITS)) & STABLE_CELL_MAX;
+}
+
+static inline void stable_set_cell(bloom_stable *filter, uint64_t cell, int value) {
+    uint64_t idx = sizeof(bloom_stable_header) + cell / STABLE_CELLS_PER_BYTE;
+    int shift = (cell % STABLE_CELLS_PER_BYTE) * STABLE_CELL_BITS;
+    unsigned char byte = filter->map->mmap[idx];
+    byte &= ~(STABLE_CELL_MAX << shift);
+    byte |= value << shift;
+    bitmap_setbyte(filter->map, idx, byte);
+}
+
+/**
+ * xorshift64*, the state is kept in the header
+ * so the decay continues where it left off
+ */
+static inline uint64_t stable_next_rand(bloom_stable_header *header) {
+    uint64_t x = header->rand_state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    header->rand_state = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
@@ -0,0 +1,118 @@
+#ifndef BLOOM_STABLE_H
+#define BLOOM_STABLE_H
+#include <stdlib.h>
+#include <inttypes.h>
+#include <errno.h>
+#include "bitmap.h"
+
+/**
+ * Stable bloom filters (Deng and Rafiei) hold a fixed
+ * number of small counters. Each add sets the k counters of
+ * the key to the maximum, and decrements P other counters,
+ * so that old keys are slowly forgotten. The false positive
+ * rate converges to a bound however many keys are added, at
+ * the cost of false negatives for keys that are not recent.
+ */
+#define STABLE_MAGIC 0xCB5AB1DD // Vaguely like CBSTABLEDD
+struct bloom_stable_header {
+    uint32_t magic;         // Magic 4 bytes
+    uint32_t k_num;         // K_num value
+    uint64_t count;         // Count of new items added
+    uint32_t p_num;         // Counters decremented per add
+    uint32_t __pad;
+    uint64_t capacity;      // Number of recent items to retain
+    uint64_t rand_state;    // Picks the counters to decrement
+    char __buf[472];        // Pad out to 512 bytes
+} __attribute__ ((packed));
+typedef struct bloom_stable_header bloom_stable_header;
+
+/**
+ * Counters are 4 bits each, packed 2 to a byte
+ */
+#define STABLE_CELL_BITS 4
+#define STABLE_CELL_MAX 15
+#define STABLE_CELLS_PER_BYTE 2
+
+/*
+ * This is the struct we use to represent a stable bloom filter.
+ */
+typedef struct {
+    bloom_stable_header *header;    // Pointer to the header in the bitmap region
+    bloom_bitmap *map;              // Underlying bitmap
+    uint64_t cells;                 // Number of counters
+} bloom_stable;
+
+/*
+ * Structure used to store the parameter information
+ * for configuring stable bloom filters.
+ */
+typedef struct {
+    uint64_t bytes;
+    uint32_t k_num;
+    uint32_t p_num;
+    uint64_t capacity;
+    double   fp_probability;
+} bloom_stable_params;
+
+/**
+ * Creates a new stable bloom filter using a given bitmap.
+ * @arg map A bloom_bitmap pointer.
+ * @arg params The parameters to use. Ignored unless new_filter is set.
+ * @arg new_filter 1 if new, sets the magic byte and does not check it.
+ * @arg filter The filter to setup
+ * @return 0 for success. Negative for error.
+ */
+int stable_from_bitmap(bloom_bitmap *map, bloom_stable_params *params, int new_filter, bloom_stable *filter);
+
+/**
+ * Adds a new key to the stable bloom filter. This decays
+ * other keys, even if the key is already present.
+ * @arg filter The filter to add to
+ * @arg key The key to add
+ * @returns 1 if the key was added, 0 if present. Negative on failure.
+ */
+int stable_add(bloom_stable *filter, char* key);
+
+/**
+ * Checks the filter for a key
+ * @arg filter The filter to check
+ * @arg key The key to check
+ * @returns 1 if present, 0 if not present, negative on error.
+ */
+int stable_contains(bloom_stable *filter, char* key);
+
+/**
+ * Returns the number of new items that were added
+ */
+uint64_t stable_size(bloom_stable *filter);
+
+/**
+ * Returns the number of recent items the filter retains
+ */
+uint64_t stable_capacity(bloom_stable *filter);
+
+/**
+ * Flushes the filter, and updates the metadata.
+ * @return 0 on success, negative on failure.
+ */
+int stable_flush(bloom_stable *filter);
+
+/**
+ * Flushes and closes the filter. Closes the underlying bitmap,
+ * but does not free it.
+ * @return 0 on success, negative on failure.
+ */
+int stable_close(bloom_stable *filter);
+
+/*
+ * Expects capacity and probability to be set, and sets the
+ * bytes, k_num and p_num that should be used. P is chosen so
+ * that the false positive rate converges to the probability,
+ * and there are enough counters that a key is still present
+ * after capacity newer keys are added about 90% of the time.
+ * This byte size accounts for the headers we need.
+ * @return 0 on success, negative on error.
+ */
+int stable_params_for_capacity(bloom_stable_params *params);
+
+#endif
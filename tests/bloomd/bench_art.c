@@ -0,0 +1,166 @@
+/*
+ * Measures the filter map with many filters. Builds an ART
+ * tree of filter names, copies it like the filter manager does
+ * at start, then times lookups of present and missing names in
+ * a random order, and churns the tree with deletes and inserts.
+ * Reports the time of each step and the memory of the trees,
+ * which share their leaves.
+ */
+#include <malloc.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "art.h"
+
+static int NUM_KEYS = 1000000;
+static int LOOKUPS = 2000000;
+static int ROUNDS = 3;
+
+#define NAME_LEN 48
+
+uint64_t nsec_since(struct timespec *t1) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - t1->tv_sec) * 1000000000ULL + (now.tv_nsec - t1->tv_nsec);
+}
+
+// Returns the bytes allocated on the heap
+uint64_t heap_bytes(void) {
+    struct mallinfo2 info = mallinfo2();
+    return info.uordblks + info.hblkhd;
+}
+
+/**
+ * Makes names like the filters of many tenants,
+ * in an order unrelated to their sort order.
+ */
+char **make_names(char *kind, int num) {
+    char buf[NAME_LEN];
+    char **names = malloc(num * sizeof(char*));
+    for (int i=0; i < num; i++) {
+        uint32_t id = (uint32_t)i * 2654435761U;
+        snprintf(buf, sizeof(buf), "tenant%05u.%s.%u", id % 50000, kind, id);
+        names[i] = strdup(buf);
+    }
+    return names;
+}
+
+/**
+ * Times lookups of the names in a random order. The names
+ * are copied out in that order first, so that only the
+ * tree is read at random, like with names from requests.
+ * @return The best time of the rounds, in nsec per lookup
+ */
+double time_lookups(art_tree *t, char **names, int num, int *order, int expect) {
+    char *keys = malloc((uint64_t)LOOKUPS * NAME_LEN);
+    int *lens = malloc(LOOKUPS * sizeof(int));
+    for (int i=0; i < LOOKUPS; i++) {
+        char *name = names[order[i] % num];
+        lens[i] = strlen(name) + 1;
+        memcpy(keys + (uint64_t)i * NAME_LEN, name, lens[i]);
+    }
+
+    uint64_t best = 0, nsec;
+    struct timespec start;
+    for (int r=0; r < ROUNDS; r++) {
+        int found = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        for (int i=0; i < LOOKUPS; i++) {
+            unsigned char *key = (unsigned char*)keys + (uint64_t)i * NAME_LEN;
+            found += art_search(t, key, lens[i]) != NULL;
+        }
+        nsec = nsec_since(&start);
+        if (found != (expect ? LOOKUPS : 0)) {
+            printf("Unexpected lookup results: %d\n", found);
+            exit(1);
+        }
+        if (!r || nsec < best) best = nsec;
+    }
+    free(keys);
+    free(lens);
+    return (double)best / LOOKUPS;
+}
+
+void usage(void) {
+    printf("usage: bench_art [-n filters] [-l lookups] [-r rounds]\n");
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    int ch;
+    while ((ch = getopt(argc, argv, "n:l:r:")) != -1) {
+        switch (ch) {
+            case 'n':
+                NUM_KEYS = atoi(optarg);
+                break;
+            case 'l':
+                LOOKUPS = atoi(optarg);
+                break;
+            case 'r':
+                ROUNDS = atoi(optarg);
+                break;
+            default:
+                usage();
+        }
+    }
+    if (NUM_KEYS <= 0 || LOOKUPS <= 0 || ROUNDS <= 0) usage();
+
+    char **names = make_names("events", NUM_KEYS);
+    char **missing = make_names("clicks", NUM_KEYS);
+    int *order = malloc(LOOKUPS * sizeof(int));
+    srand(42);
+    for (int i=0; i < LOOKUPS; i++) {
+        order[i] = rand();
+    }
+
+    struct timespec start;
+    art_tree t, copy;
+    uint64_t heap = heap_bytes();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    init_art_tree(&t);
+    for (int i=0; i < NUM_KEYS; i++) {
+        art_insert(&t, (unsigned char*)names[i], strlen(names[i])+1, names[i]);
+    }
+    uint64_t nsec = nsec_since(&start);
+    uint64_t tree_heap = heap_bytes() - heap;
+    printf("Filters: %d Insert: %.1f ns/filter Heap: %llu (%.1f bytes/filter) Slabs: %llu\n",
+            NUM_KEYS, (double)nsec / NUM_KEYS, (unsigned long long)tree_heap,
+            (double)tree_heap / NUM_KEYS, (unsigned long long)art_memory(&t));
+
+    heap = heap_bytes();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    art_copy(&copy, &t);
+    nsec = nsec_since(&start);
+    printf("Copy: %.1f msec Heap: %llu Nodes: %llu Both trees: %llu\n", nsec / 1e6,
+            (unsigned long long)(heap_bytes() - heap), (unsigned long long)art_node_memory(&copy),
+            (unsigned long long)(art_memory(&t) + art_node_memory(&copy)));
+
+    printf("Lookup present: %.1f ns missing: %.1f ns\n",
+            time_lookups(&t, names, NUM_KEYS, order, 1),
+            time_lookups(&t, missing, NUM_KEYS, order, 0));
+    printf("Lookup present in copy: %.1f ns missing: %.1f ns\n",
+            time_lookups(&copy, names, NUM_KEYS, order, 1),
+            time_lookups(&copy, missing, NUM_KEYS, order, 0));
+
+    // Drop and create a tenth of the filters, as the
+    // filter manager merges its changes into a tree
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i=0; i < NUM_KEYS; i += 10) {
+        art_delete(&copy, (unsigned char*)names[i], strlen(names[i])+1);
+    }
+    for (int i=0; i < NUM_KEYS; i += 10) {
+        art_insert(&copy, (unsigned char*)names[i], strlen(names[i])+1, names[i]);
+    }
+    nsec = nsec_since(&start);
+    printf("Churn: %.1f ns/change Lookup present after: %.1f ns\n",
+            (double)nsec / (NUM_KEYS / 5 + 1), time_lookups(&copy, names, NUM_KEYS, order, 1));
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    destroy_art_tree(&t);
+    destroy_art_tree(&copy);
+    printf("Destroy: %.1f msec\n", nsec_since(&start) / 1e6);
+    return 0;
+}
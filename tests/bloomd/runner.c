@@ -5,6 +5,15 @@
 #include "test_filter.c"
 #include "test_filtmgr.c"
 #include "test_art.c"
+#include "test_libbloomd.c"
+#include "test_owner.c"
+#include "test_workpool.c"
+#include "test_numa.c"
+#include "test_logger.c"
+#include "test_proxy.c"
+#include "test_handover.c"
+#include "test_inspect.c"
+#include "test_ratelimit.c"
 
 int main(void)
 {
@@ -15,6 +24,15 @@ int main(void)
     TCase *tc3 = tcase_create("filter");
     TCase *tc4 = tcase_create("filter manager");
     TCase *tc5 = tcase_create("art");
+    TCase *tc6 = tcase_create("libbloomd");
+    TCase *tc7 = tcase_create("owner");
+    TCase *tc8 = tcase_create("workpool");
+    TCase *tc9 = tcase_create("numa");
+    TCase *tc10 = tcase_create("logger");
+    TCase *tc11 = tcase_create("proxy");
+    TCase *tc12 = tcase_create("inspect");
+    TCase *tc13 = tcase_create("ratelimit");
+    TCase *tc14 = tcase_create("handover");
     SRunner *sr = srunner_create(s1);
     int nf;
 
@@ -38,6 +56,21 @@ int main(void)
     tcase_add_test(tc1, test_sane_in_memory);
     tcase_add_test(tc1, test_sane_use_mmap);
     tcase_add_test(tc1, test_sane_worker_threads);
+    tcase_add_test(tc1, test_sane_handover_socket);
+    tcase_add_test(tc1, test_sane_snapshot_interval);
+    tcase_add_test(tc1, test_sane_shutdown_workers);
+    tcase_add_test(tc1, test_sane_capture_sample);
+    tcase_add_test(tc1, test_sane_shared_nothing);
+    tcase_add_test(tc1, test_sane_key_log);
+    tcase_add_test(tc1, test_sane_stable);
+    tcase_add_test(tc1, test_sane_group_commit);
+    tcase_add_test(tc1, test_sane_parallel_threads);
+    tcase_add_test(tc1, test_sane_numa_aware);
+    tcase_add_test(tc1, test_sane_output_watermarks);
+    tcase_add_test(tc1, test_sane_proxy_backends);
+    tcase_add_test(tc1, test_sane_rate_limits);
+    tcase_add_test(tc1, test_sane_scrub);
+    tcase_add_test(tc1, test_sane_growth_horizon);
     tcase_add_test(tc1, test_filter_config_bad_file);
     tcase_add_test(tc1, test_filter_config_empty_file);
     tcase_add_test(tc1, test_filter_config_basic_config);
@@ -59,6 +92,15 @@ int main(void)
     tcase_add_test(tc3, test_filter_restore_order);
     tcase_add_test(tc3, test_filter_page_out);
     tcase_add_test(tc3, test_filter_bounded_fp);
+    tcase_add_test(tc3, test_filter_snapshot_restore);
+    tcase_add_test(tc3, test_filter_compact);
+    tcase_add_test(tc3, test_filter_compact_changed);
+    tcase_add_test(tc3, test_filter_compact_stream);
+    tcase_add_test(tc3, test_filter_stable);
+    tcase_add_test(tc3, test_filter_shrink);
+    tcase_add_test(tc3, test_filter_contains_keys);
+    tcase_add_test(tc3, test_filter_scrub);
+    tcase_add_test(tc3, test_filter_growth_history);
 
     // Add the filter tests
     suite_add_tcase(s1, tc4);
@@ -87,7 +129,14 @@ int main(void)
     tcase_add_test(tc4, test_mgr_create_custom_config);
     tcase_add_test(tc4, test_mgr_grow);
     tcase_add_test(tc4, test_mgr_restore);
+    tcase_add_test(tc4, test_mgr_restore_parallel_close);
     tcase_add_test(tc4, test_mgr_callback);
+    tcase_add_test(tc4, test_mgr_compact);
+    tcase_add_test(tc4, test_mgr_flush_key_log);
+    tcase_add_test(tc4, test_mgr_shrink);
+    tcase_add_test(tc4, test_mgr_rewrite_thread);
+    tcase_add_test(tc4, test_mgr_iter_filters);
+    tcase_add_test(tc4, test_mgr_limit);
 
     // Add the art tests
     suite_add_tcase(s1, tc5);
@@ -99,7 +148,76 @@ int main(void)
     tcase_add_test(tc5, test_art_insert_delete);
     tcase_add_test(tc5, test_art_insert_iter);
     tcase_add_test(tc5, test_art_iter_prefix);
+    tcase_add_test(tc5, test_art_iter_after);
+    tcase_add_test(tc5, test_art_iter_after_words);
     tcase_add_test(tc5, test_art_insert_copy_delete);
+    tcase_add_test(tc5, test_art_slab_memory);
+
+    // Add the embedded engine tests
+    suite_add_tcase(s1, tc6);
+    tcase_add_test(tc6, test_embed_open_close);
+    tcase_add_test(tc6, test_embed_bad_config);
+    tcase_add_test(tc6, test_embed_set_check);
+
+    // Add the shared nothing tests
+    suite_add_tcase(s1, tc7);
+    tcase_add_test(tc7, test_owned_cmd_single_key);
+    tcase_add_test(tc7, test_owned_cmd_split_keys);
+    tcase_add_test(tc7, test_owner_queue_order);
+    tcase_add_test(tc7, test_owner_queue_concurrent);
+    tcase_add_test(tc7, test_filter_owner);
+    tcase_add_test(tc7, test_owned_cmds_grouped);
+    tcase_add_test(tc7, test_batch_malformed);
+    tcase_add_test(tc7, test_batch_filters);
+
+    // Add the work pool tests
+    suite_add_tcase(s1, tc8);
+    tcase_add_test(tc8, test_workpool_init_destroy);
+    tcase_add_test(tc8, test_workpool_run);
+    tcase_add_test(tc8, test_workpool_concurrent);
+    tcase_add_test(tc8, test_workpool_parallel_check);
+
+    // Add the numa tests
+    suite_add_tcase(s1, tc9);
+    tcase_add_test(tc9, test_numa_topology);
+    tcase_add_test(tc9, test_numa_bind_memory);
+    tcase_add_test(tc9, test_numa_filter_placement);
+
+    // Add the logger tests
+    suite_add_tcase(s1, tc10);
+    tcase_add_test(tc10, test_logger_direct);
+    tcase_add_test(tc10, test_logger_threads);
+    tcase_add_test(tc10, test_logger_rate_limit);
+    tcase_add_test(tc10, test_logger_summary);
+    tcase_add_test(tc10, test_logger_rate_formats);
+
+    // Add the proxy tests
+    suite_add_tcase(s1, tc11);
+    tcase_set_timeout(tc11, 30);
+    tcase_add_test(tc11, test_hash_ring_spread);
+    tcase_add_test(tc11, test_hash_ring_order);
+    tcase_add_test(tc11, test_hash_ring_add_node);
+    tcase_add_test(tc11, test_hash_ring_bad_args);
+    tcase_add_test(tc11, test_proxy_instances);
+    tcase_add_test(tc11, test_proxy_stalled_backend);
+
+    // Add the inspect tests
+    suite_add_tcase(s1, tc12);
+    tcase_add_test(tc12, test_inspect_popcount);
+    tcase_add_test(tc12, test_inspect_merge);
+    tcase_add_test(tc12, test_inspect_layer);
+    tcase_add_test(tc12, test_inspect_merge_layer);
+
+    // Add the rate limit tests
+    suite_add_tcase(s1, tc13);
+    tcase_add_test(tc13, test_bucket_unlimited);
+    tcase_add_test(tc13, test_bucket_debt);
+    tcase_add_test(tc13, test_bucket_set_rate);
+
+    // Add the handover tests
+    suite_add_tcase(s1, tc14);
+    tcase_set_timeout(tc14, 30);
+    tcase_add_test(tc14, test_handover_serving);
 
     srunner_run_all(sr, CK_ENV);
     nf = srunner_ntests_failed(sr);
@@ -1,5 +1,6 @@
 #include <fcntl.h>
 #include <inttypes.h>
+#include <stddef.h>
 #include <stdio.h>
 
 #include <check.h>
@@ -325,6 +326,109 @@ START_TEST(test_art_iter_prefix)
 }
 END_TEST
 
+typedef struct {
+    int count;
+    int max_count;
+    char **keys;
+} after_data;
+
+static int test_collect_cb(void *data, const unsigned char *k, uint32_t k_len, void *val) {
+    (void)k_len;
+    (void)val;
+    after_data *a = data;
+    if (a->keys) a->keys[a->count] = (char*)k;
+    a->count++;
+    return a->count == a->max_count;
+}
+
+START_TEST(test_art_iter_after)
+{
+    art_tree t;
+    int res = init_art_tree(&t);
+    fail_unless(res == 0);
+
+    char *keys[] = {"abc.123.456", "api", "api.foe.fum", "api.foo", "api.foo.bar", "api.foo.baz"};
+    for (int i=0; i < 6; i++) {
+        fail_unless(NULL == art_insert(&t, (unsigned char*)keys[i], strlen(keys[i])+1, NULL));
+    }
+
+    // Start after a key in the tree
+    char *expected[] = {"api.foo", "api.foo.bar", "api.foo.baz"};
+    prefix_data p = { 0, 3, expected };
+    fail_unless(!art_iter_after(&t, (unsigned char*)"api.foe.fum", 12, test_prefix_cb, &p));
+    fail_unless(p.count == p.max_count, "Count: %d Max: %d", p.count, p.max_count);
+
+    // Start after a key that is not in the tree
+    char *expected2[] = {"api.foo.bar", "api.foo.baz"};
+    prefix_data p2 = { 0, 2, expected2 };
+    fail_unless(!art_iter_after(&t, (unsigned char*)"api.foo.a", 10, test_prefix_cb, &p2));
+    fail_unless(p2.count == p2.max_count);
+
+    // Before every key, and after every key
+    prefix_data p3 = { 0, 6, keys };
+    fail_unless(!art_iter_after(&t, (unsigned char*)"", 1, test_prefix_cb, &p3));
+    fail_unless(p3.count == p3.max_count);
+    prefix_data p4 = { 0, 0, NULL };
+    fail_unless(!art_iter_after(&t, (unsigned char*)"b", 2, test_prefix_cb, &p4));
+    fail_unless(p4.count == 0);
+
+    res = destroy_art_tree(&t);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_art_iter_after_words)
+{
+    art_tree t;
+    int res = init_art_tree(&t);
+    fail_unless(res == 0);
+
+    int len, num_words = 0;
+    char buf[512];
+    FILE *f = fopen("tests/words.txt", "r");
+    while (fgets(buf, sizeof buf, f)) {
+        len = strlen(buf);
+        buf[len-1] = '\0';
+        fail_unless(NULL == art_insert(&t, (unsigned char*)buf, len, NULL));
+        num_words++;
+    }
+    fclose(f);
+
+    // Get every key in order
+    char **keys = malloc(num_words * sizeof(char*));
+    after_data all = { 0, 0, keys };
+    fail_unless(!art_iter(&t, test_collect_cb, &all));
+    fail_unless(all.count == num_words);
+
+    // Resuming after any key picks up at the next one. Counting
+    // the rest walks most of the tree, so only a sample does that,
+    // including the last key.
+    for (int i=0; i < num_words; i += 97) {
+        char *first = NULL;
+        after_data page = { 0, 1, &first };
+        art_iter_after(&t, (unsigned char*)keys[i], strlen(keys[i])+1, test_collect_cb, &page);
+        if (i + 1 < num_words) {
+            fail_unless(page.count == 1);
+            fail_unless(!strcmp(first, keys[i+1]), "After: %s Got: %s", keys[i], first);
+        } else
+            fail_unless(page.count == 0);
+
+        if (i % (97 * 64)) continue;
+        after_data rest = { 0, 0, NULL };
+        fail_unless(!art_iter_after(&t, (unsigned char*)keys[i], strlen(keys[i])+1, test_collect_cb, &rest));
+        fail_unless(rest.count == num_words - i - 1);
+    }
+    after_data none = { 0, 0, NULL };
+    fail_unless(!art_iter_after(&t, (unsigned char*)keys[num_words-1],
+                strlen(keys[num_words-1])+1, test_collect_cb, &none));
+    fail_unless(none.count == 0);
+
+    free(keys);
+    res = destroy_art_tree(&t);
+    fail_unless(res == 0);
+}
+END_TEST
+
 START_TEST(test_art_insert_copy_delete)
 {
     art_tree t;
@@ -384,3 +488,88 @@ START_TEST(test_art_insert_copy_delete)
 }
 END_TEST
 
+
+START_TEST(test_art_slab_memory)
+{
+    art_tree t;
+    int res = init_art_tree(&t);
+    fail_unless(res == 0);
+    fail_unless(art_memory(&t) == 0);
+
+    // Nodes sit on cache lines, and enough keys under one
+    // byte make every node type
+    char buf[512];
+    for (uintptr_t i=1; i < 256; i++) {
+        snprintf(buf, sizeof(buf), "filter%c", (char)i);
+        art_insert(&t, (unsigned char*)buf, strlen(buf)+1, (void*)i);
+    }
+    fail_unless(art_size(&t) == 255);
+    fail_unless(t.root->type == NODE256);
+    fail_unless(((uintptr_t)t.root % ART_CACHE_LINE) == 0);
+    uint64_t mem = art_memory(&t);
+    fail_unless(mem > 0);
+
+    // Leaves too large for the slabs are allocated alone
+    char big[1024];
+    memset(big, 'x', sizeof(big));
+    big[sizeof(big)-1] = '\0';
+    fail_unless(art_insert(&t, (unsigned char*)big, sizeof(big), (void*)7) == NULL);
+    fail_unless(t.leaves->large_leaves == 1);
+    mem = art_memory(&t);
+
+    // Shrink to a node48, then leave holes in it
+    for (uintptr_t i=2; i < 256; i += 5) {
+        snprintf(buf, sizeof(buf), "filter%c", (char)i);
+        fail_unless(art_delete(&t, (unsigned char*)buf, strlen(buf)+1) == (void*)i);
+    }
+    for (uintptr_t i=1; i < 212; i++) {
+        snprintf(buf, sizeof(buf), "filter%c", (char)i);
+        art_delete(&t, (unsigned char*)buf, strlen(buf)+1);
+    }
+    fail_unless(art_size(&t) == 36);
+    fail_unless(art_memory(&t) == mem);
+
+    // The copy has every key, and shares the leaves
+    art_tree t2;
+    fail_unless(art_copy(&t2, &t) == 0);
+    fail_unless(art_size(&t2) == 36);
+    fail_unless(t2.leaves == t.leaves);
+    fail_unless(art_node_memory(&t2) > 0);
+    fail_unless(art_memory(&t2) == mem - art_node_memory(&t) + art_node_memory(&t2));
+    fail_unless(art_search(&t2, (unsigned char*)big, sizeof(big)) == (void*)7);
+    for (uintptr_t i=1; i < 256; i++) {
+        snprintf(buf, sizeof(buf), "filter%c", (char)i);
+        fail_unless(art_search(&t2, (unsigned char*)buf, strlen(buf)+1) ==
+                    art_search(&t, (unsigned char*)buf, strlen(buf)+1));
+    }
+
+    // A leaf is freed once neither tree has it
+    fail_unless(art_delete(&t, (unsigned char*)big, sizeof(big)) == (void*)7);
+    fail_unless(t.leaves->large_leaves == 1);
+    fail_unless(art_search(&t2, (unsigned char*)big, sizeof(big)) == (void*)7);
+    fail_unless(art_delete(&t2, (unsigned char*)big, sizeof(big)) == (void*)7);
+    fail_unless(t.leaves->large_leaves == 0);
+    fail_unless(t.leaves->large_bytes == 0);
+
+    // Freed nodes and leaves are reused
+    for (uintptr_t i=1; i < 256; i++) {
+        snprintf(buf, sizeof(buf), "filter%c", (char)i);
+        art_insert(&t, (unsigned char*)buf, strlen(buf)+1, (void*)i);
+    }
+    fail_unless(art_size(&t) == 255);
+    fail_unless(art_memory(&t) == mem - offsetof(art_leaf, key) - sizeof(big));
+
+    // The copy keeps the shared leaves
+    res = destroy_art_tree(&t);
+    fail_unless(res == 0);
+    fail_unless(t.leaves == NULL);
+    fail_unless(t2.leaves->trees == 1);
+    for (uintptr_t i=1; i < 256; i++) {
+        snprintf(buf, sizeof(buf), "filter%c", (char)i);
+        void *val = art_search(&t2, (unsigned char*)buf, strlen(buf)+1);
+        fail_unless(val == ((i >= 212 && (i - 2) % 5) ? (void*)i : NULL));
+    }
+    res = destroy_art_tree(&t2);
+    fail_unless(res == 0);
+}
+END_TEST
@@ -27,6 +27,27 @@ START_TEST(test_config_get_default)
     fail_unless(config.in_memory == 0);
     fail_unless(config.worker_threads == 1);
     fail_unless(config.use_mmap == 0);
+    fail_unless(config.handover_socket == NULL);
+    fail_unless(config.snapshot_interval == 0);
+    fail_unless(config.shutdown_workers == 0);
+    fail_unless(config.capture_file == NULL);
+    fail_unless(config.capture_sample == 1.0);
+    fail_unless(config.shared_nothing == 0);
+    fail_unless(config.key_log == 0);
+    fail_unless(config.stable == 0);
+    fail_unless(config.group_commit == 0);
+    fail_unless(config.parallel_threads == 0);
+    fail_unless(config.numa_aware == 0);
+    fail_unless(config.output_high_watermark == 8388608);
+    fail_unless(config.output_low_watermark == 1048576);
+    fail_unless(config.proxy_backends == NULL);
+    fail_unless(config.rate_ops == 0);
+    fail_unless(config.rate_bytes == 0);
+    fail_unless(config.conn_rate_ops == 0);
+    fail_unless(config.conn_rate_bytes == 0);
+    fail_unless(config.scrub_interval == 86400);
+    fail_unless(config.scrub_rate == 8388608);
+    fail_unless(config.growth_horizon == 0);
 }
 END_TEST
 
@@ -51,6 +72,7 @@ START_TEST(test_config_bad_file)
     fail_unless(config.in_memory == 0);
     fail_unless(config.worker_threads == 1);
     fail_unless(config.use_mmap == 0);
+    fail_unless(config.handover_socket == NULL);
 }
 END_TEST
 
@@ -100,6 +122,27 @@ probability_reduction = 0.8\n\
 data_dir = /tmp/test\n\
 workers = 2\n\
 use_mmap = 1\n\
+handover_socket = /tmp/bloomd.sock\n\
+snapshot_interval = 30\n\
+shutdown_workers = 8\n\
+capture_file = /tmp/bloomd.cap\n\
+capture_sample = 0.1\n\
+shared_nothing = 1\n\
+key_log = 1\n\
+stable = 1\n\
+group_commit = 1\n\
+parallel_threads = 4\n\
+numa_aware = 1\n\
+output_high_watermark = 4194304\n\
+output_low_watermark = 65536\n\
+proxy_backends = 10.0.0.1:8673, 10.0.0.2:8673\n\
+rate_ops = 1000\n\
+rate_bytes = 65536\n\
+conn_rate_ops = 200\n\
+conn_rate_bytes = 4096\n\
+scrub_interval = 3600\n\
+scrub_rate = 1048576\n\
+growth_horizon = 86400\n\
 log_level = INFO\n";
     write(fh, buf, strlen(buf));
     fchmod(fh, 777);
@@ -123,6 +166,27 @@ log_level = INFO\n";
     fail_unless(config.in_memory == 1);
     fail_unless(config.worker_threads == 2);
     fail_unless(config.use_mmap == 1);
+    fail_unless(strcmp(config.handover_socket, "/tmp/bloomd.sock") == 0);
+    fail_unless(config.snapshot_interval == 30);
+    fail_unless(config.shutdown_workers == 8);
+    fail_unless(strcmp(config.capture_file, "/tmp/bloomd.cap") == 0);
+    fail_unless(config.capture_sample == 0.1);
+    fail_unless(config.shared_nothing == 1);
+    fail_unless(config.key_log == 1);
+    fail_unless(config.stable == 1);
+    fail_unless(config.group_commit == 1);
+    fail_unless(config.parallel_threads == 4);
+    fail_unless(config.numa_aware == 1);
+    fail_unless(config.output_high_watermark == 4194304);
+    fail_unless(config.output_low_watermark == 65536);
+    fail_unless(strcmp(config.proxy_backends, "10.0.0.1:8673, 10.0.0.2:8673") == 0);
+    fail_unless(config.rate_ops == 1000);
+    fail_unless(config.rate_bytes == 65536);
+    fail_unless(config.conn_rate_ops == 200);
+    fail_unless(config.conn_rate_bytes == 4096);
+    fail_unless(config.scrub_interval == 3600);
+    fail_unless(config.scrub_rate == 1048576);
+    fail_unless(config.growth_horizon == 86400);
 
     unlink("/tmp/basic_config");
 }
@@ -285,6 +349,152 @@ START_TEST(test_sane_worker_threads)
 }
 END_TEST
 
+START_TEST(test_sane_handover_socket)
+{
+    fail_unless(sane_handover_socket(NULL) == 0);
+    fail_unless(sane_handover_socket("") == 1);
+    fail_unless(sane_handover_socket("/tmp/bloomd.sock") == 0);
+
+    char long_path[200];
+    memset(long_path, 'a', sizeof(long_path));
+    long_path[sizeof(long_path)-1] = '\0';
+    fail_unless(sane_handover_socket(long_path) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_snapshot_interval)
+{
+    fail_unless(sane_snapshot_interval(-1) == 1);
+    fail_unless(sane_snapshot_interval(0) == 0);
+    fail_unless(sane_snapshot_interval(5) == 0);
+    fail_unless(sane_snapshot_interval(300) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_shutdown_workers)
+{
+    fail_unless(sane_shutdown_workers(-1) == 1);
+    fail_unless(sane_shutdown_workers(0) == 0);
+    fail_unless(sane_shutdown_workers(16) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_capture_sample)
+{
+    fail_unless(sane_capture_sample(0) == 1);
+    fail_unless(sane_capture_sample(-0.5) == 1);
+    fail_unless(sane_capture_sample(1.5) == 1);
+    fail_unless(sane_capture_sample(0.01) == 0);
+    fail_unless(sane_capture_sample(1) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_shared_nothing)
+{
+    fail_unless(sane_shared_nothing(-1) == 1);
+    fail_unless(sane_shared_nothing(2) == 1);
+    fail_unless(sane_shared_nothing(0) == 0);
+    fail_unless(sane_shared_nothing(1) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_key_log)
+{
+    fail_unless(sane_key_log(-1) == 1);
+    fail_unless(sane_key_log(2) == 1);
+    fail_unless(sane_key_log(0) == 0);
+    fail_unless(sane_key_log(1) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_stable)
+{
+    fail_unless(sane_stable(-1) == 1);
+    fail_unless(sane_stable(2) == 1);
+    fail_unless(sane_stable(0) == 0);
+    fail_unless(sane_stable(1) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_group_commit)
+{
+    fail_unless(sane_group_commit(-1) == 1);
+    fail_unless(sane_group_commit(2) == 1);
+    fail_unless(sane_group_commit(0) == 0);
+    fail_unless(sane_group_commit(1) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_parallel_threads)
+{
+    fail_unless(sane_parallel_threads(-1) == 1);
+    fail_unless(sane_parallel_threads(0) == 0);
+    fail_unless(sane_parallel_threads(4) == 0);
+    fail_unless(sane_parallel_threads(128) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_numa_aware)
+{
+    fail_unless(sane_numa_aware(-1) == 1);
+    fail_unless(sane_numa_aware(2) == 1);
+    fail_unless(sane_numa_aware(0) == 0);
+    fail_unless(sane_numa_aware(1) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_output_watermarks)
+{
+    fail_unless(sane_output_watermarks(1048576, 1048576) == 1);
+    fail_unless(sane_output_watermarks(1048576, 2097152) == 1);
+    fail_unless(sane_output_watermarks(8388608, 1048576) == 0);
+    fail_unless(sane_output_watermarks(1048576, 0) == 0);
+    fail_unless(sane_output_watermarks(0, 1048576) == 0);
+}
+END_TEST
+
+START_TEST(test_sane_proxy_backends)
+{
+    fail_unless(sane_proxy_backends(NULL) == 0);
+    fail_unless(sane_proxy_backends("localhost:8673") == 0);
+    fail_unless(sane_proxy_backends("10.0.0.1:8673,10.0.0.2:8673") == 0);
+    fail_unless(sane_proxy_backends("10.0.0.1:8673, 10.0.0.2:8673") == 0);
+    fail_unless(sane_proxy_backends("") == 1);
+    fail_unless(sane_proxy_backends("localhost") == 1);
+    fail_unless(sane_proxy_backends(":8673") == 1);
+    fail_unless(sane_proxy_backends("localhost:0") == 1);
+    fail_unless(sane_proxy_backends("localhost:8673,localhost:99999") == 1);
+}
+END_TEST
+
+START_TEST(test_sane_rate_limits)
+{
+    fail_unless(sane_rate_limits(0, 0) == 0);
+    fail_unless(sane_rate_limits(1000, 0) == 0);
+    fail_unless(sane_rate_limits(0, 65536) == 0);
+    fail_unless(sane_rate_limits(-1, 0) == 1);
+    fail_unless(sane_rate_limits(0, -1) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_scrub)
+{
+    fail_unless(sane_scrub(0, 0) == 0);
+    fail_unless(sane_scrub(86400, 8388608) == 0);
+    fail_unless(sane_scrub(3600, 0) == 0);
+    fail_unless(sane_scrub(-1, 8388608) == 1);
+    fail_unless(sane_scrub(3600, -1) == 1);
+}
+END_TEST
+
+START_TEST(test_sane_growth_horizon)
+{
+    fail_unless(sane_growth_horizon(0) == 0);
+    fail_unless(sane_growth_horizon(86400) == 0);
+    fail_unless(sane_growth_horizon(-1) == 1);
+}
+END_TEST
+
 START_TEST(test_filter_config_bad_file)
 {
     bloom_filter_config config;
@@ -372,6 +582,16 @@ START_TEST(test_update_filename_from_filter_config)
     config.capacity = 4000000;
     config.bytes = 999999;
     config.in_memory = 0;
+    config.key_log = 1;
+    config.sealed = 1;
+    config.stable = 1;
+    config.rate_ops = 500;
+    config.rate_bytes = 8192;
+    config.growth_horizon = 86400;
+    config.growth_keys = 1234.5;
+    config.growth_secs = 600.25;
+    config.growth_age = 7200;
+    config.growth_time = 1700000000;
 
     int res = update_filename_from_filter_config("/tmp/update_filter", &config);
     chmod("/tmp/update_filter", 777);
@@ -391,6 +611,16 @@ START_TEST(test_update_filename_from_filter_config)
     fail_unless(config2.capacity == 4000000);
     fail_unless(config2.bytes == 999999);
     fail_unless(config2.in_memory == 0);
+    fail_unless(config2.key_log == 1);
+    fail_unless(config2.sealed == 1);
+    fail_unless(config2.stable == 1);
+    fail_unless(config2.rate_ops == 500);
+    fail_unless(config2.rate_bytes == 8192);
+    fail_unless(config2.growth_horizon == 86400);
+    fail_unless(config2.growth_keys == 1234.5);
+    fail_unless(config2.growth_secs == 600.25);
+    fail_unless(config2.growth_age == 7200);
+    fail_unless(config2.growth_time == 1700000000);
 
     unlink("/tmp/update_filter");
 }
@@ -77,7 +77,7 @@ START_TEST(test_filter_init_discover_destroy)
 
     res = destroy_bloom_filter(filter);
     fail_unless(res == 0);
-    fail_unless(delete_dir("/tmp/bloomd/bloomd.test_filter") == 2);
+    fail_unless(delete_dir("/tmp/bloomd/bloomd.test_filter") == 3);
 }
 END_TEST
 
@@ -166,7 +166,7 @@ START_TEST(test_filter_add_check)
 
     res = destroy_bloom_filter(filter);
     fail_unless(res == 0);
-    fail_unless(delete_dir("/tmp/bloomd/bloomd.test_filter4") == 2);
+    fail_unless(delete_dir("/tmp/bloomd/bloomd.test_filter4") == 3);
 }
 END_TEST
 
@@ -215,7 +215,7 @@ START_TEST(test_filter_restore)
 
     res = destroy_bloom_filter(filter);
     fail_unless(res == 0);
-    fail_unless(delete_dir("/tmp/bloomd/bloomd.test_filter5") == 2);
+    fail_unless(delete_dir("/tmp/bloomd/bloomd.test_filter5") == 3);
 }
 END_TEST
 
@@ -272,7 +272,7 @@ START_TEST(test_filter_flush)
 
     res = destroy_bloom_filter(filter2);
     fail_unless(res == 0);
-    fail_unless(delete_dir("/tmp/bloomd/bloomd.test_filter6") == 2);
+    fail_unless(delete_dir("/tmp/bloomd/bloomd.test_filter6") == 3);
 }
 END_TEST
 
@@ -350,7 +350,7 @@ START_TEST(test_filter_grow)
 
     res = destroy_bloom_filter(filter);
     fail_unless(res == 0);
-    fail_unless(delete_dir("/tmp/bloomd/bloomd.test_filter8") == 4);
+    fail_unless(delete_dir("/tmp/bloomd/bloomd.test_filter8") == 7);
 }
 END_TEST
 
@@ -395,7 +395,7 @@ START_TEST(test_filter_grow_restore)
     res = destroy_bloom_filter(filter);
     fail_unless(res == 0);
 
-    fail_unless(delete_dir("/tmp/bloomd/bloomd.test_filter9") == 4);
+    fail_unless(delete_dir("/tmp/bloomd/bloomd.test_filter9") == 7);
 }
 END_TEST
 
@@ -467,7 +467,7 @@ START_TEST(test_filter_restore_order)
     res = destroy_bloom_filter(filter);
     fail_unless(res == 0);
 
-    fail_unless(delete_dir("/tmp/bloomd/bloomd.test_filter12") == 3);
+    fail_unless(delete_dir("/tmp/bloomd/bloomd.test_filter12") == 5);
 }
 END_TEST
 
@@ -514,7 +514,7 @@ START_TEST(test_filter_page_out)
 
     res = destroy_bloom_filter(filter);
     fail_unless(res == 0);
-    fail_unless(delete_dir("/tmp/bloomd/bloomd.test_filter10") == 2);
+    fail_unless(delete_dir("/tmp/bloomd/bloomd.test_filter10") == 3);
 }
 END_TEST
 
@@ -557,3 +557,466 @@ START_TEST(test_filter_bounded_fp)
 }
 END_TEST
 
+START_TEST(test_filter_snapshot_restore)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 10000;
+    config.in_memory = 1;
+    config.snapshot_interval = 60;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter12", 1, &filter);
+    fail_unless(res == 0);
+
+    // Add enough keys to grow a second layer
+    char buf[100];
+    for (int i=0;i<20000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = bloomf_add(filter, (char*)&buf);
+        fail_unless(res == 1);
+    }
+    uint64_t size = bloomf_size(filter);
+    uint64_t bytes = bloomf_byte_size(filter);
+
+    // Snapshot, after which there is nothing new to copy
+    fail_unless(bloomf_snapshot(filter) == 0);
+    bloom_snapshot *snap = NULL;
+    fail_unless(bloomf_snapshot_copy(filter, &snap) == 1);
+    fail_unless(snap == NULL);
+
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+
+    // Restore from the snapshot
+    res = init_bloom_filter(&config, "test_filter12", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_size(filter) == size);
+    fail_unless(bloomf_byte_size(filter) == bytes);
+
+    // Check all the keys exist
+    for (int i=0;i<20000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = bloomf_contains(filter, (char*)&buf);
+        fail_unless(res == 1);
+    }
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+
+START_TEST(test_filter_compact)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 10000;
+    config.key_log = 1;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter13", 1, &filter);
+    fail_unless(res == 0);
+
+    // Set every key twice, to grow a second layer
+    char buf[100];
+    for (int j=0;j<2;j++) {
+        for (int i=0;i<20000;i++) {
+            snprintf((char*)&buf, 100, "foobar%d", i);
+            res = bloomf_add(filter, (char*)&buf);
+            fail_unless(res == 0 || res == 1);
+        }
+    }
+    uint64_t bytes = bloomf_byte_size(filter);
+
+    uint64_t log_len;
+    fail_unless(bloomf_key_log_size(filter, &log_len) == 0);
+    fail_unless(log_len > 0);
+    fail_unless(bloomf_compact_build(filter, NULL, log_len) == 0);
+    fail_unless(bloomf_compact_seal(filter, log_len) == 0);
+
+    // Sealed filters are read-only and smaller
+    fail_unless(filter->filter_config.sealed == 1);
+    fail_unless(bloomf_size(filter) == 20000);
+    fail_unless(bloomf_byte_size(filter) < bytes / 2);
+    fail_unless(bloomf_add(filter, "zipzab") == -2);
+    fail_unless(bloomf_key_log_size(filter, &log_len) == -2);
+    fail_unless(bloomf_compact_seal(filter, log_len) == -2);
+
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+
+    // Restore the fuse filter
+    res = init_bloom_filter(&config, "test_filter13", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->filter_config.sealed == 1);
+    fail_unless(bloomf_size(filter) == 20000);
+    for (int i=0;i<20000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = bloomf_contains(filter, (char*)&buf);
+        fail_unless(res == 1);
+    }
+
+    // Faults back in after a close
+    fail_unless(bloomf_close(filter) == 0);
+    fail_unless(bloomf_is_proxied(filter) == 1);
+    fail_unless(bloomf_contains(filter, "foobar0") == 1);
+    fail_unless(bloomf_is_proxied(filter) == 0);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_compact_changed)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 20000;
+    config.in_memory = 1;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter14", 1, &filter);
+    fail_unless(res == 0);
+
+    // No key log to compact from
+    uint64_t log_len;
+    fail_unless(bloomf_add(filter, "foobar") == 1);
+    fail_unless(bloomf_key_log_size(filter, &log_len) == -1);
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+
+    config.key_log = 1;
+    res = init_bloom_filter(&config, "test_filter14", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_add(filter, "foobar") == 1);
+
+    // A key set during the build fails the seal
+    fail_unless(bloomf_key_log_size(filter, &log_len) == 0);
+    fail_unless(bloomf_compact_build(filter, NULL, log_len) == 0);
+    fail_unless(bloomf_add(filter, "zipzab") == 1);
+    fail_unless(bloomf_compact_seal(filter, log_len) == -3);
+    fail_unless(filter->filter_config.sealed == 0);
+
+    // Retry, this in-memory filter is persisted by sealing
+    fail_unless(bloomf_key_log_size(filter, &log_len) == 0);
+    fail_unless(bloomf_compact_build(filter, NULL, log_len) == 0);
+    fail_unless(bloomf_compact_seal(filter, log_len) == 0);
+    fail_unless(filter->filter_config.in_memory == 0);
+    fail_unless(bloomf_contains(filter, "foobar") == 1);
+    fail_unless(bloomf_contains(filter, "zipzab") == 1);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_compact_stream)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 20000;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter15", 1, &filter);
+    fail_unless(res == 0);
+
+    // Bulk load the keys from a stream
+    FILE *keys = tmpfile();
+    for (int i=0;i<1000;i++) {
+        fprintf(keys, "foobar%d\n", i);
+    }
+    rewind(keys);
+    fail_unless(bloomf_compact_build(filter, keys, 0) == 0);
+    fclose(keys);
+    fail_unless(bloomf_compact_seal(filter, 0) == 0);
+
+    fail_unless(bloomf_size(filter) == 1000);
+    fail_unless(bloomf_contains(filter, "foobar999") == 1);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_stable)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 10000;
+    config.default_probability = 1e-3;
+    config.stable = 1;
+    config.key_log = 1;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter16", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->filter_config.stable == 1);
+    uint64_t bytes = bloomf_byte_size(filter);
+    fail_unless(bloomf_capacity(filter) == 10000);
+
+    // The size on disk is fixed, however many keys are set
+    char buf[100];
+    for (int i=0;i<100000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = bloomf_add(filter, (char*)&buf);
+        fail_unless(res == 0 || res == 1);
+    }
+    fail_unless(bloomf_byte_size(filter) == bytes);
+    fail_unless(bloomf_size(filter) > 90000);
+
+    // Stable filters keep no key log to compact from
+    uint64_t log_len;
+    fail_unless(bloomf_key_log_size(filter, &log_len) == -1);
+
+    // Recent keys are found, old ones are forgotten
+    int recent = 0, old = 0;
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", 99000 + i);
+        recent += bloomf_contains(filter, (char*)&buf);
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        old += bloomf_contains(filter, (char*)&buf);
+    }
+    fail_unless(recent > 990);
+    fail_unless(old < 10);
+
+    // Faults back in after a close
+    fail_unless(bloomf_close(filter) == 0);
+    fail_unless(bloomf_is_proxied(filter) == 1);
+    fail_unless(bloomf_contains(filter, "foobar99999") == 1);
+    fail_unless(bloomf_is_proxied(filter) == 0);
+    fail_unless(bloomf_byte_size(filter) == bytes);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+
+    // Restore from disk
+    config.stable = 0;
+    res = init_bloom_filter(&config, "test_filter16", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->filter_config.stable == 1);
+    fail_unless(bloomf_size(filter) > 90000);
+    for (int i=99000;i<100000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        recent -= bloomf_contains(filter, (char*)&buf);
+    }
+    fail_unless(recent == 0);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_shrink)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 1000000;
+    config.default_probability = 1e-3;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter17", 1, &filter);
+    fail_unless(res == 0);
+    uint64_t bytes = bloomf_byte_size(filter);
+
+    char buf[100];
+    for (int i=0;i<5000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        res = bloomf_add(filter, (char*)&buf);
+        fail_unless(res == 1);
+    }
+
+    // Keys set after the build are folded in by the swap
+    bloom_shrink *shrink;
+    fail_unless(bloomf_shrink_build(filter, 1e-3, &shrink) == 0);
+    fail_unless(bloomf_add(filter, "zipzab") == 1);
+    fail_unless(bloomf_shrink_swap(filter, shrink) == 0);
+    bloomf_shrink_free(shrink);
+
+    fail_unless(bloomf_byte_size(filter) < bytes / 20);
+    fail_unless(bloomf_size(filter) == 5001);
+    fail_unless(bloomf_capacity(filter) < 20000);
+    fail_unless(bloomf_contains(filter, "zipzab") == 1);
+    fail_unless(bloomf_shrink_build(filter, 1e-3, &shrink) == 1);
+
+    // Restore the folded layer
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    res = init_bloom_filter(&config, "test_filter17", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(bloomf_byte_size(filter) < bytes / 20);
+    fail_unless(bloomf_capacity(filter) < 20000);
+    for (int i=0;i<5000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bloomf_contains(filter, (char*)&buf) == 1);
+    }
+
+    // Grows a small layer once the folded one is full
+    for (int i=5000;i<30000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        bloomf_add(filter, (char*)&buf);
+    }
+    fail_unless(((bloom_sbf*)filter->sbf)->num_filters == 2);
+    fail_unless(bloomf_byte_size(filter) < bytes / 2);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_contains_keys)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 1000;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter18", 1, &filter);
+    fail_unless(res == 0);
+
+    char bufs[5000][32];
+    char *keys[5000];
+    char result[5000];
+    for (int i=0;i<5000;i++) {
+        keys[i] = bufs[i];
+        snprintf(bufs[i], 32, "foobar%d", i);
+        if (i % 2) bloomf_add(filter, keys[i]);
+    }
+
+    // Checks every key, and counts the hits once
+    fail_unless(bloomf_contains_keys(filter, keys, 5000, result) == 0);
+    int hits = 0;
+    for (int i=0;i<5000;i++) {
+        fail_unless(result[i] == bloomf_contains(filter, keys[i]));
+        if (i % 2) fail_unless(result[i] == 1);
+        hits += result[i];
+    }
+    filter_counters *counters = bloomf_counters(filter);
+    fail_unless(counters->check_hits == (uint64_t)hits * 2);
+    fail_unless(counters->check_misses == (uint64_t)(5000 - hits) * 2);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_scrub)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 100000;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter20", 1, &filter);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        bloomf_add(filter, (char*)&buf);
+    }
+
+    // Loaded filters are not scrubbed
+    uint64_t page = 0;
+    fail_unless(bloomf_scrub(filter, &page, 16) == 0);
+    fail_unless(bloomf_close(filter) == 0);
+
+    // Every page of the cold filter is checked
+    uint64_t pages = (bloomf_byte_size(filter) + 4095) / 4096;
+    uint64_t total = 0, checked;
+    while ((checked = bloomf_scrub(filter, &page, 16)) > 0) {
+        fail_unless(checked <= 16);
+        total += checked;
+    }
+    fail_unless(total == pages);
+    filter_counters *counters = bloomf_counters(filter);
+    fail_unless(counters->checksum_errors == 0);
+
+    // Corrupt a page of the data file
+    int fh = open("/tmp/bloomd/bloomd.test_filter20/data.000.mmap", O_RDWR);
+    fail_unless(fh >= 0);
+    unsigned char byte = 0xA5;
+    fail_unless(pwrite(fh, &byte, 1, 3 * 4096 + 7) == 1);
+    close(fh);
+
+    page = 0;
+    while (bloomf_scrub(filter, &page, 16) > 0);
+    fail_unless(counters->checksum_errors == 1);
+
+    // The corrupt filter is not loaded
+    fail_unless(bloomf_contains(filter, "foobar1") == -1);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_filter_growth_history)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.initial_capacity = 10000;
+    config.growth_horizon = 86400;
+
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter21", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->filter_config.growth_time > 0);
+
+    // Half a day in, at 10 keys a second, the second
+    // layer is sized for the other half of the day
+    filter->filter_config.growth_keys = 36000;
+    filter->filter_config.growth_secs = 3600;
+    filter->filter_config.growth_age = 43200;
+
+    char buf[100];
+    for (int i=0;i<10001;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        bloomf_add(filter, (char*)&buf);
+    }
+    uint64_t cap = bloomf_capacity(filter);
+    fail_unless(cap > 500000 && cap < 600000);
+
+    // The history is kept across a reload
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+    config.growth_horizon = 0;
+    res = init_bloom_filter(&config, "test_filter21", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->filter_config.growth_horizon == 86400);
+    fail_unless(filter->filter_config.growth_keys > 45000);
+    fail_unless(filter->filter_config.growth_age >= 43200);
+    fail_unless(bloomf_capacity(filter) == cap);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
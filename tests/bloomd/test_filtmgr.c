@@ -10,6 +10,7 @@
 #include "config.h"
 #include "filter.h"
 #include "filter_manager.h"
+#include "background.h"
 
 START_TEST(test_mgr_init_destroy)
 {
@@ -775,6 +776,67 @@ START_TEST(test_mgr_restore)
 }
 END_TEST
 
+START_TEST(test_mgr_restore_parallel_close)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.shutdown_workers = 4;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // Create many filters, with a different amount of data in each
+    char name[32];
+    char buf[32];
+    char *keys[1] = {buf};
+    char result[] = {0};
+    for (int i=0;i<10;i++) {
+        snprintf(name, sizeof(name), "zab9_%d", i);
+        res = filtmgr_create_filter(mgr, name, NULL);
+        fail_unless(res == 0);
+        for (int j=0;j<=i*100;j++) {
+            snprintf(buf, sizeof(buf), "key%d", j);
+            res = filtmgr_set_keys(mgr, name, (char**)&keys, 1, (char*)&result);
+            fail_unless(res == 0);
+        }
+    }
+
+    // Shutdown closes the filters in parallel
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+
+    char path[128];
+    for (int i=0;i<10;i++) {
+        snprintf(path, sizeof(path), "/tmp/bloomd/bloomd.zab9_%d/config.ini", i);
+        fail_unless(chmod(path, 0777) == 0);
+        snprintf(path, sizeof(path), "/tmp/bloomd/bloomd.zab9_%d/data.000.mmap", i);
+        fail_unless(chmod(path, 0777) == 0);
+    }
+
+    // Restore
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    for (int i=0;i<10;i++) {
+        snprintf(name, sizeof(name), "zab9_%d", i);
+        for (int j=0;j<=i*100;j++) {
+            snprintf(buf, sizeof(buf), "key%d", j);
+            result[0] = 0;
+            res = filtmgr_check_keys(mgr, name, (char**)&keys, 1, (char*)&result);
+            fail_unless(res == 0);
+            fail_unless(result[0]);
+        }
+        res = filtmgr_drop_filter(mgr, name);
+        fail_unless(res == 0);
+    }
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
 void test_mgr_cb(void *data, char *filter_name, bloom_filter* filter) {
     (void)filter_name;
     (void)filter;
@@ -809,3 +871,382 @@ START_TEST(test_mgr_callback)
 }
 END_TEST
 
+
+START_TEST(test_mgr_compact)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = filtmgr_compact_filter(mgr, "noop1");
+    fail_unless(res == -1);
+
+    // Filters need a key log
+    res = filtmgr_create_filter(mgr, "noop1", NULL);
+    fail_unless(res == 0);
+    res = filtmgr_compact_filter(mgr, "noop1");
+    fail_unless(res == -4);
+
+    bloom_config *custom = malloc(sizeof(bloom_config));
+    memcpy(custom, &config, sizeof(bloom_config));
+    custom->key_log = 1;
+    res = filtmgr_create_filter(mgr, "zab12", custom);
+    fail_unless(res == 0);
+
+    char *keys[] = {"hey","there","person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "zab12", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+
+    res = filtmgr_compact_filter(mgr, "zab12");
+    fail_unless(res == 0);
+    res = filtmgr_compact_filter(mgr, "zab12");
+    fail_unless(res == -3);
+
+    // Checks still work, sets are rejected
+    res = filtmgr_check_keys(mgr, "zab12", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] && result[1] && result[2]);
+    res = filtmgr_set_keys(mgr, "zab12", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == -3);
+
+    res = filtmgr_drop_filter(mgr, "noop1");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "zab12");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_flush_key_log)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    bloom_config *custom = malloc(sizeof(bloom_config));
+    memcpy(custom, &config, sizeof(bloom_config));
+    custom->key_log = 1;
+    res = filtmgr_create_filter(mgr, "zab18", custom);
+    fail_unless(res == 0);
+
+    // Logged keys are buffered until a flush
+    char *keys[] = {"hey","there","person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "zab18", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    struct stat log_st;
+    fail_unless(stat("/tmp/bloomd/bloomd.zab18/keys.log", &log_st) == 0);
+    fail_unless(log_st.st_size == 0);
+
+    // The log is on disk once the flush returns
+    res = filtmgr_flush_filter(mgr, "zab18");
+    fail_unless(res == 0);
+    fail_unless(stat("/tmp/bloomd/bloomd.zab18/keys.log", &log_st) == 0);
+    fail_unless(log_st.st_size == strlen("hey\nthere\nperson\n"));
+
+    char buf[64];
+    FILE *f = fopen("/tmp/bloomd/bloomd.zab18/keys.log", "r");
+    fail_unless(f != NULL);
+    size_t len = fread(buf, 1, sizeof(buf) - 1, f);
+    buf[len] = '\0';
+    fclose(f);
+    fail_unless(strcmp(buf, "hey\nthere\nperson\n") == 0);
+
+    res = filtmgr_drop_filter(mgr, "zab18");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_shrink)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    res = filtmgr_shrink_filter(mgr, "zab13", 0);
+    fail_unless(res == -1);
+
+    bloom_config *custom = malloc(sizeof(bloom_config));
+    memcpy(custom, &config, sizeof(bloom_config));
+    custom->initial_capacity = 1000000;
+    res = filtmgr_create_filter(mgr, "zab13", custom);
+    fail_unless(res == 0);
+
+    char *keys[] = {"hey","there","person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "zab13", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+
+    // Shrinks once, then is as small as it can be
+    res = filtmgr_shrink_filter(mgr, "zab13", 0);
+    fail_unless(res == 0);
+    res = filtmgr_shrink_filter(mgr, "zab13", 0);
+    fail_unless(res == 1);
+
+    // Keys are still present, and sets still work
+    res = filtmgr_check_keys(mgr, "zab13", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] && result[1] && result[2]);
+    char *more[] = {"more"};
+    res = filtmgr_set_keys(mgr, "zab13", (char**)&more, 1, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] == 1);
+
+    // Stable filters do not have layers to fold
+    custom = malloc(sizeof(bloom_config));
+    memcpy(custom, &config, sizeof(bloom_config));
+    custom->stable = 1;
+    res = filtmgr_create_filter(mgr, "zab14", custom);
+    fail_unless(res == 0);
+    res = filtmgr_shrink_filter(mgr, "zab14", 0);
+    fail_unless(res == -3);
+
+    res = filtmgr_drop_filter(mgr, "zab13");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "zab14");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+static volatile int REWRITES_DONE = 0;
+static void count_rewrite(owned_cmd *cmd) {
+    (void)cmd;
+    __sync_fetch_and_add(&REWRITES_DONE, 1);
+}
+
+START_TEST(test_mgr_rewrite_thread)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    bloom_config *custom = malloc(sizeof(bloom_config));
+    memcpy(custom, &config, sizeof(bloom_config));
+    custom->initial_capacity = 1000000;
+    res = filtmgr_create_filter(mgr, "zab15", custom);
+    fail_unless(res == 0);
+
+    char *keys[] = {"hey","there","person"};
+    char result[] = {0, 0, 0};
+    res = filtmgr_set_keys(mgr, "zab15", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+
+    custom = malloc(sizeof(bloom_config));
+    memcpy(custom, &config, sizeof(bloom_config));
+    custom->key_log = 1;
+    res = filtmgr_create_filter(mgr, "zab17", custom);
+    fail_unless(res == 0);
+    res = filtmgr_set_keys(mgr, "zab17", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+
+    // Nothing is queued without the thread
+    owned_cmd *cmd = owned_cmd_new("zab15", "", 0, 0);
+    cmd->rewrite = REWRITE_SHRINK;
+    fail_unless(queue_rewrite(cmd, count_rewrite) == -1);
+
+    int should_run = 1;
+    pthread_t t;
+    fail_unless(start_rewrite_thread(&config, mgr, &should_run, &t) == 1);
+
+    // Shrinks once, then is as small as it can be
+    owned_cmd *again = owned_cmd_new("zab15", "", 0, 0);
+    again->rewrite = REWRITE_SHRINK;
+    owned_cmd *missing = owned_cmd_new("zab16", "", 0, 0);
+    missing->rewrite = REWRITE_SHRINK;
+    owned_cmd *compact = owned_cmd_new("zab17", "", 0, 0);
+    compact->rewrite = REWRITE_COMPACT;
+    REWRITES_DONE = 0;
+    fail_unless(queue_rewrite(cmd, count_rewrite) == 0);
+    fail_unless(queue_rewrite(again, count_rewrite) == 0);
+    fail_unless(queue_rewrite(missing, count_rewrite) == 0);
+    fail_unless(queue_rewrite(compact, count_rewrite) == 0);
+    for (int i=0; i < 500 && REWRITES_DONE < 4; i++) usleep(10000);
+    fail_unless(REWRITES_DONE == 4);
+    fail_unless(cmd->res == 0);
+    fail_unless(again->res == 1);
+    fail_unless(missing->res == -1);
+    fail_unless(compact->res == 0);
+
+    // The folded and compacted filters still have the keys
+    res = filtmgr_check_keys(mgr, "zab15", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] && result[1] && result[2]);
+    res = filtmgr_check_keys(mgr, "zab17", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == 0);
+    fail_unless(result[0] && result[1] && result[2]);
+    res = filtmgr_set_keys(mgr, "zab17", (char**)&keys, 3, (char*)&result);
+    fail_unless(res == -3);
+
+    should_run = 0;
+    pthread_join(t, NULL);
+    fail_unless(queue_rewrite(cmd, count_rewrite) == -1);
+    owned_cmd_free(cmd);
+    owned_cmd_free(again);
+    owned_cmd_free(missing);
+    owned_cmd_free(compact);
+
+    res = filtmgr_drop_filter(mgr, "zab15");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "zab17");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+typedef struct {
+    int count;
+    int limit;
+    char names[8][16];
+} iter_names;
+
+static int collect_names_cb(void *data, char *filter_name, bloom_filter *filter) {
+    (void)filter;
+    iter_names *n = data;
+    fail_unless(n->count < 8);
+    strcpy(n->names[n->count++], filter_name);
+    return n->count == n->limit;
+}
+
+START_TEST(test_mgr_iter_filters)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.in_memory = 1;
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // Some filters in the map, and some only in the delta list
+    fail_unless(filtmgr_create_filter(mgr, "it.bar1", NULL) == 0);
+    fail_unless(filtmgr_create_filter(mgr, "it.bar3", NULL) == 0);
+    fail_unless(filtmgr_create_filter(mgr, "it.zyx", NULL) == 0);
+    filtmgr_vacuum(mgr);
+    fail_unless(filtmgr_create_filter(mgr, "it.bar4", NULL) == 0);
+    fail_unless(filtmgr_create_filter(mgr, "it.bar2", NULL) == 0);
+    fail_unless(filtmgr_create_filter(mgr, "it.baz", NULL) == 0);
+    fail_unless(filtmgr_drop_filter(mgr, "it.bar3") == 0);
+
+    // Every filter of the test, in order
+    iter_names all = {0, 0, {{0}}};
+    fail_unless(filtmgr_iter_filters(mgr, "it.", NULL, collect_names_cb, &all) == 0);
+    fail_unless(all.count == 5);
+    char *expected[] = {"it.bar1", "it.bar2", "it.bar4", "it.baz", "it.zyx"};
+    for (int i=0; i < 5; i++) {
+        fail_unless(!strcmp(all.names[i], expected[i]), "%d: %s", i, all.names[i]);
+    }
+
+    // Page through a prefix two at a time
+    iter_names page = {0, 2, {{0}}};
+    fail_unless(filtmgr_iter_filters(mgr, "it.bar", NULL, collect_names_cb, &page) == 1);
+    fail_unless(page.count == 2);
+    fail_unless(!strcmp(page.names[1], "it.bar2"));
+
+    iter_names page2 = {0, 2, {{0}}};
+    fail_unless(filtmgr_iter_filters(mgr, "it.bar", "it.bar2", collect_names_cb, &page2) == 0);
+    fail_unless(page2.count == 1);
+    fail_unless(!strcmp(page2.names[0], "it.bar4"));
+
+    // A cursor before the prefix starts at the prefix
+    iter_names page3 = {0, 0, {{0}}};
+    fail_unless(filtmgr_iter_filters(mgr, "it.baz", "a", collect_names_cb, &page3) == 0);
+    fail_unless(page3.count == 1);
+    fail_unless(!strcmp(page3.names[0], "it.baz"));
+
+    // A cursor past the prefix lists nothing
+    iter_names page4 = {0, 0, {{0}}};
+    fail_unless(filtmgr_iter_filters(mgr, "it.bar", "it.bar9", collect_names_cb, &page4) == 0);
+    fail_unless(page4.count == 0);
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_mgr_limit)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    // Nothing is limited, and filters are not looked up
+    double wait;
+    res = filtmgr_charge(mgr, "zab15", 1000000, 1000000, bucket_clock(), &wait);
+    fail_unless(res == 0 && wait == 0);
+    res = filtmgr_limit_filter(mgr, "zab15", 10, -1);
+    fail_unless(res == -1);
+
+    bloom_config *custom = malloc(sizeof(bloom_config));
+    memcpy(custom, &config, sizeof(bloom_config));
+    custom->rate_ops = 100;
+    res = filtmgr_create_filter(mgr, "zab15", custom);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "zab16", NULL);
+    fail_unless(res == 0);
+    filtmgr_vacuum(mgr);
+
+    // The burst is allowed, then clients must wait
+    double now = bucket_clock();
+    res = filtmgr_charge(mgr, "zab15", 50, 1000000, now, &wait);
+    fail_unless(res == 0 && wait == 0);
+    res = filtmgr_charge(mgr, "zab15", 100, 0, now, &wait);
+    fail_unless(res == 0 && wait > 0.4 && wait <= 0.5);
+    res = filtmgr_charge(mgr, "zab16", 1000000, 1000000, now, &wait);
+    fail_unless(res == 0 && wait == 0);
+    res = filtmgr_charge(mgr, "zab17", 1, 1, now, &wait);
+    fail_unless(res == -1);
+
+    // Limits are changed and persisted
+    res = filtmgr_limit_filter(mgr, "zab16", -1, 1000);
+    fail_unless(res == 0);
+    res = filtmgr_charge(mgr, "zab16", 1, 2000, now, &wait);
+    fail_unless(res == 0 && wait > 0);
+
+    bloom_filter_config filt_config;
+    memset(&filt_config, '\0', sizeof(filt_config));
+    res = filter_config_from_filename("/tmp/bloomd/bloomd.zab16/config.ini", &filt_config);
+    fail_unless(res == 0);
+    fail_unless(filt_config.rate_ops == 0);
+    fail_unless(filt_config.rate_bytes == 1000);
+
+    res = filtmgr_limit_filter(mgr, "zab15", 0, -1);
+    fail_unless(res == 0);
+    res = filtmgr_charge(mgr, "zab15", 1000000, 0, now, &wait);
+    fail_unless(res == 0 && wait == 0);
+
+    res = filtmgr_drop_filter(mgr, "zab15");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "zab16");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
@@ -0,0 +1,112 @@
+#include <check.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+/*
+ * The handover test runs two local bloomd processes, using
+ * the process helpers of the proxy tests.
+ */
+#define HANDOVER_TEST_PORT 18720
+#define HANDOVER_TEST_SOCKET "/tmp/bloomd_handover_test.sock"
+
+/**
+ * Connects to a port without retrying, as a refused
+ * connection is a failure of the handover.
+ * @return The socket, or -1 if refused.
+ */
+static int connect_handover_port(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+        close(fd);
+        return -1;
+    }
+    struct timeval tv = {10, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    return fd;
+}
+
+START_TEST(test_handover_serving)
+{
+    fail_unless(access("./bloomd", X_OK) == 0, "bloomd must be built to test the handover");
+    unlink(HANDOVER_TEST_SOCKET);
+
+    pid_t old = start_test_process("./bloomd", HANDOVER_TEST_PORT,
+            "handover_socket = " HANDOVER_TEST_SOCKET "\n");
+    int fd = connect_test_port(HANDOVER_TEST_PORT);
+    fail_unless(fd >= 0);
+
+    // Give the old process an in-memory filter with some keys
+    char *resp = test_command(fd, "create handme\n");
+    fail_unless(strcmp(resp, "Done\n") == 0, resp);
+    free(resp);
+    resp = test_command(fd, "bulk handme foo bar baz\n");
+    fail_unless(strcmp(resp, "Yes Yes Yes\n") == 0, resp);
+    free(resp);
+
+    // Wait for the handover thread to listen
+    for (int i=0; i < 100 && access(HANDOVER_TEST_SOCKET, F_OK); i++) usleep(20000);
+    fail_unless(access(HANDOVER_TEST_SOCKET, F_OK) == 0);
+
+    // Start the new process, which takes over and stops the old one
+    pid_t new = run_test_process("./bloomd", HANDOVER_TEST_PORT);
+    fail_unless(new > 0);
+
+    // Keep connecting while the processes swap. The listener is
+    // never closed, so no connection is refused, and each one sees
+    // the keys. A connection accepted by the old process just as it
+    // stops may be closed unanswered, and the client reconnects.
+    struct timeval start, now;
+    gettimeofday(&start, NULL);
+    int old_running = 1, answered_new = 0, status = 0;
+    while (old_running || !answered_new) {
+        gettimeofday(&now, NULL);
+        fail_unless(now.tv_sec - start.tv_sec < 20, "handover did not complete");
+        if (old_running && waitpid(old, &status, WNOHANG) == old) old_running = 0;
+
+        int client = connect_handover_port(HANDOVER_TEST_PORT);
+        fail_unless(client >= 0, "connection refused during handover");
+        resp = test_command(client, "check handme foo\n");
+        close(client);
+        if (*resp) {
+            fail_unless(strcmp(resp, "Yes\n") == 0, resp);
+            if (!old_running) answered_new = 1;
+        }
+        free(resp);
+    }
+    fail_unless(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+
+    // Clients of the old process must reconnect
+    resp = read_test_response(fd);
+    fail_unless(*resp == '\0', resp);
+    free(resp);
+    close(fd);
+
+    // The new process has the keys, and takes new ones
+    fd = connect_handover_port(HANDOVER_TEST_PORT);
+    fail_unless(fd >= 0);
+    resp = test_command(fd, "multi handme foo bar baz other\n");
+    fail_unless(strcmp(resp, "Yes Yes Yes No\n") == 0, resp);
+    free(resp);
+    resp = test_command(fd, "set handme other\n");
+    fail_unless(strcmp(resp, "Yes\n") == 0, resp);
+    free(resp);
+    close(fd);
+
+    stop_test_process(new, HANDOVER_TEST_PORT);
+    unlink(HANDOVER_TEST_SOCKET);
+}
+END_TEST
@@ -0,0 +1,158 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "inspect.h"
+#include "workpool.h"
+#include "bloom.h"
+
+/**
+ * Writes a bloom filter file holding the keys prefix0 to prefixN
+ */
+static void make_layer(char *path, uint64_t bytes, char *prefix, int num) {
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    fail_unless(bitmap_from_filename(path, bytes, 1, SHARED, &map) == 0);
+    fail_unless(bf_from_bitmap(&map, 4, 1, &filter) == 0);
+    filter.header->capacity = 10000;
+
+    char buf[64];
+    for (int i=0; i < num; i++) {
+        snprintf(buf, sizeof(buf), "%s%d", prefix, i);
+        bf_add(&filter, buf);
+    }
+    fail_unless(bf_close(&filter) == 0);
+}
+
+START_TEST(test_inspect_popcount)
+{
+    // Spans several chunks, with a tail that is not whole words
+    uint64_t len = 9 * 1024 * 1024 + 13;
+    unsigned char *buf = calloc(1, len);
+    uint64_t expect = 0;
+    for (uint64_t i=0; i < len; i += 7) {
+        buf[i] = 0x11;
+        expect += 2;
+    }
+    if ((len - 1) % 7 == 0) expect -= 2;
+    buf[len - 1] = 0xFF;
+    expect += 8;
+
+    bloom_workpool *pool;
+    fail_unless(init_workpool(3, &pool) == 0);
+    fail_unless(inspect_popcount(NULL, buf, len) == expect);
+    fail_unless(inspect_popcount(pool, buf, len) == expect);
+    fail_unless(inspect_popcount(pool, buf, 0) == 0);
+    fail_unless(destroy_workpool(pool) == 0);
+    free(buf);
+}
+END_TEST
+
+START_TEST(test_inspect_merge)
+{
+    uint64_t len = 5 * 1024 * 1024 + 3;
+    unsigned char *dst = calloc(1, len);
+    unsigned char *src = calloc(1, len);
+    for (uint64_t i=0; i < len; i++) {
+        dst[i] = (i % 2) ? 0x0F : 0;
+        src[i] = (i % 3) ? 0xF0 : 0;
+    }
+
+    bloom_workpool *pool;
+    fail_unless(init_workpool(2, &pool) == 0);
+    inspect_merge(pool, dst, src, len);
+
+    // Checked once, as each fail_unless reports to the runner
+    uint64_t wrong = 0;
+    for (uint64_t i=0; i < len; i++) {
+        unsigned char expect = ((i % 2) ? 0x0F : 0) | ((i % 3) ? 0xF0 : 0);
+        if (dst[i] != expect) wrong++;
+    }
+    fail_unless(wrong == 0);
+    fail_unless(destroy_workpool(pool) == 0);
+    free(dst);
+    free(src);
+}
+END_TEST
+
+START_TEST(test_inspect_layer)
+{
+    char *path = "/tmp/bloomd_inspect.mmap";
+    make_layer(path, 64 * 1024, "key", 5000);
+
+    layer_stats stats;
+    fail_unless(inspect_layer(path, NULL, &stats) == 0);
+    fail_unless(stats.type == LAYER_BLOOM);
+    fail_unless(stats.bytes == 64 * 1024);
+    fail_unless(stats.k_num == 4);
+    fail_unless(stats.count <= 5000 && stats.count > 4900);
+    fail_unless(stats.capacity == 10000);
+    fail_unless(stats.cells == (64 * 1024 - 512) * 8);
+    fail_unless(stats.cells_set > 0);
+
+    // The bits agree with the count
+    double keys = inspect_estimate_keys(&stats);
+    fail_unless(keys > 4800 && keys < 5200);
+    double fp = inspect_fp_rate(&stats);
+    fail_unless(fp > 0 && fp < 0.01);
+
+    // Only the header is read
+    layer_stats header;
+    fail_unless(inspect_header(path, &header) == 0);
+    fail_unless(header.count == stats.count);
+    fail_unless(header.cells == stats.cells);
+    fail_unless(header.cells_set == 0);
+
+    // A truncated header, and a missing file
+    fail_unless(truncate(path, 100) == 0);
+    fail_unless(inspect_layer(path, NULL, &stats) == -2);
+    fail_unless(unlink(path) == 0);
+    fail_unless(inspect_layer(path, NULL, &stats) == -1);
+
+    // A file that is not a filter
+    FILE *f = fopen(path, "w");
+    fputs("not a filter", f);
+    fclose(f);
+    fail_unless(inspect_layer(path, NULL, &stats) == 0);
+    fail_unless(stats.type == LAYER_UNKNOWN);
+    unlink(path);
+}
+END_TEST
+
+START_TEST(test_inspect_merge_layer)
+{
+    char *a = "/tmp/bloomd_inspect_a.mmap";
+    char *b = "/tmp/bloomd_inspect_b.mmap";
+    char *c = "/tmp/bloomd_inspect_c.mmap";
+    make_layer(a, 64 * 1024, "a", 3000);
+    make_layer(b, 64 * 1024, "b", 3000);
+    make_layer(c, 32 * 1024, "c", 100);
+
+    bloom_workpool *pool;
+    fail_unless(init_workpool(2, &pool) == 0);
+    fail_unless(inspect_merge_layer(a, c, pool) == -2);
+    fail_unless(inspect_merge_layer(a, "/tmp/bloomd_inspect_none", pool) == -1);
+    fail_unless(inspect_merge_layer(a, b, pool) == 0);
+    fail_unless(destroy_workpool(pool) == 0);
+
+    // The merged layer has the keys of both
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    fail_unless(bitmap_from_filename(a, 64 * 1024, 0, SHARED, &map) == 0);
+    fail_unless(bf_from_bitmap(&map, 4, 0, &filter) == 0);
+    fail_unless(bf_size(&filter) > 5800 && bf_size(&filter) < 6200);
+
+    char buf[64];
+    for (int i=0; i < 3000; i++) {
+        snprintf(buf, sizeof(buf), "a%d", i);
+        fail_unless(bf_contains(&filter, buf) == 1);
+        snprintf(buf, sizeof(buf), "b%d", i);
+        fail_unless(bf_contains(&filter, buf) == 1);
+    }
+    bf_close(&filter);
+    unlink(a);
+    unlink(b);
+    unlink(c);
+}
+END_TEST
@@ -0,0 +1,68 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "libbloomd.h"
+
+START_TEST(test_embed_open_close)
+{
+    bloomd_engine *engine;
+    int res = bloomd_open(NULL, &engine);
+    fail_unless(res == 0);
+    fail_unless(engine != NULL);
+
+    res = bloomd_close(engine);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_embed_bad_config)
+{
+    bloomd_engine *engine;
+    int res = bloomd_open("/tmp/does_not_exist_bloomd.ini", &engine);
+    fail_unless(res != 0);
+    fail_unless(engine == NULL);
+}
+END_TEST
+
+static void embed_list_cb(void *data, char *filter_name) {
+    int *count = data;
+    if (!strcmp(filter_name, "embed1")) *count += 1;
+}
+
+START_TEST(test_embed_set_check)
+{
+    bloomd_engine *engine;
+    int res = bloomd_open(NULL, &engine);
+    fail_unless(res == 0);
+
+    fail_unless(bloomd_create(engine, "bad name", 0, 0, -1) == -4);
+    fail_unless(bloomd_create(engine, "embed1", 1, 0, -1) == -4);
+    fail_unless(bloomd_create(engine, "embed1", 20000, 0.001, 1) == 0);
+    fail_unless(bloomd_create(engine, "embed1", 0, 0, -1) == -1);
+
+    char *keys[] = {"hey", "there", "person"};
+    char result[] = {0, 0, 0};
+    fail_unless(bloomd_check(engine, "embed2", (char**)&keys, 3, (char*)&result) == -1);
+    fail_unless(bloomd_set(engine, "embed1", (char**)&keys, 2, (char*)&result) == 0);
+    fail_unless(result[0] == 1 && result[1] == 1);
+
+    fail_unless(bloomd_check(engine, "embed1", (char**)&keys, 3, (char*)&result) == 0);
+    fail_unless(result[0] == 1 && result[1] == 1 && result[2] == 0);
+
+    bloomd_filter_info info;
+    fail_unless(bloomd_info(engine, "embed1", &info) == 0);
+    fail_unless(info.size == 2);
+    fail_unless(info.capacity == 20000);
+    fail_unless(info.in_memory == 1);
+    fail_unless(info.set_hits == 2);
+
+    int count = 0;
+    fail_unless(bloomd_list(engine, "emb", embed_list_cb, &count) == 0);
+    fail_unless(count == 1);
+
+    fail_unless(bloomd_flush(engine, NULL) == 0);
+    fail_unless(bloomd_drop(engine, "embed1") == 0);
+    fail_unless(bloomd_close(engine) == 0);
+}
+END_TEST
@@ -0,0 +1,165 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <syslog.h>
+#include <unistd.h>
+#include "logger.h"
+
+static void* log_many(void *in) {
+    int id = *(int*)in;
+    for (int i=0;i<10;i++) {
+        bloom_log(LOG_DEBUG, "Logger test thread %d message %d", id, i);
+    }
+    return NULL;
+}
+
+START_TEST(test_logger_direct)
+{
+    // Without the log thread, messages go straight to syslog
+    bloom_log_stats before, after;
+    log_stats(&before);
+    bloom_log(LOG_DEBUG, "Logger test direct %d", 1);
+    log_stats(&after);
+    fail_unless(after.written == before.written);
+    fail_unless(after.dropped == before.dropped);
+}
+END_TEST
+
+START_TEST(test_logger_threads)
+{
+    bloom_log_stats before, after;
+    log_stats(&before);
+
+    int should_run = 1;
+    pthread_t t;
+    fail_unless(start_log_thread(&should_run, &t) == 1);
+
+    pthread_t threads[4];
+    int ids[4];
+    for (int i=0;i<4;i++) {
+        ids[i] = i;
+        pthread_create(&threads[i], NULL, log_many, &ids[i]);
+    }
+    for (int i=0;i<4;i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    should_run = 0;
+    pthread_join(t, NULL);
+
+    // Every message is written once the thread stops
+    log_stats(&after);
+    fail_unless(after.written - before.written == 40);
+    fail_unless(after.dropped == before.dropped);
+}
+END_TEST
+
+START_TEST(test_logger_rate_limit)
+{
+    bloom_log_stats before, after;
+    log_stats(&before);
+
+    int should_run = 1;
+    pthread_t t;
+    fail_unless(start_log_thread(&should_run, &t) == 1);
+
+    // Only the first few of the same format are kept
+    for (int i=0;i<1000;i++) {
+        bloom_log(LOG_DEBUG, "Logger test repeated %d", i);
+    }
+    log_stats(&after);
+    fail_unless(after.suppressed - before.suppressed >= 900);
+
+    // Masked messages are not counted at all
+    int mask = setlogmask(LOG_UPTO(LOG_INFO));
+    should_run = 0;
+    pthread_join(t, NULL);
+    should_run = 1;
+    fail_unless(start_log_thread(&should_run, &t) == 1);
+    log_stats(&before);
+    bloom_log(LOG_DEBUG, "Logger test masked %d", 1);
+    should_run = 0;
+    pthread_join(t, NULL);
+    setlogmask(mask);
+
+    log_stats(&after);
+    fail_unless(after.suppressed == before.suppressed);
+    fail_unless(after.written == before.written);
+}
+END_TEST
+
+static volatile int LOGGER_STOPPED = 0;
+static void* log_until_stopped(void *in) {
+    (void)in;
+    bloom_log(LOG_DEBUG, "Logger test waiting %d", 1);
+    while (!LOGGER_STOPPED) usleep(1000);
+    return NULL;
+}
+
+START_TEST(test_logger_summary)
+{
+    bloom_log_stats before, after;
+    log_stats(&before);
+
+    int should_run = 1;
+    pthread_t t;
+    fail_unless(start_log_thread(&should_run, &t) == 1);
+
+    // A thread which exits after the log thread stops
+    pthread_t waiting;
+    LOGGER_STOPPED = 0;
+    pthread_create(&waiting, NULL, log_until_stopped, NULL);
+
+    // Skipped messages are summarized, without the format
+    // being logged again
+    for (int i=0;i<1000;i++) {
+        bloom_log(LOG_DEBUG, "Logger test summarized %d", i);
+    }
+    usleep(1500000);
+    log_stats(&after);
+    fail_unless(after.suppressed - before.suppressed >= 900);
+    fail_unless(after.summarized - before.summarized == after.suppressed - before.suppressed);
+
+    // And again when the log thread stops
+    for (int i=0;i<1000;i++) {
+        bloom_log(LOG_DEBUG, "Logger test summarized %d", i);
+    }
+    should_run = 0;
+    pthread_join(t, NULL);
+    log_stats(&after);
+    fail_unless(after.summarized - before.summarized == after.suppressed - before.suppressed);
+
+    LOGGER_STOPPED = 1;
+    pthread_join(waiting, NULL);
+}
+END_TEST
+
+START_TEST(test_logger_rate_formats)
+{
+    bloom_log_stats before, after;
+    log_stats(&before);
+
+    int should_run = 1;
+    pthread_t t;
+    fail_unless(start_log_thread(&should_run, &t) == 1);
+
+    // Many formats logged in turn still share a limit,
+    // rather than resetting each other
+    static char fmts[40][32];
+    for (int i=0;i<40;i++) {
+        snprintf(fmts[i], sizeof(fmts[i]), "Logger test format %d:%%d", i);
+    }
+    for (int j=0;j<100;j++) {
+        for (int i=0;i<40;i++) bloom_log(LOG_DEBUG, fmts[i], j);
+    }
+    should_run = 0;
+    pthread_join(t, NULL);
+
+    // At most 16 formats and the rest are allowed 20 a
+    // second each, even if a second passed meanwhile
+    log_stats(&after);
+    fail_unless(after.suppressed - before.suppressed >= 4000 - 2 * 17 * 20);
+    fail_unless(after.summarized - before.summarized == after.suppressed - before.suppressed);
+}
+END_TEST
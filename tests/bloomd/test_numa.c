@@ -0,0 +1,81 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "numa.h"
+#include "owner.h"
+#include "filter.h"
+
+START_TEST(test_numa_topology)
+{
+    int nodes = numa_num_nodes();
+    fail_unless(nodes >= 1);
+
+    // Workers take the nodes in turn
+    for (int i=0;i<16;i++) {
+        fail_unless(numa_worker_node(i) == numa_worker_node(i + nodes));
+    }
+
+    // Filters are on the node of their owner
+    fail_unless(numa_filter_node("foobar", 8) == numa_worker_node(filter_owner("foobar", 8)));
+}
+END_TEST
+
+START_TEST(test_numa_bind_memory)
+{
+    int node = numa_worker_node(0);
+    if (node < 0) return;
+
+    uint64_t len = 16 * 4096;
+    char *addr = mmap(NULL, len, PROT_READ|PROT_WRITE, MAP_ANON|MAP_PRIVATE, -1, 0);
+    fail_unless(addr != MAP_FAILED);
+    addr[0] = 1;
+    fail_unless(numa_bind_memory(addr, len, node) == 0);
+    fail_unless(numa_bind_memory(addr, len, -1) == -EINVAL);
+    for (uint64_t i=0;i<len;i+=4096) addr[i] = 1;
+    munmap(addr, len);
+
+    fail_unless(numa_pin_thread(node) == 0);
+}
+END_TEST
+
+START_TEST(test_numa_filter_placement)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+    config.worker_threads = 4;
+
+    // Not placed unless NUMA aware
+    bloom_filter *filter = NULL;
+    res = init_bloom_filter(&config, "test_filter19", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->numa_node == -1);
+    fail_unless(destroy_bloom_filter(filter) == 0);
+
+    config.numa_aware = 1;
+    res = init_bloom_filter(&config, "test_filter19", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->numa_node == numa_filter_node("test_filter19", 4));
+    fail_unless(bloomf_add(filter, "test") == 1);
+    fail_unless(bloomf_contains(filter, "test") == 1);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+
+    // Pages mapped from the data files cannot be placed
+    config.use_mmap = 1;
+    res = init_bloom_filter(&config, "test_filter19", 1, &filter);
+    fail_unless(res == 0);
+    fail_unless(filter->numa_node == -1);
+    fail_unless(bloomf_add(filter, "test") == 1);
+    fail_unless(bloomf_contains(filter, "test") == 1);
+
+    res = bloomf_delete(filter);
+    fail_unless(res == 0);
+    res = destroy_bloom_filter(filter);
+    fail_unless(res == 0);
+}
+END_TEST
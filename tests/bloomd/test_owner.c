@@ -0,0 +1,322 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "owner.h"
+#include "conn_handler.h"
+
+START_TEST(test_owned_cmd_single_key)
+{
+    char keys[] = "foo bar baz";
+    owned_cmd *cmd = owned_cmd_new("filter", keys, strlen(keys), 0);
+    fail_unless(strcmp(cmd->filter_name, "filter") == 0);
+    fail_unless(cmd->num_keys == 1);
+    fail_unless(strcmp(cmd->keys[0], "foo bar baz") == 0);
+    fail_unless(cmd->done == 0);
+    fail_unless(cmd->num_done == 0);
+    owned_cmd_free(cmd);
+}
+END_TEST
+
+START_TEST(test_owned_cmd_split_keys)
+{
+    char keys[] = "foo bar baz";
+    owned_cmd *cmd = owned_cmd_new("filter", keys, strlen(keys), 1);
+    fail_unless(cmd->num_keys == 3);
+    fail_unless(strcmp(cmd->keys[0], "foo") == 0);
+    fail_unless(strcmp(cmd->keys[1], "bar") == 0);
+    fail_unless(strcmp(cmd->keys[2], "baz") == 0);
+
+    // The input is copied
+    fail_unless(strcmp(keys, "foo bar baz") == 0);
+    owned_cmd_free(cmd);
+
+    // Stops at an empty key
+    char trailing[] = "foo bar  baz";
+    cmd = owned_cmd_new("filter", trailing, strlen(trailing), 1);
+    fail_unless(cmd->num_keys == 2);
+    owned_cmd_free(cmd);
+}
+END_TEST
+
+START_TEST(test_owner_queue_order)
+{
+    owner_queue q = {NULL};
+    fail_unless(owner_queue_take(&q) == NULL);
+
+    owned_cmd *cmds[3];
+    for (int i=0; i < 3; i++) {
+        cmds[i] = owned_cmd_new("filter", "key", 3, 0);
+        fail_unless(owner_queue_push(&q, cmds[i]) == (i == 0));
+    }
+
+    owned_cmd *cmd = owner_queue_take(&q);
+    for (int i=0; i < 3; i++) {
+        fail_unless(cmd == cmds[i]);
+        cmd = cmd->next;
+        owned_cmd_free(cmds[i]);
+    }
+    fail_unless(cmd == NULL);
+    fail_unless(owner_queue_take(&q) == NULL);
+}
+END_TEST
+
+typedef struct {
+    owner_queue *q;
+    int id;
+} owner_producer;
+
+static void* owner_queue_producer(void *in) {
+    owner_producer *p = in;
+    for (int i=0; i < 10000; i++) {
+        owned_cmd *cmd = owned_cmd_new("filter", "key", 3, 0);
+        cmd->origin = p->id;
+        cmd->num_done = i;
+        owner_queue_push(p->q, cmd);
+    }
+    return NULL;
+}
+
+START_TEST(test_owner_queue_concurrent)
+{
+    owner_queue q = {NULL};
+    pthread_t t[4];
+    owner_producer producers[4];
+    for (int i=0; i < 4; i++) {
+        producers[i].q = &q;
+        producers[i].id = i;
+        pthread_create(&t[i], NULL, owner_queue_producer, producers + i);
+    }
+
+    // Consume while producing, the commands of
+    // each producer are seen in order
+    int total = 0;
+    int last[4] = {-1, -1, -1, -1};
+    while (total < 40000) {
+        owned_cmd *cmd = owner_queue_take(&q);
+        while (cmd) {
+            owned_cmd *next = cmd->next;
+            fail_unless(cmd->num_done == last[cmd->origin] + 1);
+            last[cmd->origin] = cmd->num_done;
+            total++;
+            owned_cmd_free(cmd);
+            cmd = next;
+        }
+    }
+    for (int i=0; i < 4; i++) pthread_join(t[i], NULL);
+    fail_unless(owner_queue_take(&q) == NULL);
+}
+END_TEST
+
+START_TEST(test_filter_owner)
+{
+    for (int workers=1; workers < 8; workers++) {
+        int seen[8] = {0};
+        char name[32];
+        for (int i=0; i < 1000; i++) {
+            snprintf(name, sizeof(name), "filter%d", i);
+            int owner = filter_owner(name, workers);
+            fail_unless(owner >= 0 && owner < workers);
+            fail_unless(owner == filter_owner(name, workers));
+            seen[owner] = 1;
+        }
+
+        // Every worker owns some filters
+        for (int i=0; i < workers; i++) fail_unless(seen[i]);
+    }
+}
+END_TEST
+
+START_TEST(test_owned_cmds_grouped)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "grp1", NULL);
+    fail_unless(res == 0);
+
+    // Sets from several clients, a check, and a missing filter
+    char *keys[] = {"foo bar", "bar baz", "zip", "foo zip", "foo"};
+    char *filters[] = {"grp1", "grp1", "grp1", "grp1", "grp2"};
+    int is_set[] = {1, 1, 1, 0, 1};
+    owned_cmd *cmds = NULL, *cmd;
+    owned_cmd *all[5];
+    for (int i=4; i >= 0; i--) {
+        cmd = owned_cmd_new(filters[i], keys[i], strlen(keys[i]), 1);
+        cmd->is_set = is_set[i];
+        cmd->next = cmds;
+        cmds = cmd;
+        all[i] = cmd;
+    }
+
+    bloom_conn_handler handle;
+    handle.config = &config;
+    handle.mgr = mgr;
+    handle.conn = NULL;
+    handle.pool = NULL;
+    execute_owned_cmds(&handle, cmds);
+
+    // Results are as if the sets were applied in order
+    for (int i=0; i < 5; i++) fail_unless(all[i]->done == 1);
+    fail_unless(all[0]->res == 0 && all[0]->num_done == 2);
+    fail_unless(all[0]->result[0] == 1 && all[0]->result[1] == 1);
+    fail_unless(all[1]->res == 0 && all[1]->num_done == 2);
+    fail_unless(all[1]->result[0] == 0 && all[1]->result[1] == 1);
+    fail_unless(all[2]->res == 0 && all[2]->result[0] == 1);
+    fail_unless(all[3]->res == 0 && all[3]->num_done == 2);
+    fail_unless(all[3]->result[0] == 1 && all[3]->result[1] == 1);
+    fail_unless(all[4]->res == -1 && all[4]->num_done == 0);
+
+    // Commands stay linked in their original order
+    cmd = cmds;
+    for (int i=0; i < 5; i++, cmd = cmd->next) fail_unless(cmd == all[i]);
+    for (int i=0; i < 5; i++) owned_cmd_free(all[i]);
+
+    res = filtmgr_drop_filter(mgr, "grp1");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_batch_malformed)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+
+    bloom_conn_handler handle;
+    handle.config = &config;
+    handle.mgr = mgr;
+    handle.conn = NULL;
+    handle.pool = NULL;
+
+    // Entries need a filter, an op of c, check, s or set, and a key
+    int *results;
+    uint64_t bytes;
+    double wait;
+    fail_unless(execute_batch_cmd(&handle, NULL, 0, 0, &results, &bytes, &wait) == -1);
+    char *bad[] = {"bat1", "bat1 c", "bat1 c foo bat1", "bat1 x foo",
+        "bat1 c foo bat1 sets bar", " c foo", "bat1 c ", "bat1  foo", "bat1 c foo "};
+    char buf[64];
+    for (int i=0; i < (int)(sizeof(bad) / sizeof(char*)); i++) {
+        strcpy(buf, bad[i]);
+        res = execute_batch_cmd(&handle, buf, strlen(buf), 0, &results, &bytes, &wait);
+        fail_unless(res == -1, bad[i]);
+    }
+
+    // Every op is accepted, and a missing filter fails its entries
+    strcpy(buf, "bat1 c foo bat1 check bar bat1 s baz bat1 set zip");
+    res = execute_batch_cmd(&handle, buf, strlen(buf), 0, &results, &bytes, &wait);
+    fail_unless(res == 4);
+    for (int i=0; i < 4; i++) fail_unless(results[i] == -1);
+    fail_unless(bytes == 12);
+    free(results);
+
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
+
+START_TEST(test_batch_filters)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "bat1", NULL);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "bat2", NULL);
+    fail_unless(res == 0);
+
+    // A compacted filter is read-only
+    bloom_config *custom = malloc(sizeof(bloom_config));
+    memcpy(custom, &config, sizeof(bloom_config));
+    custom->key_log = 1;
+    res = filtmgr_create_filter(mgr, "bat3", custom);
+    fail_unless(res == 0);
+    char *sealed[] = {"sealed"};
+    char result[1];
+    res = filtmgr_set_keys(mgr, "bat3", (char**)&sealed, 1, (char*)&result);
+    fail_unless(res == 0);
+    res = filtmgr_compact_filter(mgr, "bat3");
+    fail_unless(res == 0);
+
+    // Sets then checks to two filters, interleaved, several times
+    // the 4096 keys that are done in a single run
+    int num_keys = 9000;
+    int num_entries = 4 * num_keys + 4;
+    char *buf = malloc(num_entries * 24);
+    int len = 0;
+    uint64_t key_bytes = 0;
+    for (int i=0; i < num_keys; i++) {
+        len += sprintf(buf + len, "bat1 s k%d bat2 set k%d ", i, i);
+    }
+    for (int i=0; i < num_keys; i++) {
+        len += sprintf(buf + len, "bat2 c k%d bat1 check k%d ", i, i);
+    }
+    len += sprintf(buf + len, "bat3 s new bat3 c sealed bat4 c k0 bat4 s k0");
+    for (int i=0; i < num_keys; i++) key_bytes += 4 * (snprintf(NULL, 0, "k%d", i));
+    key_bytes += 3 + 6 + 2 + 2;
+
+    bloom_conn_handler handle;
+    handle.config = &config;
+    handle.mgr = mgr;
+    handle.conn = NULL;
+    handle.pool = NULL;
+
+    int *results;
+    uint64_t bytes;
+    double wait;
+    res = execute_batch_cmd(&handle, buf, len, 0, &results, &bytes, &wait);
+    fail_unless(res == num_entries);
+    fail_unless(bytes == key_bytes);
+    fail_unless(wait == 0);
+
+    // Results are in the order sent, and checks see the earlier sets
+    int added = 0, wrong = 0;
+    for (int i=0; i < 2 * num_keys; i++) {
+        if (results[i] == 1) added++;
+        else if (results[i] != 0) wrong++;
+    }
+    for (int i=2 * num_keys; i < 4 * num_keys; i++) {
+        if (results[i] != 1) wrong++;
+    }
+    fail_unless(wrong == 0);
+    fail_unless(added > 2 * num_keys - 10);
+    fail_unless(results[4 * num_keys] == -3);
+    fail_unless(results[4 * num_keys + 1] == 1);
+    fail_unless(results[4 * num_keys + 2] == -1);
+    fail_unless(results[4 * num_keys + 3] == -1);
+    free(results);
+    free(buf);
+
+    // The keys were set in the filters
+    char *keys[] = {"k0", "k4095", "k4096", "k8999"};
+    char found[] = {0, 0, 0, 0};
+    res = filtmgr_check_keys(mgr, "bat2", (char**)&keys, 4, (char*)&found);
+    fail_unless(res == 0);
+    fail_unless(found[0] && found[1] && found[2] && found[3]);
+
+    res = filtmgr_drop_filter(mgr, "bat1");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "bat2");
+    fail_unless(res == 0);
+    res = filtmgr_drop_filter(mgr, "bat3");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
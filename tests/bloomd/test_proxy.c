@@ -0,0 +1,443 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include "hashring.h"
+
+START_TEST(test_hash_ring_spread)
+{
+    char *nodes[] = {"10.0.0.1:8673", "10.0.0.2:8673", "10.0.0.3:8673"};
+    bloom_hash_ring *ring;
+    fail_unless(init_hash_ring(nodes, 3, 160, &ring) == 0);
+
+    int counts[3] = {0, 0, 0};
+    char key[32];
+    for (int i=0; i < 30000; i++) {
+        int len = snprintf(key, sizeof(key), "filter%d", i);
+        int node = hash_ring_lookup(ring, key, len);
+        fail_unless(node >= 0 && node < 3);
+        fail_unless(node == hash_ring_lookup(ring, key, len));
+        counts[node]++;
+    }
+
+    // Each node should get about a third
+    for (int i=0; i < 3; i++) {
+        fail_unless(counts[i] > 7000 && counts[i] < 13000);
+    }
+    destroy_hash_ring(ring);
+}
+END_TEST
+
+START_TEST(test_hash_ring_order)
+{
+    // The order of the nodes does not change where keys go
+    char *nodes[] = {"10.0.0.1:8673", "10.0.0.2:8673", "10.0.0.3:8673"};
+    char *reversed[] = {"10.0.0.3:8673", "10.0.0.2:8673", "10.0.0.1:8673"};
+    bloom_hash_ring *ring, *ring_rev;
+    fail_unless(init_hash_ring(nodes, 3, 160, &ring) == 0);
+    fail_unless(init_hash_ring(reversed, 3, 160, &ring_rev) == 0);
+
+    char key[32];
+    for (int i=0; i < 10000; i++) {
+        int len = snprintf(key, sizeof(key), "filter%d", i);
+        fail_unless(hash_ring_lookup(ring, key, len) == 2 - hash_ring_lookup(ring_rev, key, len));
+    }
+    destroy_hash_ring(ring);
+    destroy_hash_ring(ring_rev);
+}
+END_TEST
+
+START_TEST(test_hash_ring_add_node)
+{
+    char *nodes[] = {"10.0.0.1:8673", "10.0.0.2:8673", "10.0.0.3:8673", "10.0.0.4:8673"};
+    bloom_hash_ring *ring, *ring_more;
+    fail_unless(init_hash_ring(nodes, 3, 160, &ring) == 0);
+    fail_unless(init_hash_ring(nodes, 4, 160, &ring_more) == 0);
+
+    // Only the keys taken by the new node move
+    int moved = 0;
+    char key[32];
+    for (int i=0; i < 10000; i++) {
+        int len = snprintf(key, sizeof(key), "filter%d", i);
+        int before = hash_ring_lookup(ring, key, len);
+        int after = hash_ring_lookup(ring_more, key, len);
+        if (before != after) {
+            fail_unless(after == 3);
+            moved++;
+        }
+    }
+    fail_unless(moved > 1500 && moved < 3500);
+    destroy_hash_ring(ring);
+    destroy_hash_ring(ring_more);
+}
+END_TEST
+
+START_TEST(test_hash_ring_bad_args)
+{
+    char *nodes[] = {"10.0.0.1:8673"};
+    bloom_hash_ring *ring;
+    fail_unless(init_hash_ring(nodes, 0, 160, &ring) == -1);
+    fail_unless(init_hash_ring(nodes, 1, 0, &ring) == -1);
+
+    // A single node gets everything
+    fail_unless(init_hash_ring(nodes, 1, 1, &ring) == 0);
+    fail_unless(hash_ring_lookup(ring, "foo", 3) == 0);
+    fail_unless(hash_ring_lookup(ring, "bar", 3) == 0);
+    destroy_hash_ring(ring);
+}
+END_TEST
+
+/*
+ * The proxy tests run local bloomd and bloomd-proxy
+ * processes from the working directory.
+ */
+#define PROXY_TEST_PORT 18710
+#define PROXY_TEST_BACKENDS 3
+
+/**
+ * Runs a process with the configuration written by
+ * start_test_process. Running it again starts a second
+ * process on the same data directory.
+ */
+static pid_t run_test_process(char *binary, int port) {
+    char path[64];
+    snprintf(path, sizeof(path), "/tmp/bloomd_proxy_test_%d.ini", port);
+    pid_t pid = fork();
+    if (pid == 0) {
+        int fd = open("/dev/null", O_WRONLY);
+        dup2(fd, 1);
+        dup2(fd, 2);
+        execl(binary, binary, "-f", path, NULL);
+        _exit(1);
+    }
+    return pid;
+}
+
+static pid_t start_test_process(char *binary, int port, char *extra) {
+    char path[64], data_dir[64], conf[512];
+    snprintf(path, sizeof(path), "/tmp/bloomd_proxy_test_%d.ini", port);
+    snprintf(data_dir, sizeof(data_dir), "/tmp/bloomd_proxy_test_%d", port);
+
+    // Start clean, even if an earlier run failed
+    snprintf(conf, sizeof(conf), "rm -rf %s", data_dir);
+    system(conf);
+    snprintf(conf, sizeof(conf), "[bloomd]\ntcp_port = %d\nudp_port = %d\ndata_dir = %s\nin_memory = 1\n%s",
+            port, port + 100, data_dir, extra);
+    FILE *f = fopen(path, "w");
+    fputs(conf, f);
+    fclose(f);
+    return run_test_process(binary, port);
+}
+
+static void stop_test_process(pid_t pid, int port) {
+    char path[64];
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    snprintf(path, sizeof(path), "/tmp/bloomd_proxy_test_%d.ini", port);
+    unlink(path);
+    snprintf(path, sizeof(path), "rm -rf /tmp/bloomd_proxy_test_%d", port);
+    system(path);
+}
+
+static int connect_test_port(int port) {
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    // Wait for the process to start listening
+    for (int i=0; i < 100; i++) {
+        int fd = socket(AF_INET, SOCK_STREAM, 0);
+        if (!connect(fd, (struct sockaddr*)&addr, sizeof(addr))) {
+            struct timeval tv = {10, 0};
+            setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+            return fd;
+        }
+        close(fd);
+        usleep(20000);
+    }
+    return -1;
+}
+
+/**
+ * Reads a response, a single line or a START to END list.
+ * Returns a buffer to free, empty on failure.
+ */
+static char* read_test_response(int fd) {
+    int size = 4096, len = 0, n;
+    char *buf = malloc(size);
+    while (1) {
+        if (len + 1 == size) buf = realloc(buf, size *= 2);
+        n = read(fd, buf + len, size - len - 1);
+        if (n <= 0) break;
+        len += n;
+        buf[len] = '\0';
+        if (strncmp(buf, "START\n", 6) && strchr(buf, '\n')) break;
+        if (len >= 10 && !strcmp(buf + len - 4, "END\n")) break;
+    }
+    buf[len] = '\0';
+    return buf;
+}
+
+static char* test_command(int fd, char *cmd) {
+    write(fd, cmd, strlen(cmd));
+    return read_test_response(fd);
+}
+
+static int count_lines(char *buf) {
+    int lines = 0;
+    for (; *buf; buf++) {
+        if (*buf == '\n') lines++;
+    }
+    return lines;
+}
+
+START_TEST(test_proxy_instances)
+{
+    fail_unless(access("./bloomd", X_OK) == 0, "bloomd must be built to test the proxy");
+    fail_unless(access("./bloomd-proxy", X_OK) == 0, "bloomd-proxy must be built to test it");
+
+    // Start the backends, and a proxy in front of them
+    pid_t backends[PROXY_TEST_BACKENDS];
+    char *names[PROXY_TEST_BACKENDS];
+    char proxy_conf[256] = "proxy_backends = ";
+    for (int i=0; i < PROXY_TEST_BACKENDS; i++) {
+        int port = PROXY_TEST_PORT + 1 + i;
+        backends[i] = start_test_process("./bloomd", port, "");
+        asprintf(&names[i], "127.0.0.1:%d", port);
+        strcat(proxy_conf, names[i]);
+        strcat(proxy_conf, (i + 1 < PROXY_TEST_BACKENDS) ? "," : "\n");
+    }
+    for (int i=0; i < PROXY_TEST_BACKENDS; i++) {
+        int bfd = connect_test_port(PROXY_TEST_PORT + 1 + i);
+        fail_unless(bfd >= 0);
+        close(bfd);
+    }
+    pid_t proxy = start_test_process("./bloomd-proxy", PROXY_TEST_PORT, proxy_conf);
+    int fd = connect_test_port(PROXY_TEST_PORT);
+    fail_unless(fd >= 0);
+
+    // Filters are created and used through the proxy
+    char cmd[256], *res;
+    for (int i=0; i < 30; i++) {
+        snprintf(cmd, sizeof(cmd), "create proxy%d\n", i);
+        res = test_command(fd, cmd);
+        fail_unless(strcmp(res, "Done\n") == 0);
+        free(res);
+
+        snprintf(cmd, sizeof(cmd), "s proxy%d key\n", i);
+        res = test_command(fd, cmd);
+        fail_unless(strcmp(res, "Yes\n") == 0);
+        free(res);
+
+        snprintf(cmd, sizeof(cmd), "m proxy%d key other\n", i);
+        res = test_command(fd, cmd);
+        fail_unless(strcmp(res, "Yes No\n") == 0);
+        free(res);
+    }
+
+    // Pipelined commands are answered in order
+    char pipelined[1024] = "";
+    for (int i=0; i < 30; i++) {
+        snprintf(cmd, sizeof(cmd), "c proxy%d %s\n", i, (i % 2) ? "key" : "other");
+        strcat(pipelined, cmd);
+    }
+    write(fd, pipelined, strlen(pipelined));
+    char expected[256] = "", got[256] = "";
+    int got_len = 0, n;
+    for (int i=0; i < 30; i++) strcat(expected, (i % 2) ? "Yes\n" : "No\n");
+    while (got_len < (int)strlen(expected) &&
+           (n = read(fd, got + got_len, sizeof(got) - 1 - got_len)) > 0) {
+        got_len += n;
+        got[got_len] = '\0';
+    }
+    fail_unless(strcmp(got, expected) == 0);
+
+    // The filters are spread over the backends by the ring
+    bloom_hash_ring *ring;
+    fail_unless(init_hash_ring(names, PROXY_TEST_BACKENDS, 160, &ring) == 0);
+    int total = 0;
+    for (int i=0; i < PROXY_TEST_BACKENDS; i++) {
+        int bfd = connect_test_port(PROXY_TEST_PORT + 1 + i);
+        fail_unless(bfd >= 0);
+        res = test_command(bfd, "list proxy\n");
+        int filters = count_lines(res) - 2;
+        fail_unless(filters > 0);
+        total += filters;
+
+        char *line = strchr(res, '\n') + 1;
+        for (int j=0; j < filters; j++) {
+            int name_len = strchr(line, ' ') - line;
+            fail_unless(hash_ring_lookup(ring, line, name_len) == i);
+            line = strchr(line, '\n') + 1;
+        }
+        free(res);
+        close(bfd);
+    }
+    fail_unless(total == 30);
+    destroy_hash_ring(ring);
+
+    // Lists are merged in order, and paged
+    res = test_command(fd, "list proxy\n");
+    fail_unless(count_lines(res) == 32);
+    free(res);
+    res = test_command(fd, "list proxy limit=3\n");
+    fail_unless(count_lines(res) == 5);
+    fail_unless(strncmp(res, "START\nproxy0 ", 13) == 0);
+    fail_unless(strstr(res, "\nproxy1 ") != NULL);
+    fail_unless(strstr(res, "\nproxy10 ") != NULL);
+    free(res);
+    res = test_command(fd, "list proxy limit=3 after=proxy10\n");
+    fail_unless(count_lines(res) == 5);
+    fail_unless(strncmp(res, "START\nproxy11 ", 14) == 0);
+    free(res);
+
+    // Commands on every filter go to every backend
+    res = test_command(fd, "flush\n");
+    fail_unless(strcmp(res, "Done\n") == 0);
+    free(res);
+    res = test_command(fd, "info proxy5\n");
+    fail_unless(strncmp(res, "START\n", 6) == 0);
+    free(res);
+    res = test_command(fd, "info missing\n");
+    fail_unless(strcmp(res, "Filter does not exist\n") == 0);
+    free(res);
+    res = test_command(fd, "stats\n");
+    fail_unless(strstr(res, "\nbackends 3\n") != NULL);
+    free(res);
+    res = test_command(fd, "bogus\n");
+    fail_unless(strcmp(res, "Client Error: Command not supported\n") == 0);
+    free(res);
+
+    // Batches are split over the backends and answered in order
+    res = test_command(fd, "batch proxy0 s bk proxy1 c bk proxy0 c bk proxy7 c key missing c x proxy1 s bk proxy1 c bk\n");
+    fail_unless(strcmp(res, "Yes No Yes Yes Missing Yes Yes\n") == 0);
+    free(res);
+    res = test_command(fd, "batch proxy0 c\n");
+    fail_unless(strncmp(res, "Client Error: ", 14) == 0);
+    free(res);
+    res = test_command(fd, "batch proxy0 c bk proxy1 z bk\n");
+    fail_unless(strncmp(res, "Client Error: ", 14) == 0);
+    free(res);
+
+    // Losing a backend only fails its own filters
+    fail_unless(init_hash_ring(names, PROXY_TEST_BACKENDS, 160, &ring) == 0);
+    stop_test_process(backends[0], PROXY_TEST_PORT + 1);
+    for (int i=0; i < 30; i++) {
+        snprintf(cmd, sizeof(cmd), "c proxy%d key\n", i);
+        res = test_command(fd, cmd);
+        int owner = hash_ring_lookup(ring, cmd + 2, strchr(cmd + 2, ' ') - (cmd + 2));
+        if (owner == 0)
+            fail_unless(strcmp(res, "Backend unavailable\n") == 0);
+        else
+            fail_unless(strcmp(res, "Yes\n") == 0);
+        free(res);
+    }
+    res = test_command(fd, "list\n");
+    fail_unless(strcmp(res, "Backend unavailable\n") == 0);
+    free(res);
+    destroy_hash_ring(ring);
+
+    close(fd);
+    stop_test_process(proxy, PROXY_TEST_PORT);
+    for (int i=1; i < PROXY_TEST_BACKENDS; i++) {
+        stop_test_process(backends[i], PROXY_TEST_PORT + 1 + i);
+    }
+    for (int i=0; i < PROXY_TEST_BACKENDS; i++) free(names[i]);
+}
+END_TEST
+
+static double test_elapsed(struct timeval *start) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    return (now.tv_sec - start->tv_sec) + (now.tv_usec - start->tv_usec) / 1e6;
+}
+
+START_TEST(test_proxy_stalled_backend)
+{
+    fail_unless(access("./bloomd", X_OK) == 0, "bloomd must be built to test the proxy");
+    fail_unless(access("./bloomd-proxy", X_OK) == 0, "bloomd-proxy must be built to test it");
+
+    // The second backend takes connections, but never answers
+    int port = PROXY_TEST_PORT + 1, stalled_port = PROXY_TEST_PORT + 2;
+    pid_t backend = start_test_process("./bloomd", port, "");
+    int bfd = connect_test_port(port);
+    fail_unless(bfd >= 0);
+    close(bfd);
+
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(stalled_port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int stalled = socket(AF_INET, SOCK_STREAM, 0);
+    int flag = 1;
+    setsockopt(stalled, SOL_SOCKET, SO_REUSEADDR, &flag, sizeof(flag));
+    fail_unless(bind(stalled, (struct sockaddr*)&addr, sizeof(addr)) == 0);
+    fail_unless(listen(stalled, 16) == 0);
+
+    char conf[256], *names[2];
+    asprintf(&names[0], "127.0.0.1:%d", port);
+    asprintf(&names[1], "127.0.0.1:%d", stalled_port);
+    snprintf(conf, sizeof(conf), "proxy_backends = %s,%s\n", names[0], names[1]);
+    pid_t proxy = start_test_process("./bloomd-proxy", PROXY_TEST_PORT, conf);
+
+    // Find a filter on each backend
+    bloom_hash_ring *ring;
+    fail_unless(init_hash_ring(names, 2, 160, &ring) == 0);
+    char live[32] = "", slow[32] = "", name[32];
+    for (int i=0; !*live || !*slow; i++) {
+        int len = snprintf(name, sizeof(name), "stall%d", i);
+        strcpy(hash_ring_lookup(ring, name, len) ? slow : live, name);
+    }
+    destroy_hash_ring(ring);
+
+    // A client waits on the stalled backend
+    char cmd[256], *res;
+    int fd = connect_test_port(PROXY_TEST_PORT);
+    fail_unless(fd >= 0);
+    struct timeval start;
+    gettimeofday(&start, NULL);
+    snprintf(cmd, sizeof(cmd), "c %s key\n", slow);
+    write(fd, cmd, strlen(cmd));
+
+    // Meanwhile the worker serves a client of the other backend
+    int other = connect_test_port(PROXY_TEST_PORT);
+    fail_unless(other >= 0);
+    snprintf(cmd, sizeof(cmd), "create %s\n", live);
+    res = test_command(other, cmd);
+    fail_unless(strcmp(res, "Done\n") == 0);
+    free(res);
+    snprintf(cmd, sizeof(cmd), "s %s key\n", live);
+    res = test_command(other, cmd);
+    fail_unless(strcmp(res, "Yes\n") == 0);
+    free(res);
+    fail_unless(test_elapsed(&start) < 2);
+
+    // The stalled backend is dropped once it times out
+    res = read_test_response(fd);
+    fail_unless(strcmp(res, "Backend unavailable\n") == 0);
+    free(res);
+    fail_unless(test_elapsed(&start) >= 4);
+    res = test_command(other, "stats\n");
+    fail_unless(strstr(res, "\nbackend_errors 0\n") == NULL);
+    free(res);
+
+    close(fd);
+    close(other);
+    close(stalled);
+    stop_test_process(proxy, PROXY_TEST_PORT);
+    stop_test_process(backend, port);
+    free(names[0]);
+    free(names[1]);
+}
+END_TEST
@@ -0,0 +1,57 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "ratelimit.h"
+
+START_TEST(test_bucket_unlimited)
+{
+    bloom_bucket bucket;
+    bucket_init(&bucket, 0);
+    double now = bucket_clock();
+    for (int i=0; i < 1000; i++) {
+        fail_unless(bucket_take(&bucket, 1000000, now) == 0);
+    }
+}
+END_TEST
+
+START_TEST(test_bucket_debt)
+{
+    bloom_bucket bucket;
+    bucket_init(&bucket, 100);
+    double start = bucket.last;
+
+    // Starts full, then goes into debt
+    fail_unless(bucket_take(&bucket, 100, start) == 0);
+    fail_unless(bucket_take(&bucket, 50, start) == 0.5);
+
+    // Refills over time
+    fail_unless(bucket_take(&bucket, 50, start + 1) == 0);
+    fail_unless(bucket_take(&bucket, 10, start + 1.1) == 0);
+    fail_unless(bucket_take(&bucket, 10, start + 1.1) > 0);
+
+    // Holds at most a second worth
+    fail_unless(bucket_take(&bucket, 150, start + 100) == 0.5);
+
+    // Time going backwards does not refill
+    fail_unless(bucket_take(&bucket, 0, start) == 0.5);
+}
+END_TEST
+
+START_TEST(test_bucket_set_rate)
+{
+    bloom_bucket bucket;
+    bucket_init(&bucket, 10);
+    double now = bucket.last;
+    fail_unless(bucket_take(&bucket, 20, now) == 1);
+
+    // A new rate starts out full
+    bucket_set_rate(&bucket, 1000);
+    now = bucket.last;
+    fail_unless(bucket_take(&bucket, 1000, now) == 0);
+    fail_unless(bucket_take(&bucket, 500, now) == 0.5);
+
+    // And can be lifted
+    bucket_set_rate(&bucket, 0);
+    fail_unless(bucket_take(&bucket, 500, now) == 0);
+}
+END_TEST
@@ -0,0 +1,143 @@
+#include <check.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "workpool.h"
+#include "conn_handler.h"
+
+/**
+ * Counts how many times each task is run
+ */
+static void count_task(void *arg, int task) {
+    int *counts = arg;
+    __sync_fetch_and_add(counts + task, 1);
+}
+
+START_TEST(test_workpool_init_destroy)
+{
+    bloom_workpool *pool;
+    fail_unless(init_workpool(4, &pool) == 0);
+    fail_unless(pool->num_threads == 4);
+    fail_unless(destroy_workpool(pool) == 0);
+}
+END_TEST
+
+START_TEST(test_workpool_run)
+{
+    bloom_workpool *pool;
+    fail_unless(init_workpool(3, &pool) == 0);
+
+    // Every task runs exactly once
+    int counts[1000];
+    for (int n=0; n < 20; n++) {
+        memset(counts, 0, sizeof(counts));
+        workpool_run(pool, 1000, count_task, counts);
+        for (int i=0; i < 1000; i++) fail_unless(counts[i] == 1);
+    }
+
+    // Runs on the caller without a pool
+    memset(counts, 0, sizeof(counts));
+    workpool_run(NULL, 10, count_task, counts);
+    for (int i=0; i < 10; i++) fail_unless(counts[i] == 1);
+    fail_unless(destroy_workpool(pool) == 0);
+}
+END_TEST
+
+static void* workpool_submitter(void *in) {
+    bloom_workpool *pool = in;
+    int *counts = calloc(500, sizeof(int));
+    for (int n=0; n < 50; n++) {
+        workpool_run(pool, 500, count_task, counts);
+    }
+    for (int i=0; i < 500; i++) {
+        if (counts[i] != 50) {
+            free(counts);
+            return (void*)1;
+        }
+    }
+    free(counts);
+    return NULL;
+}
+
+START_TEST(test_workpool_concurrent)
+{
+    bloom_workpool *pool;
+    fail_unless(init_workpool(2, &pool) == 0);
+
+    // Many workers submit jobs at once
+    pthread_t threads[4];
+    for (int i=0; i < 4; i++) {
+        pthread_create(threads + i, NULL, workpool_submitter, pool);
+    }
+    void *res;
+    for (int i=0; i < 4; i++) {
+        pthread_join(threads[i], &res);
+        fail_unless(res == NULL);
+    }
+    fail_unless(destroy_workpool(pool) == 0);
+}
+END_TEST
+
+START_TEST(test_workpool_parallel_check)
+{
+    bloom_config config;
+    int res = config_from_filename(NULL, &config);
+    fail_unless(res == 0);
+
+    bloom_filtmgr *mgr;
+    res = init_filter_manager(&config, 0, &mgr);
+    fail_unless(res == 0);
+    res = filtmgr_create_filter(mgr, "par1", NULL);
+    fail_unless(res == 0);
+
+    // Set every even key, and check every key at once
+    int num_keys = 20000;
+    char *keys = malloc(num_keys * 16);
+    int len = 0;
+    for (int i=0; i < num_keys; i++) {
+        len += sprintf(keys + len, (i) ? " key%d" : "key%d", i);
+    }
+    char *key_buf[1];
+    char result_buf[1];
+    char key[16];
+    for (int i=0; i < num_keys; i += 2) {
+        sprintf(key, "key%d", i);
+        key_buf[0] = key;
+        fail_unless(filtmgr_set_keys(mgr, "par1", key_buf, 1, result_buf) == 0);
+    }
+
+    bloom_workpool *pool;
+    fail_unless(init_workpool(3, &pool) == 0);
+    bloom_conn_handler handle;
+    handle.config = &config;
+    handle.mgr = mgr;
+    handle.conn = NULL;
+    handle.pool = pool;
+
+    owned_cmd *cmd = owned_cmd_new("par1", keys, len, 1);
+    fail_unless(cmd->num_keys == num_keys);
+    execute_owned_cmds(&handle, cmd);
+    fail_unless(cmd->res == 0);
+    fail_unless(cmd->num_done == num_keys);
+    int found = 0;
+    for (int i=0; i < num_keys; i += 2) fail_unless(cmd->result[i] == 1);
+    for (int i=1; i < num_keys; i += 2) found += cmd->result[i];
+    fail_unless(found < 10);
+    owned_cmd_free(cmd);
+
+    // Errors are reported for every key
+    cmd = owned_cmd_new("par2", keys, len, 1);
+    execute_owned_cmds(&handle, cmd);
+    fail_unless(cmd->res == -1);
+    fail_unless(cmd->num_done == 0);
+    owned_cmd_free(cmd);
+
+    free(keys);
+    fail_unless(destroy_workpool(pool) == 0);
+    res = filtmgr_drop_filter(mgr, "par1");
+    fail_unless(res == 0);
+    res = destroy_filter_manager(mgr);
+    fail_unless(res == 0);
+}
+END_TEST
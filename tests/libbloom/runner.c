@@ -4,6 +4,8 @@
 #include "test_bitmap.c"
 #include "test_bloom.c"
 #include "test_sbf.c"
+#include "test_fuse.c"
+#include "test_stable.c"
 
 int main(void)
 {
@@ -11,6 +13,8 @@ int main(void)
     TCase *tc1 = tcase_create("Bitmap");
     TCase *tc2 = tcase_create("Bloom");
     TCase *tc3 = tcase_create("SBF");
+    TCase *tc4 = tcase_create("Fuse");
+    TCase *tc5 = tcase_create("Stable");
     SRunner *sr = srunner_create(s1);
     int nf;
 
@@ -55,6 +59,13 @@ int main(void)
     tcase_add_test(tc1, close_does_flush);
     tcase_add_test(tc1, flush_does_write_persist);
     tcase_add_test(tc1, close_does_flush_persist);
+    tcase_add_test(tc1, dirty_bytes_persist);
+    tcase_add_test(tc1, dirty_bytes_anonymous);
+    tcase_add_test(tc1, crc32c_known_values);
+    tcase_add_test(tc1, checksum_bitmap_persist);
+    tcase_add_test(tc1, checksum_bitmap_interrupted);
+    tcase_add_test(tc1, checksum_bitmap_shared_and_rename);
+    tcase_add_test(tc1, checksum_bitmap_stale_sidecar);
 
     // Add the bloom tests
     suite_add_tcase(s1, tc2);
@@ -89,6 +100,10 @@ int main(void)
     tcase_add_test(tc2, test_bf_fp_prob_extended);
 
     tcase_add_test(tc2, test_bf_shared_compatible_persist);
+    tcase_add_test(tc2, test_bf_fold);
+    tcase_add_test(tc2, test_bf_fold_full);
+    tcase_add_test(tc2, test_bf_contains_sorted);
+    tcase_add_test(tc2, test_bf_probe_k_range);
 
     // Add the sbf tests
     suite_add_tcase(s1, tc3);
@@ -101,6 +116,35 @@ int main(void)
     tcase_add_test(tc3, test_sbf_flush);
     tcase_add_test(tc3, test_sbf_close_does_flush);
     tcase_add_test(tc3, sbf_fp_prob);
+    tcase_add_test(tc3, sbf_header_capacity);
+    tcase_add_test(tc3, sbf_add_keys_batch);
+    tcase_add_test(tc3, sbf_contains_keys_batch);
+    tcase_add_test(tc3, sbf_sorted_batches);
+    tcase_add_test(tc3, sbf_history_decay);
+    tcase_add_test(tc3, sbf_growth_capacity_policy);
+
+    // Add the fuse tests
+    suite_add_tcase(s1, tc4);
+    tcase_add_test(tc4, fuse_header_size);
+    tcase_add_test(tc4, fuse_unique);
+    tcase_add_test(tc4, fuse_build_small_map);
+    tcase_add_test(tc4, fuse_build_contains);
+    tcase_add_test(tc4, fuse_build_contains_16);
+    tcase_add_test(tc4, fuse_bits_for_prob_test);
+    tcase_add_test(tc4, fuse_build_tiny);
+    tcase_add_test(tc4, fuse_restore);
+    tcase_add_test(tc4, fuse_restore_bad_magic);
+
+    // Add the stable tests
+    suite_add_tcase(s1, tc5);
+    tcase_add_test(tc5, stable_header_size);
+    tcase_add_test(tc5, stable_params);
+    tcase_add_test(tc5, stable_no_map);
+    tcase_add_test(tc5, stable_add_contains);
+    tcase_add_test(tc5, stable_recent_keys);
+    tcase_add_test(tc5, stable_fp_bounded);
+    tcase_add_test(tc5, stable_restore);
+    tcase_add_test(tc5, stable_small_k);
 
     srunner_run_all(sr, CK_ENV);
     nf = srunner_ntests_failed(sr);
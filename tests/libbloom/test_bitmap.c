@@ -7,6 +7,7 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include "bitmap.h"
+#include "crc32c.h"
 
 /*
 bloom_bitmap *bitmap_from_file(int fileno, size_t len) {
@@ -80,6 +81,7 @@ START_TEST(make_bitmap_nofile_create_persistent)
     bloom_bitmap map;
     int res = bitmap_from_filename("/tmp/mmap_nofile_create_persist", 4096, 1, PERSISTENT, &map);
     unlink("/tmp/mmap_nofile_create_persist");
+    bitmap_drop_checksums("/tmp/mmap_nofile_create_persist");
     fail_unless(res == 0);
 }
 END_TEST
@@ -115,6 +117,7 @@ START_TEST(flush_bitmap_file_persistent)
     fail_unless(res == 0);
     fail_unless(bitmap_flush(&map) == 0);
     unlink("/tmp/mmap_flush_bitmap_persist");
+    bitmap_drop_checksums("/tmp/mmap_flush_bitmap_persist");
 }
 END_TEST
 
@@ -158,6 +161,7 @@ START_TEST(close_bitmap_file_persistent)
     fail_unless(bitmap_close(&map) == 0);
     fail_unless(map.mmap == NULL);
     unlink("/tmp/mmap_close_bitmap_persist");
+    bitmap_drop_checksums("/tmp/mmap_close_bitmap_persist");
 }
 END_TEST
 
@@ -182,6 +186,7 @@ START_TEST(double_close_bitmap_file_persist)
     fail_unless(bitmap_close(&map) == 0);
     fail_unless(map.mmap == NULL);
     unlink("/tmp/mmap_close_bitmap_persist");
+    bitmap_drop_checksums("/tmp/mmap_close_bitmap_persist");
     fail_unless(bitmap_close(&map) < 0);
 }
 END_TEST
@@ -251,6 +256,7 @@ START_TEST(getbit_bitmap_file_persist_zero)
         fail_unless(bitmap_getbit((&map), idx) == 0);
     }
     unlink("/tmp/persist_getbit_zero");
+    bitmap_drop_checksums("/tmp/persist_getbit_zero");
 }
 END_TEST
 
@@ -264,6 +270,7 @@ START_TEST(getbit_bitmap_file_persist_one)
         fail_unless(bitmap_getbit((&map), idx) == 1);
     }
     unlink("/tmp/persist_getbit_one");
+    bitmap_drop_checksums("/tmp/persist_getbit_one");
 }
 END_TEST
 
@@ -340,6 +347,7 @@ START_TEST(setbit_bitmap_file_persist_one)
         fail_unless(map.mmap[idx] == 255);
     }
     unlink("/tmp/persist_setbit_one");
+    bitmap_drop_checksums("/tmp/persist_setbit_one");
 }
 END_TEST
 
@@ -404,6 +412,38 @@ START_TEST(flush_does_write_persist) {
         fail_unless(map2.mmap[idx] == 255);
     }
     unlink("/tmp/persist_flush_write");
+    bitmap_drop_checksums("/tmp/persist_flush_write");
+}
+END_TEST
+
+START_TEST(dirty_bytes_persist) {
+    bloom_bitmap map;
+    int res = bitmap_from_filename("/tmp/persist_dirty_bytes", 16384, 1,
+            PERSISTENT, &map);
+    fchmod(map.fileno, 0777);
+    fail_unless(res == 0);
+    fail_unless(bitmap_dirty_bytes(&map) == 0);
+
+    // Dirty the first and last pages
+    bitmap_setbit((&map), 0);
+    bitmap_setbit((&map), 16384*8 - 1);
+    fail_unless(bitmap_dirty_bytes(&map) == 8192);
+
+    bitmap_flush(&map);
+    fail_unless(bitmap_dirty_bytes(&map) == 0);
+    bitmap_close(&map);
+    unlink("/tmp/persist_dirty_bytes");
+    bitmap_drop_checksums("/tmp/persist_dirty_bytes");
+}
+END_TEST
+
+START_TEST(dirty_bytes_anonymous) {
+    bloom_bitmap map;
+    int res = bitmap_from_file(-1, 4096, ANONYMOUS, &map);
+    fail_unless(res == 0);
+    bitmap_setbit((&map), 0);
+    fail_unless(bitmap_dirty_bytes(&map) == 0);
+    bitmap_close(&map);
 }
 END_TEST
 
@@ -425,6 +465,164 @@ START_TEST(close_does_flush_persist) {
         fail_unless(map.mmap[idx] == 255);
     }
     unlink("/tmp/persist_close_flush");
+    bitmap_drop_checksums("/tmp/persist_close_flush");
+}
+END_TEST
+
+
+START_TEST(crc32c_known_values) {
+    unsigned char *check = (unsigned char*)"123456789";
+    fail_unless(crc32c(0, check, 9) == 0xE3069283);
+    fail_unless(crc32c(crc32c(0, check, 4), check + 4, 5) == 0xE3069283);
+    fail_unless(crc32c(0, check, 0) == 0);
+
+    // Unaligned starts and tails agree with a whole pass
+    unsigned char buf[4099];
+    for (int i=0; i < 4099; i++) buf[i] = i * 31;
+    uint32_t whole = crc32c(0, buf, 4099);
+    fail_unless(crc32c(crc32c(0, buf, 3), buf + 3, 4096) == whole);
 }
 END_TEST
 
+START_TEST(checksum_bitmap_persist) {
+    char *path = "/tmp/mmap_checksum_persist";
+    char *crc_path = "/tmp/mmap_checksum_persist.crc";
+    uint64_t len = 3 * 4096 + 100;
+    unlink(crc_path);
+
+    bloom_bitmap map;
+    fail_unless(bitmap_from_filename(path, len, 1, PERSISTENT, &map) == 0);
+    fail_unless(access(crc_path, F_OK) == 0);
+    for (uint64_t idx = 0; idx < len * 8; idx += 97) {
+        bitmap_setbit((&map), idx);
+    }
+    fail_unless(bitmap_close(&map) == 0);
+
+    // All four pages match
+    uint64_t bad = 0;
+    fail_unless(bitmap_verify_file(path, 0, 100, &bad) == 4);
+    fail_unless(bad == 0);
+    fail_unless(bitmap_verify_file(path, 4, 100, &bad) == 0);
+    fail_unless(bitmap_from_filename(path, len, 0, PERSISTENT, &map) == 0);
+    fail_unless(bitmap_getbit((&map), 97) == 1);
+    fail_unless(bitmap_close(&map) == 0);
+
+    // Flip a bit in the third page behind our back
+    int fh = open(path, O_RDWR);
+    unsigned char byte;
+    fail_unless(pread(fh, &byte, 1, 2 * 4096 + 10) == 1);
+    byte ^= 0x4;
+    fail_unless(pwrite(fh, &byte, 1, 2 * 4096 + 10) == 1);
+    close(fh);
+
+    fail_unless(bitmap_verify_file(path, 0, 100, &bad) == 4);
+    fail_unless(bad == 1);
+    bad = 0;
+    fail_unless(bitmap_verify_file(path, 0, 2, &bad) == 2);
+    fail_unless(bad == 0);
+    fail_unless(bitmap_from_filename(path, len, 0, PERSISTENT, &map) == -EBADMSG);
+
+    // Dropping the checksums accepts the data
+    fail_unless(bitmap_drop_checksums(path) == 0);
+    fail_unless(bitmap_verify_file(path, 0, 100, &bad) == -2);
+    fail_unless(bitmap_from_filename(path, len, 0, PERSISTENT, &map) == 0);
+    fail_unless(bitmap_close(&map) == 0);
+    bad = 0;
+    fail_unless(bitmap_verify_file(path, 0, 100, &bad) == 4);
+    fail_unless(bad == 0);
+
+    unlink(path);
+    unlink(crc_path);
+}
+END_TEST
+
+START_TEST(checksum_bitmap_interrupted) {
+    char *path = "/tmp/mmap_checksum_interrupted";
+    char *crc_path = "/tmp/mmap_checksum_interrupted.crc";
+    bloom_bitmap map;
+    fail_unless(bitmap_from_filename(path, 8192, 1, PERSISTENT, &map) == 0);
+    bitmap_setbit((&map), 5000 * 8);
+    fail_unless(bitmap_flush(&map) == 0);
+    fail_unless(bitmap_close(&map) == 0);
+
+    // Mark a flush as in progress, and change a page
+    int fh = open(crc_path, O_RDWR);
+    uint64_t seq = 1;
+    fail_unless(pwrite(fh, &seq, sizeof(seq), 16) == sizeof(seq));
+    close(fh);
+    fh = open(path, O_RDWR);
+    unsigned char byte = 0xFF;
+    fail_unless(pwrite(fh, &byte, 1, 6000) == 1);
+    close(fh);
+
+    // The checksums cannot be trusted, so they are rebuilt
+    uint64_t bad = 0;
+    fail_unless(bitmap_verify_file(path, 0, 100, &bad) == -2);
+    fail_unless(bitmap_from_filename(path, 8192, 0, PERSISTENT, &map) == 0);
+    fail_unless(map.mmap[6000] == 0xFF);
+    fail_unless(bitmap_close(&map) == 0);
+    fail_unless(bitmap_verify_file(path, 0, 100, &bad) == 2);
+    fail_unless(bad == 0);
+
+    unlink(path);
+    unlink(crc_path);
+}
+END_TEST
+
+START_TEST(checksum_bitmap_shared_and_rename) {
+    char *path = "/tmp/mmap_checksum_rename";
+    char *new_path = "/tmp/mmap_checksum_renamed";
+    bloom_bitmap map;
+    fail_unless(bitmap_from_filename(path, 4096, 1, PERSISTENT, &map) == 0);
+    fail_unless(bitmap_close(&map) == 0);
+
+    // The checksums move with the bitmap
+    fail_unless(bitmap_rename_file(path, new_path) == 0);
+    fail_unless(access("/tmp/mmap_checksum_rename.crc", F_OK) == -1);
+    fail_unless(access("/tmp/mmap_checksum_renamed.crc", F_OK) == 0);
+
+    // A SHARED bitmap drops them
+    fail_unless(bitmap_from_filename(new_path, 4096, 0, SHARED, &map) == 0);
+    fail_unless(access("/tmp/mmap_checksum_renamed.crc", F_OK) == -1);
+    fail_unless(bitmap_close(&map) == 0);
+    unlink(new_path);
+}
+END_TEST
+
+START_TEST(checksum_bitmap_stale_sidecar) {
+    char *path = "/tmp/mmap_checksum_stale";
+    char *other = "/tmp/mmap_checksum_stale_other";
+    bloom_bitmap map;
+    fail_unless(bitmap_from_filename(other, 8192, 1, PERSISTENT, &map) == 0);
+    bitmap_setbit((&map), 100);
+    fail_unless(bitmap_close(&map) == 0);
+    fail_unless(bitmap_from_filename(path, 8192, 1, PERSISTENT, &map) == 0);
+    bitmap_setbit((&map), 5000 * 8);
+    fail_unless(bitmap_close(&map) == 0);
+
+    // Leave the checksums of the other file, of the same size, beside it
+    char crcs[4096];
+    int fh = open("/tmp/mmap_checksum_stale_other.crc", O_RDONLY);
+    ssize_t len = read(fh, crcs, sizeof(crcs));
+    close(fh);
+    fail_unless(len > 0);
+    fh = open("/tmp/mmap_checksum_stale.crc", O_WRONLY|O_TRUNC);
+    fail_unless(write(fh, crcs, len) == len);
+    close(fh);
+
+    // They are not used, and are rebuilt when the bitmap is loaded
+    uint64_t bad = 0;
+    fail_unless(bitmap_verify_file(path, 0, 100, &bad) == -2);
+    fail_unless(bitmap_from_filename(path, 8192, 0, PERSISTENT, &map) == 0);
+    fail_unless(bitmap_getbit((&map), 5000 * 8) == 1);
+    fail_unless(bitmap_getbit((&map), 100) == 0);
+    fail_unless(bitmap_close(&map) == 0);
+    fail_unless(bitmap_verify_file(path, 0, 100, &bad) == 2);
+    fail_unless(bad == 0);
+
+    unlink(path);
+    bitmap_drop_checksums(path);
+    unlink(other);
+    bitmap_drop_checksums(other);
+}
+END_TEST
@@ -6,6 +6,7 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <string.h>
 #include "bloom.h"
 
 START_TEST(bloom_filter_header_size)
@@ -506,6 +507,174 @@ START_TEST(test_bf_shared_compatible_persist)
         fail_unless(res == 1);
     }
     unlink("/tmp/shared_compat_persist.mmap");
+    bitmap_drop_checksums("/tmp/shared_compat_persist.mmap");
 }
 END_TEST
 
+
+START_TEST(test_bf_fold)
+{
+    bloom_filter_params params = {0, 0, 1e6, 1e-4};
+    bf_params_for_capacity(&params);
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    bitmap_from_file(-1, params.bytes, ANONYMOUS, &map);
+    fail_unless(bf_from_bitmap(&map, params.k_num, 1, &filter) == 0);
+
+    // Only use a fraction of the capacity
+    char buf[100];
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        bf_add(&filter, (char*)&buf);
+    }
+
+    uint64_t factor = bf_fold_factor(&filter, 1e-4);
+    fail_unless(factor > 10);
+    fail_unless(filter.offset % factor == 0);
+    uint64_t bytes = bf_fold_bytes(&filter, factor);
+    fail_unless(bytes < params.bytes / 10);
+
+    bloom_bitmap map2;
+    bloom_bloomfilter folded;
+    bitmap_from_file(-1, bytes, ANONYMOUS, &map2);
+    fail_unless(bf_from_bitmap(&map2, params.k_num, 1, &folded) == 0);
+    fail_unless(folded.offset == filter.offset / factor);
+    fail_unless(bf_fold(&filter, factor, &folded) == 0);
+    fail_unless(bf_size(&folded) == bf_size(&filter));
+
+    // No false negatives, and the false positives stay bounded
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(bf_contains(&folded, (char*)&buf) == 1);
+    }
+    int fp = 0;
+    for (int i=0;i<100000;i++) {
+        snprintf((char*)&buf, 100, "zipzab%d", i);
+        fp += bf_contains(&folded, (char*)&buf);
+    }
+    fail_unless(fp < 20);
+
+    // The folded filter fills up to the probability again
+    uint64_t capacity = bf_capacity_for_prob(&folded, 1e-4);
+    fail_unless(capacity >= 10000);
+    fail_unless(capacity < 20000);
+
+    // A bad factor is rejected
+    fail_unless(bf_fold(&filter, factor * 2, &folded) == -EINVAL);
+
+    bf_close(&folded);
+    bf_close(&filter);
+}
+END_TEST
+
+START_TEST(test_bf_fold_full)
+{
+    bloom_filter_params params = {0, 0, 1e4, 1e-3};
+    bf_params_for_capacity(&params);
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    bitmap_from_file(-1, params.bytes, ANONYMOUS, &map);
+    fail_unless(bf_from_bitmap(&map, params.k_num, 1, &filter) == 0);
+
+    // Capacity matches the sizing
+    uint64_t capacity = bf_capacity_for_prob(&filter, 1e-3);
+    fail_unless(capacity > 9900 && capacity < 10100);
+
+    // An empty filter folds as far as it can
+    fail_unless(bf_fold_factor(&filter, 1e-3) > 1);
+
+    // A full filter can not be folded
+    char buf[100];
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        bf_add(&filter, (char*)&buf);
+    }
+    fail_unless(bf_fold_factor(&filter, 1e-3) == 1);
+    bf_close(&filter);
+}
+END_TEST
+
+START_TEST(test_bf_contains_sorted)
+{
+    bloom_filter_params params = {0, 0, 1e6, 1e-4};
+    bf_params_for_capacity(&params);
+    bloom_bitmap map;
+    bloom_bloomfilter filter;
+    bitmap_from_file(-1, params.bytes, ANONYMOUS, &map);
+    fail_unless(bf_from_bitmap(&map, params.k_num, 1, &filter) == 0);
+
+    char buf[100];
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        bf_add(&filter, (char*)&buf);
+    }
+
+    // Hash a mix of present and missing keys, with extra hashes
+    int count = 20000;
+    uint32_t stride = params.k_num + 2;
+    uint64_t *hashes = malloc(count * stride * sizeof(uint64_t));
+    for (int i=0;i<count;i++) {
+        snprintf((char*)&buf, 100, (i % 2) ? "foobar%d" : "zipzab%d", i / 2);
+        bf_compute_hashes(stride, (char*)&buf, hashes + i * stride);
+    }
+
+    // Only check every third key
+    uint32_t keys[count / 3 + 1];
+    uint32_t num_keys = 0;
+    for (int i=0;i<count;i+=3) keys[num_keys++] = i;
+    char *present = malloc(count);
+    memset(present, 2, count);
+    fail_unless(bf_contains_sorted(&filter, hashes, stride, keys, num_keys, present) == 0);
+
+    // Matches checking each key, and leaves the rest alone
+    for (int i=0;i<count;i++) {
+        if (i % 3)
+            fail_unless(present[i] == 2);
+        else
+            fail_unless(present[i] == bf_contains_hashes(&filter, hashes + i * stride));
+        if (i % 3 == 0 && i % 2) fail_unless(present[i] == 1);
+    }
+    fail_unless(bf_contains_sorted(&filter, hashes, stride, keys, 0, present) == 0);
+
+    free(hashes);
+    free(present);
+    bf_close(&filter);
+}
+END_TEST
+
+START_TEST(test_bf_probe_k_range)
+{
+    // Every k_num sets and checks the same bits,
+    // whether or not it has unrolled probes
+    uint64_t hashes[32];
+    char buf[100];
+    for (uint32_t k=1;k<=24;k++) {
+        bloom_bitmap map;
+        bloom_bloomfilter filter;
+        bitmap_from_file(-1, 65536, ANONYMOUS, &map);
+        fail_unless(bf_from_bitmap(&map, k, 1, &filter) == 0);
+        uint64_t m = filter.offset;
+
+        for (int i=0;i<200;i++) {
+            snprintf((char*)&buf, 100, "foobar%d", i);
+            fail_unless(bf_add(&filter, (char*)&buf) == 1);
+            bf_compute_hashes(k, (char*)&buf, hashes);
+            for (uint32_t j=0;j<k;j++) {
+                uint64_t bit = 8*sizeof(bloom_filter_header) + j * m + (hashes[j] % m);
+                fail_unless(bitmap_getbit(&map, bit) == 1);
+            }
+            fail_unless(bf_contains(&filter, (char*)&buf) == 1);
+            fail_unless(bf_contains_hashes(&filter, hashes) == 1);
+        }
+        fail_unless(bf_size(&filter) == 200);
+
+        // Clearing any one bit of a key removes it
+        snprintf((char*)&buf, 100, "foobar%d", 0);
+        bf_compute_hashes(k, (char*)&buf, hashes);
+        uint64_t bit = 8*sizeof(bloom_filter_header) + (k - 1) * m + (hashes[k - 1] % m);
+        map.mmap[bit >> 3] &= ~(1 << (7 - bit % 8));
+        fail_unless(bf_contains_hashes(&filter, hashes) == 0);
+        bf_close(&filter);
+    }
+}
+END_TEST
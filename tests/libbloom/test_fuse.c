@@ -0,0 +1,185 @@
+#include <check.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include "fuse.h"
+
+/**
+ * Hashes count keys of the form prefix%d
+ */
+static uint64_t* fuse_test_hashes(char *prefix, int count) {
+    char buf[100];
+    uint64_t *hashes = malloc((count + 1) * sizeof(uint64_t));
+    for (int i=0;i<count;i++) {
+        snprintf((char*)&buf, 100, "%s%d", prefix, i);
+        hashes[i] = fuse_hash_key((char*)&buf);
+    }
+    return hashes;
+}
+
+START_TEST(fuse_header_size)
+{
+    fail_unless(sizeof(bloom_fuse_header) == 64);
+}
+END_TEST
+
+START_TEST(fuse_unique)
+{
+    uint64_t hashes[] = {5, 3, 5, 1, 3, 3};
+    fail_unless(fuse_unique_hashes(hashes, 6) == 3);
+    fail_unless(hashes[0] == 1);
+    fail_unless(hashes[1] == 3);
+    fail_unless(hashes[2] == 5);
+    fail_unless(fuse_unique_hashes(hashes, 0) == 0);
+}
+END_TEST
+
+START_TEST(fuse_build_small_map)
+{
+    uint64_t *hashes = fuse_test_hashes("foobar", 10000);
+    bloom_bitmap map;
+    bitmap_from_file(-1, 4096, ANONYMOUS, &map);
+    bloom_fuse fuse;
+    fail_unless(fuse_build(&map, hashes, 10000, 8, &fuse) == -ENOMEM);
+    bitmap_close(&map);
+    free(hashes);
+}
+END_TEST
+
+START_TEST(fuse_build_contains)
+{
+    int count = 100000;
+    uint64_t *hashes = fuse_test_hashes("foobar", count);
+    uint64_t bytes = fuse_bytes_for_count(count, 8);
+    fail_unless(bytes < count * 1.25 + sizeof(bloom_fuse_header));
+
+    bloom_bitmap map;
+    bitmap_from_file(-1, bytes, ANONYMOUS, &map);
+    bloom_fuse fuse;
+    int res = fuse_build(&map, hashes, count, 8, &fuse);
+    fail_unless(res == 0);
+    fail_unless(fuse_size(&fuse) == (uint64_t)count);
+
+    // No false negatives
+    char buf[100];
+    for (int i=0;i<count;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(fuse_contains(&fuse, (char*)&buf) == 1);
+    }
+
+    // Around 1/256 false positives
+    int fp = 0;
+    for (int i=0;i<count;i++) {
+        snprintf((char*)&buf, 100, "zipzab%d", i);
+        fp += fuse_contains(&fuse, (char*)&buf);
+    }
+    fail_unless(fp > count / 512);
+    fail_unless(fp < count / 128);
+
+    fail_unless(fuse_close(&fuse) == 0);
+    fail_unless(fuse_close(&fuse) == -1);
+    free(hashes);
+}
+END_TEST
+
+START_TEST(fuse_build_contains_16)
+{
+    int count = 100000;
+    uint64_t *hashes = fuse_test_hashes("foobar", count);
+    uint64_t bytes = fuse_bytes_for_count(count, 16);
+    fail_unless(bytes < 2 * count * 1.25 + sizeof(bloom_fuse_header));
+
+    bloom_bitmap map;
+    bitmap_from_file(-1, bytes, ANONYMOUS, &map);
+    bloom_fuse fuse;
+    fail_unless(fuse_build(&map, hashes, count, 16, &fuse) == 0);
+
+    // No false negatives
+    char buf[100];
+    for (int i=0;i<count;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(fuse_contains(&fuse, (char*)&buf) == 1);
+    }
+
+    // Around 1/65536 false positives
+    int fp = 0;
+    for (int i=0;i<count;i++) {
+        snprintf((char*)&buf, 100, "zipzab%d", i);
+        fp += fuse_contains(&fuse, (char*)&buf);
+    }
+    fail_unless(fp < 10);
+
+    fuse_close(&fuse);
+    free(hashes);
+}
+END_TEST
+
+START_TEST(fuse_bits_for_prob_test)
+{
+    fail_unless(fuse_bits_for_prob(0.01) == 8);
+    fail_unless(fuse_bits_for_prob(1.0/256) == 8);
+    fail_unless(fuse_bits_for_prob(1e-3) == 16);
+    fail_unless(fuse_bits_for_prob(1e-4) == 16);
+}
+END_TEST
+
+START_TEST(fuse_build_tiny)
+{
+    char buf[100];
+    bloom_bitmap map;
+    bloom_fuse fuse;
+    for (int count=0;count<50;count++) {
+        uint64_t *hashes = fuse_test_hashes("tiny", count);
+        bitmap_from_file(-1, fuse_bytes_for_count(count, 8), ANONYMOUS, &map);
+        fail_unless(fuse_build(&map, hashes, count, 8, &fuse) == 0);
+        for (int i=0;i<count;i++) {
+            snprintf((char*)&buf, 100, "tiny%d", i);
+            fail_unless(fuse_contains(&fuse, (char*)&buf) == 1);
+        }
+        fuse_close(&fuse);
+        free(hashes);
+    }
+}
+END_TEST
+
+START_TEST(fuse_restore)
+{
+    int count = 10000;
+    uint64_t *hashes = fuse_test_hashes("foobar", count);
+    uint64_t bytes = fuse_bytes_for_count(count, 16);
+
+    bloom_bitmap map;
+    bitmap_from_filename("/tmp/test_fuse_restore.fuse", bytes, 1, SHARED, &map);
+    bloom_fuse fuse;
+    fail_unless(fuse_build(&map, hashes, count, 16, &fuse) == 0);
+    fail_unless(fuse_close(&fuse) == 0);
+
+    bitmap_from_filename("/tmp/test_fuse_restore.fuse", bytes, 0, SHARED, &map);
+    fail_unless(fuse_from_bitmap(&map, &fuse) == 0);
+    fail_unless(fuse_size(&fuse) == (uint64_t)count);
+
+    char buf[100];
+    for (int i=0;i<count;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(fuse_contains(&fuse, (char*)&buf) == 1);
+    }
+    fail_unless(fuse_close(&fuse) == 0);
+    unlink("/tmp/test_fuse_restore.fuse");
+    free(hashes);
+}
+END_TEST
+
+START_TEST(fuse_restore_bad_magic)
+{
+    bloom_bitmap map;
+    bitmap_from_file(-1, 4096, ANONYMOUS, &map);
+    bloom_fuse fuse;
+    fail_unless(fuse_from_bitmap(&map, &fuse) == -1);
+    fail_unless(fuse_from_bitmap(NULL, &fuse) == -EINVAL);
+    bitmap_close(&map);
+}
+END_TEST
@@ -6,6 +6,8 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <errno.h>
+#include <string.h>
+#include <math.h>
 #include "sbf.h"
 
 
@@ -311,3 +313,260 @@ START_TEST(sbf_fp_prob)
 }
 END_TEST
 
+
+START_TEST(sbf_header_capacity)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e4;
+    bloom_sbf sbf;
+    int res = sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf);
+    fail_unless(res == 0);
+
+    char buf[100];
+    for (int i=0;i<20000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        sbf_add(&sbf, (char*)&buf);
+    }
+    fail_unless(sbf.num_filters == 2);
+    fail_unless(sbf.filters[0]->header->capacity == 40000);
+    fail_unless(sbf.filters[1]->header->capacity == 10000);
+
+    // The header capacity is used over the params
+    bloom_sbf sbf2;
+    params.initial_capacity = 1e5;
+    res = sbf_from_filters(&params, NULL, NULL, 2, sbf.filters, &sbf2);
+    fail_unless(res == 0);
+    fail_unless(sbf_total_capacity(&sbf2) == 50000);
+    free(sbf.filters);
+    free(sbf.dirty_filters);
+    free(sbf.capacities);
+
+    // Replace the last filter with a smaller one
+    bloom_bitmap *map = malloc(sizeof(bloom_bitmap));
+    bloom_bloomfilter *filter = malloc(sizeof(bloom_bloomfilter));
+    bitmap_from_file(-1, 4096, ANONYMOUS, map);
+    bf_from_bitmap(map, 10, 1, filter);
+    filter->header->capacity = 1000;
+    fail_unless(sbf_replace_filter(&sbf2, 2, filter) == -1);
+    fail_unless(sbf_replace_filter(&sbf2, 0, filter) == 0);
+    fail_unless(sbf_total_capacity(&sbf2) == 11000);
+    fail_unless(sbf_total_byte_size(&sbf2) == 4096 + sbf2.filters[1]->map->size);
+
+    // New filters scale from the last capacity
+    for (int i=0;i<2000;i++) {
+        snprintf((char*)&buf, 100, "zipzab%d", i);
+        sbf_add(&sbf2, (char*)&buf);
+    }
+    fail_unless(sbf2.num_filters == 3);
+    fail_unless(sbf2.capacities[0] == 4000);
+    sbf_close(&sbf2);
+}
+END_TEST
+
+START_TEST(sbf_add_keys_batch)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-5;
+    bloom_sbf sbf, twin;
+    fail_unless(sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf) == 0);
+    fail_unless(sbf_from_filters(&params, NULL, NULL, 0, NULL, &twin) == 0);
+
+    // Add in batches that repeat half of the last batch
+    char bufs[100][32];
+    char *keys[100];
+    char result[100];
+    for (int i=0;i<100;i++) keys[i] = bufs[i];
+    for (int b=0;b<200;b++) {
+        for (int i=0;i<100;i++) {
+            snprintf(bufs[i], 32, "foobar%d", b * 50 + i);
+        }
+        fail_unless(sbf_add_keys(&sbf, keys, 100, result) == 0);
+        for (int i=0;i<100;i++) {
+            fail_unless(result[i] == sbf_add(&twin, keys[i]));
+            fail_unless(result[i] == (b == 0 || i >= 50));
+        }
+    }
+
+    // Sets the same bits as adding one at a time
+    fail_unless(sbf_size(&sbf) == 10050);
+    fail_unless(sbf.num_filters == 3);
+    fail_unless(sbf.num_filters == twin.num_filters);
+    for (uint32_t i=0;i<sbf.num_filters;i++) {
+        fail_unless(sbf.filters[i]->map->size == twin.filters[i]->map->size);
+        fail_unless(memcmp(sbf.filters[i]->map->mmap, twin.filters[i]->map->mmap,
+                           sbf.filters[i]->map->size) == 0);
+    }
+    fail_unless(sbf_add_keys(&sbf, keys, 0, result) == 0);
+    sbf_close(&sbf);
+    sbf_close(&twin);
+}
+END_TEST
+
+START_TEST(sbf_contains_keys_batch)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-5;
+    bloom_sbf sbf;
+    fail_unless(sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf) == 0);
+
+    char buf[100];
+    for (int i=0;i<10000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        sbf_add(&sbf, (char*)&buf);
+    }
+    fail_unless(sbf.num_filters == 3);
+
+    // Check keys spread over every filter, and missing keys
+    char bufs[4000][32];
+    char *keys[4000];
+    char result[4000];
+    for (int i=0;i<4000;i++) {
+        keys[i] = bufs[i];
+        snprintf(bufs[i], 32, (i % 2) ? "foobar%d" : "zipzab%d", i * 5 / 2);
+    }
+    fail_unless(sbf_contains_keys(&sbf, keys, 4000, result) == 0);
+    for (int i=0;i<4000;i++) {
+        fail_unless(result[i] == sbf_contains(&sbf, keys[i]));
+        if (i % 2) fail_unless(result[i] == 1);
+    }
+    fail_unless(sbf_contains_keys(&sbf, keys, 0, result) == 0);
+    sbf_close(&sbf);
+}
+END_TEST
+
+START_TEST(sbf_sorted_batches)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    params.fp_probability = 1e-5;
+    bloom_sbf sorted, twin;
+    fail_unless(sbf_from_filters(&params, NULL, NULL, 0, NULL, &sorted) == 0);
+    fail_unless(sbf_from_filters(&params, NULL, NULL, 0, NULL, &twin) == 0);
+    fail_unless(sorted.sort_min_bytes == SBF_SORT_MIN_BYTES);
+
+    // Sort the probes of every large batch
+    sorted.sort_min_bytes = 0;
+
+    // Add in batches that repeat half of the last batch,
+    // growing new filters part way through some of them
+    static char bufs[4000][32];
+    static char *keys[4000];
+    static char result[4000], expect[4000];
+    for (int i=0;i<4000;i++) keys[i] = bufs[i];
+    for (int b=0;b<6;b++) {
+        for (int i=0;i<2000;i++) {
+            snprintf(bufs[i], 32, "foobar%d", b * 1000 + i);
+        }
+        fail_unless(sbf_add_keys(&sorted, keys, 2000, result) == 0);
+        for (int i=0;i<2000;i++) {
+            fail_unless(result[i] == sbf_add(&twin, keys[i]));
+            fail_unless(result[i] == (b == 0 || i >= 1000));
+        }
+    }
+    fail_unless(sbf_size(&sorted) == 7000);
+    fail_unless(sorted.num_filters == 3);
+    fail_unless(sorted.num_filters == twin.num_filters);
+    for (uint32_t i=0;i<sorted.num_filters;i++) {
+        fail_unless(memcmp(sorted.filters[i]->map->mmap, twin.filters[i]->map->mmap,
+                           sorted.filters[i]->map->size) == 0);
+    }
+
+    // Checks of present and missing keys match the unsorted checks
+    for (int i=0;i<4000;i++) {
+        snprintf(bufs[i], 32, (i % 2) ? "foobar%d" : "zipzab%d", i * 7 / 4);
+    }
+    fail_unless(sbf_contains_keys(&sorted, keys, 4000, result) == 0);
+    fail_unless(sbf_contains_keys(&twin, keys, 4000, expect) == 0);
+    for (int i=0;i<4000;i++) {
+        fail_unless(result[i] == expect[i]);
+        fail_unless(result[i] == sbf_contains(&twin, keys[i]));
+        if (i % 2) fail_unless(result[i] == 1);
+    }
+    sbf_close(&sorted);
+    sbf_close(&twin);
+}
+END_TEST
+
+START_TEST(sbf_history_decay)
+{
+    // Without a horizon the sums are plain totals
+    bloom_sbf_history history = {0, 0, 0};
+    sbf_record_history(&history, 0, 100, 10);
+    sbf_record_history(&history, 0, 50, 40);
+    fail_unless(history.keys == 150);
+    fail_unless(history.secs == 50);
+    fail_unless(history.age == 50);
+
+    // A steady rate is recovered, and one long period
+    // decays the same as many short ones
+    bloom_sbf_history many = {0, 0, 0}, one;
+    for (int i=0; i < 100; i++) {
+        sbf_record_history(&many, 3600, 600, 60);
+    }
+    fail_unless(fabs(many.keys / many.secs - 10) < 1);
+    one = many;
+    sbf_record_history(&one, 3600, 0, 7200);
+    for (int i=0; i < 120; i++) {
+        sbf_record_history(&many, 3600, 0, 60);
+    }
+    fail_unless(fabs(one.keys - many.keys) < 1e-6 * many.keys);
+    fail_unless(fabs(one.secs - many.secs) < 1e-6 * many.secs);
+    fail_unless(one.age == 13200);
+
+    // Time going backwards is ignored
+    sbf_record_history(&one, 3600, 10, -5);
+    fail_unless(one.age == 13200);
+}
+END_TEST
+
+static uint64_t steady_grow(void *in, bloom_sbf *sbf) {
+    return sbf_growth_capacity(sbf, (bloom_sbf_history*)in, 86400);
+}
+
+START_TEST(sbf_growth_capacity_policy)
+{
+    bloom_sbf_params params = SBF_DEFAULT_PARAMS;
+    params.initial_capacity = 1e3;
+    bloom_sbf sbf;
+    fail_unless(sbf_from_filters(&params, NULL, NULL, 0, NULL, &sbf) == 0);
+    fail_unless(sbf.grow_callback == NULL);
+
+    // Too little history, or no horizon, scales as usual
+    bloom_sbf_history history = {0, 0, 0};
+    sbf_record_history(&history, 86400, 500, 30);
+    fail_unless(sbf_growth_capacity(&sbf, &history, 86400) == 0);
+    sbf_record_history(&history, 86400, 500, 30);
+    fail_unless(sbf_growth_capacity(&sbf, &history, 0) == 0);
+
+    // Sized for the rest of the horizon, at most 64x the last
+    // filter. About 1000 keys in the first minute is 1.44M a day.
+    fail_unless(sbf_growth_capacity(&sbf, &history, 86400) == 64000);
+    bloom_sbf_history slow = {10, 3600, 3600};
+    fail_unless(sbf_growth_capacity(&sbf, &slow, 86400) == 1000);
+    bloom_sbf_history mid = {1000, 3600, 43200};
+    uint64_t cap = sbf_growth_capacity(&sbf, &mid, 86400);
+    fail_unless(cap > 11990 && cap < 12010);
+
+    // Past the horizon, it expects as many keys as it has seen
+    bloom_sbf_history old = {1000, 3600, 3 * 86400};
+    cap = sbf_growth_capacity(&sbf, &old, 86400);
+    fail_unless(cap > 63990 && cap <= 64000);
+
+    // The callback sizes the new filters
+    sbf.grow_callback = steady_grow;
+    sbf.callback_input = &mid;
+    char buf[100];
+    for (int i=0;i<2000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        sbf_add(&sbf, (char*)&buf);
+    }
+    fail_unless(sbf.num_filters == 2);
+    fail_unless(sbf.capacities[1] == 1000);
+    fail_unless(sbf.capacities[0] > 11990 && sbf.capacities[0] < 12010);
+    fail_unless(sbf.filters[0]->header->capacity == sbf.capacities[0]);
+    sbf_close(&sbf);
+    fail_unless(sbf.grow_callback == NULL);
+}
+END_TEST
@@ -0,0 +1,194 @@
+#include <check.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include "stable.h"
+
+START_TEST(stable_header_size)
+{
+    fail_unless(sizeof(bloom_stable_header) == 512);
+}
+END_TEST
+
+START_TEST(stable_params)
+{
+    bloom_stable_params params = {0, 0, 0, 1e4, 1e-3};
+    int res = stable_params_for_capacity(&params);
+    fail_unless(res == 0);
+    fail_unless(params.k_num == 10);
+    fail_unless(params.p_num > 1);
+    fail_unless(params.bytes == 141617);
+
+    bloom_stable_params bad = {0, 0, 0, 0, 1e-3};
+    fail_unless(stable_params_for_capacity(&bad) == -1);
+}
+END_TEST
+
+START_TEST(stable_no_map)
+{
+    bloom_stable_params params = {0, 0, 0, 1e4, 1e-3};
+    stable_params_for_capacity(&params);
+    bloom_stable filter;
+    fail_unless(stable_from_bitmap(NULL, &params, 1, &filter) == -EINVAL);
+
+    bloom_bitmap map;
+    bitmap_from_file(-1, 4096, ANONYMOUS, &map);
+    fail_unless(stable_from_bitmap(&map, &params, 0, &filter) == -1);
+    bitmap_close(&map);
+}
+END_TEST
+
+START_TEST(stable_add_contains)
+{
+    bloom_stable_params params = {0, 0, 0, 1e4, 1e-3};
+    stable_params_for_capacity(&params);
+    bloom_bitmap map;
+    bitmap_from_file(-1, params.bytes, ANONYMOUS, &map);
+    bloom_stable filter;
+    fail_unless(stable_from_bitmap(&map, &params, 1, &filter) == 0);
+    fail_unless(stable_capacity(&filter) == 1e4);
+
+    fail_unless(stable_contains(&filter, "test") == 0);
+    fail_unless(stable_add(&filter, "test") == 1);
+    fail_unless(stable_contains(&filter, "test") == 1);
+    fail_unless(stable_add(&filter, "test") == 0);
+    fail_unless(stable_size(&filter) == 1);
+
+    fail_unless(stable_close(&filter) == 0);
+    fail_unless(stable_close(&filter) == -1);
+}
+END_TEST
+
+START_TEST(stable_recent_keys)
+{
+    bloom_stable_params params = {0, 0, 0, 1e4, 1e-3};
+    stable_params_for_capacity(&params);
+    bloom_bitmap map;
+    bitmap_from_file(-1, params.bytes, ANONYMOUS, &map);
+    bloom_stable filter;
+    fail_unless(stable_from_bitmap(&map, &params, 1, &filter) == 0);
+
+    // Add far more keys than the capacity
+    char buf[100];
+    for (int i=0;i<200000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        stable_add(&filter, (char*)&buf);
+    }
+
+    // The most recent keys are retained
+    int found = 0;
+    for (int i=199000;i<200000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        found += stable_contains(&filter, (char*)&buf);
+    }
+    fail_unless(found > 990);
+
+    // Most keys are retained up to the capacity
+    found = 0;
+    for (int i=190000;i<191000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        found += stable_contains(&filter, (char*)&buf);
+    }
+    fail_unless(found > 850);
+
+    // The oldest keys are mostly forgotten
+    found = 0;
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        found += stable_contains(&filter, (char*)&buf);
+    }
+    fail_unless(found < 10);
+    stable_close(&filter);
+}
+END_TEST
+
+START_TEST(stable_fp_bounded)
+{
+    bloom_stable_params params = {0, 0, 0, 1e4, 1e-2};
+    stable_params_for_capacity(&params);
+    bloom_bitmap map;
+    bitmap_from_file(-1, params.bytes, ANONYMOUS, &map);
+    bloom_stable filter;
+    fail_unless(stable_from_bitmap(&map, &params, 1, &filter) == 0);
+
+    // The false positive rate stays bounded for a long stream
+    char buf[100];
+    for (int i=0;i<500000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        stable_add(&filter, (char*)&buf);
+    }
+    int fp = 0;
+    for (int i=0;i<100000;i++) {
+        snprintf((char*)&buf, 100, "zipzab%d", i);
+        fp += stable_contains(&filter, (char*)&buf);
+    }
+    fail_unless(fp < 1500);
+    stable_close(&filter);
+}
+END_TEST
+
+START_TEST(stable_restore)
+{
+    bloom_stable_params params = {0, 0, 0, 1e4, 1e-3};
+    stable_params_for_capacity(&params);
+    bloom_bitmap map;
+    unlink("/tmp/test_stable_restore.mmap");
+    bitmap_drop_checksums("/tmp/test_stable_restore.mmap");
+    fail_unless(bitmap_from_filename("/tmp/test_stable_restore.mmap", params.bytes, 1, PERSISTENT, &map) == 0);
+    bloom_stable filter;
+    fail_unless(stable_from_bitmap(&map, &params, 1, &filter) == 0);
+
+    char buf[100];
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(stable_add(&filter, (char*)&buf) == 1);
+    }
+    uint64_t state = filter.header->rand_state;
+    fail_unless(stable_close(&filter) == 0);
+
+    fail_unless(bitmap_from_filename("/tmp/test_stable_restore.mmap", params.bytes, 0, PERSISTENT, &map) == 0);
+    fail_unless(stable_from_bitmap(&map, NULL, 0, &filter) == 0);
+    fail_unless(stable_size(&filter) == 1000);
+    fail_unless(filter.header->k_num == params.k_num);
+    fail_unless(filter.header->p_num == params.p_num);
+    fail_unless(filter.header->rand_state == state);
+    for (int i=0;i<1000;i++) {
+        snprintf((char*)&buf, 100, "foobar%d", i);
+        fail_unless(stable_contains(&filter, (char*)&buf) == 1);
+    }
+    stable_close(&filter);
+    unlink("/tmp/test_stable_restore.mmap");
+    bitmap_drop_checksums("/tmp/test_stable_restore.mmap");
+}
+END_TEST
+
+START_TEST(stable_small_k)
+{
+    // Fewer than the 4 hashes that are always computed
+    char buf[100];
+    for (uint32_t k=1;k<=3;k++) {
+        bloom_stable_params params = {0, 0, 0, 1e4, 1e-3};
+        stable_params_for_capacity(&params);
+        params.k_num = k;
+        bloom_bitmap map;
+        bitmap_from_file(-1, params.bytes, ANONYMOUS, &map);
+        bloom_stable filter;
+        fail_unless(stable_from_bitmap(&map, &params, 1, &filter) == 0);
+        fail_unless(filter.header->k_num == k);
+
+        for (int i=0;i<100;i++) {
+            snprintf((char*)&buf, 100, "foobar%d", i);
+            fail_unless(stable_contains(&filter, (char*)&buf) == 0);
+            fail_unless(stable_add(&filter, (char*)&buf) == 1);
+            fail_unless(stable_contains(&filter, (char*)&buf) == 1);
+            fail_unless(stable_add(&filter, (char*)&buf) == 0);
+        }
+        fail_unless(stable_size(&filter) == 100);
+        stable_close(&filter);
+    }
+}
+END_TEST